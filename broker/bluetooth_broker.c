@@ -0,0 +1,370 @@
+/*
+ * Owns the adapter for every process on the host. Clients open the "broker"
+ * backend instead of bluez or bluetoothctl; their calls arrive here, where
+ * identical ones in flight are merged, and the device table of each scan is
+ * published in shared memory.
+ *
+ * usage: bluetooth_broker [-b backend] [-n name]
+ *   backend: what the broker itself opens, bluez by default
+ *   name: abstract socket name, $HAL_BLUETOOTH_BROKER or hal_bluetooth_broker
+ *
+ * Abstract sockets have no file permissions: only processes of the broker's
+ * own user, and root, are served. The table goes out sealed against writes.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bluetooth_internal.h"
+
+#define MAX_CLIENTS     (64)
+
+/* Linux 5.1, older headers lack it */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE     0x0010
+#endif
+
+typedef struct client {
+    int fd;
+    struct list_head list;
+} client_t;
+
+/* A client waiting on a job */
+typedef struct waiter {
+    client_t *client;
+    uint32_t id;
+    struct list_head list;
+} waiter_t;
+
+/* One library call, shared by every client asking the same */
+typedef struct job {
+    int op;
+    char device[BLUETOOTH_DEVNAME_MAXLEN];
+    struct list_head waiters;
+    struct list_head list;
+} job_t;
+
+static bluetooth_t *bt;
+static broker_table_t *table;
+static int table_fd;
+static LIST_HEAD(clients);
+static LIST_HEAD(jobs);
+static int nclients;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void publish_table(void)
+{
+    const bluetooth_device_table_t *devs = bluetooth_device_table_get(bt);
+    size_t n = devs->n_devices < BROKER_MAX_DEVICES ? devs->n_devices : BROKER_MAX_DEVICES;
+    uint32_t seq = table->seq;
+
+    __atomic_store_n(&table->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(table->devices, devs->devices, n * sizeof(bluetooth_device_info_t));
+    table->n_devices = n;
+    table->generation++;
+    __atomic_store_n(&table->seq, seq + 2, __ATOMIC_RELEASE);
+
+    bluetooth_device_table_unref(devs);
+}
+
+static void reply(client_t *client, uint32_t id, int op, int result)
+{
+    broker_msg_t msg = { .id = id, .op = op, .result = result };
+
+    /* a client too slow to read is its own problem */
+    send(client->fd, &msg, sizeof(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void job_done(bool ok, void *data)
+{
+    job_t *job = (job_t *)data;
+    waiter_t *w, *tmp;
+
+    if (job->op == BROKER_SCAN)
+        publish_table();
+
+    list_for_each_entry_safe(w, tmp, &job->waiters, list) {
+        reply(w->client, w->id, job->op, ok);
+        list_del(&w->list);
+        free(w);
+    }
+    list_del(&job->list);
+    free(job);
+}
+
+static int job_submit(job_t *job, int timeout_ms)
+{
+    bluetooth_deadline_t deadline = bluetooth_deadline(timeout_ms);
+
+    switch (job->op) {
+    case BROKER_SCAN:
+        return bluetooth_scan_async(bt, deadline, job_done, job);
+    case BROKER_CONNECT:
+        return bluetooth_connect_device_async(bt, job->device, deadline, job_done, job);
+    case BROKER_DISCONNECT:
+        return bluetooth_disconnect_device_async(bt, job->device, deadline, job_done, job);
+    case BROKER_IS_CONNECTED:
+        return bluetooth_device_is_connected_async(bt, job->device, job_done, job);
+    }
+    return -1;
+}
+
+/* Join the same call in flight, or start it. The first caller's deadline holds */
+static void handle_request(client_t *client, const broker_msg_t *msg)
+{
+    char device[BLUETOOTH_DEVNAME_MAXLEN];
+    waiter_t *w;
+    job_t *job;
+
+    memcpy(device, msg->device, sizeof(device));
+    device[sizeof(device) - 1] = '\0';
+    if (msg->op == BROKER_SCAN)
+        device[0] = '\0';
+
+    w = calloc(1, sizeof(waiter_t));
+    if (w == NULL) {
+        reply(client, msg->id, msg->op, 0);
+        return;
+    }
+    w->client = client;
+    w->id = msg->id;
+
+    list_for_each_entry(job, &jobs, list) {
+        if (job->op == (int)msg->op && !strcmp(job->device, device)) {
+            list_add_tail(&w->list, &job->waiters);
+            return;
+        }
+    }
+
+    job = calloc(1, sizeof(job_t));
+    if (job == NULL) {
+        free(w);
+        reply(client, msg->id, msg->op, 0);
+        return;
+    }
+    job->op = msg->op;
+    strcpy(job->device, device);
+    INIT_LIST_HEAD(&job->waiters);
+    list_add_tail(&w->list, &job->waiters);
+    list_add_tail(&job->list, &jobs);
+
+    if (job_submit(job, msg->timeout_ms)) {
+        list_del(&w->list);
+        list_del(&job->list);
+        reply(client, msg->id, msg->op, 0);
+        free(w);
+        free(job);
+    }
+}
+
+static void send_hello(int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))] = { 0 };
+    broker_msg_t hello = { .op = BROKER_HELLO };
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &table_fd, sizeof(int));
+    sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/* Same user as the broker, or root */
+static bool peer_allowed(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred))
+        return false;
+    return cred.uid == 0 || cred.uid == getuid();
+}
+
+static void client_close(client_t *client)
+{
+    waiter_t *w, *tmp;
+    job_t *job;
+
+    /* its calls keep running for the others */
+    list_for_each_entry(job, &jobs, list) {
+        list_for_each_entry_safe(w, tmp, &job->waiters, list) {
+            if (w->client == client) {
+                list_del(&w->list);
+                free(w);
+            }
+        }
+    }
+    list_del(&client->list);
+    close(client->fd);
+    free(client);
+    nclients--;
+}
+
+static int listen_on(const char *name)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    socklen_t addrlen;
+    int fd;
+
+    if (strlen(name) >= sizeof(addr.sun_path) - 1)
+        return -1;
+    memcpy(addr.sun_path + 1, name, strlen(name));
+    addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, addrlen) || listen(fd, 16)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd pfd[2 + MAX_CLIENTS];
+    client_t *clients_by_slot[MAX_CLIENTS];
+    const char *backend = "bluez", *name = getenv(BROKER_ENV);
+    client_t *client, *tmp;
+    broker_msg_t msg;
+    int opt, listen_fd, nfds, i, fd;
+    ssize_t n;
+
+    while ((opt = getopt(argc, argv, "b:n:")) != -1) {
+        switch (opt) {
+        case 'b': backend = optarg; break;
+        case 'n': name = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-b backend] [-n name]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (name == NULL)
+        name = BROKER_DEFAULT_NAME;
+
+    table_fd = memfd_create("hal_bluetooth_broker", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (table_fd < 0 || ftruncate(table_fd, sizeof(broker_table_t))) {
+        perror("bluetooth_broker: memfd");
+        return 1;
+    }
+    table = mmap(NULL, sizeof(broker_table_t), PROT_READ | PROT_WRITE, MAP_SHARED, table_fd, 0);
+    if (table == MAP_FAILED) {
+        perror("bluetooth_broker: mmap");
+        return 1;
+    }
+    /* our mapping stays writable, clients get none: no write(), no PROT_WRITE */
+    if (fcntl(table_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)) {
+        perror("bluetooth_broker: memfd seal");
+        return 1;
+    }
+
+    bt = bluetooth_new();
+    if (bt == NULL || bluetooth_open(bt, backend)) {
+        fprintf(stderr, "bluetooth_broker: %s\n", bt ? bluetooth_errmsg(bt) : "out of memory");
+        return 1;
+    }
+    /* the broker doesn't talk to itself */
+    if (!strcmp(backend, "broker")) {
+        fprintf(stderr, "bluetooth_broker: pick a backend that owns the adapter\n");
+        return 1;
+    }
+
+    listen_fd = listen_on(name);
+    if (listen_fd < 0) {
+        perror("bluetooth_broker: listen");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stop) {
+        pfd[0].fd = listen_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = bluetooth_event_fd(bt);
+        pfd[1].events = POLLIN;
+        nfds = 2;
+        list_for_each_entry(client, &clients, list) {
+            clients_by_slot[nfds - 2] = client;
+            pfd[nfds].fd = client->fd;
+            pfd[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        if (poll(pfd, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN)
+            bluetooth_dispatch(bt);
+
+        for (i = 2; i < nfds; i++) {
+            if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            client = clients_by_slot[i - 2];
+            n = recv(client->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+            if (n == sizeof(msg))
+                handle_request(client, &msg);
+            else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+                client_close(client);
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            if (!peer_allowed(fd)) {
+                close(fd);
+                continue;
+            }
+            client = nclients < MAX_CLIENTS ? calloc(1, sizeof(client_t)) : NULL;
+            if (client == NULL) {
+                close(fd);
+                continue;
+            }
+            client->fd = fd;
+            list_add_tail(&client->list, &clients);
+            nclients++;
+            send_hello(fd);
+        }
+    }
+
+    list_for_each_entry_safe(client, tmp, &clients, list)
+        client_close(client);
+    close(listen_fd);
+    /* completes what's in flight with false */
+    bluetooth_close(bt);
+    bluetooth_dispatch(bt);
+    bluetooth_free(bt);
+    munmap(table, sizeof(broker_table_t));
+    close(table_fd);
+    return 0;
+}
@@ -6,8 +6,15 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
 
 #define BLUETOOTH_DEVNAME_MAXLEN (64)
+#define BLUETOOTH_UUID_MAXLEN (37)
+#define BLUETOOTH_ADVERT_MAX_ENTRIES (8)
+#define BLUETOOTH_MACADDR_MAXLEN (18)
+#define BLUETOOTH_ICON_MAXLEN (32)
+#define BLUETOOTH_PIN_MAXLEN (17)
 
 enum bluetooth_error_code {
     BLUETOOTH_ERROR_OPEN  = -1,
@@ -15,20 +22,418 @@ enum bluetooth_error_code {
 
 typedef struct bluetooth_handle bluetooth_t;
 
+/* Absolute deadline in CLOCK_MONOTONIC milliseconds. Make one with bluetooth_deadline() */
+typedef long long bluetooth_deadline_t;
+
+/* Opaque device handle, the same for a MAC address as long as bt lives */
+typedef unsigned int bluetooth_device_id_t;
+#define BLUETOOTH_DEVICE_ID_NONE (0)
+
+enum bluetooth_device_flags {
+    BLUETOOTH_DEVICE_CONNECTED      = 1 << 0,
+    BLUETOOTH_DEVICE_PAIRED         = 1 << 1,
+    BLUETOOTH_DEVICE_TRUSTED        = 1 << 2,
+};
+
+/* What bluetooth_wait_device_state() waits for */
+enum bluetooth_device_state {
+    BLUETOOTH_STATE_CONNECTED,
+    BLUETOOTH_STATE_DISCONNECTED,
+    BLUETOOTH_STATE_SERVICES_RESOLVED,  /* GATT usable. bluez only */
+    BLUETOOTH_STATE_PAIRED,             /* bluez only */
+};
+
+/* One scanned device */
+typedef struct bluetooth_device_info {
+    char name[BLUETOOTH_DEVNAME_MAXLEN];
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+    bluetooth_device_id_t id;
+    unsigned int flags;                 /* enum bluetooth_device_flags, as of the scan. bluez only */
+    char icon[BLUETOOTH_ICON_MAXLEN];   /* freedesktop icon name, e.g. "audio-headset". bluez only */
+} bluetooth_device_info_t;
+
+/* Devices of one scan. Immutable: a scan publishes a new table with the next generation */
+typedef struct bluetooth_device_table {
+    unsigned long long generation;
+    size_t n_devices;
+    const bluetooth_device_info_t *devices;
+} bluetooth_device_table_t;
+
+/* What bluetooth_device_query_new() compiles. Zero fields match every device,
+ * set ones must all hold */
+typedef struct bluetooth_device_filter {
+    unsigned int flags_set;         /* enum bluetooth_device_flags the device has */
+    unsigned int flags_clear;       /* ... and the ones it doesn't */
+    const char *name_prefix;
+    const char *icon;               /* exact icon name */
+    const char *oui;                /* first three bytes of the MAC address, "C0:FF:EE" */
+    int rssi_min, rssi_max;         /* dBm, smoothed as bluetooth_nearest_devices() ranks */
+    int max_age_ms;                 /* RSSI heard within */
+} bluetooth_device_filter_t;
+
+typedef struct bluetooth_device_query bluetooth_device_query_t;
+
+/* Completion of an async call, ok is what the blocking call would have returned */
+typedef void (*bluetooth_done_cb_t)(bool ok, void *userdata);
+
+/* One device of bluetooth_connect_devices() */
+typedef struct bluetooth_connect_request {
+    const char *device;
+    int priority;                   /* higher goes first */
+} bluetooth_connect_request_t;
+
+typedef struct bluetooth_bulk_options {
+    int max_in_flight;              /* connection attempts at once per adapter, 0: 3 */
+    int max_retries;                /* extra attempts per device after a failure */
+    int attempt_timeout_ms;         /* 0: attempts run until the overall deadline */
+} bluetooth_bulk_options_t;
+
+typedef struct bluetooth_bulk_progress {
+    size_t total;
+    size_t connected;
+    size_t failed;                  /* out of retries or time */
+    size_t in_flight;
+    size_t retries;
+} bluetooth_bulk_progress_t;
+
+/* Called after every attempt, ok is that attempt's result */
+typedef void (*bluetooth_bulk_cb_t)(const bluetooth_bulk_progress_t *progress,
+                                    const char *device, bool ok, void *userdata);
+
+enum bluetooth_export_format {
+    BLUETOOTH_EXPORT_BINARY,        /* see README, "Device table export" */
+    BLUETOOTH_EXPORT_NDJSON,        /* one JSON object per line */
+};
+
+/* Export output, in pieces of up to a few KiB. Return 0 to go on, anything else aborts */
+typedef int (*bluetooth_export_cb_t)(const void *data, size_t len, void *userdata);
+
+typedef struct bluetooth_background_options {
+    int window_ms;                  /* discover this long ... 0: 2000 */
+    int interval_ms;                /* ... every interval, 0: 10000 */
+    int max_age_ms;                 /* drop devices not listed for this long, 0: 3 intervals */
+} bluetooth_background_options_t;
+
+/* What the pairing agent can do, and what bluetoothd is told it can */
+enum bluetooth_agent_capability {
+    BLUETOOTH_AGENT_NO_IO,          /* just works: confirms and authorizes, has no PIN */
+    BLUETOOTH_AGENT_FIXED_PIN,      /* answers PIN and passkey requests with pin */
+    BLUETOOTH_AGENT_CALLBACK,       /* asks cb */
+};
+
+enum bluetooth_agent_request_type {
+    BLUETOOTH_AGENT_REQUEST_PIN,        /* fill pin */
+    BLUETOOTH_AGENT_REQUEST_PASSKEY,    /* fill passkey */
+    BLUETOOTH_AGENT_REQUEST_CONFIRM,    /* does the device show passkey too? */
+    BLUETOOTH_AGENT_REQUEST_AUTHORIZE,  /* pairing or a service, nothing to compare */
+};
+
+typedef struct bluetooth_agent_request {
+    int type;                           /* enum bluetooth_agent_request_type */
+    const char *macaddr;                /* device pairing, empty if unknown */
+    unsigned int passkey;               /* 0-999999 */
+    char pin[BLUETOOTH_PIN_MAXLEN];
+} bluetooth_agent_request_t;
+
+/* Runs on the thread pairing, with bt busy: answer, don't call into bt.
+ * Return false to reject */
+typedef bool (*bluetooth_agent_cb_t)(bluetooth_agent_request_t *request, void *userdata);
+
+typedef struct bluetooth_agent {
+    int capability;                 /* enum bluetooth_agent_capability */
+    const char *pin;                /* FIXED_PIN: the PIN, or passkey in decimal */
+    bluetooth_agent_cb_t cb;        /* CALLBACK */
+    void *userdata;
+} bluetooth_agent_t;
+
+/* One object of bluetooth_obex_send() */
+typedef struct bluetooth_obex_request {
+    const char *device;             /* name or MAC address */
+    int fd;                         /* contents, read from the start by obexd itself */
+    const char *name;               /* object name on the device */
+    const char *folder;             /* NULL: Object Push, else File Transfer into it */
+} bluetooth_obex_request_t;
+
+enum bluetooth_obex_status {
+    BLUETOOTH_OBEX_QUEUED,
+    BLUETOOTH_OBEX_ACTIVE,
+    BLUETOOTH_OBEX_COMPLETE,
+    BLUETOOTH_OBEX_ERROR,
+};
+
+typedef struct bluetooth_obex_progress {
+    size_t index;                   /* of the request */
+    int status;                     /* enum bluetooth_obex_status */
+    unsigned long long transferred;
+    unsigned long long size;        /* 0: unknown */
+} bluetooth_obex_progress_t;
+
+/* Called as obexd reports progress, and once the object is done either way */
+typedef void (*bluetooth_obex_cb_t)(const bluetooth_obex_progress_t *progress, void *userdata);
+
+enum bluetooth_profile_role {
+    BLUETOOTH_PROFILE_ANY,
+    BLUETOOTH_PROFILE_CLIENT,       /* connections we make only */
+    BLUETOOTH_PROFILE_SERVER,       /* connections devices make only */
+};
+
+/* A profile of bluetooth_profile_register(), e.g. Serial Port */
+typedef struct bluetooth_profile {
+    const char *uuid;               /* "00001101-0000-1000-8000-00805f9b34fb" */
+    const char *name;               /* NULL: none */
+    int role;                       /* enum bluetooth_profile_role */
+    unsigned short channel;         /* RFCOMM channel, 0: bluetoothd picks */
+    unsigned short psm;             /* L2CAP PSM, 0: bluetoothd picks */
+} bluetooth_profile_t;
+
+/* Moves data of many links from one thread, see bluetooth_pump_new() */
+typedef struct bluetooth_pump bluetooth_pump_t;
+
+enum bluetooth_pump_flags {
+    BLUETOOTH_PUMP_POLL     = 1 << 0,   /* poll(), the default */
+    BLUETOOTH_PUMP_URING    = 1 << 1,   /* io_uring where it works, else poll() */
+};
+
+/* Data read from link, valid during the call only. len 0: the link closed or
+ * failed and is gone, its fd closed */
+typedef void (*bluetooth_pump_cb_t)(bluetooth_pump_t *pump, int link, const void *data, size_t len,
+                                    void *userdata);
+
+/* One ManufacturerData or ServiceData entry. data points into the record's pooled buffer */
+typedef struct bluetooth_advert_data {
+    unsigned short company_id;      /* ManufacturerData only */
+    const char *uuid;               /* ServiceData only */
+    const unsigned char *data;
+    size_t len;
+} bluetooth_advert_data_t;
+
+/* Advertisement record, produced for every ManufacturerData/ServiceData update of a device */
+typedef struct bluetooth_advert {
+    const char *macaddr;
+    const bluetooth_advert_data_t *manufacturer;
+    size_t n_manufacturer;
+    const bluetooth_advert_data_t *service;
+    size_t n_service;
+} bluetooth_advert_t;
+
+enum bluetooth_gatt_flags {
+    BLUETOOTH_GATT_READ                     = 1 << 0,
+    BLUETOOTH_GATT_WRITE                    = 1 << 1,
+    BLUETOOTH_GATT_WRITE_WITHOUT_RESPONSE   = 1 << 2,
+    BLUETOOTH_GATT_NOTIFY                   = 1 << 3,
+    BLUETOOTH_GATT_INDICATE                 = 1 << 4,
+};
+
+typedef struct bluetooth_gatt_char {
+    char uuid[BLUETOOTH_UUID_MAXLEN];
+    char service_uuid[BLUETOOTH_UUID_MAXLEN];
+    unsigned int flags;                 /* enum bluetooth_gatt_flags */
+} bluetooth_gatt_char_t;
+
+/* One device of bluetooth_nearest_devices() */
+typedef struct bluetooth_rssi_rank {
+    bluetooth_device_id_t id;
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+    float rssi;                         /* dBm, EWMA of its samples, newest weighing most */
+    int samples;                        /* heard within the window, of the last 16 */
+} bluetooth_rssi_rank_t;
+
+/* Record is valid until callback returns. Use bluetooth_advert_ref() to keep it longer */
+typedef void (*bluetooth_advert_cb_t)(const bluetooth_advert_t *advert, void *userdata);
+
 /* Primary Functions */
 bluetooth_t *bluetooth_new(void);
 void bluetooth_free(bluetooth_t *bt);
+/* A handle on the process-wide context of backend, opened by its first handle and
+ * closed when bluetooth_free() releases the last: one bus connection, device table
+ * and scan for all of them. Errors, async calls, the event fd, cancel and the
+ * advert callback are per handle; the background scan acts on the context and
+ * bluetooth_set_agent() fails. Open errors show in bluetooth_errmsg(). Not for
+ * bluetooth_open() or record/replay */
+bluetooth_t *bluetooth_new_shared(const char *backend);
 int bluetooth_open(bluetooth_t *bt, const char *backend);
 void bluetooth_close(bluetooth_t *bt);
-void bluetooth_scan(bluetooth_t *bt, int timeout);
+void bluetooth_scan(bluetooth_t *bt, bluetooth_deadline_t deadline);
 size_t bluetooth_get_devices(bluetooth_t *bt, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum);
-/* Return true is connect command is sent. Should use bluetooth_device_is_connected() to check connection status */
-bool bluetooth_connect_device(bluetooth_t *bt, const char *device, int timeout);
-bool bluetooth_disconnect_device(bluetooth_t *handle, const char *device, int timeout);
+/* Return true is connect command is sent. Use bluetooth_wait_device_state() to wait for the connection */
+bool bluetooth_connect_device(bluetooth_t *bt, const char *device, bluetooth_deadline_t deadline);
+bool bluetooth_disconnect_device(bluetooth_t *handle, const char *device, bluetooth_deadline_t deadline);
 bool bluetooth_device_is_connected(bluetooth_t *bt, const char *device);
+/* Block until device is in state, the deadline passes or bluetooth_cancel().
+ * bluez wakes on the PropertiesChanged that gets it there, other backends
+ * poll connected every 50 ms. Return true once it is */
+bool bluetooth_wait_device_state(bluetooth_t *bt, const char *device, enum bluetooth_device_state state,
+                                 bluetooth_deadline_t deadline);
+/* The same for n devices, until want of them are in state: n for all, 1 for any.
+ * reached[i], if given, tells whether devices[i] is. Return how many are, -1 on error */
+int bluetooth_wait_devices_state(bluetooth_t *bt, const char *const *devices, size_t n,
+                                 enum bluetooth_device_state state, size_t want,
+                                 bluetooth_deadline_t deadline, bool *reached);
+/* Pin the devices of the last scan, never blocks behind a running scan.
+ * Release with bluetooth_device_table_unref(), and before bluetooth_free() */
+const bluetooth_device_table_t *bluetooth_device_table_get(bluetooth_t *bt);
+void bluetooth_device_table_unref(const bluetooth_device_table_t *table);
+/* Device ids. Per-device calls taking an id skip resolving a name: no string
+ * matching, no ambiguity. Ids come from the device table or a lookup */
+/* Id of the device with this MAC address, or this exact name if no other device has it */
+bluetooth_device_id_t bluetooth_device_lookup(bluetooth_t *bt, const char *device);
+bool bluetooth_device_is_connected_id(bluetooth_t *bt, bluetooth_device_id_t id);
+bool bluetooth_connect_device_id(bluetooth_t *bt, bluetooth_device_id_t id, bluetooth_deadline_t deadline);
+bool bluetooth_disconnect_device_id(bluetooth_t *bt, bluetooth_device_id_t id, bluetooth_deadline_t deadline);
+/* Up to k devices heard within the last window_ms, strongest smoothed RSSI first.
+ * Samples come from scans, and from every RSSI update while bluez discovers.
+ * Return number of devices in ranks */
+int bluetooth_nearest_devices(bluetooth_t *bt, int window_ms, bluetooth_rssi_rank_t *ranks, int k);
+
+/* Device queries. A query runs over columns of a device table built once per scan,
+ * nothing is copied but the matches */
+/* Return NULL if the filter is malformed */
+bluetooth_device_query_t *bluetooth_device_query_new(const bluetooth_device_filter_t *filter);
+void bluetooth_device_query_free(bluetooth_device_query_t *query);
+/* Ids of devices in the last scan matching query, in table order. ids holds up to max.
+ * Return number of matches, which may be more than max */
+size_t bluetooth_device_query_ids(bluetooth_t *bt, const bluetooth_device_query_t *query,
+                                  bluetooth_device_id_t *ids, size_t max);
+/* Same over a pinned table, views point into it */
+size_t bluetooth_device_table_query(bluetooth_t *bt, const bluetooth_device_table_t *table,
+                                    const bluetooth_device_query_t *query,
+                                    const bluetooth_device_info_t **views, size_t max);
+
+/* Device table export. Changes after generation since, in the order they happened:
+ * devices added, removed, and the fields that changed. A device seen again after
+ * being removed comes with all its fields. since 0: every device.
+ * Return the generation exported up to, since of the next call; -1 on error */
+long long bluetooth_device_export(bluetooth_t *bt, unsigned long long since, int format,
+                                  bluetooth_export_cb_t cb, void *userdata);
+/* Same, written to fd */
+long long bluetooth_device_export_fd(bluetooth_t *bt, unsigned long long since, int format, int fd);
+
+/* Background scanning. A thread of bt scans for a window every interval and
+ * merges each scan into the device table, devices drop out once not listed
+ * for max_age_ms. Windows shrink with every connected device, and wait for
+ * connection attempts in flight. opts NULL: defaults. Return -1 on error */
+int bluetooth_background_scan_start(bluetooth_t *bt, const bluetooth_background_options_t *opts);
+/* Return once the window in progress ended. bluetooth_close() stops it too */
+void bluetooth_background_scan_stop(bluetooth_t *bt);
+
+/* OBEX. Send objects through obexd on the session bus, to different devices
+ * at once and one after another per device. Progress comes from obexd's
+ * signals, unfinished transfers are cancelled at the deadline. obexd opens
+ * each fd through /proc, nothing passes through this process. bt is busy
+ * meanwhile. bluez only. Return number of objects sent, -1 on error */
+int bluetooth_obex_send(bluetooth_t *bt, const bluetooth_obex_request_t *requests, size_t n,
+                        bluetooth_deadline_t deadline, bluetooth_obex_cb_t cb, void *userdata);
+
+/* Profiles. Register a profile with bluetoothd, which then hands out a
+ * socket per connection on it: RFCOMM or L2CAP, ready for data. Profiles
+ * stay registered until bluetooth_close(). bluez only */
+bool bluetooth_profile_register(bluetooth_t *bt, const bluetooth_profile_t *profile);
+/* Connect device on the registered profile uuid. Return the socket, yours to
+ * close, or -1 */
+int bluetooth_profile_connect(bluetooth_t *bt, const char *device, const char *uuid,
+                              bluetooth_deadline_t deadline);
+/* Next connection a device made on a registered profile, waiting for one
+ * until deadline. macaddr and uuid, either NULL, are set to whose it is.
+ * Return the socket, yours to close, or -1 */
+int bluetooth_profile_accept(bluetooth_t *bt, char macaddr[BLUETOOTH_MACADDR_MAXLEN],
+                             char uuid[BLUETOOTH_UUID_MAXLEN], bluetooth_deadline_t deadline);
+
+/* Data pump. Serves up to max_links sockets, e.g. profile connections, from
+ * the calling thread with one poll() per bluetooth_pump_run(). With
+ * BLUETOOTH_PUMP_URING it runs on io_uring instead where that works: a
+ * multishot recv per link into a ring of provided buffers, and the sends
+ * queued in one submission per run. Not thread safe. Return NULL on error */
+bluetooth_pump_t *bluetooth_pump_new(int max_links, unsigned int flags);
+/* Closes every link left */
+void bluetooth_pump_free(bluetooth_pump_t *pump);
+/* true: runs on io_uring */
+bool bluetooth_pump_uring(const bluetooth_pump_t *pump);
+/* Take over socket fd, closed when the link goes. Return the link, -1 if full */
+int bluetooth_pump_add(bluetooth_pump_t *pump, int fd, bluetooth_pump_cb_t cb, void *userdata);
+/* Close link, its callback is not called again */
+void bluetooth_pump_remove(bluetooth_pump_t *pump, int link);
+/* Queue len bytes for link, sent by the next bluetooth_pump_run(). false if
+ * they don't fit: run, then try again */
+bool bluetooth_pump_write(bluetooth_pump_t *pump, int link, const void *data, size_t len);
+/* Wait until data moved on some link or deadline, and call back for what was
+ * read. Callbacks may write and remove, but not run. Return reads and writes
+ * done, 0 at once without links, -1 on error */
+int bluetooth_pump_run(bluetooth_pump_t *pump, bluetooth_deadline_t deadline);
+
+/* Pairing agent. Pairing done by bt answers bluetoothd's requests itself
+ * instead of waiting on an agent elsewhere, e.g. a desktop prompt. agent is
+ * copied, NULL removes it. Kept across bluetooth_close()/bluetooth_open().
+ * Return false if malformed, bt is shared or the backend can't */
+bool bluetooth_set_agent(bluetooth_t *bt, const bluetooth_agent_t *agent);
+
+/* Connect many devices at once, by priority, retrying failures. Attempts in flight
+ * are capped so the controller isn't flooded. opts NULL: defaults.
+ * Return number of devices connected, -1 on error */
+int bluetooth_connect_devices(bluetooth_t *bt, const bluetooth_connect_request_t *requests, size_t n,
+                              const bluetooth_bulk_options_t *opts, bluetooth_deadline_t deadline,
+                              bluetooth_bulk_cb_t cb, void *userdata);
 
 const char *bluetooth_errmsg(bluetooth_t *bt);
 
+/* Record and replay */
+/* Record what the backend exchanges with the system (D-Bus messages, bluetoothctl
+ * commands and output), timestamped, from the next bluetooth_open() until
+ * bluetooth_close(). Return 0 on success */
+int bluetooth_record(bluetooth_t *bt, const char *path);
+/* Open the backend a recording was made with, talking to the recording instead of
+ * the system. speed: 1 keeps the recorded pace, 10 is ten times faster, 0 doesn't wait */
+int bluetooth_open_replay(bluetooth_t *bt, const char *path, double speed);
+
+/* Deadline timeout_ms from now */
+bluetooth_deadline_t bluetooth_deadline(int timeout_ms);
+/* Abort scan, pair or connect in progress on bt right away. Safe from any thread
+ * and from signal handlers. Calls on bt fail fast until bluetooth_cancel_reset() */
+void bluetooth_cancel(bluetooth_t *bt);
+void bluetooth_cancel_reset(bluetooth_t *bt);
+
+/* Async Functions */
+/* Run the call on a worker thread of bt. Once done, cb runs from the next
+ * bluetooth_dispatch(). Return -1 if the call couldn't be queued. On bluez,
+ * connects and disconnects queued together are in flight together */
+int bluetooth_scan_async(bluetooth_t *bt, bluetooth_deadline_t deadline,
+                         bluetooth_done_cb_t cb, void *userdata);
+int bluetooth_connect_device_async(bluetooth_t *bt, const char *device, bluetooth_deadline_t deadline,
+                                   bluetooth_done_cb_t cb, void *userdata);
+int bluetooth_disconnect_device_async(bluetooth_t *bt, const char *device, bluetooth_deadline_t deadline,
+                                      bluetooth_done_cb_t cb, void *userdata);
+int bluetooth_device_is_connected_async(bluetooth_t *bt, const char *device,
+                                        bluetooth_done_cb_t cb, void *userdata);
+/* Readable while completed calls wait for bluetooth_dispatch(). Poll it in your event loop */
+int bluetooth_event_fd(bluetooth_t *bt);
+/* Run callbacks of completed calls in the calling thread. bluetooth_close() completes
+ * queued calls with false, callbacks not dispatched by bluetooth_free() are dropped */
+void bluetooth_dispatch(bluetooth_t *bt);
+
+/* Advertisement Functions */
+/* Adverts are delivered while scanning. Returns false if backend can't capture them */
+bool bluetooth_set_advert_callback(bluetooth_t *bt, bluetooth_advert_cb_t cb, void *userdata);
+/* Records come from a fixed per-handle pool. Release every ref before bluetooth_close() */
+const bluetooth_advert_t *bluetooth_advert_ref(const bluetooth_advert_t *advert);
+void bluetooth_advert_unref(const bluetooth_advert_t *advert);
+
+/* GATT Functions. Device must be connected and its services resolved */
+/* Return number of characteristics, -1 on error */
+int bluetooth_gatt_discover(bluetooth_t *bt, const char *device, bluetooth_gatt_char_t *chars, int charnum);
+/* Return number of bytes read, -1 on error */
+int bluetooth_gatt_read(bluetooth_t *bt, const char *device, const char *uuid, void *buf, size_t len);
+bool bluetooth_gatt_write(bluetooth_t *bt, const char *device, const char *uuid, const void *buf, size_t len);
+/* Return a SOCK_SEQPACKET fd (one packet per ATT value) or -1. Close with bluetooth_gatt_release() */
+int bluetooth_gatt_acquire_notify(bluetooth_t *bt, const char *device, const char *uuid, size_t *mtu);
+int bluetooth_gatt_acquire_write(bluetooth_t *bt, const char *device, const char *uuid, size_t *mtu);
+void bluetooth_gatt_release(bluetooth_t *bt, int fd);
+/* Persist resolved attribute trees per device MAC under dir, so a reconnect skips
+ * service discovery. Trees are always cached in memory. NULL: memory only (default) */
+bool bluetooth_gatt_set_cache_dir(bluetooth_t *bt, const char *dir);
+/* Batched I/O on acquired fds, one syscall for many values. iov_len is updated to each
+ * value's length on receive. Return number of values moved, -1 on error */
+int bluetooth_gatt_recv(int fd, struct iovec *values, int n, int timeout_ms);
+int bluetooth_gatt_send(int fd, const struct iovec *values, int n);
+
 #ifdef __cplusplus
 }
 #endif
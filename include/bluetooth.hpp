@@ -0,0 +1,244 @@
+#ifndef _BLUETOOTH_HPP
+#define _BLUETOOTH_HPP
+
+/*
+ * C++20 wrapper over bluetooth.h, header only.
+ *
+ *   bluetooth::Bluetooth bt("bluez");
+ *   co_await bt.scan(3000ms);
+ *   for (const auto &dev : bt.devices())   // pinned until the loop ends
+ *       if (co_await bt.connect(dev.name, 10000ms)) ...
+ *
+ * Awaited calls run on the library's worker threads and resume from
+ * dispatch(), so poll event_fd() in the thread that owns the coroutines.
+ * Connects and disconnects awaited together go out together on bluez, see
+ * bluetooth.h.
+ */
+
+#include <chrono>
+#include <coroutine>
+#include <new>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "bluetooth.h"
+
+namespace bluetooth {
+
+using device_info = bluetooth_device_info_t;
+
+/* A pinned device table. Scans publish new tables, this one never changes */
+class device_table {
+public:
+    explicit device_table(const bluetooth_device_table_t *table) noexcept : table_(table) {}
+    ~device_table() { bluetooth_device_table_unref(table_); }
+
+    device_table(const device_table &) = delete;
+    device_table &operator=(const device_table &) = delete;
+
+    device_table(device_table &&other) noexcept : table_(std::exchange(other.table_, nullptr)) {}
+
+    device_table &operator=(device_table &&other) noexcept
+    {
+        if (this != &other) {
+            bluetooth_device_table_unref(table_);
+            table_ = std::exchange(other.table_, nullptr);
+        }
+        return *this;
+    }
+
+    unsigned long long generation() const noexcept { return table_ ? table_->generation : 0; }
+
+    std::span<const device_info> span() const noexcept
+    {
+        if (table_ == nullptr)
+            return {};
+        return {table_->devices, table_->n_devices};
+    }
+
+    auto begin() const noexcept { return span().begin(); }
+    auto end() const noexcept { return span().end(); }
+    size_t size() const noexcept { return span().size(); }
+
+    /* valid as long as this table */
+    auto names() const noexcept
+    {
+        return span() | std::views::transform([](const device_info &dev) {
+            return std::string_view(dev.name);
+        });
+    }
+
+private:
+    const bluetooth_device_table_t *table_;
+};
+
+class Bluetooth {
+public:
+    explicit Bluetooth(const char *backend) : bt_(bluetooth_new())
+    {
+        if (bt_ == nullptr)
+            throw std::bad_alloc();
+        if (bluetooth_open(bt_, backend)) {
+            std::string msg = bluetooth_errmsg(bt_);
+            bluetooth_free(bt_);
+            throw std::runtime_error(msg);
+        }
+    }
+
+    ~Bluetooth() { reset(); }
+
+    Bluetooth(const Bluetooth &) = delete;
+    Bluetooth &operator=(const Bluetooth &) = delete;
+
+    Bluetooth(Bluetooth &&other) noexcept : bt_(std::exchange(other.bt_, nullptr)) {}
+
+    Bluetooth &operator=(Bluetooth &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            bt_ = std::exchange(other.bt_, nullptr);
+        }
+        return *this;
+    }
+
+    bluetooth_t *get() const noexcept { return bt_; }
+
+    /* Devices of the last scan, without copying them. Release tables before
+     * the Bluetooth object goes away */
+    device_table devices() const noexcept
+    {
+        return device_table(bluetooth_device_table_get(bt_));
+    }
+
+    /* Blocking calls */
+    void scan_sync(std::chrono::milliseconds timeout)
+    {
+        bluetooth_scan(bt_, bluetooth_deadline(timeout.count()));
+    }
+
+    bool connect_sync(const std::string &device, std::chrono::milliseconds timeout)
+    {
+        return bluetooth_connect_device(bt_, device.c_str(), bluetooth_deadline(timeout.count()));
+    }
+
+    bool disconnect_sync(const std::string &device, std::chrono::milliseconds timeout)
+    {
+        return bluetooth_disconnect_device(bt_, device.c_str(), bluetooth_deadline(timeout.count()));
+    }
+
+    bool is_connected(const std::string &device)
+    {
+        return bluetooth_device_is_connected(bt_, device.c_str());
+    }
+
+    /* By id, see bluetooth_device_lookup() */
+    bluetooth_device_id_t lookup(const std::string &device) const noexcept
+    {
+        return bluetooth_device_lookup(bt_, device.c_str());
+    }
+
+    bool connect_sync(bluetooth_device_id_t id, std::chrono::milliseconds timeout)
+    {
+        return bluetooth_connect_device_id(bt_, id, bluetooth_deadline(timeout.count()));
+    }
+
+    bool disconnect_sync(bluetooth_device_id_t id, std::chrono::milliseconds timeout)
+    {
+        return bluetooth_disconnect_device_id(bt_, id, bluetooth_deadline(timeout.count()));
+    }
+
+    bool is_connected(bluetooth_device_id_t id)
+    {
+        return bluetooth_device_is_connected_id(bt_, id);
+    }
+
+    void cancel() noexcept { bluetooth_cancel(bt_); }
+    void cancel_reset() noexcept { bluetooth_cancel_reset(bt_); }
+
+    int event_fd() const noexcept { return bluetooth_event_fd(bt_); }
+    /* Resume the coroutines whose calls completed */
+    void dispatch() noexcept { bluetooth_dispatch(bt_); }
+
+    /* co_await-able call, yields what the blocking call returns */
+    class operation {
+    public:
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle) noexcept
+        {
+            handle_ = handle;
+            /* not queued: resume right away with false */
+            return submit_(bt_, device_.c_str(), deadline_, &operation::done, this) == 0;
+        }
+
+        bool await_resume() const noexcept { return ok_; }
+
+    private:
+        friend class Bluetooth;
+        using submit_fn = int (*)(bluetooth_t *, const char *, bluetooth_deadline_t,
+                                  bluetooth_done_cb_t, void *);
+
+        operation(bluetooth_t *bt, submit_fn submit, std::string device,
+                  std::chrono::milliseconds timeout)
+            : bt_(bt), submit_(submit), device_(std::move(device)),
+              deadline_(bluetooth_deadline(timeout.count())) {}
+
+        static void done(bool ok, void *userdata)
+        {
+            auto *op = static_cast<operation *>(userdata);
+
+            op->ok_ = ok;
+            op->handle_.resume();
+        }
+
+        bluetooth_t *bt_;
+        submit_fn submit_;
+        std::string device_;
+        bluetooth_deadline_t deadline_;
+        std::coroutine_handle<> handle_;
+        bool ok_ = false;
+    };
+
+    operation scan(std::chrono::milliseconds timeout)
+    {
+        return operation(bt_, &submit_scan, {}, timeout);
+    }
+
+    operation connect(std::string device, std::chrono::milliseconds timeout)
+    {
+        return operation(bt_, &bluetooth_connect_device_async, std::move(device), timeout);
+    }
+
+    operation disconnect(std::string device, std::chrono::milliseconds timeout)
+    {
+        return operation(bt_, &bluetooth_disconnect_device_async, std::move(device), timeout);
+    }
+
+private:
+    static int submit_scan(bluetooth_t *bt, const char *, bluetooth_deadline_t deadline,
+                           bluetooth_done_cb_t cb, void *userdata)
+    {
+        return bluetooth_scan_async(bt, deadline, cb, userdata);
+    }
+
+    void reset() noexcept
+    {
+        if (bt_ == nullptr)
+            return;
+        bluetooth_close(bt_);
+        /* resume what bluetooth_close() completed */
+        bluetooth_dispatch(bt_);
+        bluetooth_free(bt_);
+        bt_ = nullptr;
+    }
+
+    bluetooth_t *bt_;
+};
+
+} // namespace bluetooth
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "bluetooth_internal.h"
+#include "bluetooth.h"
+
+/* Payload bytes of one record. Legacy adverts carry at most 31 bytes and
+ * extended ones 255, so this holds a full update with room to spare. */
+#define ADVERT_ARENA_SIZE   (512)
+
+typedef struct advert_slot {
+    /* public view handed to consumers */
+    bluetooth_advert_t advert;
+
+    struct advert_pool *pool;
+    int refcnt;
+
+    char macaddr[18];
+    bluetooth_advert_data_t manufacturer[BLUETOOTH_ADVERT_MAX_ENTRIES];
+    bluetooth_advert_data_t service[BLUETOOTH_ADVERT_MAX_ENTRIES];
+    char uuids[BLUETOOTH_ADVERT_MAX_ENTRIES][BLUETOOTH_UUID_MAXLEN];
+
+    size_t used;
+    unsigned char arena[ADVERT_ARENA_SIZE];
+
+    struct list_head list;
+} advert_slot_t;
+
+struct advert_pool {
+    pthread_mutex_t lock;
+    struct list_head free;
+    size_t nslots;
+    unsigned long dropped;
+    advert_slot_t slots[];
+};
+
+advert_pool_t *advert_pool_new(size_t nslots)
+{
+    advert_pool_t *pool;
+    size_t i;
+
+    pool = calloc(1, sizeof(advert_pool_t) + nslots * sizeof(advert_slot_t));
+    if (pool == NULL)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    INIT_LIST_HEAD(&pool->free);
+    pool->nslots = nslots;
+    for (i = 0; i < nslots; i++) {
+        pool->slots[i].pool = pool;
+        list_add_tail(&pool->slots[i].list, &pool->free);
+    }
+    return pool;
+}
+
+void advert_pool_free(advert_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+bluetooth_advert_t *advert_pool_get(advert_pool_t *pool, const char *macaddr)
+{
+    advert_slot_t *slot = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!list_empty(&pool->free)) {
+        slot = list_first_entry(&pool->free, advert_slot_t, list);
+        list_del(&slot->list);
+    } else {
+        pool->dropped++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (slot == NULL)
+        return NULL;
+
+    slot->refcnt = 1;
+    slot->used = 0;
+    strncpy(slot->macaddr, macaddr, sizeof(slot->macaddr));
+    slot->macaddr[sizeof(slot->macaddr)-1] = '\0';
+
+    slot->advert.macaddr = slot->macaddr;
+    slot->advert.manufacturer = slot->manufacturer;
+    slot->advert.n_manufacturer = 0;
+    slot->advert.service = slot->service;
+    slot->advert.n_service = 0;
+    return &slot->advert;
+}
+
+static const unsigned char *advert_store(advert_slot_t *slot, const void *data, size_t len)
+{
+    unsigned char *p;
+
+    if (len > sizeof(slot->arena) - slot->used)
+        return NULL;
+
+    p = slot->arena + slot->used;
+    memcpy(p, data, len);
+    slot->used += len;
+    return p;
+}
+
+int advert_add_manufacturer(bluetooth_advert_t *advert, unsigned short company,
+                            const void *data, size_t len)
+{
+    advert_slot_t *slot = container_of(advert, advert_slot_t, advert);
+    bluetooth_advert_data_t *entry;
+
+    if (advert->n_manufacturer == BLUETOOTH_ADVERT_MAX_ENTRIES)
+        return 1;
+
+    entry = &slot->manufacturer[advert->n_manufacturer];
+    entry->data = advert_store(slot, data, len);
+    if (entry->data == NULL)
+        return 1;
+    entry->len = len;
+    entry->company_id = company;
+    entry->uuid = NULL;
+    advert->n_manufacturer++;
+    return 0;
+}
+
+int advert_add_service(bluetooth_advert_t *advert, const char *uuid,
+                       const void *data, size_t len)
+{
+    advert_slot_t *slot = container_of(advert, advert_slot_t, advert);
+    bluetooth_advert_data_t *entry;
+    size_t n = advert->n_service;
+
+    if (n == BLUETOOTH_ADVERT_MAX_ENTRIES)
+        return 1;
+
+    entry = &slot->service[n];
+    entry->data = advert_store(slot, data, len);
+    if (entry->data == NULL)
+        return 1;
+    entry->len = len;
+    entry->company_id = 0;
+    strncpy(slot->uuids[n], uuid, sizeof(slot->uuids[n]));
+    slot->uuids[n][sizeof(slot->uuids[n])-1] = '\0';
+    entry->uuid = slot->uuids[n];
+    advert->n_service++;
+    return 0;
+}
+
+const bluetooth_advert_t *bluetooth_advert_ref(const bluetooth_advert_t *advert)
+{
+    advert_slot_t *slot = container_of(advert, advert_slot_t, advert);
+
+    __atomic_add_fetch(&slot->refcnt, 1, __ATOMIC_RELAXED);
+    return advert;
+}
+
+void bluetooth_advert_unref(const bluetooth_advert_t *advert)
+{
+    advert_slot_t *slot;
+    advert_pool_t *pool;
+
+    if (advert == NULL)
+        return;
+
+    slot = container_of(advert, advert_slot_t, advert);
+    if (__atomic_sub_fetch(&slot->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    pool = slot->pool;
+    pthread_mutex_lock(&pool->lock);
+    list_add(&slot->list, &pool->free);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bluetooth_internal.h"
+
+#define PASSKEY_MAX     (999999)
+
+/* "123456" -> 123456, 1 unless a passkey */
+static int parse_passkey(const char *pin, unsigned int *passkey)
+{
+    char *end;
+    unsigned long v;
+
+    if (pin == NULL || *pin < '0' || *pin > '9')
+        return 1;
+    v = strtoul(pin, &end, 10);
+    if (*end || v > PASSKEY_MAX)
+        return 1;
+    *passkey = v;
+    return 0;
+}
+
+bool agent_answer(const bluetooth_agent_t *agent, bluetooth_agent_request_t *request)
+{
+    unsigned int passkey;
+    bool ok;
+
+    if (agent == NULL)
+        return false;
+
+    switch (agent->capability) {
+    case BLUETOOTH_AGENT_NO_IO:
+        return request->type == BLUETOOTH_AGENT_REQUEST_CONFIRM ||
+               request->type == BLUETOOTH_AGENT_REQUEST_AUTHORIZE;
+
+    case BLUETOOTH_AGENT_FIXED_PIN:
+        switch (request->type) {
+        case BLUETOOTH_AGENT_REQUEST_PIN:
+            snprintf(request->pin, sizeof(request->pin), "%s", agent->pin);
+            return true;
+        case BLUETOOTH_AGENT_REQUEST_PASSKEY:
+            return !parse_passkey(agent->pin, &request->passkey);
+        case BLUETOOTH_AGENT_REQUEST_CONFIRM:
+            /* the device shows what we would have typed */
+            return !parse_passkey(agent->pin, &passkey) && passkey == request->passkey;
+        default:
+            return true;
+        }
+
+    case BLUETOOTH_AGENT_CALLBACK:
+        if (agent->cb == NULL)
+            return false;
+        ok = agent->cb(request, agent->userdata);
+        request->pin[sizeof(request->pin) - 1] = '\0';
+        if (ok && request->type == BLUETOOTH_AGENT_REQUEST_PASSKEY && request->passkey > PASSKEY_MAX)
+            return false;
+        return ok;
+    }
+    return false;
+}
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "list.h"
+#include "bluetooth_internal.h"
+
+#define ASYNC_MAX_WORKERS   (sizeof(((async_t *)0)->workers) / sizeof(pthread_t))
+/* devices one batch takes at most, the rest go in the next */
+#define ASYNC_BATCH_MAX     (64)
+
+typedef struct async_call {
+    bluetooth_t *bt;
+    async_fn_t fn;
+    char device[BLUETOOTH_DEVNAME_MAXLEN];
+    long long deadline;
+    bluetooth_done_cb_t cb;
+    void *userdata;
+    bool ok;
+    struct list_head list;
+} async_call_t;
+
+int async_init(async_t *async)
+{
+    async->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (async->event_fd < 0)
+        return 1;
+
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->cond, NULL);
+    INIT_LIST_HEAD(&async->pending);
+    INIT_LIST_HEAD(&async->done);
+    INIT_LIST_HEAD(&async->batch);
+    async->batching = false;
+    async->nworkers = 0;
+    async->stop = false;
+    return 0;
+}
+
+/* caller holds async->lock */
+static void async_complete(async_t *async, async_call_t *call)
+{
+    uint64_t one = 1;
+
+    list_add_tail(&call->list, &async->done);
+    if (write(async->event_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/*
+ * Connects and disconnects run as one batch on the backend's pending calls,
+ * see bluetooth_batch(): one worker drives it, and calls queued while it runs
+ * join it from async_feed() instead of taking a worker each. Calls on one
+ * device keep their order, identical ones go to the backend once.
+ */
+static bool batchable(const async_call_t *call)
+{
+    return call->fn == bluetooth_connect_device || call->fn == bluetooth_disconnect_device;
+}
+
+/* caller holds async->lock. Next call a worker may run */
+static async_call_t *async_next(async_t *async)
+{
+    async_call_t *call;
+
+    list_for_each_entry(call, &async->pending, list) {
+        if (!(async->batching && batchable(call)))
+            return call;
+    }
+    return NULL;
+}
+
+/* caller holds async->lock. Whether call may join the batch now: not ahead of
+ * a call on its device left queued, nor next to the opposite call in it */
+static bool batch_takes(async_t *async, async_call_t *call)
+{
+    async_call_t *other;
+
+    if (!batchable(call) || !bluetooth_batchable(call->bt, call->device))
+        return false;
+    list_for_each_entry(other, &async->pending, list) {
+        if (other == call)
+            break;
+        if (!strcmp(other->device, call->device))
+            return false;
+    }
+    list_for_each_entry(other, &async->batch, list) {
+        if (!strcmp(other->device, call->device) && other->fn != call->fn)
+            return false;
+    }
+    return true;
+}
+
+/* bulk_feed_t: the next call queued for the batch, one already in it for the
+ * same device comes along without an item of its own */
+static bool async_feed(void *userdata, bulk_item_t *item)
+{
+    async_t *async = (async_t *)userdata;
+    async_call_t *call, *tmp, *other;
+    bool same;
+
+    pthread_mutex_lock(&async->lock);
+    list_for_each_entry_safe(call, tmp, &async->pending, list) {
+        if (async->stop)
+            break;
+        if (!batch_takes(async, call))
+            continue;
+        same = false;
+        list_for_each_entry(other, &async->batch, list)
+            same |= other->fn == call->fn && !strcmp(other->device, call->device);
+        list_del(&call->list);
+        list_add_tail(&call->list, &async->batch);
+        if (same)
+            continue;
+        item->device = call->device;
+        item->deadline = call->deadline;
+        item->disconnect = call->fn == bluetooth_disconnect_device;
+        pthread_mutex_unlock(&async->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&async->lock);
+    return false;
+}
+
+/* bluetooth_bulk_cb_t: device is the call->device of the call fed, the calls
+ * that came along end with it */
+static void async_batch_done(const bluetooth_bulk_progress_t *progress, const char *device, bool ok,
+                             void *userdata)
+{
+    async_t *async = (async_t *)userdata;
+    async_call_t *call, *tmp, *fed = NULL;
+    async_fn_t fn;
+
+    (void)progress;
+    pthread_mutex_lock(&async->lock);
+    list_for_each_entry(call, &async->batch, list) {
+        if (call->device == device) {
+            fed = call;
+            break;
+        }
+    }
+    if (fed) {
+        fn = fed->fn;
+        list_for_each_entry_safe(call, tmp, &async->batch, list) {
+            if (call->fn != fn || strcmp(call->device, device))
+                continue;
+            call->ok = ok;
+            list_del(&call->list);
+            async_complete(async, call);
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+}
+
+static void *async_worker(void *data)
+{
+    async_t *async = (async_t *)data;
+    async_call_t *call;
+    int ret;
+
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+        while (!async->stop && !(call = async_next(async)))
+            pthread_cond_wait(&async->cond, &async->lock);
+        if (async->stop)
+            break;
+
+        if (batch_takes(async, call)) {
+            /* the batch takes call and what comes after from async_feed() */
+            async->batching = true;
+            pthread_mutex_unlock(&async->lock);
+            ret = bluetooth_batch(call->bt, ASYNC_BATCH_MAX, async_feed, async_batch_done, async);
+            pthread_mutex_lock(&async->lock);
+            async->batching = false;
+            pthread_cond_broadcast(&async->cond);
+            /* out of memory: nothing was fed, call is still queued. Run it on its own */
+            if (ret == 0)
+                continue;
+        }
+        list_del(&call->list);
+        pthread_mutex_unlock(&async->lock);
+
+        /* identical calls on other workers coalesce in the blocking API */
+        call->ok = call->fn(call->bt, call->device, call->deadline);
+
+        pthread_mutex_lock(&async->lock);
+        async_complete(async, call);
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+int async_submit(async_t *async, bluetooth_t *bt, async_fn_t fn, const char *device,
+                 long long deadline, bluetooth_done_cb_t cb, void *userdata)
+{
+    async_call_t *call;
+
+    call = calloc(1, sizeof(async_call_t));
+    if (call == NULL)
+        return -1;
+
+    call->bt = bt;
+    call->fn = fn;
+    strncpy(call->device, device ? device : "", sizeof(call->device));
+    call->device[sizeof(call->device)-1] = '\0';
+    call->deadline = deadline;
+    call->cb = cb;
+    call->userdata = userdata;
+
+    pthread_mutex_lock(&async->lock);
+    /* workers start with the first call and stay until async_stop() */
+    if ((size_t)async->nworkers < ASYNC_MAX_WORKERS) {
+        if (pthread_create(&async->workers[async->nworkers], NULL, async_worker, async) == 0)
+            async->nworkers++;
+    }
+    if (async->nworkers == 0) {
+        pthread_mutex_unlock(&async->lock);
+        free(call);
+        return -1;
+    }
+    async->stop = false;
+    list_add_tail(&call->list, &async->pending);
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+    return 0;
+}
+
+void async_stop(async_t *async)
+{
+    async_call_t *call, *tmp;
+    int i, nworkers;
+
+    pthread_mutex_lock(&async->lock);
+    async->stop = true;
+    pthread_cond_broadcast(&async->cond);
+    nworkers = async->nworkers;
+    pthread_mutex_unlock(&async->lock);
+
+    for (i = 0; i < nworkers; i++)
+        pthread_join(async->workers[i], NULL);
+
+    pthread_mutex_lock(&async->lock);
+    async->nworkers = 0;
+    list_for_each_entry_safe(call, tmp, &async->pending, list) {
+        list_del(&call->list);
+        call->ok = false;
+        async_complete(async, call);
+    }
+    pthread_mutex_unlock(&async->lock);
+}
+
+void async_dispatch(async_t *async)
+{
+    struct list_head done;
+    async_call_t *call, *tmp;
+    uint64_t count;
+
+    INIT_LIST_HEAD(&done);
+    pthread_mutex_lock(&async->lock);
+    if (read(async->event_fd, &count, sizeof(count)) < 0)
+        count = 0;
+    list_splice_init(&async->done, &done);
+    pthread_mutex_unlock(&async->lock);
+
+    /* unlocked: callbacks may queue the next call */
+    list_for_each_entry_safe(call, tmp, &done, list) {
+        list_del(&call->list);
+        if (call->cb)
+            call->cb(call->ok, call->userdata);
+        free(call);
+    }
+}
+
+void async_destroy(async_t *async)
+{
+    async_call_t *call, *tmp;
+
+    async_stop(async);
+    list_for_each_entry_safe(call, tmp, &async->done, list) {
+        list_del(&call->list);
+        free(call);
+    }
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->lock);
+    close(async->event_fd);
+}
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "bluetooth_internal.h"
+
+/* Backends live in libhal_bluetooth_<ident>.so next to this library, loaded
+ * the first time bluetooth_open() asks for them and kept until exit */
+#define BACKEND_LIB_PREFIX  "libhal_bluetooth_"
+
+static struct {
+    const char *ident;
+    const bluetooth_backend_t *backend;
+} backends[] = {
+    { "bluetoothctl", NULL },
+    { "bluez", NULL },
+    { "broker", NULL },
+};
+
+static pthread_mutex_t backends_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *backend_dlopen(const char *ident, char *errmsg, size_t len)
+{
+    char path[PATH_MAX];
+    const char *slash;
+    Dl_info info;
+    void *dl;
+
+    /* the directory this library was loaded from */
+    if (dladdr((void *)backend_load, &info) && info.dli_fname &&
+        (slash = strrchr(info.dli_fname, '/'))) {
+        snprintf(path, sizeof(path), "%.*s/" BACKEND_LIB_PREFIX "%s.so",
+                 (int)(slash - info.dli_fname), info.dli_fname, ident);
+        dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (dl)
+            return dl;
+    }
+
+    /* then wherever the dynamic linker looks */
+    snprintf(path, sizeof(path), BACKEND_LIB_PREFIX "%s.so", ident);
+    dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (dl == NULL)
+        snprintf(errmsg, len, "%s", dlerror());
+    return dl;
+}
+
+const bluetooth_backend_t *backend_load(const char *name, char *errmsg, size_t len)
+{
+    const bluetooth_backend_t *(*entry)(void);
+    const bluetooth_backend_t *backend = NULL;
+    size_t i;
+    void *dl;
+
+    pthread_mutex_lock(&backends_lock);
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strncmp(name, backends[i].ident, strlen(name)))
+            continue;
+
+        if (backends[i].backend == NULL) {
+            dl = backend_dlopen(backends[i].ident, errmsg, len);
+            if (dl == NULL)
+                break;
+            entry = (const bluetooth_backend_t *(*)(void))dlsym(dl, BLUETOOTH_BACKEND_ENTRY_NAME);
+            if (entry == NULL) {
+                /* built against another bluetooth_backend_t */
+                snprintf(errmsg, len, BACKEND_LIB_PREFIX "%s.so has no " BLUETOOTH_BACKEND_ENTRY_NAME,
+                         backends[i].ident);
+                dlclose(dl);
+                break;
+            }
+            backends[i].backend = entry();
+        }
+        backend = backends[i].backend;
+        break;
+    }
+    if (i == sizeof(backends) / sizeof(backends[0]))
+        snprintf(errmsg, len, "not found");
+    pthread_mutex_unlock(&backends_lock);
+    return backend;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "bluetooth_internal.h"
+
+#define BACKGROUND_WINDOW_MS        (2000)
+#define BACKGROUND_INTERVAL_MS      (10000)
+/* a connect in flight is checked on this often */
+#define BACKGROUND_HOLD_POLL_MS     (50)
+
+void background_init(background_t *bg, bluetooth_t *bt)
+{
+    pthread_condattr_t attr;
+
+    memset(bg, 0, sizeof(*bg));
+    bg->bt = bt;
+    pthread_mutex_init(&bg->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&bg->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void background_destroy(background_t *bg)
+{
+    background_stop(bg);
+    free(bg->last_seen);
+    free(bg->seen_scan);
+    pthread_cond_destroy(&bg->cond);
+    pthread_mutex_destroy(&bg->lock);
+}
+
+/* caller holds bg->lock. Return early on background_stop() */
+static void background_wait(background_t *bg, long long until)
+{
+    struct timespec ts = { .tv_sec = until / 1000, .tv_nsec = until % 1000 * 1000000 };
+
+    while (!bg->stop && bluetooth_now_ms() < until)
+        pthread_cond_timedwait(&bg->cond, &bg->lock, &ts);
+}
+
+/* Scanning costs connected devices airtime: a shorter window per connection,
+ * down to a quarter */
+static int background_window(background_t *bg)
+{
+    const bluetooth_device_table_t *table;
+    size_t i, connected = 0;
+    int window;
+
+    table = bluetooth_device_table_get(bg->bt);
+    for (i = 0; i < table->n_devices; i++)
+        connected += !!(table->devices[i].flags & BLUETOOTH_DEVICE_CONNECTED);
+    bluetooth_device_table_unref(table);
+
+    window = bg->window_ms * 2 / (2 + (int)(connected < 6 ? connected : 6));
+    return window > bg->window_ms / 4 ? window : bg->window_ms / 4;
+}
+
+static void *background_thread(void *data)
+{
+    background_t *bg = (background_t *)data;
+    long long start;
+    int window;
+
+    pthread_mutex_lock(&bg->lock);
+    while (!bg->stop) {
+        start = bluetooth_now_ms();
+        /* connection setup gets the radio first, for up to an interval */
+        while (!bg->stop && __atomic_load_n(&bg->connecting, __ATOMIC_ACQUIRE) > 0 &&
+               bluetooth_now_ms() < start + bg->interval_ms)
+            background_wait(bg, bluetooth_now_ms() + BACKGROUND_HOLD_POLL_MS);
+        if (bg->stop)
+            break;
+
+        pthread_mutex_unlock(&bg->lock);
+        window = background_window(bg);
+        bluetooth_scan(bg->bt, bluetooth_deadline(window));
+        pthread_mutex_lock(&bg->lock);
+
+        background_wait(bg, start + bg->interval_ms);
+    }
+    pthread_mutex_unlock(&bg->lock);
+    return NULL;
+}
+
+int background_start(background_t *bg, const bluetooth_background_options_t *opts)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&bg->lock);
+    if (bg->running) {
+        pthread_mutex_unlock(&bg->lock);
+        return 1;
+    }
+    bg->window_ms = (opts && opts->window_ms > 0) ? opts->window_ms : BACKGROUND_WINDOW_MS;
+    bg->interval_ms = (opts && opts->interval_ms > 0) ? opts->interval_ms : BACKGROUND_INTERVAL_MS;
+    if (bg->interval_ms < bg->window_ms)
+        bg->interval_ms = bg->window_ms;
+    __atomic_store_n(&bg->max_age_ms, (opts && opts->max_age_ms > 0) ? opts->max_age_ms :
+                     3 * bg->interval_ms, __ATOMIC_RELEASE);
+    /* ages start over, see background_merge(). Callers hold the table writer's lock */
+    bg->scans = 0;
+    if (bg->n_seen)
+        memset(bg->seen_scan, 0, bg->n_seen * sizeof(*bg->seen_scan));
+    bg->stop = false;
+    if (pthread_create(&bg->thread, NULL, background_thread, bg)) {
+        __atomic_store_n(&bg->max_age_ms, 0, __ATOMIC_RELEASE);
+        ret = 1;
+    } else {
+        bg->running = true;
+    }
+    pthread_mutex_unlock(&bg->lock);
+    return ret;
+}
+
+void background_stop(background_t *bg)
+{
+    pthread_mutex_lock(&bg->lock);
+    if (!bg->running) {
+        pthread_mutex_unlock(&bg->lock);
+        return;
+    }
+    bg->stop = true;
+    pthread_cond_broadcast(&bg->cond);
+    pthread_mutex_unlock(&bg->lock);
+
+    pthread_join(bg->thread, NULL);
+
+    pthread_mutex_lock(&bg->lock);
+    bg->running = false;
+    /* scans replace the table again */
+    __atomic_store_n(&bg->max_age_ms, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&bg->lock);
+}
+
+/* Grow the last seen columns to hold id */
+static int background_reserve(background_t *bg, bluetooth_device_id_t id)
+{
+    unsigned long long *seen_scan;
+    long long *last_seen;
+    size_t n = bg->n_seen ? bg->n_seen : 64;
+
+    if (id <= bg->n_seen)
+        return 0;
+    while (n < id)
+        n *= 2;
+    last_seen = realloc(bg->last_seen, n * sizeof(*last_seen));
+    if (last_seen == NULL)
+        return 1;
+    bg->last_seen = last_seen;
+    seen_scan = realloc(bg->seen_scan, n * sizeof(*seen_scan));
+    if (seen_scan == NULL)
+        return 1;
+    bg->seen_scan = seen_scan;
+    memset(bg->seen_scan + bg->n_seen, 0, (n - bg->n_seen) * sizeof(*seen_scan));
+    bg->n_seen = n;
+    return 0;
+}
+
+size_t background_merge(background_t *bg, const bluetooth_device_table_t *prev,
+                        bluetooth_device_info_t *devs, size_t n, long long now)
+{
+    int max_age = __atomic_load_n(&bg->max_age_ms, __ATOMIC_ACQUIRE);
+    bluetooth_device_id_t id;
+    size_t i, listed = n;
+
+    if (max_age <= 0)
+        return n;
+
+    /* a scan count tells listed devices apart, two scans may share a ms */
+    bg->scans++;
+    for (i = 0; i < listed; i++) {
+        id = devs[i].id;
+        if (id == BLUETOOTH_DEVICE_ID_NONE || background_reserve(bg, id))
+            continue;
+        bg->last_seen[id - 1] = now;
+        bg->seen_scan[id - 1] = bg->scans;
+    }
+
+    /* the rest of the live table stays until it ages out, in its order */
+    for (i = 0; i < prev->n_devices; i++) {
+        id = prev->devices[i].id;
+        if (id == BLUETOOTH_DEVICE_ID_NONE || background_reserve(bg, id) ||
+            bg->seen_scan[id - 1] == bg->scans)
+            continue;
+        /* listed before background scanning started: aging starts now */
+        if (!bg->seen_scan[id - 1]) {
+            bg->seen_scan[id - 1] = ULLONG_MAX;
+            bg->last_seen[id - 1] = now;
+        }
+        if (now - bg->last_seen[id - 1] > max_age)
+            continue;
+        devs[n++] = prev->devices[i];
+    }
+    return n;
+}
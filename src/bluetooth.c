@@ -2,26 +2,98 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "bluetooth_internal.h"
 #include "bluetooth.h"
 
+/* keys for coalescing identical calls */
+enum bluetooth_flight_op {
+    FLIGHT_SCAN,
+    FLIGHT_IS_CONNECTED,
+    FLIGHT_CONNECT,
+    FLIGHT_DISCONNECT,
+};
+
+/* bluetooth_wait_device_state() on backends without signals */
+#define WAIT_POLL_MS    (50)
+
+/* See bluetooth_new_shared(): a context per backend, for the whole process */
+typedef struct shared_context {
+    char backend[32];
+    /* a full handle, the one calls of shared handles go to */
+    bluetooth_t *bt;
+    int refs;
+    /* its handles, under bt->lock: adverts go out to each of them */
+    struct list_head handles;
+    struct list_head list;
+} shared_context_t;
+
+static LIST_HEAD(shared_contexts);
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread int bluetooth_handle_cancel_fd = -1;
+
 struct bluetooth_handle {
+    /* bluetooth_new_shared() handles: everything but async, error, cancel and
+     * the advert callback is the context's */
+    shared_context_t *shared;
+    struct list_head shared_list;
+    bluetooth_advert_cb_t advert_cb;
+    void *advert_userdata;
+    /* the context of shared handles, never handed out */
+    bool context;
+
     const bluetooth_backend_t *backend;
     void *backend_handle;
 
+    /* backends aren't thread safe. Recursive: advert callbacks may call back in */
+    pthread_mutex_t lock;
+    singleflight_t flights;
+    /* bluetooth_wait_devices_state() calls in, they sleep without the lock.
+     * bluetooth_close() wakes them and waits for them on waits_done */
+    int waiters;
+    bool closing;
+    pthread_cond_t waits_done;
+
+    /* eventfd, readable while cancelled */
+    int cancel_fd;
+
+    /* devices of the last scan, see bluetooth_device_table_get() */
+    device_tables_t tables;
+    /* where the next table is gathered */
+    bluetooth_device_info_t *scratch;
+    size_t scratch_size;
+    /* changes between tables, see bluetooth_device_export() */
+    device_log_t log;
+
+    async_t async;
+    /* see bluetooth_background_scan_start() */
+    background_t background;
+
+    /* see bluetooth_device_lookup(), outlives backends like rssi */
+    device_ids_t ids;
+    /* see bluetooth_nearest_devices() */
+    rssi_table_t *rssi;
+
+    /* see bluetooth_set_agent(), handed to every backend opened */
+    bluetooth_agent_t agent;
+    char agent_pin[BLUETOOTH_PIN_MAXLEN];
+    bool has_agent;
+
+    /* see bluetooth_record() and bluetooth_open_replay() */
+    char *record_path;
+    trace_t *trace;
+
     struct {
         int c_errno;
         char errmsg[128];
     } error;
 };
 
-const bluetooth_backend_t *bluetooth_backends[] = {
-    &bluetooth_bluetoothctl,
-    &bluetooth_bluez,
-    NULL,
-};
-
 static int _bluetooth_error(bluetooth_t *bt, int code, int c_errno, const char *fmt, ...)
 {
     va_list ap;
@@ -42,91 +114,1173 @@ static int _bluetooth_error(bluetooth_t *bt, int code, int c_errno, const char *
     return code;
 }
 
-bool bluetooth_device_is_connected(bluetooth_t *bt, const char *device)
+/* Where calls of bt go. A cancel of the handle ends the call, whichever
+ * context runs it; calls the context makes itself keep the caller's */
+static bluetooth_t *shared_context(bluetooth_t *bt)
 {
-    if (bt && bt->backend && bt->backend->device_is_connected)
-        return bt->backend->device_is_connected(bt->backend_handle, device);
-    
-    return false;
+    if (bt && !bt->context)
+        bluetooth_handle_cancel_fd = bt->shared ? bt->cancel_fd : -1;
+    return bt && bt->shared ? bt->shared->bt : bt;
 }
 
-bool bluetooth_disconnect_device(bluetooth_t *bt, const char *device, int timeout)
+/* Connection attempts about to wait for the lock, or leaving it: background
+ * scans hold their next window back meanwhile */
+static void connecting(bluetooth_t *bt, int delta)
 {
-    if (bt && bt->backend && bt->backend->disconnect_device)
-        return bt->backend->disconnect_device(bt->backend_handle, device, timeout);
-    
-    return false;
+    __atomic_add_fetch(&bt->background.connecting, delta, __ATOMIC_RELEASE);
 }
 
-bool bluetooth_connect_device(bluetooth_t *bt, const char *device, int timeout)
+/* Per-device calls on an exact MAC address, no name to resolve */
+static bool is_connected_addr(bluetooth_t *bt, const char *macaddr)
 {
-    if (bt && bt->backend && bt->backend->connect_device)
-        return bt->backend->connect_device(bt->backend_handle, device, timeout);
-    
-    return false;
+    flight_t flight;
+    long ret = false;
+
+    if (singleflight_begin(&bt->flights, &flight, FLIGHT_IS_CONNECTED, macaddr, &ret)) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->device_is_connected_addr(bt->backend_handle, macaddr);
+        pthread_mutex_unlock(&bt->lock);
+        singleflight_end(&bt->flights, &flight, ret);
+    }
+    return ret;
 }
 
-size_t bluetooth_get_devices(bluetooth_t *bt, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum)
+static bool connect_addr(bluetooth_t *bt, const char *macaddr, long long deadline)
 {
-    if (bt && bt->backend && bt->backend->get_devices)
-        return bt->backend->get_devices(bt->backend_handle, devs, devnum);
-    
+    flight_t flight;
+    long ret = false;
+
+    if (singleflight_begin(&bt->flights, &flight, FLIGHT_CONNECT, macaddr, &ret)) {
+        connecting(bt, 1);
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->connect_device_addr(bt->backend_handle, macaddr, deadline);
+        pthread_mutex_unlock(&bt->lock);
+        connecting(bt, -1);
+        singleflight_end(&bt->flights, &flight, ret);
+    }
+    return ret;
+}
+
+static bool disconnect_addr(bluetooth_t *bt, const char *macaddr, long long deadline)
+{
+    flight_t flight;
+    long ret = false;
+
+    if (singleflight_begin(&bt->flights, &flight, FLIGHT_DISCONNECT, macaddr, &ret)) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->disconnect_device_addr(bt->backend_handle, macaddr, deadline);
+        pthread_mutex_unlock(&bt->lock);
+        singleflight_end(&bt->flights, &flight, ret);
+    }
+    return ret;
+}
+
+bluetooth_device_id_t bluetooth_device_lookup(bluetooth_t *handle, const char *device)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && device))
+        return BLUETOOTH_DEVICE_ID_NONE;
+    return device_ids_lookup(&bt->ids, device);
+}
+
+bool bluetooth_device_is_connected_id(bluetooth_t *handle, bluetooth_device_id_t id)
+{
+    bluetooth_t *bt = shared_context(handle);
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+
+    if (!(bt && bt->backend && bt->backend->device_is_connected_addr))
+        return false;
+    if (device_ids_macaddr(&bt->ids, id, macaddr))
+        return false;
+    return is_connected_addr(bt, macaddr);
+}
+
+bool bluetooth_connect_device_id(bluetooth_t *handle, bluetooth_device_id_t id, bluetooth_deadline_t deadline)
+{
+    bluetooth_t *bt = shared_context(handle);
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+
+    if (!(bt && bt->backend && bt->backend->connect_device_addr))
+        return false;
+    if (device_ids_macaddr(&bt->ids, id, macaddr))
+        return false;
+    return connect_addr(bt, macaddr, deadline);
+}
+
+bool bluetooth_disconnect_device_id(bluetooth_t *handle, bluetooth_device_id_t id, bluetooth_deadline_t deadline)
+{
+    bluetooth_t *bt = shared_context(handle);
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+
+    if (!(bt && bt->backend && bt->backend->disconnect_device_addr))
+        return false;
+    if (device_ids_macaddr(&bt->ids, id, macaddr))
+        return false;
+    return disconnect_addr(bt, macaddr, deadline);
+}
+
+bool bluetooth_device_is_connected(bluetooth_t *handle, const char *device)
+{
+    bluetooth_t *bt = shared_context(handle);
+    flight_t flight;
+    long ret = false;
+
+    if (!(bt && bt->backend && bt->backend->device_is_connected))
+        return false;
+    /* a known MAC address names one device */
+    if (bt->backend->device_is_connected_addr && device_ids_find(&bt->ids, device))
+        return is_connected_addr(bt, device);
+
+    if (singleflight_begin(&bt->flights, &flight, FLIGHT_IS_CONNECTED, device, &ret)) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->device_is_connected(bt->backend_handle, device);
+        pthread_mutex_unlock(&bt->lock);
+        singleflight_end(&bt->flights, &flight, ret);
+    }
+    return ret;
+}
+
+bool bluetooth_disconnect_device(bluetooth_t *handle, const char *device, bluetooth_deadline_t deadline)
+{
+    bluetooth_t *bt = shared_context(handle);
+    flight_t flight;
+    long ret = false;
+
+    if (!(bt && bt->backend && bt->backend->disconnect_device))
+        return false;
+    if (bt->backend->disconnect_device_addr && device_ids_find(&bt->ids, device))
+        return disconnect_addr(bt, device, deadline);
+
+    if (singleflight_begin(&bt->flights, &flight, FLIGHT_DISCONNECT, device, &ret)) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->disconnect_device(bt->backend_handle, device, deadline);
+        pthread_mutex_unlock(&bt->lock);
+        singleflight_end(&bt->flights, &flight, ret);
+    }
+    return ret;
+}
+
+bool bluetooth_connect_device(bluetooth_t *handle, const char *device, bluetooth_deadline_t deadline)
+{
+    bluetooth_t *bt = shared_context(handle);
+    flight_t flight;
+    long ret = false;
+
+    if (!(bt && bt->backend && bt->backend->connect_device))
+        return false;
+    if (bt->backend->connect_device_addr && device_ids_find(&bt->ids, device))
+        return connect_addr(bt, device, deadline);
+
+    if (singleflight_begin(&bt->flights, &flight, FLIGHT_CONNECT, device, &ret)) {
+        connecting(bt, 1);
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->connect_device(bt->backend_handle, device, deadline);
+        pthread_mutex_unlock(&bt->lock);
+        connecting(bt, -1);
+        singleflight_end(&bt->flights, &flight, ret);
+    }
+    return ret;
+}
+
+/* Attempt every device of bulk, then finish it */
+static int run_bulk(bluetooth_t *bt, bulk_t *bulk)
+{
+    long long attempt_deadline, wake;
+    struct pollfd pfd[2];
+    bulk_item_t *item;
+    int ret;
+
+    connecting(bt, 1);
+    pthread_mutex_lock(&bt->lock);
+    if (bt->backend->connect_devices) {
+        bt->backend->connect_devices(bt->backend_handle, bulk);
+    } else {
+        /* one attempt at a time */
+        for (;;) {
+            item = bulk_next(bulk, &attempt_deadline);
+            if (item) {
+                bulk_done(bulk, item, bt->backend->connect_device(bt->backend_handle,
+                                                                  item->device, attempt_deadline));
+                continue;
+            }
+            wake = bulk_wake(bulk);
+            if (wake < 0 || wake >= bulk->deadline || bluetooth_now_ms() >= bulk->deadline ||
+                bluetooth_cancelled(bt->cancel_fd))
+                break;
+            /* backing off, a cancel ends it early */
+            poll(pfd, bluetooth_cancel_pollfds(bt->cancel_fd, pfd), wake - bluetooth_now_ms());
+        }
+    }
+    ret = bulk_finish(bulk);
+    pthread_mutex_unlock(&bt->lock);
+    connecting(bt, -1);
+    return ret;
+}
+
+int bluetooth_connect_devices(bluetooth_t *handle, const bluetooth_connect_request_t *requests, size_t n,
+                              const bluetooth_bulk_options_t *opts, bluetooth_deadline_t deadline,
+                              bluetooth_bulk_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+    bulk_t bulk;
+
+    if (!(bt && bt->backend && bt->backend->connect_device))
+        return -1;
+    if (bulk_init(&bulk, requests, n, opts, deadline, bt->cancel_fd, cb, userdata))
+        return _bluetooth_error(handle, -1, 0, "Out of memory");
+    return run_bulk(bt, &bulk);
+}
+
+bool bluetooth_batchable(bluetooth_t *handle, const char *device)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && bt->backend && bt->backend->connect_devices))
+        return false;
+    /* a known MAC address goes to the backend as is, see bluetooth_connect_device() */
+    return !(bt->backend->connect_device_addr && bt->backend->disconnect_device_addr &&
+             device_ids_find(&bt->ids, device));
+}
+
+int bluetooth_batch(bluetooth_t *handle, size_t cap, bulk_feed_t feed, bluetooth_bulk_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+    bulk_t bulk;
+
+    if (!(bt && bt->backend && bt->backend->connect_devices))
+        return 1;
+    if (bulk_init(&bulk, NULL, 0, NULL, 0, bt->cancel_fd, cb, userdata))
+        return 1;
+    if (bulk_feed(&bulk, cap, feed)) {
+        bulk_finish(&bulk);
+        return 1;
+    }
+    bulk_fill(&bulk);
+    if (bulk.n)
+        run_bulk(bt, &bulk);
+    else
+        bulk_finish(&bulk);
     return 0;
 }
 
-void bluetooth_scan(bluetooth_t *bt, int timeout)
+size_t bluetooth_get_devices(bluetooth_t *handle, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum)
 {
-    if (bt && bt->backend && bt->backend->scan)
-        bt->backend->scan(bt->backend_handle, timeout);
+    bluetooth_t *bt = shared_context(handle);
+    size_t ret = 0;
+
+    if (bt && bt->backend && bt->backend->get_devices) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->get_devices(bt->backend_handle, devs, devnum);
+        pthread_mutex_unlock(&bt->lock);
+    }
+    return ret;
 }
 
-int bluetooth_open(bluetooth_t *bt, const char *backend)
+/* caller holds bt->lock */
+static void refresh_device_table(bluetooth_t *bt)
 {
-    int i;
+    const bluetooth_device_table_t *prev, *next;
+    bluetooth_device_info_t *devs;
+    size_t size = bt->scratch_size ? bt->scratch_size : 64;
+    size_t merged;
+    int n, i;
 
-    if (backend == NULL)
-        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend param invalid");
+    if (!bt->backend->get_device_info)
+        return;
 
-    for(i=0; bluetooth_backends[i]; i++) {
-        if (!strncmp(backend, bluetooth_backends[i]->ident, strlen(backend))) {
-            bt->backend = bluetooth_backends[i];
+    for (;;) {
+        if (size > bt->scratch_size) {
+            devs = realloc(bt->scratch, size * sizeof(bluetooth_device_info_t));
+            if (devs == NULL)
+                return;
+            bt->scratch = devs;
+            bt->scratch_size = size;
+        }
+        n = bt->backend->get_device_info(bt->backend_handle, bt->scratch, size);
+        if (n < 0)
+            n = 0;
+        if ((size_t)n < size)
             break;
+        size *= 2;
+    }
+
+    for (i = 0; i < n; i++)
+        bt->scratch[i].id = device_ids_assign(&bt->ids, bt->scratch[i].macaddr, bt->scratch[i].name);
+    merged = n;
+
+    /* exports see a table and its changes together */
+    pthread_mutex_lock(&bt->log.lock);
+    prev = device_tables_get(&bt->tables);
+
+    /* scanning in the background: the live table keeps devices until they age out */
+    if (__atomic_load_n(&bt->background.max_age_ms, __ATOMIC_ACQUIRE)) {
+        if (n + prev->n_devices > bt->scratch_size) {
+            devs = realloc(bt->scratch, (n + prev->n_devices) * sizeof(bluetooth_device_info_t));
+            if (devs) {
+                bt->scratch = devs;
+                bt->scratch_size = n + prev->n_devices;
+            }
+        }
+        if (n + prev->n_devices <= bt->scratch_size)
+            merged = background_merge(&bt->background, prev, bt->scratch, n, bluetooth_now_ms());
+    }
+
+    /* readers keep the table they pinned, new ones get this one */
+    if (!device_tables_publish(&bt->tables, bt->scratch, merged)) {
+        next = device_tables_get(&bt->tables);
+        device_log_update(&bt->log, prev, next);
+        bluetooth_device_table_unref(next);
+    }
+    bluetooth_device_table_unref(prev);
+    pthread_mutex_unlock(&bt->log.lock);
+}
+
+long long bluetooth_device_export(bluetooth_t *handle, unsigned long long since, int format,
+                                  bluetooth_export_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+    const bluetooth_device_table_t *table;
+    long long ret;
+    void *data;
+    size_t len;
+
+    if (!(bt && cb) || (format != BLUETOOTH_EXPORT_BINARY && format != BLUETOOTH_EXPORT_NDJSON))
+        return -1;
+
+    /* not the handle lock: never waits for a scan window. Nor does a scan
+     * wait for cb or a slow reader, it gets the encoded delta after */
+    pthread_mutex_lock(&bt->log.lock);
+    table = device_tables_get(&bt->tables);
+    ret = device_log_export(&bt->log, table, since, format, &data, &len) ? -1 :
+          (long long)table->generation;
+    pthread_mutex_unlock(&bt->log.lock);
+    bluetooth_device_table_unref(table);
+    if (ret < 0)
+        return -1;
+    if (device_log_output(data, len, cb, userdata))
+        ret = -1;
+    free(data);
+    return ret;
+}
+
+static int write_fd(const void *data, size_t len, void *userdata)
+{
+    int fd = *(int *)userdata;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data = (const char *)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+long long bluetooth_device_export_fd(bluetooth_t *bt, unsigned long long since, int format, int fd)
+{
+    return bluetooth_device_export(bt, since, format, write_fd, &fd);
+}
+
+const bluetooth_device_table_t *bluetooth_device_table_get(bluetooth_t *handle)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    return bt ? device_tables_get(&bt->tables) : NULL;
+}
+
+int bluetooth_nearest_devices(bluetooth_t *handle, int window_ms, bluetooth_rssi_rank_t *ranks, int k)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && ranks))
+        return 0;
+    return rssi_top(bt->rssi, bluetooth_now_ms(), window_ms, ranks, k);
+}
+
+size_t bluetooth_device_table_query(bluetooth_t *handle, const bluetooth_device_table_t *table,
+                                    const bluetooth_device_query_t *query,
+                                    const bluetooth_device_info_t **views, size_t max)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && table && query))
+        return 0;
+    return device_columns_match(device_table_columns(table), table->devices, table->n_devices,
+                                query, bt->rssi, bluetooth_now_ms(), NULL, views, max);
+}
+
+size_t bluetooth_device_query_ids(bluetooth_t *handle, const bluetooth_device_query_t *query,
+                                  bluetooth_device_id_t *ids, size_t max)
+{
+    bluetooth_t *bt = shared_context(handle);
+    const bluetooth_device_table_t *table;
+    size_t n;
+
+    if (!(bt && query))
+        return 0;
+    table = device_tables_get(&bt->tables);
+    n = device_columns_match(device_table_columns(table), table->devices, table->n_devices,
+                             query, bt->rssi, bluetooth_now_ms(), ids, NULL, max);
+    bluetooth_device_table_unref(table);
+    return n;
+}
+
+void bluetooth_scan(bluetooth_t *handle, bluetooth_deadline_t deadline)
+{
+    bluetooth_t *bt = shared_context(handle);
+    flight_t flight;
+    long ret;
+
+    if (!(bt && bt->backend && bt->backend->scan))
+        return;
+
+    /* a caller arriving mid-scan shares the running scan, whatever its deadline */
+    if (singleflight_begin(&bt->flights, &flight, FLIGHT_SCAN, NULL, &ret)) {
+        pthread_mutex_lock(&bt->lock);
+        bt->backend->scan(bt->backend_handle, deadline);
+        refresh_device_table(bt);
+        pthread_mutex_unlock(&bt->lock);
+        singleflight_end(&bt->flights, &flight, 0);
+    }
+}
+
+int bluetooth_background_scan_start(bluetooth_t *handle, const bluetooth_background_options_t *opts)
+{
+    bluetooth_t *bt = shared_context(handle);
+    int ret;
+
+    if (!(bt && bt->backend && bt->backend->scan))
+        return -1;
+    /* as the table writer: ages reset under it */
+    pthread_mutex_lock(&bt->lock);
+    ret = background_start(&bt->background, opts);
+    pthread_mutex_unlock(&bt->lock);
+    return ret ? -1 : 0;
+}
+
+void bluetooth_background_scan_stop(bluetooth_t *handle)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (bt)
+        background_stop(&bt->background);
+}
+
+static bool scan_call(bluetooth_t *bt, const char *device, long long deadline)
+{
+    (void)device;
+    bluetooth_scan(bt, deadline);
+    return true;
+}
+
+int bluetooth_scan_async(bluetooth_t *handle, bluetooth_deadline_t deadline,
+                         bluetooth_done_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && bt->backend && bt->backend->scan))
+        return -1;
+    return async_submit(&handle->async, handle, scan_call, NULL, deadline, cb, userdata);
+}
+
+int bluetooth_connect_device_async(bluetooth_t *handle, const char *device, bluetooth_deadline_t deadline,
+                                   bluetooth_done_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && bt->backend && bt->backend->connect_device))
+        return -1;
+    return async_submit(&handle->async, handle, bluetooth_connect_device, device, deadline, cb, userdata);
+}
+
+int bluetooth_disconnect_device_async(bluetooth_t *handle, const char *device, bluetooth_deadline_t deadline,
+                                      bluetooth_done_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && bt->backend && bt->backend->disconnect_device))
+        return -1;
+    return async_submit(&handle->async, handle, bluetooth_disconnect_device, device, deadline, cb, userdata);
+}
+
+static bool is_connected_call(bluetooth_t *bt, const char *device, long long deadline)
+{
+    (void)deadline;
+    return bluetooth_device_is_connected(bt, device);
+}
+
+int bluetooth_device_is_connected_async(bluetooth_t *handle, const char *device,
+                                        bluetooth_done_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (!(bt && bt->backend && bt->backend->device_is_connected))
+        return -1;
+    return async_submit(&handle->async, handle, is_connected_call, device, 0, cb, userdata);
+}
+
+int bluetooth_event_fd(bluetooth_t *bt)
+{
+    return bt ? bt->async.event_fd : -1;
+}
+
+void bluetooth_dispatch(bluetooth_t *bt)
+{
+    if (bt)
+        async_dispatch(&bt->async);
+}
+
+/* The context's advert callback: every shared handle gets its own call */
+static void shared_advert(const bluetooth_advert_t *advert, void *userdata)
+{
+    shared_context_t *ctx = (shared_context_t *)userdata;
+    bluetooth_t *handle;
+
+    list_for_each_entry(handle, &ctx->handles, shared_list) {
+        if (handle->advert_cb)
+            handle->advert_cb(advert, handle->advert_userdata);
+    }
+}
+
+bool bluetooth_set_advert_callback(bluetooth_t *handle, bluetooth_advert_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+    bluetooth_t *other;
+    bool ret = false;
+
+    if (!(bt && bt->backend && bt->backend->set_advert_callback))
+        return false;
+
+    pthread_mutex_lock(&bt->lock);
+    if (handle->shared) {
+        handle->advert_cb = cb;
+        handle->advert_userdata = userdata;
+        /* the backend calls out only while a handle listens */
+        cb = NULL;
+        list_for_each_entry(other, &handle->shared->handles, shared_list) {
+            if (other->advert_cb)
+                cb = shared_advert;
         }
+        userdata = handle->shared;
     }
+    ret = bt->backend->set_advert_callback(bt->backend_handle, cb, userdata);
+    pthread_mutex_unlock(&bt->lock);
+    return ret;
+}
+
+int bluetooth_gatt_discover(bluetooth_t *handle, const char *device, bluetooth_gatt_char_t *chars, int charnum)
+{
+    bluetooth_t *bt = shared_context(handle);
+    int ret = -1;
+
+    if (bt && bt->backend && bt->backend->gatt_discover) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->gatt_discover(bt->backend_handle, device, chars, charnum);
+        pthread_mutex_unlock(&bt->lock);
+    }
+    return ret;
+}
+
+int bluetooth_gatt_read(bluetooth_t *handle, const char *device, const char *uuid, void *buf, size_t len)
+{
+    bluetooth_t *bt = shared_context(handle);
+    int ret = -1;
+
+    if (bt && bt->backend && bt->backend->gatt_read) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->gatt_read(bt->backend_handle, device, uuid, buf, len);
+        pthread_mutex_unlock(&bt->lock);
+    }
+    return ret;
+}
+
+bool bluetooth_gatt_write(bluetooth_t *handle, const char *device, const char *uuid, const void *buf, size_t len)
+{
+    bluetooth_t *bt = shared_context(handle);
+    bool ret = false;
+
+    if (bt && bt->backend && bt->backend->gatt_write) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->gatt_write(bt->backend_handle, device, uuid, buf, len);
+        pthread_mutex_unlock(&bt->lock);
+    }
+    return ret;
+}
+
+int bluetooth_gatt_acquire_notify(bluetooth_t *handle, const char *device, const char *uuid, size_t *mtu)
+{
+    bluetooth_t *bt = shared_context(handle);
+    int ret = -1;
+
+    if (bt && bt->backend && bt->backend->gatt_acquire) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->gatt_acquire(bt->backend_handle, device, uuid, true, mtu);
+        pthread_mutex_unlock(&bt->lock);
+    }
+    return ret;
+}
+
+int bluetooth_gatt_acquire_write(bluetooth_t *handle, const char *device, const char *uuid, size_t *mtu)
+{
+    bluetooth_t *bt = shared_context(handle);
+    int ret = -1;
+
+    if (bt && bt->backend && bt->backend->gatt_acquire) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->gatt_acquire(bt->backend_handle, device, uuid, false, mtu);
+        pthread_mutex_unlock(&bt->lock);
+    }
+    return ret;
+}
+
+void bluetooth_gatt_release(bluetooth_t *handle, int fd)
+{
+    bluetooth_t *bt = shared_context(handle);
+
+    if (bt && bt->backend && bt->backend->gatt_release) {
+        pthread_mutex_lock(&bt->lock);
+        bt->backend->gatt_release(bt->backend_handle, fd);
+        pthread_mutex_unlock(&bt->lock);
+    }
+}
+
+bool bluetooth_gatt_set_cache_dir(bluetooth_t *handle, const char *dir)
+{
+    bluetooth_t *bt = shared_context(handle);
+    bool ret = false;
+
+    if (bt && bt->backend && bt->backend->set_gatt_cache_dir) {
+        pthread_mutex_lock(&bt->lock);
+        ret = bt->backend->set_gatt_cache_dir(bt->backend_handle, dir);
+        pthread_mutex_unlock(&bt->lock);
+    }
+    return ret;
+}
+
+/* A name of the device table, or any MAC address. 1 if neither */
+static int device_macaddr(bluetooth_t *bt, const char *device, char macaddr[BLUETOOTH_MACADDR_MAXLEN])
+{
+    bluetooth_device_id_t id;
+    unsigned int b[6];
+
+    if (device == NULL)
+        return 1;
+    id = device_ids_lookup(&bt->ids, device);
+    if (id != BLUETOOTH_DEVICE_ID_NONE)
+        return device_ids_macaddr(&bt->ids, id, macaddr);
+    if (strlen(device) != BLUETOOTH_MACADDR_MAXLEN - 1 ||
+        sscanf(device, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        return 1;
+    strcpy(macaddr, device);
+    return 0;
+}
+
+int bluetooth_obex_send(bluetooth_t *handle, const bluetooth_obex_request_t *requests, size_t n,
+                        bluetooth_deadline_t deadline, bluetooth_obex_cb_t cb, void *userdata)
+{
+    bluetooth_t *bt = shared_context(handle);
+    char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN];
+    size_t i;
+    int ret = -1;
+
+    if (!(bt && bt->backend && bt->backend->obex_send) || (n && requests == NULL))
+        return -1;
+    macaddrs = calloc(n ? n : 1, sizeof(*macaddrs));
+    if (macaddrs == NULL)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        if (device_macaddr(bt, requests[i].device, macaddrs[i]))
+            macaddrs[i][0] = '\0';
+    }
+
+    pthread_mutex_lock(&bt->lock);
+    if (bt->backend)
+        ret = bt->backend->obex_send(bt->backend_handle, requests,
+                                     (const char (*)[BLUETOOTH_MACADDR_MAXLEN])macaddrs, n,
+                                     deadline, cb, userdata);
+    pthread_mutex_unlock(&bt->lock);
+    free(macaddrs);
+    return ret;
+}
+
+bool bluetooth_profile_register(bluetooth_t *handle, const bluetooth_profile_t *profile)
+{
+    bluetooth_t *bt = shared_context(handle);
+    bool ret = false;
+
+    if (!(bt && profile && profile->uuid && strlen(profile->uuid) == BLUETOOTH_UUID_MAXLEN - 1) ||
+        profile->role < BLUETOOTH_PROFILE_ANY || profile->role > BLUETOOTH_PROFILE_SERVER)
+        return false;
+
+    pthread_mutex_lock(&bt->lock);
+    if (bt->backend && bt->backend->register_profile)
+        ret = bt->backend->register_profile(bt->backend_handle, profile);
+    pthread_mutex_unlock(&bt->lock);
+    return ret;
+}
+
+int bluetooth_profile_connect(bluetooth_t *handle, const char *device, const char *uuid,
+                              bluetooth_deadline_t deadline)
+{
+    bluetooth_t *bt = shared_context(handle);
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+    int fd = -1;
+
+    if (!(bt && uuid) || device_macaddr(bt, device, macaddr))
+        return -1;
+
+    pthread_mutex_lock(&bt->lock);
+    if (bt->backend && bt->backend->connect_profile)
+        fd = bt->backend->connect_profile(bt->backend_handle, macaddr, uuid, deadline);
+    pthread_mutex_unlock(&bt->lock);
+    return fd;
+}
+
+int bluetooth_profile_accept(bluetooth_t *handle, char macaddr[BLUETOOTH_MACADDR_MAXLEN],
+                             char uuid[BLUETOOTH_UUID_MAXLEN], bluetooth_deadline_t deadline)
+{
+    bluetooth_t *bt = shared_context(handle);
+    int fd = -1;
+
+    if (bt == NULL)
+        return -1;
+
+    pthread_mutex_lock(&bt->lock);
+    if (bt->backend && bt->backend->accept_profile)
+        fd = bt->backend->accept_profile(bt->backend_handle, macaddr, uuid, deadline);
+    pthread_mutex_unlock(&bt->lock);
+    return fd;
+}
+
+/* Backends without wait_devices: connected is all they can tell, so ask that
+ * every WAIT_POLL_MS. Sleeps unlocked, a cancel ends them early */
+static int poll_devices(bluetooth_t *bt, const char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN], size_t n,
+                        int state, size_t want, bool *reached, long long deadline)
+{
+    long long wake;
+    struct pollfd pfd[2];
+    size_t i;
+    int count;
+
+    if (state != BLUETOOTH_STATE_CONNECTED && state != BLUETOOTH_STATE_DISCONNECTED)
+        return -1;
+
+    for (;;) {
+        count = 0;
+        for (i = 0; i < n; i++) {
+            reached[i] = macaddrs[i][0] &&
+                is_connected_addr(bt, macaddrs[i]) == (state == BLUETOOTH_STATE_CONNECTED);
+            count += reached[i];
+        }
+        if ((size_t)count >= want || bluetooth_now_ms() >= deadline || bluetooth_cancelled(bt->cancel_fd) ||
+            __atomic_load_n(&bt->closing, __ATOMIC_ACQUIRE))
+            return count;
+
+        wake = bluetooth_now_ms() + WAIT_POLL_MS;
+        if (wake > deadline)
+            wake = deadline;
+        poll(pfd, bluetooth_cancel_pollfds(bt->cancel_fd, pfd), wake - bluetooth_now_ms());
+    }
+}
+
+int bluetooth_wait_devices_state(bluetooth_t *handle, const char *const *devices, size_t n,
+                                 enum bluetooth_device_state state, size_t want,
+                                 bluetooth_deadline_t deadline, bool *reached)
+{
+    bluetooth_t *bt = shared_context(handle);
+    char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN];
+    bool *in_state = reached;
+    size_t i;
+    int ret = -1;
+
+    if (!(bt && bt->backend && bt->backend->device_is_connected_addr) || (n && devices == NULL))
+        return -1;
+    if (want > n)
+        want = n;
+    macaddrs = calloc(n ? n : 1, sizeof(*macaddrs));
+    if (in_state == NULL)
+        in_state = calloc(n ? n : 1, sizeof(bool));
+    if (macaddrs == NULL || in_state == NULL)
+        goto out;
+
+    for (i = 0; i < n; i++) {
+        if (device_macaddr(bt, devices[i], macaddrs[i]))
+            macaddrs[i][0] = '\0';
+        in_state[i] = false;
+    }
+
+    /* the backend stays until the wait is over, see bluetooth_close() */
+    pthread_mutex_lock(&bt->lock);
+    if (bt->backend == NULL || bt->closing) {
+        pthread_mutex_unlock(&bt->lock);
+        goto out;
+    }
+    bt->waiters++;
+    pthread_mutex_unlock(&bt->lock);
+
+    if (bt->backend->wait_devices)
+        ret = bt->backend->wait_devices(bt->backend_handle,
+                                        (const char (*)[BLUETOOTH_MACADDR_MAXLEN])macaddrs, n,
+                                        state, want, in_state, deadline, &bt->lock);
+    else
+        ret = poll_devices(bt, (const char (*)[BLUETOOTH_MACADDR_MAXLEN])macaddrs, n,
+                           state, want, in_state, deadline);
+
+    pthread_mutex_lock(&bt->lock);
+    if (--bt->waiters == 0)
+        pthread_cond_broadcast(&bt->waits_done);
+    pthread_mutex_unlock(&bt->lock);
+
+out:
+    if (in_state != reached)
+        free(in_state);
+    free(macaddrs);
+    return ret;
+}
+
+bool bluetooth_wait_device_state(bluetooth_t *bt, const char *device, enum bluetooth_device_state state,
+                                 bluetooth_deadline_t deadline)
+{
+    if (device == NULL)
+        return false;
+    return bluetooth_wait_devices_state(bt, &device, 1, state, 1, deadline, NULL) == 1;
+}
+
+bool bluetooth_set_agent(bluetooth_t *handle, const bluetooth_agent_t *agent)
+{
+    bluetooth_t *bt = shared_context(handle);
+    bool ret = true;
+
+    if (bt == NULL)
+        return false;
+    /* one agent a bus connection: the context's isn't any handle's to set */
+    if (handle->shared) {
+        _bluetooth_error(handle, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth agent not settable on a shared handle");
+        return false;
+    }
+    if (agent && (agent->capability < BLUETOOTH_AGENT_NO_IO || agent->capability > BLUETOOTH_AGENT_CALLBACK ||
+                  (agent->capability == BLUETOOTH_AGENT_FIXED_PIN &&
+                   (agent->pin == NULL || !agent->pin[0] || strlen(agent->pin) >= BLUETOOTH_PIN_MAXLEN)) ||
+                  (agent->capability == BLUETOOTH_AGENT_CALLBACK && agent->cb == NULL)))
+        return false;
+
+    pthread_mutex_lock(&bt->lock);
+    bt->has_agent = agent != NULL;
+    if (agent) {
+        bt->agent = *agent;
+        snprintf(bt->agent_pin, sizeof(bt->agent_pin), "%s", agent->pin ? agent->pin : "");
+        bt->agent.pin = bt->agent_pin;
+    }
+    if (bt->backend)
+        ret = bt->backend->set_agent &&
+              bt->backend->set_agent(bt->backend_handle, bt->has_agent ? &bt->agent : NULL);
+    pthread_mutex_unlock(&bt->lock);
+    return ret;
+}
+
+bluetooth_deadline_t bluetooth_deadline(int timeout_ms)
+{
+    return bluetooth_now_ms() + timeout_ms;
+}
+
+/* Shared handles cancel their own calls, not the context's */
+void bluetooth_cancel(bluetooth_t *bt)
+{
+    uint64_t one = 1;
+
+    if (bt && write(bt->cancel_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+void bluetooth_cancel_reset(bluetooth_t *bt)
+{
+    uint64_t count;
+
+    if (bt && read(bt->cancel_fd, &count, sizeof(count)) < 0)
+        return;
+}
+
+/* Load and init backend, recording it if record_path is set */
+static int open_backend(bluetooth_t *bt, const char *backend, bluetooth_backend_config_t *config,
+                        const char *record_path)
+{
+    char errmsg[96];
+
+    bt->backend = backend_load(backend, errmsg, sizeof(errmsg));
     if (bt->backend == NULL)
-        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend %s not found", backend);
+        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend %s %s", backend, errmsg);
+
+    if (record_path) {
+        bt->trace = trace_create(record_path, bt->backend->ident);
+        if (bt->trace == NULL) {
+            bt->backend = NULL;
+            return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, errno, "Bluetooth record %s", record_path);
+        }
+        config->record = bt->trace;
+    }
+    config->rssi = bt->rssi;
 
     if(bt->backend->init) {
-        bt->backend_handle = bt->backend->init();
+        bt->backend_handle = bt->backend->init(config);
         if (bt->backend_handle == NULL)
-            return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend %s init fail", backend);
+            _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend %s init fail", backend);
     } else {
-        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend %s not implemented yet", backend);
+        _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend %s not implemented yet", backend);
     }
+    if (bt->backend_handle == NULL) {
+        bt->backend = NULL;
+        trace_close(bt->trace);
+        bt->trace = NULL;
+        return BLUETOOTH_ERROR_OPEN;
+    }
+    if (bt->has_agent && bt->backend->set_agent)
+        bt->backend->set_agent(bt->backend_handle, &bt->agent);
 
     return 0;
 }
 
+int bluetooth_open(bluetooth_t *bt, const char *backend)
+{
+    bluetooth_backend_config_t config = { .cancel_fd = bt->cancel_fd };
+    char *record_path = bt->record_path;
+    int ret;
+
+    if (bt->shared)
+        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth shared handle opened with its context");
+    if (backend == NULL)
+        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth backend param invalid");
+
+    /* one recording per bluetooth_record() */
+    bt->record_path = NULL;
+    ret = open_backend(bt, backend, &config, record_path);
+    free(record_path);
+    return ret;
+}
+
+int bluetooth_record(bluetooth_t *bt, const char *path)
+{
+    if (bt == NULL || path == NULL || bt->shared)
+        return -1;
+
+    free(bt->record_path);
+    bt->record_path = strdup(path);
+    return bt->record_path ? 0 : -1;
+}
+
+int bluetooth_open_replay(bluetooth_t *bt, const char *path, double speed)
+{
+    bluetooth_backend_config_t config = { .cancel_fd = bt->cancel_fd };
+
+    if (bt->shared)
+        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth shared handle opened with its context");
+    if (path == NULL)
+        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, 0, "Bluetooth replay param invalid");
+
+    bt->trace = trace_load(path, speed);
+    if (bt->trace == NULL)
+        return _bluetooth_error(bt, BLUETOOTH_ERROR_OPEN, errno, "Bluetooth replay %s unreadable", path);
+    config.replay = bt->trace;
+
+    return open_backend(bt, bt->trace->backend, &config, NULL);
+}
+
 void bluetooth_close(bluetooth_t *bt)
 {
+    /* shared handles never have a backend: the context closes with the last of them */
     if (bt == NULL || bt->backend == NULL)
         return;
-    
+
+    /* workers call into the backend, so does the background scan */
+    async_stop(&bt->async);
+    background_stop(&bt->background);
+
+    pthread_mutex_lock(&bt->lock);
+    /* nor may a wait be left using it */
+    if (bt->waiters) {
+        __atomic_store_n(&bt->closing, true, __ATOMIC_RELEASE);
+        if (bt->backend->wake_waits)
+            bt->backend->wake_waits(bt->backend_handle);
+        while (bt->waiters)
+            pthread_cond_wait(&bt->waits_done, &bt->lock);
+        __atomic_store_n(&bt->closing, false, __ATOMIC_RELEASE);
+    }
     if (bt->backend->free)
         bt->backend->free(bt->backend_handle);
+    bt->backend = NULL;
+    bt->backend_handle = NULL;
+    /* after the backend: a replay is served from it */
+    trace_close(bt->trace);
+    bt->trace = NULL;
+    free(bt->scratch);
+    bt->scratch = NULL;
+    bt->scratch_size = 0;
+    pthread_mutex_unlock(&bt->lock);
 }
 
 bluetooth_t *bluetooth_new(void)
 {
+    pthread_mutexattr_t attr;
+
     bluetooth_t *bt = calloc(1, sizeof(bluetooth_t));
     if (bt == NULL)
         return NULL;
+
+    bt->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (bt->cancel_fd < 0) {
+        free(bt);
+        return NULL;
+    }
+    if (async_init(&bt->async)) {
+        close(bt->cancel_fd);
+        free(bt);
+        return NULL;
+    }
+    if (device_tables_init(&bt->tables)) {
+        async_destroy(&bt->async);
+        close(bt->cancel_fd);
+        free(bt);
+        return NULL;
+    }
+    if (device_ids_init(&bt->ids)) {
+        device_tables_destroy(&bt->tables);
+        async_destroy(&bt->async);
+        close(bt->cancel_fd);
+        free(bt);
+        return NULL;
+    }
+    bt->rssi = rssi_table_new(&bt->ids);
+    if (bt->rssi == NULL) {
+        device_ids_destroy(&bt->ids);
+        device_tables_destroy(&bt->tables);
+        async_destroy(&bt->async);
+        close(bt->cancel_fd);
+        free(bt);
+        return NULL;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&bt->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_cond_init(&bt->waits_done, NULL);
+    singleflight_init(&bt->flights);
+    background_init(&bt->background, bt);
+    device_log_init(&bt->log);
     
     return bt;
 }
 
+bluetooth_t *bluetooth_new_shared(const char *backend)
+{
+    shared_context_t *ctx;
+    bluetooth_t *bt;
+
+    if (backend == NULL)
+        return NULL;
+
+    /* its own errors, cancel, adverts and async calls, nothing else */
+    bt = calloc(1, sizeof(bluetooth_t));
+    if (bt == NULL)
+        return NULL;
+    bt->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (bt->cancel_fd < 0) {
+        free(bt);
+        return NULL;
+    }
+    if (async_init(&bt->async)) {
+        close(bt->cancel_fd);
+        free(bt);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shared_lock);
+    list_for_each_entry(ctx, &shared_contexts, list) {
+        if (!strcmp(ctx->backend, backend))
+            goto found;
+    }
+    ctx = calloc(1, sizeof(shared_context_t));
+    if (ctx == NULL)
+        goto oom;
+    ctx->bt = bluetooth_new();
+    if (ctx->bt == NULL) {
+        free(ctx);
+        goto oom;
+    }
+    ctx->bt->context = true;
+    INIT_LIST_HEAD(&ctx->handles);
+    snprintf(ctx->backend, sizeof(ctx->backend), "%s", backend);
+    list_add_tail(&ctx->list, &shared_contexts);
+found:
+    /* opened by the first handle, or the first after a failed open */
+    if (ctx->bt->backend == NULL && bluetooth_open(ctx->bt, backend)) {
+        bt->error.c_errno = ctx->bt->error.c_errno;
+        memcpy(bt->error.errmsg, ctx->bt->error.errmsg, sizeof(bt->error.errmsg));
+    }
+    ctx->refs++;
+    bt->shared = ctx;
+    pthread_mutex_lock(&ctx->bt->lock);
+    list_add_tail(&bt->shared_list, &ctx->handles);
+    pthread_mutex_unlock(&ctx->bt->lock);
+    pthread_mutex_unlock(&shared_lock);
+    return bt;
+
+oom:
+    pthread_mutex_unlock(&shared_lock);
+    async_destroy(&bt->async);
+    close(bt->cancel_fd);
+    free(bt);
+    return NULL;
+}
+
+static void shared_release(bluetooth_t *bt)
+{
+    shared_context_t *ctx = bt->shared;
+
+    async_destroy(&bt->async);
+    if (bt->advert_cb)
+        bluetooth_set_advert_callback(bt, NULL, NULL);
+    pthread_mutex_lock(&shared_lock);
+    pthread_mutex_lock(&ctx->bt->lock);
+    list_del(&bt->shared_list);
+    pthread_mutex_unlock(&ctx->bt->lock);
+    if (--ctx->refs == 0) {
+        list_del(&ctx->list);
+        bluetooth_close(ctx->bt);
+        bluetooth_free(ctx->bt);
+        free(ctx);
+    }
+    pthread_mutex_unlock(&shared_lock);
+    close(bt->cancel_fd);
+    free(bt);
+}
+
 void bluetooth_free(bluetooth_t *bt)
 {
+    if (bt == NULL)
+        return;
+    if (bt->shared) {
+        shared_release(bt);
+        return;
+    }
+
+    background_destroy(&bt->background);
+    async_destroy(&bt->async);
+    device_log_destroy(&bt->log);
+    device_tables_destroy(&bt->tables);
+    rssi_table_free(bt->rssi);
+    device_ids_destroy(&bt->ids);
+    free(bt->scratch);
+    free(bt->record_path);
+    singleflight_destroy(&bt->flights);
+    pthread_cond_destroy(&bt->waits_done);
+    pthread_mutex_destroy(&bt->lock);
+    close(bt->cancel_fd);
     free(bt);
 }
 
@@ -2,25 +2,546 @@
 #define __BLUETOOTH_INTERNAL_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "bluetooth.h"
 
 #ifndef BLUETOOTH_DEVNAME_MAXLEN
 #define BLUETOOTH_DEVNAME_MAXLEN    (64)
 #endif
 
+/* D-Bus error name of calls aborted by bluetooth_cancel() */
+#define BLUETOOTH_ERROR_CANCELLED_NAME  "org.hal_bluetooth.Error.Cancelled"
+/* D-Bus error name of calls not sent while bluetoothd is unresponsive */
+#define BLUETOOTH_ERROR_UNAVAILABLE_NAME    "org.hal_bluetooth.Error.Unavailable"
+
+/* trace.c: backend traffic recorded to a file, and served back from one */
+enum trace_type {
+    TRACE_SEND = 1,         /* D-Bus message sent, marshalled */
+    TRACE_RECV,             /* D-Bus reply or signal received, marshalled */
+    TRACE_EXEC,             /* bluetoothctl arguments */
+    TRACE_OUTPUT,           /* bluetoothctl output, as read */
+    TRACE_EXIT,             /* bluetoothctl exit status, as text */
+};
+
+typedef struct trace_record {
+    int type;
+    /* since the trace started */
+    long long time_us;
+    const unsigned char *data;
+    size_t len;
+} trace_record_t;
+
+typedef struct trace {
+    char backend[32];
+    /* recording */
+    FILE *file;
+    long long last_us;
+    /* replay */
+    unsigned char *buf;
+    trace_record_t *records;
+    size_t n;
+    /* 1: recorded pace, 0: no waiting */
+    double speed;
+} trace_t;
+
+trace_t *trace_create(const char *path, const char *backend);
+/* Callers serialize writes, the handle lock does */
+void trace_write(trace_t *trace, int type, const void *data, size_t len);
+trace_t *trace_load(const char *path, double speed);
+/* Replay time between two recorded instants */
+long long trace_delay_ms(trace_t *trace, long long from_us, long long to_us);
+void trace_close(trace_t *trace);
+
+/* bluez_replay.c: a bus serving a recording to the bluez backend */
+typedef struct bluez_replay bluez_replay_t;
+
+bluez_replay_t *bluez_replay_start(trace_t *trace);
+/* D-Bus address to connect to */
+const char *bluez_replay_address(bluez_replay_t *replay);
+void bluez_replay_stop(bluez_replay_t *replay);
+
+/* obex.c: OBEX client of the bluez backend, talking to obexd on the session bus */
+typedef struct obex obex_t;
+
+obex_t *obex_new(int cancel_fd);
+void obex_free(obex_t *obex);
+/* See bluetooth_backend_t.obex_send() and bluetooth_obex_send() */
+int obex_send(obex_t *obex, const bluetooth_obex_request_t *requests,
+              const char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN], size_t n, long long deadline,
+              bluetooth_obex_cb_t cb, void *userdata);
+
+/* device_ids.c: stable ids of MAC addresses, see bluetooth_device_id_t */
+typedef struct device_ids {
+    pthread_mutex_t lock;
+    size_t n;
+    size_t cap;
+    /* [id - 1] */
+    char (*macaddr)[BLUETOOTH_MACADDR_MAXLEN];
+    char (*name)[BLUETOOTH_DEVNAME_MAXLEN];
+    /* open addressing over macaddr, holds id, 0: empty */
+    uint32_t *index;
+    size_t index_size;
+} device_ids_t;
+
+int device_ids_init(device_ids_t *ids);
+void device_ids_destroy(device_ids_t *ids);
+/* Id of macaddr, a new one on first sight. name NULL: keep the known one.
+ * BLUETOOTH_DEVICE_ID_NONE when out of memory */
+bluetooth_device_id_t device_ids_assign(device_ids_t *ids, const char *macaddr, const char *name);
+bluetooth_device_id_t device_ids_find(device_ids_t *ids, const char *macaddr);
+/* MAC address, or exact name if unambiguous */
+bluetooth_device_id_t device_ids_lookup(device_ids_t *ids, const char *device);
+/* Copy the MAC address of id, return 1 if id is unknown */
+int device_ids_macaddr(device_ids_t *ids, bluetooth_device_id_t id, char *macaddr);
+
+/* rssi.c: recent RSSI samples of every device heard, ranked by smoothed strength */
+#define RSSI_RING_SIZE      (16)        /* samples kept per device, power of two */
+
+typedef struct rssi_table rssi_table_t;
+
+/* Rows are device ids, assigned on first sample */
+rssi_table_t *rssi_table_new(device_ids_t *ids);
+void rssi_table_free(rssi_table_t *table);
+/* Safe from any thread */
+void rssi_record(rssi_table_t *table, const char *macaddr, int rssi, long long now);
+/* Up to k devices with samples within window_ms before now, strongest first */
+int rssi_top(rssi_table_t *table, long long now, int window_ms, bluetooth_rssi_rank_t *ranks, int k);
+/* Clear match[i] unless device ids[i] has a smoothed RSSI within min..max dBm
+ * and a sample within window_ms before now, 0: any time */
+void rssi_filter(rssi_table_t *table, long long now, const uint32_t *ids, size_t n,
+                 int min, int max, int window_ms, uint8_t *match);
+
+/* query.c: device tables as columns, and filters compiled to run over them */
+#define QUERY_ICON_OTHER    (255)       /* icon class of names past the dictionary */
+
+typedef struct device_columns {
+    /* [n] each */
+    uint32_t *name[2];                  /* first 8 bytes of the name, zero padded */
+    uint32_t *id;
+    uint32_t *oui;                      /* first three MAC address bytes */
+    uint8_t *flags;
+    uint8_t *icon;                      /* index into icons, or QUERY_ICON_OTHER */
+    /* icon names of the table, in order of first use */
+    char (*icons)[BLUETOOTH_ICON_MAXLEN];
+    size_t n_icons;
+} device_columns_t;
+
+int device_columns_build(device_columns_t *cols, const bluetooth_device_info_t *devs, size_t n);
+void device_columns_free(device_columns_t *cols);
+/* Matches of query among devs, in order: their ids, or pointers to them, up to max.
+ * Return number of matches */
+size_t device_columns_match(const device_columns_t *cols, const bluetooth_device_info_t *devs,
+                            size_t n, const bluetooth_device_query_t *query,
+                            rssi_table_t *rssi, long long now, bluetooth_device_id_t *ids,
+                            const bluetooth_device_info_t **views, size_t max);
+
+typedef struct bluetooth_backend_config {
+    /* eventfd, readable while the handle is cancelled */
+    int cancel_fd;
+    /* record traffic here, NULL: don't */
+    trace_t *record;
+    /* serve traffic from here instead of the system, NULL: don't */
+    trace_t *replay;
+    /* RSSI samples go here */
+    rssi_table_t *rssi;
+} bluetooth_backend_config_t;
+
+/* bulk.c: which device to attempt next in bluetooth_connect_devices() */
+#define BULK_DEFAULT_IN_FLIGHT  (3)
+
+typedef struct bulk_item {
+    const char *device;
+    int priority;
+    int attempts;
+    /* FIFO within a priority, retries queue up behind */
+    unsigned int seq;
+    /* retries back off */
+    long long not_before;
+    int state;
+    /* bulk's deadline unless set after bulk_init() */
+    long long deadline;
+    /* Disconnect instead, for async calls queued together */
+    bool disconnect;
+} bulk_item_t;
+
+/* Fill in device, deadline and disconnect of one more item. false: none */
+typedef bool (*bulk_feed_t)(void *userdata, bulk_item_t *item);
+
+typedef struct bulk {
+    bulk_item_t *items;
+    size_t n;
+    int max_in_flight;
+    /* attempts allowed at once right now, see bulk_done() */
+    int limit;
+    int successes;
+    int max_retries;
+    int attempt_timeout_ms;
+    long long deadline;
+    int cancel_fd;
+    unsigned int seq;
+    bluetooth_bulk_progress_t progress;
+    bluetooth_bulk_cb_t cb;
+    void *userdata;
+    /* more items as attempts run, up to cap */
+    bulk_feed_t feed;
+    size_t cap;
+} bulk_t;
+
+int bulk_init(bulk_t *bulk, const bluetooth_connect_request_t *requests, size_t n,
+              const bluetooth_bulk_options_t *opts, long long deadline, int cancel_fd,
+              bluetooth_bulk_cb_t cb, void *userdata);
+/* Room for cap items in all, those past the requests taken from feed with
+ * bulk's userdata by bulk_fill() and bulk_next() */
+int bulk_feed(bulk_t *bulk, size_t cap, bulk_feed_t feed);
+void bulk_fill(bulk_t *bulk);
+/* Next device to attempt and the attempt's deadline. NULL when none is waiting,
+ * or time is up */
+bulk_item_t *bulk_next(bulk_t *bulk, long long *deadline);
+void bulk_done(bulk_t *bulk, bulk_item_t *item, bool ok);
+/* When the next waiting device is due, -1 if none is waiting */
+long long bulk_wake(bulk_t *bulk);
+/* Devices never attempted count as failed. Return number connected */
+int bulk_finish(bulk_t *bulk);
+
+/* deadlines are absolute CLOCK_MONOTONIC milliseconds, see bluetooth_now_ms() */
 typedef struct bluetooth_backend
 {
-    void* (*init)(void);
+    void* (*init)(const bluetooth_backend_config_t *config);
     void (*free)(void *handle);
-    void (*scan)(void *handle, int timeout);
+    void (*scan)(void *handle, long long deadline);
     int (*get_devices)(void *handle, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum);
     bool (*device_is_connected)(void *handle, const char *device);
-    bool (*connect_device)(void *handle, const char *device, int timeout);
-    bool (*disconnect_device)(void *handle, const char *device, int timeout);
+    bool (*connect_device)(void *handle, const char *device, long long deadline);
+    bool (*disconnect_device)(void *handle, const char *device, long long deadline);
+    bool (*set_advert_callback)(void *handle, bluetooth_advert_cb_t cb, void *userdata);
+    int (*gatt_discover)(void *handle, const char *device, bluetooth_gatt_char_t *chars, int charnum);
+    int (*gatt_read)(void *handle, const char *device, const char *uuid, void *buf, size_t len);
+    bool (*gatt_write)(void *handle, const char *device, const char *uuid, const void *buf, size_t len);
+    int (*gatt_acquire)(void *handle, const char *device, const char *uuid, bool notify, size_t *mtu);
+    void (*gatt_release)(void *handle, int fd);
+    bool (*set_gatt_cache_dir)(void *handle, const char *dir);
+    int (*get_device_info)(void *handle, bluetooth_device_info_t *devs, int devnum);
+    int (*connect_devices)(void *handle, struct bulk *bulk);
+    /* the device with exactly this MAC address, no name matching */
+    bool (*device_is_connected_addr)(void *handle, const char *macaddr);
+    bool (*connect_device_addr)(void *handle, const char *macaddr, long long deadline);
+    bool (*disconnect_device_addr)(void *handle, const char *macaddr, long long deadline);
+    /* agent stays valid until the next call, NULL: none */
+    bool (*set_agent)(void *handle, const bluetooth_agent_t *agent);
+    /* macaddrs[i]: device of requests[i], empty if unknown */
+    int (*obex_send)(void *handle, const bluetooth_obex_request_t *requests,
+                     const char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN], size_t n,
+                     long long deadline, bluetooth_obex_cb_t cb, void *userdata);
+    /* profile strings are copied */
+    bool (*register_profile)(void *handle, const bluetooth_profile_t *profile);
+    int (*connect_profile)(void *handle, const char *macaddr, const char *uuid, long long deadline);
+    /* macaddr and uuid: BLUETOOTH_MACADDR_MAXLEN and BLUETOOTH_UUID_MAXLEN, or NULL */
+    int (*accept_profile)(void *handle, char *macaddr, char *uuid, long long deadline);
+    /* macaddrs[i] empty: unknown, never in state. Called without lock, takes
+     * it and lets go of that hold only while it sleeps. Return how many are */
+    int (*wait_devices)(void *handle, const char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN], size_t n,
+                        int state, size_t want, bool *reached, long long deadline,
+                        pthread_mutex_t *lock);
+    /* bluetooth_close(), holding lock: wait_devices() calls underway return
+     * once they get it back. handle is freed after the last one did */
+    void (*wake_waits)(void *handle);
 
     const char *ident;
 } bluetooth_backend_t;
 
-extern bluetooth_backend_t bluetooth_bluetoothctl;
-extern bluetooth_backend_t bluetooth_bluez;
+/* Broker protocol, between broker/bluetooth_broker and the broker backend.
+ * SOCK_SEQPACKET on an abstract unix socket, one broker_msg_t per packet both
+ * ways, replies carry the request id. The first packet from the broker is a
+ * BROKER_HELLO with a memfd holding the broker_table_t */
+#define BROKER_DEFAULT_NAME     "hal_bluetooth_broker"
+/* environment variable naming another broker socket */
+#define BROKER_ENV              "HAL_BLUETOOTH_BROKER"
+#define BROKER_MAX_DEVICES      (4096)
+
+enum broker_op {
+    BROKER_HELLO,
+    BROKER_SCAN,
+    BROKER_CONNECT,
+    BROKER_DISCONNECT,
+    BROKER_IS_CONNECTED,
+};
+
+typedef struct broker_msg {
+    uint32_t id;
+    uint32_t op;
+    int32_t timeout_ms;
+    /* replies: what the library call returned */
+    int32_t result;
+    char device[BLUETOOTH_DEVNAME_MAXLEN];
+} broker_msg_t;
+
+/* Devices of the broker's last scan. Readers retry while seq is odd or moved */
+typedef struct broker_table {
+    uint32_t seq;
+    uint32_t n_devices;
+    uint64_t generation;
+    bluetooth_device_info_t devices[BROKER_MAX_DEVICES];
+} broker_table_t;
+
+/* backend.c: every backend is a shared object exporting this entry point.
+ * Bump the version whenever bluetooth_backend_t or bluetooth_backend_config_t
+ * changes: init() reads the config of whoever loaded it */
+#define BLUETOOTH_BACKEND_ENTRY         bluetooth_backend_v10
+#define BLUETOOTH_BACKEND_ENTRY_NAME    "bluetooth_backend_v10"
+
+#define BLUETOOTH_BACKEND_EXPORT(backend) \
+    const bluetooth_backend_t *BLUETOOTH_BACKEND_ENTRY(void) { return &(backend); }
+
+/* Load the backend whose ident starts with name, NULL with errmsg set if it can't */
+const bluetooth_backend_t *backend_load(const char *name, char *errmsg, size_t len);
+
+static inline long long bluetooth_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* ms as the int timeout poll() and libdbus take: a far deadline waits
+ * INT_MAX ms, not a wrapped negative */
+static inline int bluetooth_timeout_ms(long long ms)
+{
+    return ms < 0 ? 0 : ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/* bluetooth.c: cancel_fd of the bluetooth_new_shared() handle whose call this
+ * thread runs, -1 for other handles. A cancel shows on it or the context's */
+extern __thread int bluetooth_handle_cancel_fd;
+
+/* Fill pfd with what to poll for a cancel besides cancel_fd, return how many */
+static inline int bluetooth_cancel_pollfds(int cancel_fd, struct pollfd *pfd)
+{
+    int n = 0;
+
+    if (cancel_fd >= 0) {
+        pfd[n].fd = cancel_fd;
+        pfd[n++].events = POLLIN;
+    }
+    if (bluetooth_handle_cancel_fd >= 0) {
+        pfd[n].fd = bluetooth_handle_cancel_fd;
+        pfd[n++].events = POLLIN;
+    }
+    return n;
+}
+
+static inline bool bluetooth_cancelled(int cancel_fd)
+{
+    struct pollfd pfd[2];
+    int n = bluetooth_cancel_pollfds(cancel_fd, pfd);
+
+    return n && poll(pfd, n, 0) > 0;
+}
+
+/* agent.c: what a pairing agent answers request with. Return false to reject */
+bool agent_answer(const bluetooth_agent_t *agent, bluetooth_agent_request_t *request);
+
+/* advert.c: fixed pool of advertisement records, no allocation once created */
+typedef struct advert_pool advert_pool_t;
+
+advert_pool_t *advert_pool_new(size_t nslots);
+void advert_pool_free(advert_pool_t *pool);
+/* Returns a record holding one reference, NULL if pool is exhausted */
+bluetooth_advert_t *advert_pool_get(advert_pool_t *pool, const char *macaddr);
+int advert_add_manufacturer(bluetooth_advert_t *advert, unsigned short company,
+                            const void *data, size_t len);
+int advert_add_service(bluetooth_advert_t *advert, const char *uuid,
+                       const void *data, size_t len);
+
+/* singleflight.c: identical calls in flight at the same time share one result */
+typedef struct flight {
+    int op;
+    char key[BLUETOOTH_DEVNAME_MAXLEN];
+    long result;
+    bool done;
+    int waiters;
+    pthread_cond_t cond;
+    struct list_head list;
+} flight_t;
+
+typedef struct singleflight {
+    pthread_mutex_t lock;
+    struct list_head flights;
+} singleflight_t;
+
+void singleflight_init(singleflight_t *sf);
+void singleflight_destroy(singleflight_t *sf);
+/* Return true if caller leads: it must run the call and pass the result to
+ * singleflight_end(). Otherwise *result is the leader's result */
+bool singleflight_begin(singleflight_t *sf, flight_t *flight, int op, const char *key, long *result);
+void singleflight_end(singleflight_t *sf, flight_t *flight, long result);
+
+/* rtt.c: round-trip estimate of one kind of call, and a circuit breaker */
+typedef struct rtt {
+    /* ms, smoothed mean and mean deviation */
+    double srtt;
+    double rttvar;
+    unsigned int samples;
+    int backoff;
+    int initial_ms;
+    int min_ms;
+    int max_ms;
+} rtt_t;
+
+void rtt_init(rtt_t *rtt, int initial_ms, int min_ms, int max_ms);
+void rtt_sample(rtt_t *rtt, long long ms);
+/* A call ran out of rtt_timeout(), back off */
+void rtt_expired(rtt_t *rtt);
+/* Mean plus four deviations, clamped: few answers take longer */
+int rtt_timeout(const rtt_t *rtt);
+
+typedef struct breaker {
+    int failures;
+    long long open_until;
+    int cooldown_ms;
+} breaker_t;
+
+/* False while open: fail fast or answer from cache */
+bool breaker_allow(breaker_t *breaker, long long now);
+bool breaker_open(const breaker_t *breaker);
+void breaker_success(breaker_t *breaker);
+void breaker_failure(breaker_t *breaker, long long now);
+
+/* async.c: calls run by worker threads, completions handed back through an eventfd */
+typedef bool (*async_fn_t)(bluetooth_t *bt, const char *device, long long deadline);
+
+typedef struct async {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head pending;
+    struct list_head done;
+    /* connects and disconnects a worker runs together, see async_feed() */
+    struct list_head batch;
+    bool batching;
+    pthread_t workers[4];
+    int nworkers;
+    bool stop;
+    /* eventfd, readable while done isn't empty */
+    int event_fd;
+} async_t;
+
+int async_init(async_t *async);
+void async_destroy(async_t *async);
+/* Join the workers, calls still queued complete with false */
+void async_stop(async_t *async);
+int async_submit(async_t *async, bluetooth_t *bt, async_fn_t fn, const char *device,
+                 long long deadline, bluetooth_done_cb_t cb, void *userdata);
+void async_dispatch(async_t *async);
+
+/* bluetooth.c: connects and disconnects of devices from feed, up to cap, all
+ * in flight together, see bluetooth_connect_devices(). feed may hand out more
+ * while they run. cb as each ends. Return 1, nothing done, if the backend
+ * can't or out of memory */
+bool bluetooth_batchable(bluetooth_t *bt, const char *device);
+int bluetooth_batch(bluetooth_t *bt, size_t cap, bulk_feed_t feed, bluetooth_bulk_cb_t cb, void *userdata);
+
+/* export.c: what changed in the device table at which generation, see
+ * bluetooth_device_export() */
+typedef struct device_log_entry {
+    unsigned long long first_seen;
+    /* generation the device last came back in, or went */
+    unsigned long long added;
+    unsigned long long removed;
+    unsigned long long name;
+    unsigned long long flags;
+    unsigned long long icon;
+    /* latest of the above, entries are listed in its order */
+    unsigned long long changed;
+    /* ids, 0: none */
+    uint32_t older;
+    uint32_t newer;
+    /* row in the current table while present */
+    uint32_t row;
+    bool present;
+} device_log_entry_t;
+
+typedef struct device_log {
+    /* held by the table writer from publish to log update, and by exports */
+    pthread_mutex_t lock;
+    /* [id - 1] */
+    device_log_entry_t *entries;
+    size_t cap;
+    /* least and most recently changed ids */
+    uint32_t oldest;
+    uint32_t newest;
+} device_log_t;
+
+void device_log_init(device_log_t *log);
+void device_log_destroy(device_log_t *log);
+/* Note the changes from prev to next, next just published. Caller holds log->lock */
+void device_log_update(device_log_t *log, const bluetooth_device_table_t *prev,
+                       const bluetooth_device_table_t *next);
+/* Encode changes after since against table, the current one, into *data, the
+ * caller's to free. Caller holds log->lock. Return 1 if out of memory */
+int device_log_export(device_log_t *log, const bluetooth_device_table_t *table,
+                      unsigned long long since, int format, void **data, size_t *len);
+/* Hand data to out in pieces, without the lock. Return 1 if out aborted */
+int device_log_output(const void *data, size_t len, bluetooth_export_cb_t out, void *userdata);
+
+/* background.c: duty-cycled scans on a thread of their own, see
+ * bluetooth_background_scan_start() */
+typedef struct background {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bluetooth_t *bt;
+    bool running;
+    bool stop;
+    int window_ms;
+    int interval_ms;
+    /* read by scans outside the lock, 0 while stopped: tables aren't merged */
+    int max_age_ms;
+    /* connection attempts in flight, the next window waits for them */
+    int connecting;
+    /* [id - 1], touched by the table writer only */
+    long long *last_seen;
+    unsigned long long *seen_scan;
+    size_t n_seen;
+    unsigned long long scans;
+} background_t;
+
+void background_init(background_t *bg, bluetooth_t *bt);
+void background_destroy(background_t *bg);
+int background_start(background_t *bg, const bluetooth_background_options_t *opts);
+/* Wait for the window in progress, if any */
+void background_stop(background_t *bg);
+/* Devices of the last table not in devs[0..n) yet, heard within max_age_ms,
+ * appended after them. devs must have room for prev's devices too.
+ * Return the new count */
+size_t background_merge(background_t *bg, const bluetooth_device_table_t *prev,
+                        bluetooth_device_info_t *devs, size_t n, long long now);
+
+/* snapshot.c: immutable device tables, swapped RCU-style. One writer at a time */
+#define TABLE_SLOTS         (256)
+#define TABLE_SLOT_SHIFT    (56)
+
+typedef struct device_tables {
+    /* slot << TABLE_SLOT_SHIFT | pins taken */
+    uint64_t current;
+    struct device_table *slots[TABLE_SLOTS];
+    unsigned long long generation;
+} device_tables_t;
+
+int device_tables_init(device_tables_t *tables);
+/* Drop the current table. Readers must have released theirs */
+void device_tables_destroy(device_tables_t *tables);
+/* Publish a copy of devs as the next generation */
+int device_tables_publish(device_tables_t *tables, const bluetooth_device_info_t *devs, size_t n);
+/* Pin the current table, release with bluetooth_device_table_unref() */
+const bluetooth_device_table_t *device_tables_get(device_tables_t *tables);
+const device_columns_t *device_table_columns(const bluetooth_device_table_t *table);
 
 #endif
\ No newline at end of file
@@ -1,12 +1,26 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
 
 #include "list.h"
 #include "bluetooth_internal.h"
 
 #define min(x, y) (((x) < (y)) ? (x) : (y))
 
+/* bluetoothctl -v at init */
+#define PROBE_TIMEOUT_MS    (5000)
+/* bluetoothctl info / devices, no radio involved */
+#define QUERY_TIMEOUT_MS    (5000)
+
 typedef struct bluetooth_device {
     char ident[128];
     char macaddr[32];
@@ -16,19 +30,305 @@ typedef struct bluetooth_device {
 
 typedef struct bluetoothctl_handle {
     struct list_head devices;
+    /* readable once the caller cancels, see bluetooth_cancel() */
+    int cancel_fd;
+    rssi_table_t *rssi;
+    /* powered on by an earlier scan, until one fails with NotReady */
+    bool powered;
+    /* see bluetooth_set_agent(). Its prompts are answered while pairing this device */
+    const bluetooth_agent_t *agent;
+    const char *pairing;
+    trace_t *record;
+    trace_t *replay;
+    /* next replay record */
+    size_t cursor;
 } bluetoothctl_t;
 
-static void* bluetoothctl_init(void)
+typedef void (*line_cb_t)(char *line, void *data);
+
+/* bluetoothctl --timeout takes whole seconds */
+static int deadline_seconds(long long deadline)
+{
+    long long remaining = deadline - bluetooth_now_ms();
+
+    if (remaining < 1000)
+        return 1;
+    if (remaining / 1000 >= INT_MAX)
+        return INT_MAX;
+    return (remaining + 999) / 1000;
+}
+
+/* Append n bytes of output, hand out complete lines and keep the tail */
+static void feed_lines(char *buf, size_t size, size_t *len, const char *data, size_t n,
+                       line_cb_t cb, void *cbdata)
+{
+    char *line, *nl;
+    size_t chunk;
+
+    while (n) {
+        chunk = min(n, size - 1 - *len);
+        memcpy(buf + *len, data, chunk);
+        *len += chunk;
+        buf[*len] = '\0';
+        data += chunk;
+        n -= chunk;
+
+        line = buf;
+        while ((nl = strchr(line, '\n'))) {
+            *nl = '\0';
+            if (cb)
+                cb(line, cbdata);
+            line = nl + 1;
+        }
+        *len = strlen(line);
+        memmove(buf, line, *len + 1);
+        if (*len == size - 1)
+            *len = 0;                   /* overlong line, drop it */
+    }
+}
+
+/* --timeout depends on the time left, replay matches what follows it */
+static const char *command_key(const char *command, size_t len, size_t *keylen)
+{
+    const char *end = command + len, *p = command;
+
+    if (len > 10 && !strncmp(p, "--timeout ", 10)) {
+        p += 10;
+        while (p < end && *p != ' ')
+            p++;
+        if (p < end)
+            p++;
+    }
+    *keylen = end - p;
+    return p;
+}
+
+/* Wait for ms unless cancelled, return 1 if cancelled */
+static int replay_sleep(int cancel_fd, long long ms)
+{
+    struct pollfd pfd[2];
+
+    if (ms <= 0)
+        return bluetooth_cancelled(cancel_fd);
+    return poll(pfd, bluetooth_cancel_pollfds(cancel_fd, pfd), bluetooth_timeout_ms(ms)) > 0;
+}
+
+/* run_bluetoothctl() served from the next recorded run of the same command */
+static int replay_bluetoothctl(bluetoothctl_t *btctl, long long deadline, line_cb_t cb, void *data,
+                               const char *command)
+{
+    trace_t *trace = btctl->replay;
+    const trace_record_t *rec, *exec = NULL;
+    const char *key, *want;
+    size_t i, keylen, wantlen, len = 0;
+    long long start = bluetooth_now_ms(), at;
+    char buf[1024];
+    int ret = -1;
+
+    want = command_key(command, strlen(command), &wantlen);
+    for (i = btctl->cursor; i < trace->n; i++) {
+        rec = &trace->records[i];
+        if (rec->type != TRACE_EXEC)
+            continue;
+        key = command_key((const char *)rec->data, rec->len, &keylen);
+        if (keylen == wantlen && !memcmp(key, want, keylen)) {
+            exec = rec;
+            break;
+        }
+    }
+    /* never recorded: as if bluetoothctl wasn't there */
+    if (exec == NULL)
+        return 127;
+
+    for (i++; i < trace->n && trace->records[i].type != TRACE_EXEC; i++) {
+        rec = &trace->records[i];
+        at = start + trace_delay_ms(trace, exec->time_us, rec->time_us);
+        if (at > deadline || replay_sleep(btctl->cancel_fd, at - bluetooth_now_ms())) {
+            ret = -1;
+            break;
+        }
+        if (rec->type == TRACE_OUTPUT)
+            feed_lines(buf, sizeof(buf), &len, (const char *)rec->data, rec->len, cb, data);
+        else if (rec->type == TRACE_EXIT)
+            ret = atoi((const char *)rec->data);
+    }
+    btctl->cursor = i;
+
+    /* killed when recorded, so it runs into the deadline again */
+    if (ret < 0)
+        replay_sleep(btctl->cancel_fd, deadline - bluetooth_now_ms());
+    return ret;
+}
+
+/* Agent prompts end without a newline, waiting for ours:
+ * "[agent] Enter PIN code: ", "[agent] Confirm passkey 123456 (yes/no): ".
+ * Send the answer to fd, return 1 if tail was one */
+static int answer_prompt(bluetoothctl_t *btctl, const char *tail, int fd)
+{
+    bluetooth_agent_request_t request = { .macaddr = btctl->pairing };
+    const char *p;
+    char answer[32];
+    bool ok;
+
+    if (strstr(tail, "Enter PIN code")) {
+        request.type = BLUETOOTH_AGENT_REQUEST_PIN;
+    } else if (strstr(tail, "Enter passkey")) {
+        request.type = BLUETOOTH_AGENT_REQUEST_PASSKEY;
+    } else if ((p = strstr(tail, "Confirm passkey "))) {
+        request.type = BLUETOOTH_AGENT_REQUEST_CONFIRM;
+        request.passkey = strtoul(p + strlen("Confirm passkey "), NULL, 10);
+    } else if (strstr(tail, "Accept pairing") || strstr(tail, "Authorize service")) {
+        request.type = BLUETOOTH_AGENT_REQUEST_AUTHORIZE;
+    } else {
+        return 0;
+    }
+
+    ok = agent_answer(btctl->agent, &request);
+    if (request.type == BLUETOOTH_AGENT_REQUEST_PIN)
+        snprintf(answer, sizeof(answer), "%s\n", ok ? request.pin : "");
+    else if (request.type == BLUETOOTH_AGENT_REQUEST_PASSKEY && ok)
+        snprintf(answer, sizeof(answer), "%u\n", request.passkey);
+    else if (request.type == BLUETOOTH_AGENT_REQUEST_PASSKEY)
+        snprintf(answer, sizeof(answer), "\n");
+    else
+        snprintf(answer, sizeof(answer), "%s\n", ok ? "yes" : "no");
+    /* a child gone meanwhile shows as EOF on its output */
+    send(fd, answer, strlen(answer), MSG_NOSIGNAL);
+    return 1;
+}
+
+/*
+ * Run "bluetoothctl <args>", passing every output line to cb. The child is
+ * killed once the deadline passes or the caller cancels, and always reaped.
+ * While pairing with an agent set, its prompts get answers on stdin.
+ * Return the exit status, -1 if it didn't exit on its own.
+ */
+static int run_bluetoothctl(bluetoothctl_t *btctl, long long deadline, line_cb_t cb, void *data, const char *fmt, ...)
+{
+    char command[256], args[256], buf[1024], line[1024], status_text[16];
+    char *argv[16], *sbuf = NULL;
+    struct pollfd pfd[3];
+    size_t len = 0;
+    int pipefd[2], answer_fd[2] = { -1, -1 }, argc = 0, status, ret = -1, npfd;
+    int cancel_fd = btctl->cancel_fd;
+    long long remaining;
+    ssize_t n;
+    va_list ap;
+    pid_t pid;
+
+    va_start(ap, fmt);
+    vsnprintf(command, sizeof(command), fmt, ap);
+    va_end(ap);
+
+    if (btctl->replay)
+        return replay_bluetoothctl(btctl, deadline, cb, data, command);
+    if (btctl->record)
+        trace_write(btctl->record, TRACE_EXEC, command, strlen(command));
+
+    strcpy(args, command);
+    argv[argc++] = "bluetoothctl";
+    for (argv[argc] = strtok_r(args, " ", &sbuf); argv[argc] && argc < 15;
+         argv[argc] = strtok_r(NULL, " ", &sbuf))
+        argc++;
+    argv[argc] = NULL;
+
+    if (pipe2(pipefd, O_CLOEXEC))
+        return -1;
+    /* a socket: no SIGPIPE if the child is gone */
+    if (btctl->agent && btctl->pairing && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, answer_fd)) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (answer_fd[0] >= 0) {
+            close(answer_fd[0]);
+            close(answer_fd[1]);
+        }
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        dup2(answer_fd[0] >= 0 ? answer_fd[0] : null, STDIN_FILENO);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    if (answer_fd[0] >= 0)
+        close(answer_fd[0]);
+
+    pfd[0].fd = pipefd[0];
+    pfd[0].events = POLLIN;
+    npfd = 1 + bluetooth_cancel_pollfds(cancel_fd, &pfd[1]);
+    for (;;) {
+        remaining = deadline - bluetooth_now_ms();
+        if (remaining <= 0)
+            break;
+        if (poll(pfd, npfd, bluetooth_timeout_ms(remaining)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (npfd > 1 && bluetooth_cancelled(cancel_fd))
+            break;
+        if (!(pfd[0].revents & (POLLIN | POLLHUP)))
+            continue;
+
+        n = read(pipefd[0], buf, sizeof(buf));
+        if (n <= 0) {
+            /* EOF: the child is done */
+            ret = 0;
+            break;
+        }
+        if (btctl->record)
+            trace_write(btctl->record, TRACE_OUTPUT, buf, n);
+        feed_lines(line, sizeof(line), &len, buf, n, cb, data);
+        if (answer_fd[1] >= 0 && len && answer_prompt(btctl, line, answer_fd[1]))
+            len = 0;
+    }
+    close(pipefd[0]);
+    if (answer_fd[1] >= 0)
+        close(answer_fd[1]);
+
+    if (ret)
+        kill(pid, SIGKILL);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (ret == 0)
+        ret = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+    if (btctl->record) {
+        snprintf(status_text, sizeof(status_text), "%d", ret);
+        trace_write(btctl->record, TRACE_EXIT, status_text, strlen(status_text) + 1);
+    }
+    return ret;
+}
+
+static void* bluetoothctl_init(const bluetooth_backend_config_t *config)
 {
     bluetoothctl_t *btctl;
-    int ret;
-    
-    ret = pclose(popen("bluetoothctl -v >/dev/null 2>&1", "r"));
-    if (WIFEXITED(ret) != 1 || WEXITSTATUS(ret) !=0 )
-        return NULL;
-        
+
     btctl = calloc(1, sizeof(bluetoothctl_t));
+    if (btctl == NULL)
+        return NULL;
+
     INIT_LIST_HEAD(&btctl->devices);
+    btctl->cancel_fd = config->cancel_fd;
+    btctl->rssi = config->rssi;
+    btctl->record = config->record;
+    btctl->replay = config->replay;
+
+    if (run_bluetoothctl(btctl, bluetooth_now_ms() + PROBE_TIMEOUT_MS, NULL, NULL, "-v") != 0) {
+        free(btctl);
+        return NULL;
+    }
     return btctl;
 }
 
@@ -61,45 +361,90 @@ static void bluetoothctl_free(void *handle)
         free(handle);
 }
 
-static void bluetoothctl_scan(void *handle, int timeout)
+/* format: Device ${MAC} ${name} */
+static void read_device_line(char *line, void *data)
 {
-    bluetoothctl_t *btctl = (bluetoothctl_t *)handle;
-    FILE *stream;
-    char line[128] = {0};
-    char command[128] = {0};
+    bluetoothctl_t *btctl = (bluetoothctl_t *)data;
+
+    if (strncmp(line, "Device ", strlen("Device ")))
+        return;
+
+    bluetooth_device_t *dev = calloc(1, sizeof(bluetooth_device_t));
+    if (dev == NULL)
+        return;
+    strncpy(dev->ident, line, sizeof(dev->ident));
+    dev->ident[sizeof(dev->ident)-1] = '\0';
+
+    char *p = NULL;
+    char *sbuf = NULL;                  // split ident
+    strtok_r(line, " ", &sbuf);
+    p = strtok_r(NULL, " ", &sbuf);
+    if (p == NULL) {
+        free(dev);
+        return;
+    }
+    strncpy(dev->macaddr, p, sizeof(dev->macaddr));
+    dev->macaddr[sizeof(dev->macaddr)-1] = '\0';
+    p = strtok_r(NULL, "\n", &sbuf);
+    strncpy(dev->name, p ? p : "", sizeof(dev->name));
+    dev->name[sizeof(dev->name)-1] = '\0';
+    list_add_tail(&dev->list, &btctl->devices);
+}
 
-    if(timeout < 1)
-        timeout = 1;
+/* format: [CHG] Device ${MAC} RSSI: -62, newer bluez: RSSI: 0xffffffc2 (-62) */
+static void read_scan_line(char *line, void *data)
+{
+    bluetoothctl_t *btctl = (bluetoothctl_t *)data;
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+    char *dev, *rssi, *p;
+
+    /* Failed to start discovery: org.bluez.Error.NotReady, powered off meanwhile */
+    if (strstr(line, "Failed to start discovery") && strstr(line, "NotReady")) {
+        btctl->powered = false;
+        return;
+    }
+
+    dev = strstr(line, "Device ");
+    rssi = strstr(line, " RSSI: ");
+    if (dev == NULL || rssi == NULL || rssi < dev)
+        return;
+
+    dev += strlen("Device ");
+    if (rssi - dev != BLUETOOTH_MACADDR_MAXLEN - 1)
+        return;
+    memcpy(macaddr, dev, BLUETOOTH_MACADDR_MAXLEN - 1);
+    macaddr[BLUETOOTH_MACADDR_MAXLEN - 1] = '\0';
+
+    p = strchr(rssi, '(');
+    rssi_record(btctl->rssi, macaddr, strtol(p ? p + 1 : rssi + strlen(" RSSI: "), NULL, 10),
+                bluetooth_now_ms());
+}
+
+static void bluetoothctl_scan(void *handle, long long deadline)
+{
+    bluetoothctl_t *btctl = (bluetoothctl_t *)handle;
+    int attempt;
 
     /* Clean up */
     free_devices(btctl);
 
-    /* Fill up */
-    pclose(popen("bluetoothctl -- power on", "r"));
-    snprintf(command, sizeof(command), "bluetoothctl --timeout %d scan on", timeout);
-    pclose(popen(command, "r"));
-    stream = popen("bluetoothctl -- devices", "r");
-    while(fgets(line, sizeof(line), stream)) {
-        if (!strncmp(line, "Device ", strlen("Device "))) {
-            char *n = strchr(line, '\n');
-            *n = '\0';                       // strip '\n'
-
-            bluetooth_device_t *dev = calloc(1, sizeof(bluetooth_device_t));
-            strncpy(dev->ident, line, sizeof(dev->ident));
-            dev->ident[sizeof(dev->ident)-1] = '\0'; 
-
-            char *p = NULL;
-            char *sbuf = NULL;                  // split ident, format: Device ${MAC} ${name} 
-            strtok_r(line, " ", &sbuf);
-            p = strtok_r(NULL, " ", &sbuf);
-            strncpy(dev->macaddr, p, sizeof(dev->macaddr));
-            dev->macaddr[sizeof(dev->macaddr)-1] = '\0'; 
-            p = strtok_r(NULL, "\n", &sbuf);
-            strncpy(dev->name, p, sizeof(dev->name));
-            dev->name[sizeof(dev->name)-1] = '\0'; 
-            list_add_tail(&dev->list, &btctl->devices);
+    /* Fill up, powering on once per handle. A stale guess costs one retry */
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (!btctl->powered) {
+            run_bluetoothctl(btctl, deadline, NULL, NULL, "-- power on");
+            btctl->powered = true;
         }
+        run_bluetoothctl(btctl, deadline, read_scan_line, btctl, "--timeout %d scan on",
+                         deadline_seconds(deadline));
+        if (bluetooth_cancelled(btctl->cancel_fd))
+            return;
+        if (btctl->powered)
+            break;
     }
+
+    /* scan window is over, give the listing its own budget */
+    run_bluetoothctl(btctl, bluetooth_now_ms() + QUERY_TIMEOUT_MS,
+                     read_device_line, btctl, "-- devices");
 }
 
 static int bluetoothctl_get_devices(void *handle, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum)
@@ -117,88 +462,160 @@ static int bluetoothctl_get_devices(void *handle, char devs[][BLUETOOTH_DEVNAME_
     return num;
 }
 
+static void read_connected_line(char *line, void *data)
+{
+    if (strstr(line, "Connected: yes"))
+        *(bool *)data = true;
+}
+
+static int bluetoothctl_get_device_info(void *handle, bluetooth_device_info_t *devs, int devnum)
+{
+    bluetoothctl_t *btctl = (bluetoothctl_t *)handle;
+    bluetooth_device_t *dev;
+    int num = 0;
+
+    if (devnum <= 0)
+        return 0;
+
+    list_for_each_entry(dev, &btctl->devices, list) {
+        strncpy(devs[num].name, dev->name, sizeof(devs[num].name));
+        devs[num].name[sizeof(devs[num].name)-1] = '\0';
+        strncpy(devs[num].macaddr, dev->macaddr, sizeof(devs[num].macaddr));
+        devs[num].macaddr[sizeof(devs[num].macaddr)-1] = '\0';
+        /* "devices" lists names only */
+        devs[num].flags = 0;
+        devs[num].icon[0] = '\0';
+        if (++num == devnum)
+            break;
+    }
+    return num;
+}
+
+static bool bluetoothctl_device_is_connected_addr(void *handle, const char *macaddr)
+{
+    bluetoothctl_t *btctl = (bluetoothctl_t *)handle;
+    bool connected = false;
+
+    run_bluetoothctl(btctl, bluetooth_now_ms() + QUERY_TIMEOUT_MS,
+                     read_connected_line, &connected, "info %s", macaddr);
+    return connected;
+}
+
 static bool bluetoothctl_device_is_connected(void *handle, const char *device)
 {
     bluetoothctl_t *btctl = (bluetoothctl_t *)handle;
     bluetooth_device_t *dev;
-    char command[128] = {0};
-    FILE *stream;
-    char line[512] = {0};
 
     list_for_each_entry(dev, &btctl->devices, list) {
         if(!strncmp(dev->name, device, strlen(device))) {
-            snprintf(command, sizeof(command), "bluetoothctl info %s",
-            dev->macaddr);
-            stream = popen(command, "r");
-            while(fgets(line, 512, stream)) {
-                if (strstr(line, "Connected: yes"))
-                    return true;
-            }
+            if (bluetoothctl_device_is_connected_addr(btctl, dev->macaddr))
+                return true;
         }
     }
     return false;
 }
 
-static bool bluetoothctl_connect_device(void *handle, const char *device, int timeout)
+/* "Failed to pair: org.bluez.Error.AuthenticationFailed". Paired before is fine */
+static void read_pair_line(char *line, void *data)
+{
+    if (strstr(line, "Failed to pair") && !strstr(line, "AlreadyExists"))
+        *(bool *)data = false;
+}
+
+static const char *const agent_capabilities[] = {
+    [BLUETOOTH_AGENT_NO_IO] = "NoInputNoOutput",
+    [BLUETOOTH_AGENT_FIXED_PIN] = "KeyboardOnly",
+    [BLUETOOTH_AGENT_CALLBACK] = "KeyboardDisplay",
+};
+
+static bool pair_and_connect(bluetoothctl_t *btctl, const char *macaddr, long long deadline)
+{
+    bool paired = true;
+    int ret;
+
+    run_bluetoothctl(btctl, deadline, NULL, NULL,
+            "--timeout %d pairable on", deadline_seconds(deadline));
+    if (btctl->agent) {
+        /* our own agent for the pairing: no waiting on one elsewhere */
+        btctl->pairing = macaddr;
+        run_bluetoothctl(btctl, deadline, read_pair_line, &paired,
+                "--timeout %d --agent %s pair %s", deadline_seconds(deadline),
+                agent_capabilities[btctl->agent->capability], macaddr);
+        btctl->pairing = NULL;
+    } else {
+        run_bluetoothctl(btctl, deadline, read_pair_line, &paired,
+                "--timeout %d pair %s", deadline_seconds(deadline), macaddr);
+    }
+    if (!paired)
+        return false;
+    run_bluetoothctl(btctl, deadline, NULL, NULL,
+            "--timeout %d trust %s", deadline_seconds(deadline), macaddr);
+    ret = run_bluetoothctl(btctl, deadline, NULL, NULL,
+            "--timeout %d connect %s", deadline_seconds(deadline), macaddr);
+    return ret >= 0;
+}
+
+static bool disconnect_macaddr(bluetoothctl_t *btctl, const char *macaddr, long long deadline)
+{
+    return run_bluetoothctl(btctl, deadline, NULL, NULL,
+            "--timeout %d disconnect %s", deadline_seconds(deadline), macaddr) >= 0;
+}
+
+static bool bluetoothctl_connect_device(void *handle, const char *device, long long deadline)
 {
     bluetoothctl_t *btctl = (bluetoothctl_t *)handle;
     bluetooth_device_t *dev;
-    char command[128] = {0};
-    int ret;
 
     if(bluetoothctl_device_is_connected(btctl, device))
         return true;
 
 	list_for_each_entry(dev, &btctl->devices, list) {
-        if(!strncmp(dev->name, device, strlen(device))) {
-            snprintf(command, sizeof(command), "bluetoothctl --timeout %d pairable on",
-                 timeout);
-            pclose(popen(command, "r"));
-
-            snprintf(command, sizeof(command), "bluetoothctl --timeout %d pair %s",
-                 timeout, dev->macaddr);
-            pclose(popen(command, "r"));
-
-            snprintf(command, sizeof(command), "bluetoothctl --timeout %d trust %s",
-                 timeout, dev->macaddr);
-            pclose(popen(command, "r"));
-
-            snprintf(command, sizeof(command), "bluetoothctl --timeout %d connect %s",
-                 timeout, dev->macaddr);
-            ret = pclose(popen(command, "r"));
-            return WIFEXITED(ret);
-        }
+        if(!strncmp(dev->name, device, strlen(device)))
+            return pair_and_connect(btctl, dev->macaddr, deadline);
 	}
 
     /* connect command not executed */
     return false;
 }
 
-static bool bluetoothctl_disconnect_device(void *handle, const char *device, int timeout)
+static bool bluetoothctl_disconnect_device(void *handle, const char *device, long long deadline)
 {
     bluetoothctl_t *btctl = (bluetoothctl_t *)handle;
     bluetooth_device_t *dev;
-    char command[128] = {0};
-    int ret;
 
     if (!bluetoothctl_device_is_connected(handle, device))
         return true;
 
     list_for_each_entry(dev, &btctl->devices, list) {
-        if(!strncmp(dev->name, device, strlen(device))) {
-            snprintf(command, sizeof(command), "bluetoothctl --timeout %d disconnect %s",
-                    timeout,
-                    dev->macaddr);
-            ret = pclose(popen(command, "r"));
-            return WIFEXITED(ret);
-        }
+        if(!strncmp(dev->name, device, strlen(device)))
+            return disconnect_macaddr(btctl, dev->macaddr, deadline);
     }
 
     /* disconnect command not executed */
     return false;
 }
 
-bluetooth_backend_t bluetooth_bluetoothctl = {
+static bool bluetoothctl_connect_device_addr(void *handle, const char *macaddr, long long deadline)
+{
+    if (bluetoothctl_device_is_connected_addr(handle, macaddr))
+        return true;
+    return pair_and_connect((bluetoothctl_t *)handle, macaddr, deadline);
+}
+
+static bool bluetoothctl_disconnect_device_addr(void *handle, const char *macaddr, long long deadline)
+{
+    if (!bluetoothctl_device_is_connected_addr(handle, macaddr))
+        return true;
+    return disconnect_macaddr((bluetoothctl_t *)handle, macaddr, deadline);
+}
+
+static bool bluetoothctl_set_agent(void *handle, const bluetooth_agent_t *agent)
+{
+    ((bluetoothctl_t *)handle)->agent = agent;
+    return true;
+}
+
+static bluetooth_backend_t bluetooth_bluetoothctl = {
     bluetoothctl_init,
     bluetoothctl_free,
     bluetoothctl_scan,
@@ -206,5 +623,26 @@ bluetooth_backend_t bluetooth_bluetoothctl = {
     bluetoothctl_device_is_connected,
     bluetoothctl_connect_device,
     bluetoothctl_disconnect_device,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    bluetoothctl_get_device_info,
+    NULL,
+    bluetoothctl_device_is_connected_addr,
+    bluetoothctl_connect_device_addr,
+    bluetoothctl_disconnect_device_addr,
+    bluetoothctl_set_agent,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
     "bluetoothctl"
-};
\ No newline at end of file
+};
+
+BLUETOOTH_BACKEND_EXPORT(bluetooth_bluetoothctl)
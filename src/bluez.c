@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <dbus/dbus.h>
 
 #include "list.h"
@@ -29,12 +34,188 @@ typedef struct bluetooth_device {
     struct list_head list;
 } bluetooth_device_t;
 
+enum gatt_kind {
+    GATT_SERVICE,
+    GATT_CHARACTERISTIC,
+    GATT_DESCRIPTOR,
+};
+
+typedef struct gatt_attr {
+    /* object path, e.g. /org/bluez/hci0/dev_AA_BB_CC_DD_EE_FF/service000a/char000b */
+    char path[160];
+    char uuid[BLUETOOTH_UUID_MAXLEN];
+
+    /* service of a characteristic, characteristic of a descriptor */
+    char parent[160];
+
+    /* characteristics only */
+    char service_uuid[BLUETOOTH_UUID_MAXLEN];
+    unsigned int flags;
+
+    int kind;
+    struct list_head list;
+} gatt_attr_t;
+
+/* Resolved attribute tree of one device. Outlives rescans and reconnects,
+ * dropped when bluetoothd adds or removes objects below the device */
+typedef struct gatt_cache {
+    char macaddr[32];
+    struct list_head attrs;
+    struct list_head list;
+} gatt_cache_t;
+
+#define GATT_CACHE_MAGIC    "hal_bluetooth-gatt 1"
+
+/* Calls answered by bluetoothd alone get timeouts from their observed round
+ * trips: first guess, floor and ceiling. Ceiling of GetManagedObjects is the
+ * libdbus default */
+#define PROPERTY_TIMEOUT_MS             (1000)
+#define PROPERTY_TIMEOUT_MIN_MS         (100)
+#define PROPERTY_TIMEOUT_MAX_MS         (5000)
+#define MANAGED_OBJECTS_TIMEOUT_MS      (5000)
+#define MANAGED_OBJECTS_TIMEOUT_MIN_MS  (250)
+#define MANAGED_OBJECTS_TIMEOUT_MAX_MS  (25000)
+/* ReadValue/WriteValue go over the air, allow more than a property access */
+#define GATT_TIMEOUT_MS             (5000)
+
+/* records in flight at once, between signal decode and consumer release */
+#define ADVERT_POOL_SLOTS   (64)
+
+/* where bluetoothd finds our Agent1, on our own connection */
+#define AGENT_PATH          "/org/hal_bluetooth/agent"
+
+/* our Profile1 objects, PROFILE_PATH/<index of bluez->profiles> */
+#define PROFILE_PATH        "/org/hal_bluetooth/profile"
+#define MAX_PROFILES        (8)
+/* NewConnection sockets nobody took yet, past that they are refused */
+#define PROFILE_BACKLOG     (16)
+
+/* prebuilt Properties.Get/Set calls kept, reused round robin */
+#define PROPERTY_TEMPLATES  (16)
+
+/* A Properties.Get (value < 0) or Set call, marshalled once. Calls send a copy:
+ * no re-marshalling, and the copy gets its own serial */
+typedef struct property_template {
+    char path[128];
+    /* static strings */
+    const char *interface;
+    const char *property;
+    int value;
+    DBusMessage *message;
+} property_template_t;
+
+/* See bluetooth_profile_register() */
+typedef struct bluez_profile {
+    char uuid[BLUETOOTH_UUID_MAXLEN];
+    char name[64];
+    int role;
+    unsigned short channel;
+    unsigned short psm;
+    /* with bluetoothd, on this connection */
+    bool registered;
+} bluez_profile_t;
+
+/* A socket from NewConnection */
+typedef struct profile_link {
+    int fd;
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+    char uuid[BLUETOOTH_UUID_MAXLEN];
+} profile_link_t;
+
+/* See bluez_wait_devices(): reached[i] follows the property of paths[i] */
+typedef struct device_wait {
+    char (*paths)[128];
+    size_t n;
+    /* Device1 boolean, static string */
+    const char *property;
+    dbus_bool_t value;
+    bool *reached;
+    /* a signal told: newer than an answer bluez_call() dispatched it before */
+    bool *signalled;
+    /* written when reached changes, wakes the waiter sleeping unlocked */
+    int event_fd;
+    struct list_head list;
+} device_wait_t;
+
+enum bluez_call_kind {
+    CALL_PROPERTY,
+    CALL_MANAGED_OBJECTS,
+    CALL_KINDS,
+};
+
 typedef struct bluez_handle {
     DBusConnection *dbus_connection;
-    char adapter[256];
+    /* readable once the caller cancels, see bluetooth_cancel() */
+    int cancel_fd;
     struct list_head devices;
+
+    /* Adapter session: the connection outlives calls, so the adapter found once
+     * stays known and its signals keep powered and discovering current */
+    char adapter[256];
+    bool adapter_known;
+    /* -1: unknown */
+    int powered;
+    int discovering;
+
+    advert_pool_t *adverts;
+    bluetooth_advert_cb_t advert_cb;
+    void *advert_userdata;
+
+    rssi_table_t *rssi;
+
+    trace_t *record;
+    /* NULL: the system bus */
+    bluez_replay_t *replay;
+
+    rtt_t rtt[CALL_KINDS];
+    /* open while bluetoothd doesn't answer */
+    breaker_t breaker;
+    /* last GetManagedObjects reply, served while the breaker is open */
+    DBusMessage *objects;
+
+    property_template_t templates[PROPERTY_TEMPLATES];
+    unsigned int next_template;
+
+    /* see bluetooth_set_agent(), NULL: pairing waits on whatever agent
+     * bluetoothd has. Registered once per connection, before pairing */
+    const bluetooth_agent_t *agent;
+    bool agent_registered;
+
+    struct list_head gatt_cache;
+    /* empty: memory only */
+    char gatt_cache_dir[256];
+
+    /* on the session bus, opened by the first bluetooth_obex_send() */
+    obex_t *obex;
+
+    bluez_profile_t profiles[MAX_PROFILES];
+    int nprofiles;
+    /* oldest first */
+    profile_link_t backlog[PROFILE_BACKLOG];
+    int nbacklog;
+
+    /* bluez_wait_devices() underway, kept current by the signal filter */
+    struct list_head waits;
+    /* scans and waits underway: Device1 signals are only asked for while
+     * someone reads them, an idle connection doesn't queue them up */
+    int device_signals;
+    /* set by bluez_wake_waits(), the handle is about to go */
+    bool closing;
 } bluez_t;
 
+static void free_gatt(gatt_cache_t *cache)
+{
+    gatt_attr_t *attr;
+
+    while(!list_empty(&cache->attrs)) {
+        attr = list_first_entry(&cache->attrs, gatt_attr_t, list);
+        list_del(&attr->list);
+        free(attr);
+    }
+    list_del(&cache->list);
+    free(cache);
+}
+
 static void free_devices(bluez_t *bluez)
 {
     bluetooth_device_t *dev;
@@ -55,43 +236,323 @@ static void __attribute__((unused)) dump_devices(bluez_t *bluez)
 	}
 }
 
-static void* bluez_init(void)
+static void* bluez_init(const bluetooth_backend_config_t *config)
 {
     bluez_t *bluez;
 
     bluez = calloc(1, sizeof(bluez_t));
+    if (bluez == NULL)
+        return NULL;
+
+    bluez->cancel_fd = config->cancel_fd;
+    bluez->powered = -1;
+    bluez->discovering = -1;
+    bluez->record = config->record;
+    bluez->rssi = config->rssi;
+    rtt_init(&bluez->rtt[CALL_PROPERTY], PROPERTY_TIMEOUT_MS,
+             PROPERTY_TIMEOUT_MIN_MS, PROPERTY_TIMEOUT_MAX_MS);
+    rtt_init(&bluez->rtt[CALL_MANAGED_OBJECTS], MANAGED_OBJECTS_TIMEOUT_MS,
+             MANAGED_OBJECTS_TIMEOUT_MIN_MS, MANAGED_OBJECTS_TIMEOUT_MAX_MS);
+    bluez->adverts = advert_pool_new(ADVERT_POOL_SLOTS);
+    if (bluez->adverts == NULL) {
+        free(bluez);
+        return NULL;
+    }
+    if (config->replay) {
+        bluez->replay = bluez_replay_start(config->replay);
+        if (bluez->replay == NULL) {
+            advert_pool_free(bluez->adverts);
+            free(bluez);
+            return NULL;
+        }
+    }
     INIT_LIST_HEAD(&bluez->devices);
+    INIT_LIST_HEAD(&bluez->gatt_cache);
+    INIT_LIST_HEAD(&bluez->waits);
     return bluez;
 }
 
+static void bluez_dbus_close(bluez_t *bluez);
+
 static void bluez_free(void *handle)
 {
     bluez_t *bluez = (bluez_t *)handle;
-    bluetooth_device_t *dev;
+    int i;
 
-    while(!list_empty(&bluez->devices)) {
-        dev = list_first_entry(&bluez->devices, bluetooth_device_t, list);
-        list_del(&dev->list);
-        free(dev);
+    free_devices(bluez);
+    while (!list_empty(&bluez->gatt_cache))
+        free_gatt(list_first_entry(&bluez->gatt_cache, gatt_cache_t, list));
+
+    bluez_dbus_close(bluez);
+    obex_free(bluez->obex);
+    for (i = 0; i < bluez->nbacklog; i++)
+        close(bluez->backlog[i].fd);
+    bluez_replay_stop(bluez->replay);
+    if (bluez->objects)
+        dbus_message_unref(bluez->objects);
+    for (i = 0; i < PROPERTY_TEMPLATES; i++) {
+        if (bluez->templates[i].message)
+            dbus_message_unref(bluez->templates[i].message);
     }
-
+    advert_pool_free(bluez->adverts);
     if (handle)
         free(handle);
 }
 
-static int set_bool_property(
-                bluez_t * bluez, 
-                const char *path, 
-                const char *arg_adapter, 
+static gatt_cache_t *gatt_cache_find(bluez_t *bluez, const char *macaddr)
+{
+    gatt_cache_t *cache;
+
+    list_for_each_entry(cache, &bluez->gatt_cache, list) {
+        if (!strcmp(cache->macaddr, macaddr))
+            return cache;
+    }
+    return NULL;
+}
+
+static gatt_cache_t *gatt_cache_new(bluez_t *bluez, const char *macaddr)
+{
+    gatt_cache_t *cache;
+
+    cache = calloc(1, sizeof(gatt_cache_t));
+    if (cache == NULL)
+        return NULL;
+
+    strncpy(cache->macaddr, macaddr, sizeof(cache->macaddr) - 1);
+    INIT_LIST_HEAD(&cache->attrs);
+    list_add(&cache->list, &bluez->gatt_cache);
+    return cache;
+}
+
+static int gatt_cache_file(bluez_t *bluez, const char *macaddr, char *file, size_t len)
+{
+    size_t i, n;
+
+    if (bluez->gatt_cache_dir[0] == '\0')
+        return 1;
+
+    n = snprintf(file, len, "%s/", bluez->gatt_cache_dir);
+    for (i = 0; macaddr[i] && n < len - 1; i++)
+        file[n++] = (macaddr[i] == ':') ? '_' : macaddr[i];
+    file[n] = '\0';
+    return 0;
+}
+
+static void gatt_cache_drop(bluez_t *bluez, const char *macaddr)
+{
+    gatt_cache_t *cache = gatt_cache_find(bluez, macaddr);
+    char file[320];
+
+    if (cache)
+        free_gatt(cache);
+    if (!gatt_cache_file(bluez, macaddr, file, sizeof(file)))
+        unlink(file);
+}
+
+/* One attribute per line: <kind> <path> <uuid> <parent> <flags> */
+static int gatt_cache_save(bluez_t *bluez, gatt_cache_t *cache)
+{
+    gatt_attr_t *attr;
+    char file[320], tmp[330];
+    FILE *fp;
+
+    if (gatt_cache_file(bluez, cache->macaddr, file, sizeof(file)))
+        return 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    fp = fopen(tmp, "w");
+    if (fp == NULL)
+        return 1;
+
+    fprintf(fp, "%s\n", GATT_CACHE_MAGIC);
+    list_for_each_entry(attr, &cache->attrs, list) {
+        fprintf(fp, "%d %s %s %s %u\n", attr->kind, attr->path, attr->uuid,
+                attr->parent[0] ? attr->parent : "-", attr->flags);
+    }
+    if (fclose(fp)) {
+        unlink(tmp);
+        return 1;
+    }
+
+    /* readers never see a half written file */
+    return rename(tmp, file) ? 1 : 0;
+}
+
+static gatt_cache_t *gatt_cache_load(bluez_t *bluez, const char *macaddr)
+{
+    gatt_cache_t *cache;
+    gatt_attr_t *attr;
+    char file[320], line[512];
+    FILE *fp;
+
+    if (gatt_cache_file(bluez, macaddr, file, sizeof(file)))
+        return NULL;
+
+    fp = fopen(file, "r");
+    if (fp == NULL)
+        return NULL;
+
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, GATT_CACHE_MAGIC, strlen(GATT_CACHE_MAGIC))) {
+        fclose(fp);
+        return NULL;
+    }
+
+    cache = gatt_cache_new(bluez, macaddr);
+    while (cache && fgets(line, sizeof(line), fp)) {
+        attr = calloc(1, sizeof(gatt_attr_t));
+        if (attr == NULL)
+            break;
+        if (sscanf(line, "%d %159s %36s %159s %u", &attr->kind, attr->path, attr->uuid,
+                   attr->parent, &attr->flags) != 5) {
+            free(attr);
+            continue;
+        }
+        if (!strcmp(attr->parent, "-"))
+            attr->parent[0] = '\0';
+        list_add_tail(&attr->list, &cache->attrs);
+    }
+    fclose(fp);
+
+    if (cache && list_empty(&cache->attrs)) {
+        free_gatt(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void bluez_trace(bluez_t *bluez, int type, DBusMessage *message)
+{
+    char *data;
+    int len;
+
+    /* fds don't marshal, replay lets those calls time out */
+    if (!bluez->record || !message || dbus_message_contains_unix_fds(message))
+        return;
+    if (dbus_message_marshal(message, &data, &len)) {
+        trace_write(bluez->record, type, data, len);
+        dbus_free(data);
+    }
+}
+
+/* Dispatch what is queued, or wait for traffic until deadline and dispatch
+ * that. Return 1 once the deadline passed or the caller cancelled */
+static int bluez_wait(bluez_t *bluez, long long deadline)
+{
+    DBusConnection *conn = bluez->dbus_connection;
+    struct pollfd pfd[3];
+    long long remaining;
+    int fd, npfd;
+
+    if (bluetooth_cancelled(bluez->cancel_fd))
+        return 1;
+
+    if (dbus_connection_get_dispatch_status(conn) != DBUS_DISPATCH_DATA_REMAINS) {
+        remaining = deadline - bluetooth_now_ms();
+        if (remaining <= 0)
+            return 1;
+        if (!dbus_connection_get_is_connected(conn) || !dbus_connection_get_unix_fd(conn, &fd))
+            return 1;
+
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        npfd = 1 + bluetooth_cancel_pollfds(bluez->cancel_fd, &pfd[1]);
+        if (poll(pfd, npfd, bluetooth_timeout_ms(remaining)) < 0 && errno != EINTR)
+            return 1;
+        if (npfd > 1 && bluetooth_cancelled(bluez->cancel_fd))
+            return 1;
+        dbus_connection_read_write(conn, 0);
+    }
+
+    while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    return 0;
+}
+
+/* Send message and wait for its reply until deadline, dispatching signals
+ * meanwhile. On expiry or cancel the call is dropped right away */
+static DBusMessage *bluez_call(bluez_t *bluez, DBusMessage *message, long long deadline, DBusError *err)
+{
+    DBusPendingCall *pending;
+    DBusMessage *reply;
+    long long remaining = deadline - bluetooth_now_ms();
+
+    if (!bluez->dbus_connection || remaining <= 0) {
+        dbus_set_error_const(err, DBUS_ERROR_TIMEOUT, "Deadline expired");
+        return NULL;
+    }
+
+    if (!dbus_connection_send_with_reply(bluez->dbus_connection, message, &pending,
+                                         bluetooth_timeout_ms(remaining)) ||
+        !pending) {
+        dbus_set_error_const(err, DBUS_ERROR_DISCONNECTED, "Not connected");
+        return NULL;
+    }
+    bluez_trace(bluez, TRACE_SEND, message);
+    dbus_connection_flush(bluez->dbus_connection);
+
+    while (!dbus_pending_call_get_completed(pending)) {
+        if (bluez_wait(bluez, deadline)) {
+            dbus_pending_call_cancel(pending);
+            dbus_pending_call_unref(pending);
+            if (bluetooth_cancelled(bluez->cancel_fd))
+                dbus_set_error_const(err, BLUETOOTH_ERROR_CANCELLED_NAME, "Cancelled");
+            else
+                dbus_set_error_const(err, DBUS_ERROR_TIMEOUT, "Deadline expired");
+            return NULL;
+        }
+    }
+
+    reply = dbus_pending_call_steal_reply(pending);
+    dbus_pending_call_unref(pending);
+    bluez_trace(bluez, TRACE_RECV, reply);
+    if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+        dbus_set_error_from_message(err, reply);
+        dbus_message_unref(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+/* bluez_call() with a deadline from the recent round trips of this kind of
+ * call. Timeouts trip the breaker, then calls fail fast until a probe passes */
+static DBusMessage *bluez_timed_call(bluez_t *bluez, int kind, DBusMessage *message, DBusError *err)
+{
+    rtt_t *rtt = &bluez->rtt[kind];
+    long long start = bluetooth_now_ms();
+    DBusMessage *reply;
+
+    if (!breaker_allow(&bluez->breaker, start)) {
+        dbus_set_error_const(err, BLUETOOTH_ERROR_UNAVAILABLE_NAME, "bluetoothd not answering");
+        return NULL;
+    }
+
+    reply = bluez_call(bluez, message, start + rtt_timeout(rtt), err);
+    if (dbus_error_has_name(err, BLUETOOTH_ERROR_CANCELLED_NAME))
+        return NULL;
+    /* errors from bluetoothd are answers too */
+    if (reply || !(dbus_error_has_name(err, DBUS_ERROR_TIMEOUT) ||
+                   dbus_error_has_name(err, DBUS_ERROR_NO_REPLY) ||
+                   dbus_error_has_name(err, DBUS_ERROR_DISCONNECTED))) {
+        rtt_sample(rtt, bluetooth_now_ms() - start);
+        breaker_success(&bluez->breaker);
+        return reply;
+    }
+
+    rtt_expired(rtt);
+    breaker_failure(&bluez->breaker, bluetooth_now_ms());
+    return NULL;
+}
+
+/* Properties.Set call of a boolean, NULL if out of memory */
+static DBusMessage *bool_property_message(
+                const char *path,
+                const char *arg_adapter,
                 const char *arg_property,
                 int value)
 {
-    DBusError err;
-    DBusMessage *message, *reply;
+    DBusMessage *message;
     DBusMessageIter req_iter, req_subiter;
 
-    dbus_error_init(&err);
-
     message = dbus_message_new_method_call(
         "org.bluez",
         path,
@@ -99,7 +560,7 @@ static int set_bool_property(
         "Set"
     );
     if (!message)
-        return 1;
+        return NULL;
     
     dbus_message_iter_init_append(message, &req_iter);
     if (!dbus_message_iter_append_basic(
@@ -119,20 +580,88 @@ static int set_bool_property(
             &req_iter, &req_subiter))
         goto fault;
 
-    reply = dbus_connection_send_with_reply_and_block(bluez->dbus_connection,
-        message, 1000, &err);   // 1 second, can't be too long. Otherwise other api may occur message is locked
-    if (!reply)
-        goto fault;
+    return message;
 
-    dbus_message_unref(reply);
+fault:
+    dbus_message_iter_abandon_container_if_open(&req_iter, &req_subiter);
     dbus_message_unref(message);
+    return NULL;
+}
 
-    return 0;
+/* Properties.Get call (value < 0) or Set of a boolean, copied from its template */
+static DBusMessage *property_message(
+                bluez_t *bluez,
+                const char *path,
+                const char *arg_adapter,
+                const char *arg_property,
+                int value)
+{
+    property_template_t *t;
+    DBusMessage *message;
+    int i;
 
-fault:
-    dbus_message_iter_abandon_container_if_open(&req_iter, &req_subiter);
+    for (i = 0; i < PROPERTY_TEMPLATES; i++) {
+        t = &bluez->templates[i];
+        if (t->message && t->value == value && !strcmp(t->property, arg_property) &&
+            !strcmp(t->path, path) && !strcmp(t->interface, arg_adapter))
+            return dbus_message_copy(t->message);
+    }
+    if (strlen(path) >= sizeof(t->path))
+        return NULL;
+
+    if (value < 0) {
+        message = dbus_message_new_method_call("org.bluez", path,
+            "org.freedesktop.DBus.Properties", "Get");
+        if (message && !dbus_message_append_args(message,
+                DBUS_TYPE_STRING, &arg_adapter,
+                DBUS_TYPE_STRING, &arg_property,
+                DBUS_TYPE_INVALID)) {
+            dbus_message_unref(message);
+            message = NULL;
+        }
+    } else {
+        message = bool_property_message(path, arg_adapter, arg_property, value);
+    }
+    if (!message)
+        return NULL;
+
+    /* the oldest goes */
+    t = &bluez->templates[bluez->next_template++ % PROPERTY_TEMPLATES];
+    if (t->message)
+        dbus_message_unref(t->message);
+    strcpy(t->path, path);
+    t->interface = arg_adapter;
+    t->property = arg_property;
+    t->value = value;
+    t->message = message;
+    return dbus_message_copy(message);
+}
+
+static int set_bool_property(
+                bluez_t * bluez, 
+                const char *path, 
+                const char *arg_adapter, 
+                const char *arg_property,
+                int value)
+{
+    DBusError err;
+    DBusMessage *message, *reply;
+
+    dbus_error_init(&err);
+
+    message = property_message(bluez, path, arg_adapter, arg_property, !!value);
+    if (!message)
+        return 1;
+
+    reply = bluez_timed_call(bluez, CALL_PROPERTY, message, &err);
     dbus_message_unref(message);
-    return 1;
+    if (!reply) {
+        dbus_error_free(&err);
+        return 1;
+    }
+
+    dbus_message_unref(reply);
+    return 0;
 }
 
 static int get_bool_property(
@@ -148,30 +677,24 @@ static int get_bool_property(
 
     dbus_error_init(&err);
 
-    message = dbus_message_new_method_call( "org.bluez", path,
-        "org.freedesktop.DBus.Properties", "Get");
+    message = property_message(bluez, path, arg_adapter, arg_property, -1);
     if (!message)
         return 1;
 
-    if (!dbus_message_append_args(message,
-        DBUS_TYPE_STRING, &arg_adapter,
-        DBUS_TYPE_STRING, &arg_property,
-        DBUS_TYPE_INVALID))
-        return 1;
-
-    reply = dbus_connection_send_with_reply_and_block(bluez->dbus_connection,
-        message, 1000, &err);
+    reply = bluez_timed_call(bluez, CALL_PROPERTY, message, &err);
 
     dbus_message_unref(message);
 
-    if (!reply)
-        return 1;
-
-    if (!dbus_message_iter_init(reply, &root_iter))
+    if (!reply) {
+        dbus_error_free(&err);
         return 1;
+    }
 
-    if (DBUS_TYPE_VARIANT != dbus_message_iter_get_arg_type(&root_iter))
+    if (!dbus_message_iter_init(reply, &root_iter) ||
+        DBUS_TYPE_VARIANT != dbus_message_iter_get_arg_type(&root_iter)) {
+        dbus_message_unref(reply);
         return 1;
+    }
 
     dbus_message_iter_recurse(&root_iter, &variant_iter);
     dbus_message_iter_get_basic(&variant_iter, value);
@@ -188,8 +711,11 @@ static int adapter_discovery(bluez_t *bluez, const char *method)
     if (!message)
         return 1;
 
-    if (!dbus_connection_send(bluez->dbus_connection, message, NULL))
+    if (!dbus_connection_send(bluez->dbus_connection, message, NULL)) {
+        dbus_message_unref(message);
         return 1;
+    }
+    bluez_trace(bluez, TRACE_SEND, message);
 
     dbus_connection_flush(bluez->dbus_connection);
     dbus_message_unref(message);
@@ -197,6 +723,33 @@ static int adapter_discovery(bluez_t *bluez, const char *method)
     return 0;
 }
 
+/* StartDiscovery, waiting for the answer: NotReady means the adapter is off */
+static int adapter_start_discovery(bluez_t *bluez)
+{
+    DBusMessage *message, *reply;
+    DBusError err;
+
+    message = dbus_message_new_method_call("org.bluez", bluez->adapter,
+            "org.bluez.Adapter1", "StartDiscovery");
+    if (!message)
+        return 1;
+
+    dbus_error_init(&err);
+    reply = bluez_timed_call(bluez, CALL_PROPERTY, message, &err);
+    dbus_message_unref(message);
+    if (!reply) {
+        if (dbus_error_has_name(&err, "org.bluez.Error.NotReady"))
+            bluez->powered = 0;
+        dbus_error_free(&err);
+        return 1;
+    }
+
+    /* not until its signal says so: StopDiscovery is skipped only once it did */
+    bluez->discovering = -1;
+    dbus_message_unref(reply);
+    return 0;
+}
+
 static int get_managed_objects(bluez_t *bluez, DBusMessage **reply)
 {
     DBusMessage *message;
@@ -209,15 +762,24 @@ static int get_managed_objects(bluez_t *bluez, DBusMessage **reply)
     if (!message)
         return 1;
 
-    *reply = dbus_connection_send_with_reply_and_block(bluez->dbus_connection,
-            message, -1, &err);
+    *reply = bluez_timed_call(bluez, CALL_MANAGED_OBJECTS, message, &err);
     /* if (!reply) is done by the caller in this one */
+    dbus_error_free(&err);
+
+    if (*reply) {
+        if (bluez->objects)
+            dbus_message_unref(bluez->objects);
+        bluez->objects = dbus_message_ref(*reply);
+    } else if (bluez->objects && breaker_open(&bluez->breaker)) {
+        /* stale beats nothing while bluetoothd is stuck */
+        *reply = dbus_message_ref(bluez->objects);
+    }
 
     dbus_message_unref(message);
     return 0;
 }
 
-static int device_method(bluez_t *bluez, const char *path, const char *method, int timeout)
+static int device_method(bluez_t *bluez, const char *path, const char *method, long long deadline)
 {
     DBusMessage *message, *reply;
     DBusError err;
@@ -229,18 +791,37 @@ static int device_method(bluez_t *bluez, const char *path, const char *method, i
     if (!message) {
         return 1;
     }
-    reply = dbus_connection_send_with_reply_and_block(bluez->dbus_connection,
-            message, 1000*timeout, &err);
+    reply = bluez_call(bluez, message, deadline, &err);
+    dbus_message_unref(message);
     if (!reply) {
+        dbus_error_free(&err);
         return 1;
     }
 
-    dbus_connection_flush(bluez->dbus_connection);
-    dbus_message_unref(message);
-
+    dbus_message_unref(reply);
     return 0;
 }
 
+static int find_property(DBusMessageIter *props, const char *name, DBusMessageIter *variant_iter);
+
+/* Adapter1 a{sv}, all of it or what PropertiesChanged says changed */
+static void read_adapter_properties(bluez_t *bluez, DBusMessageIter *props)
+{
+    DBusMessageIter variant_iter;
+    dbus_bool_t value;
+
+    if (!find_property(props, "Powered", &variant_iter) &&
+        DBUS_TYPE_BOOLEAN == dbus_message_iter_get_arg_type(&variant_iter)) {
+        dbus_message_iter_get_basic(&variant_iter, &value);
+        bluez->powered = value;
+    }
+    if (!find_property(props, "Discovering", &variant_iter) &&
+        DBUS_TYPE_BOOLEAN == dbus_message_iter_get_arg_type(&variant_iter)) {
+        dbus_message_iter_get_basic(&variant_iter, &value);
+        bluez->discovering = value;
+    }
+}
+
 static int get_default_adapter(bluez_t *bluez, DBusMessage *reply)
 {
     /* "...an application would discover the available adapters by
@@ -305,6 +886,10 @@ static int get_default_adapter(bluez_t *bluez, DBusMessage *reply)
 
             if (!strcmp(interface_name, "org.bluez.Adapter1")) {
                 strncpy(bluez->adapter, obj_path, sizeof(bluez->adapter));
+                bluez->powered = bluez->discovering = -1;
+                if (dbus_message_iter_next(&dict_2_iter))
+                    read_adapter_properties(bluez, &dict_2_iter);
+                bluez->adapter_known = true;
                 return 0;
             }
         } while (dbus_message_iter_next(&array_2_iter));
@@ -322,6 +907,8 @@ static int read_scanned_devices(bluez_t *bluez, DBusMessage *reply)
     DBusMessageIter variant_iter;
     char *obj_path, *interface_name, *interface_property_name;
     char *found_device_address, *found_device_name, *found_device_icon;
+    dbus_int16_t rssi = 0;
+    bool heard;
 
     /* a{oa{sa{sv}}} */
     if (!dbus_message_iter_init(reply, &root_iter))
@@ -380,6 +967,7 @@ static int read_scanned_devices(bluez_t *bluez, DBusMessage *reply)
 
             bluetooth_device_t *dev = calloc(1, sizeof(bluetooth_device_t));
             strncpy(dev->path, obj_path, sizeof(dev->path));
+            heard = false;
 
             if (!dbus_message_iter_next(&dict_2_iter))
                 return 1;
@@ -448,8 +1036,14 @@ static int read_scanned_devices(bluez_t *bluez, DBusMessage *reply)
                 } else if (!strcmp(interface_property_name, "Trusted")) {
                     dbus_message_iter_get_basic(&variant_iter,
                             &dev->trusted);
+                } else if (!strcmp(interface_property_name, "RSSI")) {
+                    /* last value heard, only present while it's recent */
+                    dbus_message_iter_get_basic(&variant_iter, &rssi);
+                    heard = true;
                 }
             } while (dbus_message_iter_next(&array_3_iter));
+            if (heard)
+                rssi_record(bluez->rssi, dev->macaddr, rssi, bluetooth_now_ms());
             list_add_tail(&dev->list, &bluez->devices);
         } while (dbus_message_iter_next(&array_2_iter));
     } while (dbus_message_iter_next(&array_1_iter));
@@ -457,162 +1051,1779 @@ static int read_scanned_devices(bluez_t *bluez, DBusMessage *reply)
     return 0;
 }
 
-static void bluez_dbus_connect(bluez_t *bluez)
+/* /org/bluez/hci0/dev_AA_BB_CC_DD_EE_FF[/service000a] -> AA:BB:CC:DD:EE:FF */
+static int path_to_macaddr(const char *path, char *macaddr, size_t len)
 {
-    DBusError err;
-    dbus_error_init(&err);
-    bluez->dbus_connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
-}
+    const char *p = strstr(path, "/dev_");
+    size_t i;
 
-static void bluez_dbus_disconnect(bluez_t *bluez)
-{
-    if (!bluez->dbus_connection)
-        return;
-    
-    dbus_connection_close(bluez->dbus_connection);
-    dbus_connection_unref(bluez->dbus_connection);
-    bluez->dbus_connection = NULL;
+    if (p == NULL)
+        return 1;
+
+    p += strlen("/dev_");
+    for (i = 0; p[i] && p[i] != '/' && i < len - 1; i++)
+        macaddr[i] = (p[i] == '_') ? ':' : p[i];
+    macaddr[i] = '\0';
+    return 0;
 }
 
-static void bluez_scan(void *handle, int timeout)
+/* ManufacturerData a{qv} or ServiceData a{sv}, every v holding an ay */
+static void read_advert_data(bluetooth_advert_t *advert, DBusMessageIter *variant_iter, int key_type)
 {
-    DBusMessage *reply;
-    bluez_t *bluez = (bluez_t *)handle;
+    DBusMessageIter array_iter, dict_iter, value_iter, bytes_iter;
+    const unsigned char *data;
+    unsigned short company;
+    const char *uuid;
+    int len;
 
-    bluez_dbus_connect(bluez);
-    if (get_managed_objects(bluez, &reply))
-        return;
-    if (!reply)
+    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(variant_iter))
         return;
 
-    /* Get default adapter */
-    if (get_default_adapter(bluez, reply))
-        return;
-    dbus_message_unref(reply);
+    dbus_message_iter_recurse(variant_iter, &array_iter);
+    for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&array_iter);
+           dbus_message_iter_next(&array_iter)) {
+        dbus_message_iter_recurse(&array_iter, &dict_iter);
+        if (key_type != dbus_message_iter_get_arg_type(&dict_iter))
+            continue;
+        if (key_type == DBUS_TYPE_UINT16)
+            dbus_message_iter_get_basic(&dict_iter, &company);
+        else
+            dbus_message_iter_get_basic(&dict_iter, &uuid);
 
-    /* Power device on */
-    if (set_bool_property(bluez, bluez->adapter,
-            "org.bluez.Adapter1", "Powered", 1))
-        return;
+        if (!dbus_message_iter_next(&dict_iter) ||
+            DBUS_TYPE_VARIANT != dbus_message_iter_get_arg_type(&dict_iter))
+            continue;
+        dbus_message_iter_recurse(&dict_iter, &value_iter);
+        if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&value_iter) ||
+            DBUS_TYPE_BYTE != dbus_message_iter_get_element_type(&value_iter))
+            continue;
 
-    /* Start discovery */
-    if (adapter_discovery(bluez, "StartDiscovery"))
-        return;
+        /* points into the message, the pool keeps the only copy */
+        dbus_message_iter_recurse(&value_iter, &bytes_iter);
+        dbus_message_iter_get_fixed_array(&bytes_iter, &data, &len);
 
-    sleep(timeout);
+        if (key_type == DBUS_TYPE_UINT16)
+            advert_add_manufacturer(advert, company, data, len);
+        else
+            advert_add_service(advert, uuid, data, len);
+    }
+}
 
-    /* Stop discovery */
-    if (adapter_discovery(bluez, "StopDiscovery"))
-        return;
+/* Device1 a{sv} from PropertiesChanged or InterfacesAdded: RSSI and adverts */
+static void read_advert_properties(bluez_t *bluez, const char *path, DBusMessageIter *array_iter)
+{
+    DBusMessageIter dict_iter, variant_iter;
+    bluetooth_advert_t *advert = NULL;
+    dbus_int16_t rssi;
+    char macaddr[18];
+    char *name;
 
-    /* Get scanned devices */
-    if (get_managed_objects(bluez, &reply))
+    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(array_iter))
         return;
-    if (!reply)
+    if (path_to_macaddr(path, macaddr, sizeof(macaddr)))
         return;
 
-    read_scanned_devices(bluez, reply);
+    dbus_message_iter_recurse(array_iter, &dict_iter);
+    for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&dict_iter);
+           dbus_message_iter_next(&dict_iter)) {
+        DBusMessageIter entry_iter;
+
+        dbus_message_iter_recurse(&dict_iter, &entry_iter);
+        dbus_message_iter_get_basic(&entry_iter, &name);
+        if (!dbus_message_iter_next(&entry_iter))
+            continue;
+        if (!strcmp(name, "RSSI")) {
+            dbus_message_iter_recurse(&entry_iter, &variant_iter);
+            if (DBUS_TYPE_INT16 == dbus_message_iter_get_arg_type(&variant_iter)) {
+                dbus_message_iter_get_basic(&variant_iter, &rssi);
+                rssi_record(bluez->rssi, macaddr, rssi, bluetooth_now_ms());
+            }
+            continue;
+        }
+        if (bluez->advert_cb == NULL)
+            continue;
+        if (strcmp(name, "ManufacturerData") && strcmp(name, "ServiceData"))
+            continue;
+
+        if (advert == NULL) {
+            advert = advert_pool_get(bluez->adverts, macaddr);
+            if (advert == NULL)
+                return;
+        }
+        dbus_message_iter_recurse(&entry_iter, &variant_iter);
+        read_advert_data(advert, &variant_iter,
+                !strcmp(name, "ManufacturerData") ? DBUS_TYPE_UINT16 : DBUS_TYPE_STRING);
+    }
+
+    if (advert == NULL)
+        return;
+    bluez->advert_cb(advert, bluez->advert_userdata);
+    bluetooth_advert_unref(advert);
+}
+
+static void gatt_link(gatt_cache_t *cache);
+
+/* Objects added below a device are GATT attributes. bluetoothd exports the
+ * same tree again on every connect; one the cached tree doesn't have, or
+ * has with another UUID, comes from a Service Changed and makes it stale.
+ * Removals say nothing: every disconnect unexports the tree, and a cached
+ * path gone for good fails its call, see gatt_call() */
+static void gatt_objects_changed(bluez_t *bluez, DBusMessage *message)
+{
+    DBusMessageIter root_iter, array_iter, dict_iter, variant_iter;
+    gatt_cache_t *cache;
+    gatt_attr_t *attr;
+    char macaddr[32];
+    char *obj_path, *interface_name, *uuid;
+    bool known;
+
+    if (!dbus_message_iter_init(message, &root_iter) ||
+        DBUS_TYPE_OBJECT_PATH != dbus_message_iter_get_arg_type(&root_iter))
+        return;
+    dbus_message_iter_get_basic(&root_iter, &obj_path);
+    if (path_to_macaddr(obj_path, macaddr, sizeof(macaddr)))
+        return;
+    if (strchr(strstr(obj_path, "/dev_") + 1, '/') == NULL)
+        return;
+    if (!dbus_message_iter_next(&root_iter) ||
+        DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&root_iter))
+        return;
+
+    cache = gatt_cache_find(bluez, macaddr);
+    if (cache == NULL && (cache = gatt_cache_load(bluez, macaddr)) != NULL)
+        gatt_link(cache);
+    if (cache == NULL)
+        return;
+
+    dbus_message_iter_recurse(&root_iter, &array_iter);
+    for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&array_iter);
+           dbus_message_iter_next(&array_iter)) {
+        dbus_message_iter_recurse(&array_iter, &dict_iter);
+        dbus_message_iter_get_basic(&dict_iter, &interface_name);
+        if (strncmp(interface_name, "org.bluez.Gatt", strlen("org.bluez.Gatt")) ||
+            !dbus_message_iter_next(&dict_iter))
+            continue;
+        if (find_property(&dict_iter, "UUID", &variant_iter) ||
+            DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&variant_iter))
+            continue;
+        dbus_message_iter_get_basic(&variant_iter, &uuid);
+
+        known = false;
+        list_for_each_entry(attr, &cache->attrs, list) {
+            if (!strcmp(attr->path, obj_path)) {
+                known = !strcasecmp(attr->uuid, uuid);
+                break;
+            }
+        }
+        if (!known) {
+            gatt_cache_drop(bluez, macaddr);
+            return;
+        }
+    }
+}
+
+/* A Device1 property or the whole object changed: the waiter's devices there */
+static void wait_update(device_wait_t *wait, const char *path, DBusMessageIter *props)
+{
+    DBusMessageIter variant_iter;
+    dbus_bool_t value = FALSE;
+    uint64_t one = 1;
+    bool changed = false;
+    size_t i;
+
+    if (props) {
+        if (find_property(props, wait->property, &variant_iter) ||
+            DBUS_TYPE_BOOLEAN != dbus_message_iter_get_arg_type(&variant_iter))
+            return;
+        dbus_message_iter_get_basic(&variant_iter, &value);
+    }
+    for (i = 0; i < wait->n; i++) {
+        if (strcmp(wait->paths[i], path))
+            continue;
+        wait->signalled[i] = true;
+        if (wait->reached[i] == (!value == !wait->value))
+            continue;
+        wait->reached[i] = !wait->reached[i];
+        changed = true;
+    }
+    if (changed && write(wait->event_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+static DBusHandlerResult bluez_signal_filter(DBusConnection *connection, DBusMessage *message, void *data)
+{
+    bluez_t *bluez = (bluez_t *)data;
+    DBusMessageIter root_iter, array_iter, dict_iter;
+    char *interface_name, *obj_path;
+    device_wait_t *wait;
+    char **interfaces;
+    int i, ninterfaces;
+
+    (void)connection;
+
+    if (dbus_message_is_signal(message, "org.freedesktop.DBus.ObjectManager", "InterfacesAdded"))
+        gatt_objects_changed(bluez, message);
+
+    /* bluetoothd went away or the adapter did: find it again next scan */
+    if (dbus_message_is_signal(message, "org.freedesktop.DBus", "NameOwnerChanged") ||
+        (dbus_message_is_signal(message, "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved") &&
+         dbus_message_get_args(message, NULL, DBUS_TYPE_OBJECT_PATH, &obj_path, DBUS_TYPE_INVALID) &&
+         !strcmp(obj_path, bluez->adapter)))
+        bluez->adapter_known = false;
+
+    /* a device object gone is neither connected nor paired */
+    if (!list_empty(&bluez->waits) &&
+        dbus_message_is_signal(message, "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved") &&
+        dbus_message_get_args(message, NULL, DBUS_TYPE_OBJECT_PATH, &obj_path,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &interfaces, &ninterfaces,
+                              DBUS_TYPE_INVALID)) {
+        for (i = 0; i < ninterfaces; i++) {
+            if (strcmp(interfaces[i], "org.bluez.Device1"))
+                continue;
+            list_for_each_entry(wait, &bluez->waits, list)
+                wait_update(wait, obj_path, NULL);
+        }
+        dbus_free_string_array(interfaces);
+    }
+
+    if (dbus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged")) {
+        /* sa{sv}as */
+        if (!dbus_message_iter_init(message, &root_iter) ||
+            DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&root_iter))
+            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+        dbus_message_iter_get_basic(&root_iter, &interface_name);
+        if (!dbus_message_iter_next(&root_iter))
+            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+        if (!strcmp(interface_name, "org.bluez.Device1")) {
+            list_for_each_entry(wait, &bluez->waits, list)
+                wait_update(wait, dbus_message_get_path(message), &root_iter);
+        }
+        if (!strcmp(interface_name, "org.bluez.Device1"))
+            read_advert_properties(bluez, dbus_message_get_path(message), &root_iter);
+        else if (!strcmp(interface_name, "org.bluez.Adapter1") &&
+                 !strcmp(dbus_message_get_path(message), bluez->adapter))
+            read_adapter_properties(bluez, &root_iter);
+    } else if (dbus_message_is_signal(message, "org.freedesktop.DBus.ObjectManager", "InterfacesAdded")) {
+        /* oa{sa{sv}} */
+        if (!dbus_message_iter_init(message, &root_iter) ||
+            DBUS_TYPE_OBJECT_PATH != dbus_message_iter_get_arg_type(&root_iter))
+            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+        dbus_message_iter_get_basic(&root_iter, &obj_path);
+        if (!dbus_message_iter_next(&root_iter) ||
+            DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&root_iter))
+            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+        dbus_message_iter_recurse(&root_iter, &array_iter);
+        for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&array_iter);
+               dbus_message_iter_next(&array_iter)) {
+            dbus_message_iter_recurse(&array_iter, &dict_iter);
+            dbus_message_iter_get_basic(&dict_iter, &interface_name);
+            if (strcmp(interface_name, "org.bluez.Device1") || !dbus_message_iter_next(&dict_iter))
+                continue;
+            read_advert_properties(bluez, obj_path, &dict_iter);
+        }
+    }
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Everything not a reply to a pending call gets here first */
+static DBusHandlerResult bluez_trace_filter(DBusConnection *connection, DBusMessage *message, void *data)
+{
+    (void)connection;
+    bluez_trace((bluez_t *)data, TRACE_RECV, message);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* org.bluez.Agent1 calls, answered inline: they arrive while bluez_call()
+ * waits for the Pair they are about */
+static DBusHandlerResult agent_message(DBusConnection *connection, DBusMessage *message, void *data)
+{
+    bluez_t *bluez = (bluez_t *)data;
+    bluetooth_agent_request_t request = { .type = -1 };
+    const char *member = dbus_message_get_member(message), *pin = request.pin;
+    char macaddr[32] = "", *path;
+    dbus_uint32_t passkey;
+    DBusMessage *reply;
+    bool ok = true;
+
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+        !dbus_message_has_interface(message, "org.bluez.Agent1") || !bluez->agent)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    /* the device is the first argument, where there is one */
+    if (dbus_message_get_args(message, NULL, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID))
+        path_to_macaddr(path, macaddr, sizeof(macaddr));
+    request.macaddr = macaddr;
+
+    if (!strcmp(member, "RequestPinCode")) {
+        request.type = BLUETOOTH_AGENT_REQUEST_PIN;
+    } else if (!strcmp(member, "RequestPasskey")) {
+        request.type = BLUETOOTH_AGENT_REQUEST_PASSKEY;
+    } else if (!strcmp(member, "RequestConfirmation")) {
+        request.type = BLUETOOTH_AGENT_REQUEST_CONFIRM;
+        if (dbus_message_get_args(message, NULL, DBUS_TYPE_OBJECT_PATH, &path,
+                                  DBUS_TYPE_UINT32, &passkey, DBUS_TYPE_INVALID))
+            request.passkey = passkey;
+    } else if (!strcmp(member, "RequestAuthorization") || !strcmp(member, "AuthorizeService")) {
+        request.type = BLUETOOTH_AGENT_REQUEST_AUTHORIZE;
+    } else if (strcmp(member, "DisplayPinCode") && strcmp(member, "DisplayPasskey") &&
+               strcmp(member, "Release") && strcmp(member, "Cancel")) {
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    /* displays, Release and Cancel just get acknowledged */
+    if (request.type >= 0)
+        ok = agent_answer(bluez->agent, &request);
+
+    reply = ok ? dbus_message_new_method_return(message) :
+                 dbus_message_new_error(message, "org.bluez.Error.Rejected", "Rejected");
+    if (reply == NULL)
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    if (ok && request.type == BLUETOOTH_AGENT_REQUEST_PIN)
+        dbus_message_append_args(reply, DBUS_TYPE_STRING, &pin, DBUS_TYPE_INVALID);
+    else if (ok && request.type == BLUETOOTH_AGENT_REQUEST_PASSKEY)
+        dbus_message_append_args(reply, DBUS_TYPE_UINT32, &request.passkey, DBUS_TYPE_INVALID);
+
+    bluez_trace(bluez, TRACE_SEND, reply);
+    dbus_connection_send(connection, reply, NULL);
+    /* bluez_wait() polls for input only */
+    dbus_connection_flush(connection);
+    dbus_message_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable agent_vtable = { .message_function = agent_message };
+
+/* org.bluez.Profile1 calls. NewConnection hands over a socket, kept until
+ * bluez_connect_profile() or bluez_accept_profile() takes it */
+static DBusHandlerResult profile_message(DBusConnection *connection, DBusMessage *message, void *data)
+{
+    bluez_t *bluez = (bluez_t *)data;
+    const char *member = dbus_message_get_member(message), *path = dbus_message_get_path(message);
+    profile_link_t *link;
+    DBusMessage *reply;
+    unsigned int index;
+    char *device;
+    int fd = -1;
+
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+        !dbus_message_has_interface(message, "org.bluez.Profile1"))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (!strcmp(member, "NewConnection")) {
+        /* oa{sv}: the device, its socket and properties we don't need */
+        if (sscanf(path, PROFILE_PATH "/%u", &index) != 1 || index >= (unsigned int)bluez->nprofiles ||
+            !dbus_message_get_args(message, NULL, DBUS_TYPE_OBJECT_PATH, &device,
+                                   DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_INVALID) ||
+            bluez->nbacklog == PROFILE_BACKLOG) {
+            if (fd >= 0)
+                close(fd);
+            reply = dbus_message_new_error(message, "org.bluez.Error.Rejected", "Rejected");
+        } else {
+            link = &bluez->backlog[bluez->nbacklog++];
+            link->fd = fd;
+            link->macaddr[0] = '\0';
+            path_to_macaddr(device, link->macaddr, sizeof(link->macaddr));
+            memcpy(link->uuid, bluez->profiles[index].uuid, sizeof(link->uuid));
+            reply = dbus_message_new_method_return(message);
+        }
+    } else if (!strcmp(member, "RequestDisconnection") || !strcmp(member, "Release")) {
+        /* the socket is the application's, closing it is up to them */
+        reply = dbus_message_new_method_return(message);
+    } else {
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    if (reply == NULL)
+        return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+    bluez_trace(bluez, TRACE_SEND, reply);
+    dbus_connection_send(connection, reply, NULL);
+    dbus_connection_flush(connection);
+    dbus_message_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable profile_vtable = { .message_function = profile_message };
+
+/* Process incoming signals until deadline or cancel */
+static void bluez_pump(bluez_t *bluez, long long deadline)
+{
+    while (!bluez_wait(bluez, deadline))
+        ;
+}
+
+/* RSSI updates, adverts and waited for states, see device_signals_hold() */
+#define DEVICE_SIGNALS_MATCH \
+    "type='signal',sender='org.bluez'," \
+    "interface='org.freedesktop.DBus.Properties'," \
+    "member='PropertiesChanged',arg0='org.bluez.Device1'"
+
+static void bluez_dbus_connect(bluez_t *bluez)
+{
+    DBusError err;
+
+    if (bluez->dbus_connection && dbus_connection_get_is_connected(bluez->dbus_connection))
+        return;
+    bluez_dbus_close(bluez);
+
+    dbus_error_init(&err);
+    if (bluez->replay) {
+        bluez->dbus_connection = dbus_connection_open_private(bluez_replay_address(bluez->replay), &err);
+        if (bluez->dbus_connection && !dbus_bus_register(bluez->dbus_connection, &err)) {
+            dbus_connection_close(bluez->dbus_connection);
+            dbus_connection_unref(bluez->dbus_connection);
+            bluez->dbus_connection = NULL;
+        }
+    } else {
+        bluez->dbus_connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+    }
+    if (!bluez->dbus_connection) {
+        dbus_error_free(&err);
+        return;
+    }
+
+    if (bluez->record)
+        dbus_connection_add_filter(bluez->dbus_connection, bluez_trace_filter, bluez, NULL);
+    dbus_connection_add_filter(bluez->dbus_connection, bluez_signal_filter, bluez, NULL);
+    /* answers only while bluez->agent is set */
+    dbus_connection_register_object_path(bluez->dbus_connection, AGENT_PATH, &agent_vtable, bluez);
+    dbus_connection_register_fallback(bluez->dbus_connection, PROFILE_PATH, &profile_vtable, bluez);
+
+    /* NULL error: don't wait for the bus to confirm the rules */
+    dbus_bus_add_match(bluez->dbus_connection,
+        "type='signal',sender='org.bluez',"
+        "interface='org.freedesktop.DBus.ObjectManager',"
+        "member='InterfacesAdded'", NULL);
+    dbus_bus_add_match(bluez->dbus_connection,
+        "type='signal',sender='org.bluez',"
+        "interface='org.freedesktop.DBus.ObjectManager',"
+        "member='InterfacesRemoved'", NULL);
+    if (bluez->device_signals)
+        dbus_bus_add_match(bluez->dbus_connection, DEVICE_SIGNALS_MATCH, NULL);
+    /* the adapter session */
+    dbus_bus_add_match(bluez->dbus_connection,
+        "type='signal',sender='org.bluez',"
+        "interface='org.freedesktop.DBus.Properties',"
+        "member='PropertiesChanged',arg0='org.bluez.Adapter1'", NULL);
+    dbus_bus_add_match(bluez->dbus_connection,
+        "type='signal',sender='org.freedesktop.DBus',"
+        "interface='org.freedesktop.DBus',"
+        "member='NameOwnerChanged',arg0='org.bluez'", NULL);
+}
+
+/* Device1 PropertiesChanged on for a scan or wait, off after the last one */
+static void device_signals_hold(bluez_t *bluez)
+{
+    if (bluez->device_signals++ == 0 && bluez->dbus_connection)
+        dbus_bus_add_match(bluez->dbus_connection, DEVICE_SIGNALS_MATCH, NULL);
+}
+
+static void device_signals_drop(bluez_t *bluez)
+{
+    if (--bluez->device_signals == 0 && bluez->dbus_connection)
+        dbus_bus_remove_match(bluez->dbus_connection, DEVICE_SIGNALS_MATCH, NULL);
+}
+
+/* Dispatch signals queued since the last call */
+static void bluez_drain(bluez_t *bluez)
+{
+    do {
+        dbus_connection_read_write(bluez->dbus_connection, 0);
+    } while (dbus_connection_dispatch(bluez->dbus_connection) == DBUS_DISPATCH_DATA_REMAINS);
+}
+
+/* End of a call. The connection stays for the next one unless the bus dropped it */
+static void bluez_dbus_release(bluez_t *bluez)
+{
+    if (bluez->dbus_connection && !dbus_connection_get_is_connected(bluez->dbus_connection))
+        bluez_dbus_close(bluez);
+}
+
+/* AcquireWrite/AcquireNotify sessions end with the connection that made them */
+static void bluez_dbus_close(bluez_t *bluez)
+{
+    int i;
+
+    bluez->adapter_known = false;
+    bluez->agent_registered = false;
+    for (i = 0; i < bluez->nprofiles; i++)
+        bluez->profiles[i].registered = false;
+    if (!bluez->dbus_connection)
+        return;
+
+    dbus_connection_close(bluez->dbus_connection);
+    dbus_connection_unref(bluez->dbus_connection);
+    bluez->dbus_connection = NULL;
+}
+
+/* Get default adapter, once per session. Return 1 if there is none */
+static int bluez_find_adapter(bluez_t *bluez)
+{
+    DBusMessage *reply;
+    int ret;
+
+    if (bluez->adapter_known)
+        return 0;
+    bluez_dbus_connect(bluez);
+    if (!bluez->dbus_connection || get_managed_objects(bluez, &reply) || !reply)
+        return 1;
+    ret = get_default_adapter(bluez, reply);
+    dbus_message_unref(reply);
+    return ret;
+}
+
+static void bluez_scan(void *handle, long long deadline)
+{
+    DBusMessage *reply;
+    bluez_t *bluez = (bluez_t *)handle;
+    int attempt;
+
+    bluez_dbus_connect(bluez);
+    if (!bluez->dbus_connection)
+        return;
+    bluez_drain(bluez);
+    if (bluez_find_adapter(bluez))
+        return;
+
+    /* Power device on unless it is, start discovery. A stale cache costs one retry */
+    device_signals_hold(bluez);
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (bluez->powered != 1) {
+            if (set_bool_property(bluez, bluez->adapter,
+                    "org.bluez.Adapter1", "Powered", 1)) {
+                device_signals_drop(bluez);
+                return;
+            }
+            bluez->powered = 1;
+        }
+        /* other errors: someone else's discovery may still find devices */
+        if (!adapter_start_discovery(bluez) || bluez->powered != 0)
+            break;
+    }
+
+    bluez_pump(bluez, deadline);
+    device_signals_drop(bluez);
+
+    /* Stop discovery, even when cancelled */
+    if (bluez->discovering != 0 && adapter_discovery(bluez, "StopDiscovery"))
+        return;
+
+    /* Get scanned devices */
+    if (get_managed_objects(bluez, &reply))
+        return;
+    if (!reply)
+        return;
+
+    read_scanned_devices(bluez, reply);
+    dbus_message_unref(reply);
+
+    bluez_dbus_release(bluez);
+}
+
+static int bluez_get_devices(void *handle, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluetooth_device_t *dev;
+    int num = 0;
+
+	list_for_each_entry(dev, &bluez->devices, list) {
+        strncpy(devs[num], dev->name, sizeof(devs[num]));
+        num++;
+        if (num == devnum)
+            break;
+	}
+    return num;
+}
+
+static int bluez_get_device_info(void *handle, bluetooth_device_info_t *devs, int devnum)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluetooth_device_t *dev;
+    int num = 0;
+
+    if (devnum <= 0)
+        return 0;
+
+    list_for_each_entry(dev, &bluez->devices, list) {
+        strncpy(devs[num].name, dev->name, sizeof(devs[num].name));
+        devs[num].name[sizeof(devs[num].name)-1] = '\0';
+        strncpy(devs[num].macaddr, dev->macaddr, sizeof(devs[num].macaddr));
+        devs[num].macaddr[sizeof(devs[num].macaddr)-1] = '\0';
+        devs[num].flags = (dev->connected ? BLUETOOTH_DEVICE_CONNECTED : 0) |
+                          (dev->paired ? BLUETOOTH_DEVICE_PAIRED : 0) |
+                          (dev->trusted ? BLUETOOTH_DEVICE_TRUSTED : 0);
+        strncpy(devs[num].icon, dev->icon, sizeof(devs[num].icon));
+        devs[num].icon[sizeof(devs[num].icon)-1] = '\0';
+        if (++num == devnum)
+            break;
+    }
+    return num;
+}
+
+/* AA:BB:CC:DD:EE:FF -> <adapter>/dev_AA_BB_CC_DD_EE_FF, what bluetoothd names it.
+ * A handle that never scanned finds the adapter first */
+static int macaddr_to_path(bluez_t *bluez, const char *macaddr, char *path, size_t len)
+{
+    char *p;
+
+    if (!bluez->adapter[0] && bluez_find_adapter(bluez))
+        return 1;
+    if (snprintf(path, len, "%s/dev_%s", bluez->adapter, macaddr) >= (int)len)
+        return 1;
+    for (p = path + strlen(bluez->adapter); *p; p++) {
+        if (*p == ':')
+            *p = '_';
+    }
+    return 0;
+}
+
+static bluetooth_device_t *find_device_path(bluez_t *bluez, const char *path)
+{
+    bluetooth_device_t *dev;
+
+    list_for_each_entry(dev, &bluez->devices, list) {
+        if (!strcmp(dev->path, path))
+            return dev;
+    }
+    return NULL;
+}
+
+/* Connected property of the device at path. dev, if given, keeps the answer */
+static bool path_is_connected(bluez_t *bluez, const char *path, bluetooth_device_t *dev)
+{
+    int value = false;
+
+    if (!get_bool_property(bluez, path, "org.bluez.Device1", "Connected", &value)) {
+        if (dev)
+            dev->connected = value;
+        return value;
+    }
+    if (!breaker_open(&bluez->breaker))
+        return false;
+
+    /* last known */
+    if (dev == NULL)
+        dev = find_device_path(bluez, path);
+    return dev ? dev->connected : false;
+}
+
+/* AgentManager1 call about our agent, capability NULL: UnregisterAgent */
+static int agent_manager_call(bluez_t *bluez, const char *capability, long long deadline)
+{
+    const char *path = AGENT_PATH;
+    DBusMessage *message, *reply;
+    DBusError err;
+    int ret = 1;
+
+    message = dbus_message_new_method_call("org.bluez", "/org/bluez", "org.bluez.AgentManager1",
+                                           capability ? "RegisterAgent" : "UnregisterAgent");
+    if (!message)
+        return 1;
+    if (!dbus_message_append_args(message, DBUS_TYPE_OBJECT_PATH, &path,
+                                  capability ? DBUS_TYPE_STRING : DBUS_TYPE_INVALID, &capability,
+                                  DBUS_TYPE_INVALID)) {
+        dbus_message_unref(message);
+        return 1;
+    }
+
+    dbus_error_init(&err);
+    reply = bluez_call(bluez, message, deadline, &err);
+    dbus_message_unref(message);
+    if (reply) {
+        dbus_message_unref(reply);
+        ret = 0;
+    } else if (dbus_error_has_name(&err, "org.bluez.Error.AlreadyExists")) {
+        ret = 0;
+    }
+    dbus_error_free(&err);
+    return ret;
+}
+
+/* Register the agent, if any, with bluetoothd before the first pairing on this connection */
+static int agent_register(bluez_t *bluez, long long deadline)
+{
+    static const char *const capabilities[] = {
+        [BLUETOOTH_AGENT_NO_IO] = "NoInputNoOutput",
+        [BLUETOOTH_AGENT_FIXED_PIN] = "KeyboardOnly",
+        [BLUETOOTH_AGENT_CALLBACK] = "KeyboardDisplay",
+    };
+
+    if (!bluez->agent || bluez->agent_registered)
+        return 0;
+    if (agent_manager_call(bluez, capabilities[bluez->agent->capability], deadline))
+        return 1;
+    bluez->agent_registered = true;
+    return 0;
+}
+
+static int path_connect(bluez_t *bluez, const char *path, long long deadline)
+{
+    /* Nobody to ask: bluetoothd would wait for an agent until the deadline */
+    if (agent_register(bluez, deadline))
+        return 1;
+
+    /* Trust the device */
+    if (set_bool_property(bluez, path, "org.bluez.Device1", "Trusted", 1))
+        return 1;
+
+    /* Pair the device */
+    if (device_method(bluez, path, "Pair", deadline))
+        return 1;
+
+    /* Connect the device */
+    return device_method(bluez, path, "Connect", deadline);
+}
+
+static bool bluez_set_agent(void *handle, const bluetooth_agent_t *agent)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+
+    /* bluetoothd keeps the capability registered: register anew at the next pairing */
+    if (bluez->agent_registered && bluez->dbus_connection)
+        agent_manager_call(bluez, NULL, bluetooth_now_ms() + PROPERTY_TIMEOUT_MS);
+    bluez->agent_registered = false;
+    bluez->agent = agent;
+    return true;
+}
+
+static void append_option(DBusMessageIter *dict, const char *key, int type, const void *value)
+{
+    DBusMessageIter entry, variant;
+    char sig[2] = { (char)type, '\0' };
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, sig, &variant);
+    dbus_message_iter_append_basic(&variant, type, value);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+/* ProfileManager1.RegisterProfile of bluez->profiles[index] */
+static int profile_register(bluez_t *bluez, int index, long long deadline)
+{
+    static const char *const roles[] = { NULL, "client", "server" };
+    bluez_profile_t *profile = &bluez->profiles[index];
+    const char *uuid = profile->uuid, *name = profile->name, *p;
+    DBusMessageIter iter, dict;
+    DBusMessage *message, *reply;
+    DBusError err;
+    char path[64];
+    int ret = 1;
+
+    snprintf(path, sizeof(path), PROFILE_PATH "/%d", index);
+    p = path;
+    message = dbus_message_new_method_call("org.bluez", "/org/bluez", "org.bluez.ProfileManager1",
+                                           "RegisterProfile");
+    if (!message)
+        return 1;
+    dbus_message_iter_init_append(message, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &p);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &uuid);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    if (name[0])
+        append_option(&dict, "Name", DBUS_TYPE_STRING, &name);
+    if (roles[profile->role])
+        append_option(&dict, "Role", DBUS_TYPE_STRING, &roles[profile->role]);
+    if (profile->channel)
+        append_option(&dict, "Channel", DBUS_TYPE_UINT16, &profile->channel);
+    if (profile->psm)
+        append_option(&dict, "PSM", DBUS_TYPE_UINT16, &profile->psm);
+    dbus_message_iter_close_container(&iter, &dict);
+
+    dbus_error_init(&err);
+    reply = bluez_call(bluez, message, deadline, &err);
+    dbus_message_unref(message);
+    if (reply) {
+        dbus_message_unref(reply);
+        ret = 0;
+    } else if (dbus_error_has_name(&err, "org.bluez.Error.AlreadyExists")) {
+        ret = 0;
+    }
+    dbus_error_free(&err);
+    profile->registered = !ret;
+    return ret;
+}
+
+/* bluetoothd forgets profiles with the connection that registered them */
+static int profiles_register(bluez_t *bluez, long long deadline)
+{
+    int i;
+
+    for (i = 0; i < bluez->nprofiles; i++) {
+        if (!bluez->profiles[i].registered && profile_register(bluez, i, deadline))
+            return 1;
+    }
+    return 0;
+}
+
+/* The oldest socket of the backlog from macaddr on uuid, NULL: any. -1 if none */
+static int profile_take(bluez_t *bluez, const char *macaddr, const char *uuid, char *macaddr_out,
+                        char *uuid_out)
+{
+    profile_link_t *link;
+    int i, fd;
+
+    for (i = 0; i < bluez->nbacklog; i++) {
+        link = &bluez->backlog[i];
+        if ((macaddr && strcasecmp(link->macaddr, macaddr)) || (uuid && strcasecmp(link->uuid, uuid)))
+            continue;
+        fd = link->fd;
+        if (macaddr_out)
+            memcpy(macaddr_out, link->macaddr, BLUETOOTH_MACADDR_MAXLEN);
+        if (uuid_out)
+            memcpy(uuid_out, link->uuid, BLUETOOTH_UUID_MAXLEN);
+        memmove(link, link + 1, (bluez->nbacklog - i - 1) * sizeof(*link));
+        bluez->nbacklog--;
+        return fd;
+    }
+    return -1;
+}
+
+static bool bluez_register_profile(void *handle, const bluetooth_profile_t *profile)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluez_profile_t *p;
+    int i, ret;
+
+    if (bluez->nprofiles == MAX_PROFILES)
+        return false;
+    for (i = 0; i < bluez->nprofiles; i++) {
+        if (!strcasecmp(bluez->profiles[i].uuid, profile->uuid))
+            return false;
+    }
+    p = &bluez->profiles[bluez->nprofiles];
+    memset(p, 0, sizeof(*p));
+    snprintf(p->uuid, sizeof(p->uuid), "%s", profile->uuid);
+    snprintf(p->name, sizeof(p->name), "%s", profile->name ? profile->name : "");
+    p->role = profile->role;
+    p->channel = profile->channel;
+    p->psm = profile->psm;
+
+    bluez_dbus_connect(bluez);
+    /* counted first: its NewConnection may come in while registering */
+    bluez->nprofiles++;
+    ret = profile_register(bluez, bluez->nprofiles - 1, bluetooth_now_ms() + PROPERTY_TIMEOUT_MS);
+    if (ret)
+        bluez->nprofiles--;
+    bluez_dbus_release(bluez);
+    return !ret;
+}
+
+static int bluez_connect_profile(void *handle, const char *macaddr, const char *uuid, long long deadline)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    DBusMessage *message, *reply;
+    DBusError err;
+    char path[128];
+    int fd = -1;
+
+    if (macaddr_to_path(bluez, macaddr, path, sizeof(path)))
+        return -1;
+    bluez_dbus_connect(bluez);
+    /* ConnectProfile may pair first */
+    if (profiles_register(bluez, deadline) || agent_register(bluez, deadline)) {
+        bluez_dbus_release(bluez);
+        return -1;
+    }
+
+    message = dbus_message_new_method_call("org.bluez", path, "org.bluez.Device1", "ConnectProfile");
+    if (message && !dbus_message_append_args(message, DBUS_TYPE_STRING, &uuid, DBUS_TYPE_INVALID)) {
+        dbus_message_unref(message);
+        message = NULL;
+    }
+    if (message) {
+        dbus_error_init(&err);
+        reply = bluez_call(bluez, message, deadline, &err);
+        dbus_message_unref(message);
+        if (reply) {
+            dbus_message_unref(reply);
+            /* NewConnection came ahead of the reply, or is right behind it */
+            while ((fd = profile_take(bluez, macaddr, uuid, NULL, NULL)) < 0 && !bluez_wait(bluez, deadline))
+                ;
+        }
+        dbus_error_free(&err);
+    }
+    bluez_dbus_release(bluez);
+    return fd;
+}
+
+static int bluez_accept_profile(void *handle, char *macaddr, char *uuid, long long deadline)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    int fd;
+
+    bluez_dbus_connect(bluez);
+    if (!bluez->dbus_connection || profiles_register(bluez, deadline)) {
+        bluez_dbus_release(bluez);
+        return -1;
+    }
+    while ((fd = profile_take(bluez, NULL, NULL, macaddr, uuid)) < 0 && !bluez_wait(bluez, deadline))
+        ;
+    bluez_dbus_release(bluez);
+    return fd;
+}
+
+static bool bluez_device_is_connected(void *handle, const char *device)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluetooth_device_t *dev;
+    int value = false;
+
+    bluez_dbus_connect(bluez);
+
+    list_for_each_entry(dev, &bluez->devices, list) {
+        if(!strncmp(dev->name, device, strlen(device)))
+            value = path_is_connected(bluez, dev->path, dev);
+    }
+    bluez_dbus_release(bluez);
+    return value;
+}
+
+static bool bluez_connect_device(void *handle,const char *device, long long deadline)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluetooth_device_t *dev;
+
+    if(bluez_device_is_connected(bluez, device))
+        return true;
+
+    bluez_dbus_connect(bluez);
+
+	list_for_each_entry(dev, &bluez->devices, list) {
+        if(!strncmp(dev->name, device, strlen(device))) {
+            if (path_connect(bluez, dev->path, deadline)) {
+                bluez_dbus_release(bluez);
+                return false;
+            }
+            dev->connected = 1;
+        }
+    }
+
+    bluez_dbus_release(bluez);
+    return true;
+}
+
+static bool bluez_disconnect_device(void *handle, const char *device, long long deadline)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluetooth_device_t *dev;
+
+    if (!bluez_device_is_connected(handle, device))
+        return true;
+
+    bluez_dbus_connect(bluez);
+
+    list_for_each_entry(dev, &bluez->devices, list) {
+        if(!strncmp(dev->name, device, strlen(device))) {
+            /* Disconnect the device */
+            if (device_method(bluez, dev->path, "Disconnect", deadline)) {
+                bluez_dbus_release(bluez);
+                return false;
+            }
+            dev->connected = 0;
+        }
+    }
+
+    bluez_dbus_release(bluez);
+    return true;
+}
+
+/* By MAC address: the object path follows from it, no device list walk */
+static bool bluez_device_is_connected_addr(void *handle, const char *macaddr)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    char path[128];
+    bool value;
+
+    if (macaddr_to_path(bluez, macaddr, path, sizeof(path)))
+        return false;
+
+    bluez_dbus_connect(bluez);
+    value = path_is_connected(bluez, path, NULL);
+    bluez_dbus_release(bluez);
+    return value;
+}
+
+static bool bluez_connect_device_addr(void *handle, const char *macaddr, long long deadline)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluetooth_device_t *dev;
+    char path[128];
+    int ret;
+
+    if (bluez_device_is_connected_addr(handle, macaddr))
+        return true;
+    if (macaddr_to_path(bluez, macaddr, path, sizeof(path)))
+        return false;
+
+    bluez_dbus_connect(bluez);
+    ret = path_connect(bluez, path, deadline);
+    /* slow anyway, keep the last known state right */
+    if (!ret && (dev = find_device_path(bluez, path)))
+        dev->connected = 1;
+    bluez_dbus_release(bluez);
+    return !ret;
+}
+
+static bool bluez_disconnect_device_addr(void *handle, const char *macaddr, long long deadline)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    bluetooth_device_t *dev;
+    char path[128];
+    int ret;
+
+    if (!bluez_device_is_connected_addr(handle, macaddr))
+        return true;
+    if (macaddr_to_path(bluez, macaddr, path, sizeof(path)))
+        return false;
+
+    bluez_dbus_connect(bluez);
+    ret = device_method(bluez, path, "Disconnect", deadline);
+    if (!ret && (dev = find_device_path(bluez, path)))
+        dev->connected = 0;
+    bluez_dbus_release(bluez);
+    return !ret;
+}
+
+/* The Device1 boolean of each bluetooth_device_state, and its value there */
+static const struct {
+    const char *property;
+    dbus_bool_t value;
+} device_states[] = {
+    [BLUETOOTH_STATE_CONNECTED]         = { "Connected", TRUE },
+    [BLUETOOTH_STATE_DISCONNECTED]      = { "Connected", FALSE },
+    [BLUETOOTH_STATE_SERVICES_RESOLVED] = { "ServicesResolved", TRUE },
+    [BLUETOOTH_STATE_PAIRED]            = { "Paired", TRUE },
+};
+
+/* Sleep with our hold of lock released until the bus has traffic, a waiter's
+ * devices changed or the caller cancelled, then dispatch under it. Whoever
+ * holds the lock meanwhile dispatches what it reads, the filter wakes us
+ * through event_fd. Return 1 once the deadline passed, on cancel, on close or
+ * if the connection went away */
+static int wait_unlocked(bluez_t *bluez, device_wait_t *wait, pthread_mutex_t *lock, long long deadline)
+{
+    DBusConnection *conn = bluez->dbus_connection;
+    struct pollfd pfd[4];
+    long long remaining;
+    uint64_t count;
+    int fd, npfd;
+
+    if (bluetooth_cancelled(bluez->cancel_fd))
+        return 1;
+    if (dbus_connection_get_dispatch_status(conn) == DBUS_DISPATCH_DATA_REMAINS)
+        return bluez_wait(bluez, deadline);
+    remaining = deadline - bluetooth_now_ms();
+    if (remaining <= 0 || !dbus_connection_get_is_connected(conn) || !dbus_connection_get_unix_fd(conn, &fd))
+        return 1;
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wait->event_fd;
+    pfd[1].events = POLLIN;
+    npfd = 2 + bluetooth_cancel_pollfds(bluez->cancel_fd, &pfd[2]);
+    pthread_mutex_unlock(lock);
+    poll(pfd, npfd, bluetooth_timeout_ms(remaining));
+    pthread_mutex_lock(lock);
+
+    if (read(wait->event_fd, &count, sizeof(count)) < 0)
+        count = 0;
+    if (bluez->closing || bluez->dbus_connection != conn || bluetooth_cancelled(bluez->cancel_fd))
+        return 1;
+    /* another call may have read it meanwhile, don't block on it */
+    dbus_connection_read_write(conn, 0);
+    while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    return 0;
+}
+
+/* Read where each device is, then dispatch signals until enough got there.
+ * The waiter is in place before the reads: a change racing one shows in its
+ * answer or in a signal after it. A device that can't be read stays out */
+static int bluez_wait_devices(void *handle, const char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN], size_t n,
+                              int state, size_t want, bool *reached, long long deadline,
+                              pthread_mutex_t *lock)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    device_wait_t wait;
+    size_t i, count;
+    int value, ret = -1;
+
+    if (state < 0 || state >= (int)(sizeof(device_states) / sizeof(device_states[0])))
+        return -1;
+    wait.paths = calloc(n ? n : 1, sizeof(*wait.paths));
+    wait.signalled = calloc(n ? n : 1, sizeof(*wait.signalled));
+    wait.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wait.paths == NULL || wait.signalled == NULL || wait.event_fd < 0)
+        goto out;
+    wait.n = n;
+    wait.property = device_states[state].property;
+    wait.value = device_states[state].value;
+    wait.reached = reached;
+
+    pthread_mutex_lock(lock);
+    bluez_dbus_connect(bluez);
+    if (!bluez->dbus_connection)
+        goto unlock;
+    list_add_tail(&wait.list, &bluez->waits);
+    /* the bus takes the rule before the Gets below */
+    device_signals_hold(bluez);
+    for (i = 0; i < n; i++) {
+        reached[i] = false;
+        if (!macaddrs[i][0] || macaddr_to_path(bluez, macaddrs[i], wait.paths[i], sizeof(wait.paths[i])))
+            continue;
+        if (!get_bool_property(bluez, wait.paths[i], "org.bluez.Device1", wait.property, &value) &&
+            !wait.signalled[i])
+            reached[i] = !value == !wait.value;
+    }
+
+    for (;;) {
+        for (i = 0, count = 0; i < n; i++)
+            count += reached[i];
+        if (count >= want || !bluez->dbus_connection || bluez->closing ||
+            wait_unlocked(bluez, &wait, lock, deadline))
+            break;
+    }
+    device_signals_drop(bluez);
+    list_del(&wait.list);
+    bluez_dbus_release(bluez);
+    ret = count;
+unlock:
+    pthread_mutex_unlock(lock);
+out:
+    if (wait.event_fd >= 0)
+        close(wait.event_fd);
+    free(wait.signalled);
+    free(wait.paths);
+    return ret;
+}
+
+/* Every waiter sleeping without the lock wakes up to leave */
+static void bluez_wake_waits(void *handle)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    device_wait_t *wait;
+    uint64_t one = 1;
+
+    bluez->closing = true;
+    list_for_each_entry(wait, &bluez->waits, list) {
+        if (write(wait->event_fd, &one, sizeof(one)) < 0)
+            continue;
+    }
+}
+
+static bluetooth_device_t *find_device(bluez_t *bluez, const char *device)
+{
+    bluetooth_device_t *dev;
+
+    list_for_each_entry(dev, &bluez->devices, list) {
+        if(!strncmp(dev->name, device, strlen(device)))
+            return dev;
+    }
+    return NULL;
+}
+
+typedef void (*object_cb_t)(void *data, const char *path, const char *interface,
+                            DBusMessageIter *props);
+
+/* Walk a GetManagedObjects reply, calling cb for every interface of every object */
+static int foreach_managed_object(DBusMessage *reply, object_cb_t cb, void *data)
+{
+    DBusMessageIter root_iter;
+    DBusMessageIter dict_1_iter, dict_2_iter;
+    DBusMessageIter array_1_iter, array_2_iter;
+    char *obj_path, *interface_name;
+
+    /* a{oa{sa{sv}}} */
+    if (!dbus_message_iter_init(reply, &root_iter))
+        return 1;
+    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&root_iter))
+        return 1;
+
+    dbus_message_iter_recurse(&root_iter, &array_1_iter);
+    for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&array_1_iter);
+           dbus_message_iter_next(&array_1_iter)) {
+        dbus_message_iter_recurse(&array_1_iter, &dict_1_iter);
+        if (DBUS_TYPE_OBJECT_PATH != dbus_message_iter_get_arg_type(&dict_1_iter))
+            return 1;
+        dbus_message_iter_get_basic(&dict_1_iter, &obj_path);
+
+        if (!dbus_message_iter_next(&dict_1_iter) ||
+            DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(&dict_1_iter))
+            return 1;
+        dbus_message_iter_recurse(&dict_1_iter, &array_2_iter);
+        for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&array_2_iter);
+               dbus_message_iter_next(&array_2_iter)) {
+            dbus_message_iter_recurse(&array_2_iter, &dict_2_iter);
+            if (DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&dict_2_iter))
+                return 1;
+            dbus_message_iter_get_basic(&dict_2_iter, &interface_name);
+            if (!dbus_message_iter_next(&dict_2_iter))
+                return 1;
+            cb(data, obj_path, interface_name, &dict_2_iter);
+        }
+    }
+    return 0;
+}
+
+/* Find name in a{sv}, leaving variant_iter on its value */
+static int find_property(DBusMessageIter *props, const char *name, DBusMessageIter *variant_iter)
+{
+    DBusMessageIter array_iter, dict_iter;
+    char *property_name;
+
+    if (DBUS_TYPE_ARRAY != dbus_message_iter_get_arg_type(props))
+        return 1;
+
+    dbus_message_iter_recurse(props, &array_iter);
+    for (; DBUS_TYPE_DICT_ENTRY == dbus_message_iter_get_arg_type(&array_iter);
+           dbus_message_iter_next(&array_iter)) {
+        dbus_message_iter_recurse(&array_iter, &dict_iter);
+        dbus_message_iter_get_basic(&dict_iter, &property_name);
+        if (strcmp(property_name, name) || !dbus_message_iter_next(&dict_iter))
+            continue;
+        dbus_message_iter_recurse(&dict_iter, variant_iter);
+        return 0;
+    }
+    return 1;
+}
+
+static unsigned int gatt_flag(const char *flag)
+{
+    if (!strcmp(flag, "read"))
+        return BLUETOOTH_GATT_READ;
+    if (!strcmp(flag, "write"))
+        return BLUETOOTH_GATT_WRITE;
+    if (!strcmp(flag, "write-without-response"))
+        return BLUETOOTH_GATT_WRITE_WITHOUT_RESPONSE;
+    if (!strcmp(flag, "notify"))
+        return BLUETOOTH_GATT_NOTIFY;
+    if (!strcmp(flag, "indicate"))
+        return BLUETOOTH_GATT_INDICATE;
+    return 0;
+}
+
+typedef struct gatt_collect {
+    gatt_cache_t *cache;
+    const char *device_path;
+} gatt_collect_t;
+
+static void collect_gatt(void *data, const char *path, const char *interface, DBusMessageIter *props)
+{
+    gatt_collect_t *collect = (gatt_collect_t *)data;
+    size_t len = strlen(collect->device_path);
+    DBusMessageIter variant_iter, flags_iter;
+    const char *parent_property;
+    gatt_attr_t *attr;
+    char *value;
+    int kind;
+
+    if (strncmp(path, collect->device_path, len) || path[len] != '/')
+        return;
+
+    if (!strcmp(interface, "org.bluez.GattService1")) {
+        kind = GATT_SERVICE;
+        parent_property = NULL;
+    } else if (!strcmp(interface, "org.bluez.GattCharacteristic1")) {
+        kind = GATT_CHARACTERISTIC;
+        parent_property = "Service";
+    } else if (!strcmp(interface, "org.bluez.GattDescriptor1")) {
+        kind = GATT_DESCRIPTOR;
+        parent_property = "Characteristic";
+    } else {
+        return;
+    }
+
+    attr = calloc(1, sizeof(gatt_attr_t));
+    if (attr == NULL)
+        return;
+    strncpy(attr->path, path, sizeof(attr->path) - 1);
+    attr->kind = kind;
+
+    if (!find_property(props, "UUID", &variant_iter)) {
+        dbus_message_iter_get_basic(&variant_iter, &value);
+        strncpy(attr->uuid, value, sizeof(attr->uuid) - 1);
+    }
+    if (parent_property && !find_property(props, parent_property, &variant_iter)) {
+        dbus_message_iter_get_basic(&variant_iter, &value);
+        strncpy(attr->parent, value, sizeof(attr->parent) - 1);
+    }
+    if (kind == GATT_CHARACTERISTIC && !find_property(props, "Flags", &variant_iter) &&
+        DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&variant_iter)) {
+        dbus_message_iter_recurse(&variant_iter, &flags_iter);
+        for (; DBUS_TYPE_STRING == dbus_message_iter_get_arg_type(&flags_iter);
+               dbus_message_iter_next(&flags_iter)) {
+            dbus_message_iter_get_basic(&flags_iter, &value);
+            attr->flags |= gatt_flag(value);
+        }
+    }
+    list_add_tail(&attr->list, &collect->cache->attrs);
+}
+
+/* Fill in service UUIDs of characteristics */
+static void gatt_link(gatt_cache_t *cache)
+{
+    gatt_attr_t *attr, *service;
+
+    list_for_each_entry(attr, &cache->attrs, list) {
+        if (attr->kind != GATT_CHARACTERISTIC)
+            continue;
+        list_for_each_entry(service, &cache->attrs, list) {
+            if (service->kind == GATT_SERVICE && !strcmp(service->path, attr->parent)) {
+                strncpy(attr->service_uuid, service->uuid, sizeof(attr->service_uuid) - 1);
+                break;
+            }
+        }
+    }
+}
+
+/* Memory, then disk, then a full GetManagedObjects walk. Services must be
+ * resolved (ServicesResolved=true) for the walk to find anything. A Service
+ * Changed queued since the last call drops the cached tree first */
+static gatt_cache_t *gatt_resolve(bluez_t *bluez, bluetooth_device_t *dev)
+{
+    gatt_collect_t collect = { NULL, dev->path };
+    DBusMessage *reply;
+
+    if (bluez->dbus_connection)
+        bluez_drain(bluez);
+    collect.cache = gatt_cache_find(bluez, dev->macaddr);
+    if (collect.cache)
+        return collect.cache;
+
+    collect.cache = gatt_cache_load(bluez, dev->macaddr);
+    if (collect.cache) {
+        gatt_link(collect.cache);
+        return collect.cache;
+    }
+
+    if (get_managed_objects(bluez, &reply))
+        return NULL;
+    if (!reply)
+        return NULL;
+
+    collect.cache = gatt_cache_new(bluez, dev->macaddr);
+    if (collect.cache)
+        foreach_managed_object(reply, collect_gatt, &collect);
     dbus_message_unref(reply);
+    if (collect.cache == NULL)
+        return NULL;
 
-    bluez_dbus_disconnect(bluez);
+    if (list_empty(&collect.cache->attrs)) {
+        free_gatt(collect.cache);
+        return NULL;
+    }
+    gatt_link(collect.cache);
+    gatt_cache_save(bluez, collect.cache);
+    return collect.cache;
 }
 
-static int bluez_get_devices(void *handle, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum)
+static gatt_attr_t *find_characteristic(gatt_cache_t *cache, const char *uuid)
+{
+    gatt_attr_t *attr;
+
+    list_for_each_entry(attr, &cache->attrs, list) {
+        if (attr->kind == GATT_CHARACTERISTIC && !strcasecmp(attr->uuid, uuid))
+            return attr;
+    }
+    return NULL;
+}
+
+static int append_empty_options(DBusMessageIter *iter)
+{
+    DBusMessageIter options_iter;
+
+    if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}", &options_iter))
+        return 1;
+    if (!dbus_message_iter_close_container(iter, &options_iter))
+        return 1;
+    return 0;
+}
+
+/* Call a GattCharacteristic1 method. data, if not NULL, is sent as leading ay argument */
+static DBusMessage *characteristic_method(bluez_t *bluez, gatt_attr_t *attr, const char *method,
+                                          const void *data, size_t len, DBusError *err)
+{
+    DBusMessage *message, *reply;
+    DBusMessageIter iter, array_iter;
+
+    message = dbus_message_new_method_call("org.bluez", attr->path,
+                "org.bluez.GattCharacteristic1", method);
+    if (!message)
+        return NULL;
+
+    dbus_message_iter_init_append(message, &iter);
+    if (data) {
+        if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+                    DBUS_TYPE_BYTE_AS_STRING, &array_iter))
+            goto fault;
+        if (!dbus_message_iter_append_fixed_array(&array_iter, DBUS_TYPE_BYTE, &data, len)) {
+            dbus_message_iter_abandon_container(&iter, &array_iter);
+            goto fault;
+        }
+        if (!dbus_message_iter_close_container(&iter, &array_iter))
+            goto fault;
+    }
+    if (append_empty_options(&iter))
+        goto fault;
+
+    reply = bluez_call(bluez, message, bluetooth_now_ms() + GATT_TIMEOUT_MS, err);
+    dbus_message_unref(message);
+    return reply;
+
+fault:
+    dbus_message_unref(message);
+    return NULL;
+}
+
+/* Call method on characteristic uuid. A cached path bluetoothd no longer
+ * knows means the tree changed while we weren't listening: resolve again */
+static DBusMessage *gatt_call(bluez_t *bluez, const char *device, const char *uuid,
+                              const char *method, const void *data, size_t len)
+{
+    bluetooth_device_t *dev;
+    gatt_cache_t *cache;
+    gatt_attr_t *attr;
+    DBusMessage *reply;
+    DBusError err;
+    int retry, stale;
+
+    dev = find_device(bluez, device);
+    if (dev == NULL)
+        return NULL;
+
+    for (retry = 0; retry < 2; retry++) {
+        cache = gatt_resolve(bluez, dev);
+        attr = cache ? find_characteristic(cache, uuid) : NULL;
+        if (attr == NULL)
+            return NULL;
+
+        dbus_error_init(&err);
+        reply = characteristic_method(bluez, attr, method, data, len, &err);
+        stale = dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_OBJECT) ||
+                dbus_error_has_name(&err, DBUS_ERROR_UNKNOWN_METHOD);
+        dbus_error_free(&err);
+        if (reply || !stale)
+            return reply;
+
+        gatt_cache_drop(bluez, dev->macaddr);
+    }
+    return NULL;
+}
+
+static int bluez_gatt_discover(void *handle, const char *device, bluetooth_gatt_char_t *chars, int charnum)
 {
     bluez_t *bluez = (bluez_t *)handle;
     bluetooth_device_t *dev;
+    gatt_cache_t *cache;
+    gatt_attr_t *attr;
     int num = 0;
 
-	list_for_each_entry(dev, &bluez->devices, list) {
-        strncpy(devs[num], dev->name, sizeof(devs[num]));
-        num++;
-        if (num == devnum)
+    dev = find_device(bluez, device);
+    if (dev == NULL)
+        return -1;
+
+    bluez_dbus_connect(bluez);
+    cache = gatt_resolve(bluez, dev);
+    bluez_dbus_release(bluez);
+    if (cache == NULL)
+        return -1;
+
+    list_for_each_entry(attr, &cache->attrs, list) {
+        if (attr->kind != GATT_CHARACTERISTIC)
+            continue;
+        if (num == charnum)
             break;
-	}
+        strncpy(chars[num].uuid, attr->uuid, sizeof(chars[num].uuid));
+        strncpy(chars[num].service_uuid, attr->service_uuid, sizeof(chars[num].service_uuid));
+        chars[num].flags = attr->flags;
+        num++;
+    }
     return num;
 }
 
-static bool bluez_device_is_connected(void *handle, const char *device)
+static int bluez_gatt_read(void *handle, const char *device, const char *uuid, void *buf, size_t len)
 {
     bluez_t *bluez = (bluez_t *)handle;
-    bluetooth_device_t *dev;
-    int value;
+    DBusMessage *reply;
+    DBusMessageIter root_iter, array_iter;
+    const unsigned char *data;
+    int n = -1;
 
     bluez_dbus_connect(bluez);
-
-    list_for_each_entry(dev, &bluez->devices, list) {
-        if(!strncmp(dev->name, device, strlen(device))) {
-            if (get_bool_property(bluez, dev->path,
-                                    "org.bluez.Device1", "Connected", &value))
-                value = false;
-        }
+    reply = gatt_call(bluez, device, uuid, "ReadValue", NULL, 0);
+    if (reply == NULL)
+        goto out;
+
+    /* ay */
+    if (dbus_message_iter_init(reply, &root_iter) &&
+        DBUS_TYPE_ARRAY == dbus_message_iter_get_arg_type(&root_iter)) {
+        dbus_message_iter_recurse(&root_iter, &array_iter);
+        dbus_message_iter_get_fixed_array(&array_iter, &data, &n);
+        if ((size_t)n > len)
+            n = len;
+        memcpy(buf, data, n);
     }
-    bluez_dbus_disconnect(bluez);
-    return value;
+    dbus_message_unref(reply);
+
+out:
+    bluez_dbus_release(bluez);
+    return n;
 }
 
-static bool bluez_connect_device(void *handle,const char *device, int timeout)
+static bool bluez_gatt_write(void *handle, const char *device, const char *uuid, const void *buf, size_t len)
 {
     bluez_t *bluez = (bluez_t *)handle;
-    bluetooth_device_t *dev;
+    DBusMessage *reply;
 
-    if(bluez_device_is_connected(bluez, device))
-        return true;
+    bluez_dbus_connect(bluez);
+    reply = gatt_call(bluez, device, uuid, "WriteValue", buf, len);
+    bluez_dbus_release(bluez);
+
+    if (reply == NULL)
+        return false;
+    dbus_message_unref(reply);
+    return true;
+}
+
+static int bluez_gatt_acquire(void *handle, const char *device, const char *uuid, bool notify, size_t *mtu)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    DBusMessage *reply;
+    dbus_uint16_t att_mtu;
+    int fd = -1;
 
     bluez_dbus_connect(bluez);
+    reply = gatt_call(bluez, device, uuid, notify ? "AcquireNotify" : "AcquireWrite", NULL, 0);
+    if (reply == NULL)
+        goto out;
+
+    /* hq */
+    if (dbus_message_get_args(reply, NULL,
+            DBUS_TYPE_UNIX_FD, &fd,
+            DBUS_TYPE_UINT16, &att_mtu,
+            DBUS_TYPE_INVALID)) {
+        if (mtu)
+            *mtu = att_mtu;
+    }
+    dbus_message_unref(reply);
 
-	list_for_each_entry(dev, &bluez->devices, list) {
-        if(!strncmp(dev->name, device, strlen(device))) {
+out:
+    bluez_dbus_release(bluez);
+    return fd;
+}
 
-            /* Trust the device */
-            if (set_bool_property(bluez, dev->path,
-                    "org.bluez.Device1", "Trusted", 1)) {
-                bluez_dbus_disconnect(bluez);
-                return false;
-            }
-            
-            /* Pair the device */
-            if (device_method(bluez, dev->path, "Pair", timeout)) {
-                bluez_dbus_disconnect(bluez);
-                printf("Error\n");
-                return false;
-            }
+static void bluez_gatt_release(void *handle, int fd)
+{
+    (void)handle;
 
-            /* Connect the device */
-            if (device_method(bluez, dev->path, "Connect", timeout)) {
-                bluez_dbus_disconnect(bluez);
-                return false;
-            }
-        }
+    /* the connection is the handle's, not the fd's */
+    close(fd);
+}
+
+static bool bluez_set_gatt_cache_dir(void *handle, const char *dir)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+
+    if (dir == NULL) {
+        bluez->gatt_cache_dir[0] = '\0';
+        return true;
     }
+    if (strlen(dir) >= sizeof(bluez->gatt_cache_dir))
+        return false;
+    if (mkdir(dir, 0700) && errno != EEXIST)
+        return false;
 
-    bluez_dbus_disconnect(bluez);
+    strcpy(bluez->gatt_cache_dir, dir);
     return true;
 }
 
-static bool bluez_disconnect_device(void *handle, const char *device, int timeout)
+static bool bluez_set_advert_callback(void *handle, bluetooth_advert_cb_t cb, void *userdata)
 {
     bluez_t *bluez = (bluez_t *)handle;
+
+    bluez->advert_cb = cb;
+    bluez->advert_userdata = userdata;
+    return true;
+}
+
+/* One device going through Trusted, Pair and Connect in bluez_connect_devices(),
+ * or just Disconnect */
+enum connect_step {
+    STEP_TRUST,
+    STEP_PAIR,
+    STEP_CONNECT,
+    STEP_DISCONNECT,
+};
+
+typedef struct connect_job {
+    bulk_item_t *item;
     bluetooth_device_t *dev;
+    int step;
+    long long deadline;
+    DBusPendingCall *pending;
+} connect_job_t;
 
-    if (!bluez_device_is_connected(handle, device))
-        return true;
+static int connect_job_send(bluez_t *bluez, connect_job_t *job)
+{
+    long long remaining = job->deadline - bluetooth_now_ms();
+    DBusMessage *message;
+    int ret = 1;
 
-    list_for_each_entry(dev, &bluez->devices, list) {
-        if(!strncmp(dev->name, device, strlen(device))) {
-            /* Disconnect the device */
-            if (device_method(bluez, dev->path, "Disconnect", timeout)) {
-                bluez_dbus_disconnect(bluez);
-                return false;
+    if (remaining <= 0)
+        return 1;
+
+    if (job->step == STEP_TRUST)
+        message = bool_property_message(job->dev->path, "org.bluez.Device1", "Trusted", 1);
+    else
+        message = dbus_message_new_method_call("org.bluez", job->dev->path, "org.bluez.Device1",
+                                               job->step == STEP_PAIR ? "Pair" :
+                                               job->step == STEP_CONNECT ? "Connect" : "Disconnect");
+    if (!message)
+        return 1;
+
+    if (dbus_connection_send_with_reply(bluez->dbus_connection, message, &job->pending,
+                                        bluetooth_timeout_ms(remaining)) &&
+        job->pending) {
+        bluez_trace(bluez, TRACE_SEND, message);
+        ret = 0;
+    }
+    dbus_message_unref(message);
+    return ret;
+}
+
+/* Take the reply and send the next call. Return 1 once the job is over, *ok tells how */
+static int connect_job_step(bluez_t *bluez, connect_job_t *job, bool *ok)
+{
+    DBusMessage *reply = dbus_pending_call_steal_reply(job->pending);
+    bool failed;
+
+    dbus_pending_call_unref(job->pending);
+    job->pending = NULL;
+    bluez_trace(bluez, TRACE_RECV, reply);
+
+    failed = !reply || dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR;
+    /* paired, connected or gone before: that's what we wanted */
+    if (failed && reply && (dbus_message_is_error(reply, "org.bluez.Error.AlreadyExists") ||
+                            dbus_message_is_error(reply, "org.bluez.Error.AlreadyConnected") ||
+                            dbus_message_is_error(reply, "org.bluez.Error.NotConnected")))
+        failed = false;
+    if (reply)
+        dbus_message_unref(reply);
+
+    if (failed || job->step >= STEP_CONNECT) {
+        *ok = !failed;
+        return 1;
+    }
+
+    job->step++;
+    if (connect_job_send(bluez, job)) {
+        *ok = false;
+        return 1;
+    }
+    return 0;
+}
+
+static void connect_job_end(bulk_t *bulk, connect_job_t *job, bool ok)
+{
+    if (job->pending) {
+        dbus_pending_call_cancel(job->pending);
+        dbus_pending_call_unref(job->pending);
+        job->pending = NULL;
+    }
+    if (ok)
+        job->dev->connected = !job->item->disconnect;
+    bulk_done(bulk, job->item, ok);
+    job->item = NULL;
+}
+
+/* Up to max_in_flight devices at once, each call of every job pending on the one connection */
+static int bluez_connect_devices(void *handle, bulk_t *bulk)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+    connect_job_t *jobs;
+    bulk_item_t *item;
+    long long deadline, wait_until, wake;
+    int i, active = 0;
+    bool ok;
+
+    jobs = calloc(bulk->max_in_flight, sizeof(connect_job_t));
+    if (jobs == NULL)
+        return 1;
+
+    bluez_dbus_connect(bluez);
+    if (!bluez->dbus_connection || agent_register(bluez, bulk->deadline)) {
+        free(jobs);
+        bluez_dbus_release(bluez);
+        return 1;
+    }
+
+    for (;;) {
+        /* free slots go to the highest priority waiting */
+        for (i = 0; i < bulk->max_in_flight; i++) {
+            if (jobs[i].item)
+                continue;
+            while ((item = bulk_next(bulk, &deadline))) {
+                jobs[i].item = item;
+                jobs[i].dev = find_device(bluez, item->device);
+                jobs[i].step = item->disconnect ? STEP_DISCONNECT : STEP_TRUST;
+                jobs[i].deadline = deadline;
+                jobs[i].pending = NULL;
+                if (jobs[i].dev && !connect_job_send(bluez, &jobs[i])) {
+                    active++;
+                    break;
+                }
+                connect_job_end(bulk, &jobs[i], false);
+            }
+        }
+        wake = bulk_wake(bulk);
+        if (active == 0 && (wake < 0 || wake >= bulk->deadline ||
+                            bluetooth_now_ms() >= bulk->deadline ||
+                            bluetooth_cancelled(bluez->cancel_fd)))
+            break;
+        dbus_connection_flush(bluez->dbus_connection);
+
+        wait_until = bulk->deadline;
+        if (wake >= 0 && wake < wait_until && active < bulk->limit)
+            wait_until = wake;
+        for (i = 0; i < bulk->max_in_flight; i++) {
+            if (jobs[i].item && jobs[i].deadline < wait_until)
+                wait_until = jobs[i].deadline;
+        }
+        bluez_wait(bluez, wait_until);
+
+        for (i = 0; i < bulk->max_in_flight; i++) {
+            if (!jobs[i].item)
+                continue;
+            if (bluetooth_cancelled(bluez->cancel_fd) || bluetooth_now_ms() >= jobs[i].deadline) {
+                connect_job_end(bulk, &jobs[i], false);
+                active--;
+            } else if (dbus_pending_call_get_completed(jobs[i].pending) &&
+                       connect_job_step(bluez, &jobs[i], &ok)) {
+                connect_job_end(bulk, &jobs[i], ok);
+                active--;
             }
         }
     }
 
-    bluez_dbus_disconnect(bluez);
-    return true;
+    free(jobs);
+    bluez_dbus_release(bluez);
+    return 0;
+}
+
+static int bluez_obex_send(void *handle, const bluetooth_obex_request_t *requests,
+                           const char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN], size_t n,
+                           long long deadline, bluetooth_obex_cb_t cb, void *userdata)
+{
+    bluez_t *bluez = (bluez_t *)handle;
+
+    if (bluez->obex == NULL && (bluez->obex = obex_new(bluez->cancel_fd)) == NULL)
+        return -1;
+    return obex_send(bluez->obex, requests, macaddrs, n, deadline, cb, userdata);
 }
 
-bluetooth_backend_t bluetooth_bluez = {
+static bluetooth_backend_t bluetooth_bluez = {
     bluez_init,
     bluez_free,
     bluez_scan,
@@ -620,5 +2831,26 @@ bluetooth_backend_t bluetooth_bluez = {
     bluez_device_is_connected,
     bluez_connect_device,
     bluez_disconnect_device,
+    bluez_set_advert_callback,
+    bluez_gatt_discover,
+    bluez_gatt_read,
+    bluez_gatt_write,
+    bluez_gatt_acquire,
+    bluez_gatt_release,
+    bluez_set_gatt_cache_dir,
+    bluez_get_device_info,
+    bluez_connect_devices,
+    bluez_device_is_connected_addr,
+    bluez_connect_device_addr,
+    bluez_disconnect_device_addr,
+    bluez_set_agent,
+    bluez_obex_send,
+    bluez_register_profile,
+    bluez_connect_profile,
+    bluez_accept_profile,
+    bluez_wait_devices,
+    bluez_wake_waits,
     "bluez"
 };
+
+BLUETOOTH_BACKEND_EXPORT(bluetooth_bluez)
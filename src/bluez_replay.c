@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <dbus/dbus.h>
+
+#include "list.h"
+#include "bluetooth_internal.h"
+
+/*
+ * Stand-in for the system bus during replay. The bluez backend connects to it
+ * as it would to the bus. Each call it makes is matched with the first unused
+ * recorded call to the same object and method, whose reply goes back after
+ * the recorded delay. Signals recorded right after that call follow it the
+ * same way. Bus calls (Hello, AddMatch) are answered here, never recorded.
+ */
+
+#define REPLAY_ERROR_NAME   "org.hal_bluetooth.Error.NotRecorded"
+
+typedef struct replay_out {
+    long long at;
+    DBusMessage *message;
+    struct list_head list;
+} replay_out_t;
+
+struct bluez_replay {
+    trace_t *trace;
+    char address[128];
+    int listen_fd;
+    int stop_fd;
+    pthread_t thread;
+
+    /* recorded calls already answered */
+    bool *used;
+    size_t cursor;
+    dbus_uint32_t serial;
+    /* messages for the client, by time due */
+    struct list_head queue;
+};
+
+static DBusMessage *record_message(const trace_record_t *rec)
+{
+    DBusError err;
+    DBusMessage *message;
+
+    dbus_error_init(&err);
+    message = dbus_message_demarshal((const char *)rec->data, rec->len, &err);
+    dbus_error_free(&err);
+    return message;
+}
+
+static void queue_message(bluez_replay_t *replay, DBusMessage *message, long long at)
+{
+    replay_out_t *out, *pos;
+
+    out = calloc(1, sizeof(replay_out_t));
+    if (out == NULL) {
+        dbus_message_unref(message);
+        return;
+    }
+    out->at = at;
+    out->message = message;
+
+    list_for_each_entry(pos, &replay->queue, list) {
+        if (pos->at > at)
+            break;
+    }
+    list_add_tail(&out->list, &pos->list);
+}
+
+static void flush_queue(bluez_replay_t *replay)
+{
+    replay_out_t *out;
+
+    while (!list_empty(&replay->queue)) {
+        out = list_first_entry(&replay->queue, replay_out_t, list);
+        list_del(&out->list);
+        dbus_message_unref(out->message);
+        free(out);
+    }
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_message(bluez_replay_t *replay, int fd, DBusMessage *message)
+{
+    char *data;
+    int len, ret;
+
+    dbus_message_set_serial(message, ++replay->serial);
+    if (!dbus_message_marshal(message, &data, &len))
+        return 1;
+    ret = write_all(fd, data, len);
+    dbus_free(data);
+    return ret;
+}
+
+static bool same_call(DBusMessage *a, DBusMessage *b)
+{
+    const char *pa = dbus_message_get_path(a), *pb = dbus_message_get_path(b);
+    const char *ia = dbus_message_get_interface(a), *ib = dbus_message_get_interface(b);
+    const char *ma = dbus_message_get_member(a), *mb = dbus_message_get_member(b);
+
+    return pa && pb && ma && mb && !strcmp(pa, pb) && !strcmp(ma, mb) &&
+           ((!ia && !ib) || (ia && ib && !strcmp(ia, ib)));
+}
+
+/* Schedule the recorded answer to call */
+static void replay_call(bluez_replay_t *replay, DBusMessage *call)
+{
+    trace_t *trace = replay->trace;
+    const trace_record_t *sent = NULL, *rec;
+    DBusMessage *recorded, *message;
+    dbus_uint32_t serial = 0;
+    long long now = bluetooth_now_ms();
+    size_t i, k;
+
+    for (k = replay->cursor; k < trace->n; k++) {
+        if (replay->used[k] || trace->records[k].type != TRACE_SEND)
+            continue;
+        recorded = record_message(&trace->records[k]);
+        if (recorded && same_call(recorded, call)) {
+            sent = &trace->records[k];
+            serial = dbus_message_get_serial(recorded);
+        }
+        if (recorded)
+            dbus_message_unref(recorded);
+        if (sent)
+            break;
+    }
+
+    if (sent == NULL) {
+        if (!dbus_message_get_no_reply(call)) {
+            message = dbus_message_new_error(call, REPLAY_ERROR_NAME, "Call not in the recording");
+            if (message)
+                queue_message(replay, message, now);
+        }
+        return;
+    }
+    replay->used[k] = true;
+    while (replay->cursor < trace->n && (replay->used[replay->cursor] ||
+                                         trace->records[replay->cursor].type != TRACE_SEND))
+        replay->cursor++;
+
+    /* signals up to the next call */
+    for (i = k + 1; i < trace->n && trace->records[i].type != TRACE_SEND; i++) {
+        rec = &trace->records[i];
+        if (rec->type != TRACE_RECV || replay->used[i])
+            continue;
+        message = record_message(rec);
+        if (message && dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL) {
+            replay->used[i] = true;
+            queue_message(replay, message, now + trace_delay_ms(trace, sent->time_us, rec->time_us));
+        } else if (message) {
+            dbus_message_unref(message);
+        }
+    }
+
+    /* the reply may come after other calls went out. None recorded: it timed out or was dropped */
+    for (i = k + 1; i < trace->n; i++) {
+        rec = &trace->records[i];
+        if (rec->type != TRACE_RECV || replay->used[i])
+            continue;
+        message = record_message(rec);
+        if (message && dbus_message_get_reply_serial(message) == serial &&
+            dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL) {
+            replay->used[i] = true;
+            dbus_message_set_reply_serial(message, dbus_message_get_serial(call));
+            queue_message(replay, message, now + trace_delay_ms(trace, sent->time_us, rec->time_us));
+            break;
+        }
+        if (message)
+            dbus_message_unref(message);
+    }
+}
+
+/* What the bus itself answers */
+static void replay_bus_call(bluez_replay_t *replay, DBusMessage *call)
+{
+    const char *name = ":1.1";
+    DBusMessage *reply;
+
+    if (dbus_message_get_no_reply(call))
+        return;
+    reply = dbus_message_new_method_return(call);
+    if (reply == NULL)
+        return;
+    if (dbus_message_is_method_call(call, DBUS_INTERFACE_DBUS, "Hello"))
+        dbus_message_append_args(reply, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+    queue_message(replay, reply, bluetooth_now_ms());
+}
+
+static void handle_message(bluez_replay_t *replay, DBusMessage *message)
+{
+    const char *dest = dbus_message_get_destination(message);
+
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return;
+    if (dest && !strcmp(dest, DBUS_SERVICE_DBUS))
+        replay_bus_call(replay, message);
+    else
+        replay_call(replay, message);
+}
+
+/* SASL exchange up to BEGIN. Return 1 if the client went away */
+static int replay_auth(int fd, char *buf, size_t size, size_t *len)
+{
+    char *line, *nl;
+    ssize_t n;
+
+    *len = 0;
+    for (;;) {
+        n = read(fd, buf + *len, size - 1 - *len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        *len += n;
+        buf[*len] = '\0';
+
+        line = buf;
+        /* credentials byte */
+        if (*line == '\0' && *len)
+            line++;
+        while ((nl = memchr(line, '\n', *len - (line - buf)))) {
+            *nl = '\0';
+            if (!strncmp(line, "AUTH", 4)) {
+                if (write_all(fd, "OK 0123456789abcdef0123456789abcdef\r\n", 37))
+                    return 1;
+            } else if (!strncmp(line, "BEGIN", 5)) {
+                line = nl + 1;
+                *len -= line - buf;
+                memmove(buf, line, *len);
+                return 0;
+            } else if (write_all(fd, "ERROR\r\n", 7)) {
+                return 1;
+            }
+            line = nl + 1;
+        }
+        *len -= line - buf;
+        memmove(buf, line, *len);
+        if (*len == size - 1)
+            return 1;
+    }
+}
+
+/* One client connection, until it closes or replay stops. Return 1 on stop */
+static int replay_serve(bluez_replay_t *replay, int fd)
+{
+    struct pollfd pfd[2];
+    replay_out_t *out;
+    DBusMessage *message;
+    DBusError err;
+    char *buf, *grown;
+    size_t size = 4096, len = 0;
+    long long timeout;
+    int needed, ret = 0;
+    ssize_t n;
+
+    buf = malloc(size);
+    if (buf == NULL || replay_auth(fd, buf, size, &len)) {
+        free(buf);
+        return 0;
+    }
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = replay->stop_fd;
+    pfd[1].events = POLLIN;
+    for (;;) {
+        /* whole messages in, answers queued */
+        while ((needed = dbus_message_demarshal_bytes_needed(buf, len)) > 0 && (size_t)needed <= len) {
+            dbus_error_init(&err);
+            message = dbus_message_demarshal(buf, needed, &err);
+            dbus_error_free(&err);
+            if (message) {
+                handle_message(replay, message);
+                dbus_message_unref(message);
+            }
+            len -= needed;
+            memmove(buf, buf + needed, len);
+        }
+        if (needed < 0)
+            break;
+        if ((size_t)needed > size) {
+            grown = realloc(buf, needed);
+            if (grown == NULL)
+                break;
+            buf = grown;
+            size = needed;
+        }
+
+        /* answers due */
+        while (!list_empty(&replay->queue)) {
+            out = list_first_entry(&replay->queue, replay_out_t, list);
+            if (out->at > bluetooth_now_ms())
+                break;
+            list_del(&out->list);
+            send_message(replay, fd, out->message);
+            dbus_message_unref(out->message);
+            free(out);
+        }
+
+        timeout = -1;
+        if (!list_empty(&replay->queue)) {
+            timeout = list_first_entry(&replay->queue, replay_out_t, list)->at - bluetooth_now_ms();
+            if (timeout < 0)
+                timeout = 0;
+        }
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+            break;
+        if (pfd[1].revents & POLLIN) {
+            ret = 1;
+            break;
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            n = read(fd, buf + len, size - len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            len += n;
+        }
+    }
+
+    flush_queue(replay);
+    free(buf);
+    return ret;
+}
+
+static void *replay_thread(void *data)
+{
+    bluez_replay_t *replay = (bluez_replay_t *)data;
+    struct pollfd pfd[2];
+    int fd;
+
+    pfd[0].fd = replay->listen_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = replay->stop_fd;
+    pfd[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents & POLLIN)
+            break;
+        fd = accept4(replay->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        /* the backend reconnects per operation, serve one at a time */
+        if (replay_serve(replay, fd)) {
+            close(fd);
+            break;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+bluez_replay_t *bluez_replay_start(trace_t *trace)
+{
+    static int instances;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    bluez_replay_t *replay;
+    socklen_t addrlen;
+    char name[64];
+
+    replay = calloc(1, sizeof(bluez_replay_t));
+    if (replay == NULL)
+        return NULL;
+    replay->used = calloc(trace->n ? trace->n : 1, sizeof(bool));
+    if (replay->used == NULL) {
+        free(replay);
+        return NULL;
+    }
+    replay->trace = trace;
+    INIT_LIST_HEAD(&replay->queue);
+
+    /* abstract socket, nothing to clean up */
+    snprintf(name, sizeof(name), "hal_bluetooth-replay-%d-%d", getpid(),
+             __atomic_fetch_add(&instances, 1, __ATOMIC_RELAXED));
+    snprintf(replay->address, sizeof(replay->address), "unix:abstract=%s", name);
+    memcpy(addr.sun_path + 1, name, strlen(name));
+    addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+
+    replay->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    replay->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (replay->listen_fd < 0 || replay->stop_fd < 0 ||
+        bind(replay->listen_fd, (struct sockaddr *)&addr, addrlen) ||
+        listen(replay->listen_fd, 4) ||
+        pthread_create(&replay->thread, NULL, replay_thread, replay)) {
+        if (replay->listen_fd >= 0)
+            close(replay->listen_fd);
+        if (replay->stop_fd >= 0)
+            close(replay->stop_fd);
+        free(replay->used);
+        free(replay);
+        return NULL;
+    }
+    return replay;
+}
+
+const char *bluez_replay_address(bluez_replay_t *replay)
+{
+    return replay->address;
+}
+
+void bluez_replay_stop(bluez_replay_t *replay)
+{
+    uint64_t one = 1;
+
+    if (replay == NULL)
+        return;
+
+    if (write(replay->stop_fd, &one, sizeof(one)) == sizeof(one))
+        pthread_join(replay->thread, NULL);
+    close(replay->listen_fd);
+    close(replay->stop_fd);
+    free(replay->used);
+    free(replay);
+}
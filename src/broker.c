@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bluetooth_internal.h"
+
+/*
+ * Backend talking to broker/bluetooth_broker, which owns the adapter for
+ * every process on the host. Requests go over its socket. The device table
+ * is read straight from the broker's shared memory, without a syscall.
+ */
+
+/* the broker lists devices after the scan window, and may be finishing someone else's call */
+#define BROKER_REPLY_GRACE_MS   (10000)
+/* is_connected has no deadline of its own */
+#define BROKER_QUERY_TIMEOUT_MS (5000)
+
+typedef struct broker_handle {
+    int fd;
+    /* readable once the caller cancels, see bluetooth_cancel() */
+    int cancel_fd;
+    uint32_t id;
+    const broker_table_t *table;
+} broker_t;
+
+static int broker_connect(const char *name)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    socklen_t addrlen;
+    int fd;
+
+    if (strlen(name) >= sizeof(addr.sun_path) - 1)
+        return -1;
+    memcpy(addr.sun_path + 1, name, strlen(name));
+    addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, addrlen)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* BROKER_HELLO and the table's memfd */
+static int broker_hello(broker_t *broker)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    broker_msg_t hello;
+    void *table;
+    int memfd = -1;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(broker->fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello.op != BROKER_HELLO)
+        return 1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    if (memfd < 0)
+        return 1;
+
+    table = mmap(NULL, sizeof(broker_table_t), PROT_READ, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (table == MAP_FAILED)
+        return 1;
+    broker->table = table;
+    return 0;
+}
+
+static void* broker_init(const bluetooth_backend_config_t *config)
+{
+    const char *name = getenv(BROKER_ENV);
+    broker_t *broker;
+
+    broker = calloc(1, sizeof(broker_t));
+    if (broker == NULL)
+        return NULL;
+
+    broker->cancel_fd = config->cancel_fd;
+    broker->fd = broker_connect(name ? name : BROKER_DEFAULT_NAME);
+    if (broker->fd < 0) {
+        free(broker);
+        return NULL;
+    }
+    if (broker_hello(broker)) {
+        close(broker->fd);
+        free(broker);
+        return NULL;
+    }
+    return broker;
+}
+
+static void broker_free(void *handle)
+{
+    broker_t *broker = (broker_t *)handle;
+
+    munmap((void *)broker->table, sizeof(broker_table_t));
+    close(broker->fd);
+    free(broker);
+}
+
+/* Send a request and wait for its reply. Return the result, -1 on failure,
+ * cancel or once the reply is late */
+static int broker_request(broker_t *broker, int op, const char *device, long long deadline)
+{
+    broker_msg_t msg = { .id = ++broker->id, .op = op }, reply;
+    long long until = deadline + BROKER_REPLY_GRACE_MS, remaining;
+    struct pollfd pfd[3];
+    ssize_t n;
+    int npfd;
+
+    msg.timeout_ms = bluetooth_timeout_ms(deadline - bluetooth_now_ms());
+    if (msg.timeout_ms <= 0)
+        return -1;
+    if (device)
+        strncpy(msg.device, device, sizeof(msg.device) - 1);
+    if (send(broker->fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+        return -1;
+
+    pfd[0].fd = broker->fd;
+    pfd[0].events = POLLIN;
+    npfd = 1 + bluetooth_cancel_pollfds(broker->cancel_fd, &pfd[1]);
+    for (;;) {
+        remaining = until - bluetooth_now_ms();
+        if (remaining <= 0)
+            return -1;
+        if (poll(pfd, npfd, bluetooth_timeout_ms(remaining)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (npfd > 1 && bluetooth_cancelled(broker->cancel_fd))
+            return -1;
+        if (!(pfd[0].revents & (POLLIN | POLLHUP)))
+            continue;
+
+        n = recv(broker->fd, &reply, sizeof(reply), 0);
+        if (n <= 0)
+            return -1;
+        /* replies of requests given up on are dropped here */
+        if (n == sizeof(reply) && reply.id == msg.id)
+            return reply.result;
+    }
+}
+
+static void broker_scan(void *handle, long long deadline)
+{
+    broker_request((broker_t *)handle, BROKER_SCAN, NULL, deadline);
+}
+
+/* Copy the table out, retrying while the broker rewrites it */
+static int read_table(const broker_table_t *table, bluetooth_device_info_t *devs, int devnum)
+{
+    uint32_t seq;
+    int n;
+
+    for (;;) {
+        seq = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        n = __atomic_load_n(&table->n_devices, __ATOMIC_RELAXED);
+        if (n > devnum)
+            n = devnum;
+        if (n > BROKER_MAX_DEVICES)
+            n = BROKER_MAX_DEVICES;
+        if (n > 0)
+            memcpy(devs, table->devices, n * sizeof(bluetooth_device_info_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&table->seq, __ATOMIC_RELAXED) == seq)
+            return n;
+    }
+}
+
+static int broker_get_device_info(void *handle, bluetooth_device_info_t *devs, int devnum)
+{
+    broker_t *broker = (broker_t *)handle;
+
+    if (devnum <= 0)
+        return 0;
+    return read_table(broker->table, devs, devnum);
+}
+
+static int broker_get_devices(void *handle, char devs[][BLUETOOTH_DEVNAME_MAXLEN], int devnum)
+{
+    broker_t *broker = (broker_t *)handle;
+    bluetooth_device_info_t *info;
+    int i, n;
+
+    if (devnum <= 0)
+        return 0;
+    info = malloc(devnum * sizeof(bluetooth_device_info_t));
+    if (info == NULL)
+        return 0;
+    n = read_table(broker->table, info, devnum);
+    for (i = 0; i < n; i++)
+        memcpy(devs[i], info[i].name, BLUETOOTH_DEVNAME_MAXLEN);
+    free(info);
+    return n;
+}
+
+/* Also the calls by MAC address: the broker's library takes a known one as is */
+static bool broker_device_is_connected(void *handle, const char *device)
+{
+    return broker_request((broker_t *)handle, BROKER_IS_CONNECTED, device,
+                          bluetooth_now_ms() + BROKER_QUERY_TIMEOUT_MS) > 0;
+}
+
+static bool broker_connect_device(void *handle, const char *device, long long deadline)
+{
+    return broker_request((broker_t *)handle, BROKER_CONNECT, device, deadline) > 0;
+}
+
+static bool broker_disconnect_device(void *handle, const char *device, long long deadline)
+{
+    return broker_request((broker_t *)handle, BROKER_DISCONNECT, device, deadline) > 0;
+}
+
+static bluetooth_backend_t bluetooth_broker = {
+    broker_init,
+    broker_free,
+    broker_scan,
+    broker_get_devices,
+    broker_device_is_connected,
+    broker_connect_device,
+    broker_disconnect_device,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    broker_get_device_info,
+    NULL,
+    broker_device_is_connected,
+    broker_connect_device,
+    broker_disconnect_device,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    "broker"
+};
+
+BLUETOOTH_BACKEND_EXPORT(bluetooth_broker)
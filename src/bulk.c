@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bluetooth_internal.h"
+
+/* First retry waits this long, doubling up to BULK_BACKOFF_MAX_MS */
+#define BULK_BACKOFF_MS         (100)
+#define BULK_BACKOFF_MAX_MS     (1600)
+
+enum bulk_state {
+    BULK_WAITING,
+    BULK_IN_FLIGHT,
+    BULK_CONNECTED,
+    BULK_FAILED,
+};
+
+int bulk_init(bulk_t *bulk, const bluetooth_connect_request_t *requests, size_t n,
+              const bluetooth_bulk_options_t *opts, long long deadline, int cancel_fd,
+              bluetooth_bulk_cb_t cb, void *userdata)
+{
+    size_t i;
+
+    memset(bulk, 0, sizeof(*bulk));
+    bulk->items = calloc(n ? n : 1, sizeof(bulk_item_t));
+    if (bulk->items == NULL)
+        return 1;
+
+    for (i = 0; i < n; i++) {
+        bulk->items[i].device = requests[i].device;
+        bulk->items[i].priority = requests[i].priority;
+        bulk->items[i].seq = bulk->seq++;
+        bulk->items[i].state = BULK_WAITING;
+        bulk->items[i].deadline = deadline;
+    }
+    bulk->n = n;
+    bulk->max_in_flight = (opts && opts->max_in_flight > 0) ? opts->max_in_flight : BULK_DEFAULT_IN_FLIGHT;
+    bulk->limit = bulk->max_in_flight;
+    bulk->max_retries = (opts && opts->max_retries > 0) ? opts->max_retries : 0;
+    bulk->attempt_timeout_ms = opts ? opts->attempt_timeout_ms : 0;
+    bulk->deadline = deadline;
+    bulk->cancel_fd = cancel_fd;
+    bulk->progress.total = n;
+    bulk->cb = cb;
+    bulk->userdata = userdata;
+    return 0;
+}
+
+int bulk_feed(bulk_t *bulk, size_t cap, bulk_feed_t feed)
+{
+    bulk_item_t *items;
+
+    /* items don't move once attempts hold on to them */
+    items = realloc(bulk->items, (cap > bulk->n ? cap : bulk->n) * sizeof(bulk_item_t));
+    if (items == NULL)
+        return 1;
+    bulk->items = items;
+    bulk->cap = cap;
+    bulk->feed = feed;
+    return 0;
+}
+
+void bulk_fill(bulk_t *bulk)
+{
+    bulk_item_t *item;
+
+    while (bulk->feed && bulk->n < bulk->cap) {
+        item = &bulk->items[bulk->n];
+        memset(item, 0, sizeof(*item));
+        if (!bulk->feed(bulk->userdata, item))
+            break;
+        item->seq = bulk->seq++;
+        item->state = BULK_WAITING;
+        if (item->deadline > bulk->deadline)
+            bulk->deadline = item->deadline;
+        bulk->n++;
+        bulk->progress.total++;
+    }
+}
+
+bulk_item_t *bulk_next(bulk_t *bulk, long long *deadline)
+{
+    bulk_item_t *best = NULL, *item;
+    long long now = bluetooth_now_ms();
+    size_t i;
+
+    bulk_fill(bulk);
+
+    if (bulk->progress.in_flight >= (size_t)bulk->limit)
+        return NULL;
+    if (now >= bulk->deadline || bluetooth_cancelled(bulk->cancel_fd))
+        return NULL;
+
+    for (i = 0; i < bulk->n; i++) {
+        item = &bulk->items[i];
+        if (item->state != BULK_WAITING || item->not_before > now)
+            continue;
+        if (best == NULL || item->priority > best->priority ||
+            (item->priority == best->priority && item->seq < best->seq))
+            best = item;
+    }
+    if (best == NULL)
+        return NULL;
+
+    best->state = BULK_IN_FLIGHT;
+    best->attempts++;
+    bulk->progress.in_flight++;
+
+    *deadline = best->deadline < bulk->deadline ? best->deadline : bulk->deadline;
+    if (bulk->attempt_timeout_ms > 0 && now + bulk->attempt_timeout_ms < *deadline)
+        *deadline = now + bulk->attempt_timeout_ms;
+    return best;
+}
+
+void bulk_done(bulk_t *bulk, bulk_item_t *item, bool ok)
+{
+    long long backoff;
+
+    bulk->progress.in_flight--;
+
+    /* A failure next to other attempts means the controller is full: stay at
+     * what it holds. Grow back by one after a limit's worth of successes */
+    if (!ok && bulk->progress.in_flight > 0) {
+        bulk->limit = bulk->progress.in_flight;
+        bulk->successes = 0;
+    } else if (ok && bulk->limit < bulk->max_in_flight && ++bulk->successes >= bulk->limit) {
+        bulk->limit++;
+        bulk->successes = 0;
+    }
+
+    if (ok) {
+        item->state = BULK_CONNECTED;
+        bulk->progress.connected++;
+    } else if (item->attempts <= bulk->max_retries) {
+        /* the controller is likely busy, give it room */
+        backoff = BULK_BACKOFF_MS << (item->attempts - 1 < 4 ? item->attempts - 1 : 4);
+        if (backoff > BULK_BACKOFF_MAX_MS)
+            backoff = BULK_BACKOFF_MAX_MS;
+        item->state = BULK_WAITING;
+        item->seq = bulk->seq++;
+        item->not_before = bluetooth_now_ms() + backoff;
+        bulk->progress.retries++;
+    } else {
+        item->state = BULK_FAILED;
+        bulk->progress.failed++;
+    }
+
+    if (bulk->cb)
+        bulk->cb(&bulk->progress, item->device, ok, bulk->userdata);
+}
+
+long long bulk_wake(bulk_t *bulk)
+{
+    long long wake = -1;
+    size_t i;
+
+    for (i = 0; i < bulk->n; i++) {
+        if (bulk->items[i].state != BULK_WAITING)
+            continue;
+        if (wake < 0 || bulk->items[i].not_before < wake)
+            wake = bulk->items[i].not_before;
+    }
+    return wake;
+}
+
+int bulk_finish(bulk_t *bulk)
+{
+    size_t i;
+
+    for (i = 0; i < bulk->n; i++) {
+        if (bulk->items[i].state != BULK_WAITING)
+            continue;
+        bulk->items[i].state = BULK_FAILED;
+        bulk->progress.failed++;
+        if (bulk->cb)
+            bulk->cb(&bulk->progress, bulk->items[i].device, false, bulk->userdata);
+    }
+    free(bulk->items);
+    bulk->items = NULL;
+    return bulk->progress.connected;
+}
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bluetooth_internal.h"
+
+#define DEVICE_IDS_INITIAL_CAP  (64)
+
+/*
+ * Ids are MAC addresses numbered in order of first sight, never reused while
+ * the handle lives. Entry id - 1 of every array belongs to device id.
+ */
+
+static uint32_t hash_macaddr(const char *macaddr)
+{
+    uint32_t h = 2166136261u;
+
+    while (*macaddr)
+        h = (h ^ (unsigned char)*macaddr++) * 16777619u;
+    return h;
+}
+
+/* Id of macaddr, or the empty index slot it would go in as -(slot + 1). Caller holds lock */
+static long find(const device_ids_t *ids, const char *macaddr)
+{
+    size_t mask = ids->index_size - 1;
+    size_t i = hash_macaddr(macaddr) & mask;
+    uint32_t id;
+
+    for (;; i = (i + 1) & mask) {
+        id = ids->index[i];
+        if (id == 0)
+            return -(long)i - 1;
+        if (!strcmp(ids->macaddr[id - 1], macaddr))
+            return id;
+    }
+}
+
+static int grow(device_ids_t *ids)
+{
+    size_t cap = ids->cap ? ids->cap * 2 : DEVICE_IDS_INITIAL_CAP;
+    size_t index_size = cap * 2, d, i;
+    void *macaddr, *name;
+    uint32_t *index;
+
+    macaddr = realloc(ids->macaddr, cap * sizeof(*ids->macaddr));
+    if (macaddr)
+        ids->macaddr = macaddr;
+    name = realloc(ids->name, cap * sizeof(*ids->name));
+    if (name)
+        ids->name = name;
+    index = calloc(index_size, sizeof(uint32_t));
+    if (!macaddr || !name || !index) {
+        free(index);
+        return 1;
+    }
+
+    /* keep the index at most half full */
+    for (d = 0; d < ids->n; d++) {
+        for (i = hash_macaddr(ids->macaddr[d]) & (index_size - 1); index[i];
+             i = (i + 1) & (index_size - 1))
+            ;
+        index[i] = d + 1;
+    }
+    free(ids->index);
+    ids->index = index;
+    ids->index_size = index_size;
+    ids->cap = cap;
+    return 0;
+}
+
+int device_ids_init(device_ids_t *ids)
+{
+    memset(ids, 0, sizeof(*ids));
+    pthread_mutex_init(&ids->lock, NULL);
+    if (grow(ids)) {
+        device_ids_destroy(ids);
+        return 1;
+    }
+    return 0;
+}
+
+void device_ids_destroy(device_ids_t *ids)
+{
+    pthread_mutex_destroy(&ids->lock);
+    free(ids->macaddr);
+    free(ids->name);
+    free(ids->index);
+}
+
+bluetooth_device_id_t device_ids_assign(device_ids_t *ids, const char *macaddr, const char *name)
+{
+    long id;
+
+    if (strlen(macaddr) >= BLUETOOTH_MACADDR_MAXLEN)
+        return BLUETOOTH_DEVICE_ID_NONE;
+
+    pthread_mutex_lock(&ids->lock);
+    id = find(ids, macaddr);
+    if (id < 0) {
+        if (ids->n == ids->cap) {
+            if (grow(ids)) {
+                pthread_mutex_unlock(&ids->lock);
+                return BLUETOOTH_DEVICE_ID_NONE;
+            }
+            id = find(ids, macaddr);
+        }
+        ids->index[-id - 1] = ids->n + 1;
+        id = ++ids->n;
+        strcpy(ids->macaddr[id - 1], macaddr);
+        ids->name[id - 1][0] = '\0';
+    }
+    /* renamed devices keep their id */
+    if (name) {
+        strncpy(ids->name[id - 1], name, BLUETOOTH_DEVNAME_MAXLEN);
+        ids->name[id - 1][BLUETOOTH_DEVNAME_MAXLEN - 1] = '\0';
+    }
+    pthread_mutex_unlock(&ids->lock);
+    return id;
+}
+
+bluetooth_device_id_t device_ids_find(device_ids_t *ids, const char *macaddr)
+{
+    long id;
+
+    pthread_mutex_lock(&ids->lock);
+    id = find(ids, macaddr);
+    pthread_mutex_unlock(&ids->lock);
+    return id > 0 ? id : BLUETOOTH_DEVICE_ID_NONE;
+}
+
+bluetooth_device_id_t device_ids_lookup(device_ids_t *ids, const char *device)
+{
+    bluetooth_device_id_t id = device_ids_find(ids, device);
+    size_t d;
+
+    if (id != BLUETOOTH_DEVICE_ID_NONE)
+        return id;
+
+    /* by name, once per caller: not worth an index */
+    pthread_mutex_lock(&ids->lock);
+    for (d = 0; d < ids->n; d++) {
+        if (strcmp(ids->name[d], device))
+            continue;
+        if (id != BLUETOOTH_DEVICE_ID_NONE) {
+            id = BLUETOOTH_DEVICE_ID_NONE;
+            break;
+        }
+        id = d + 1;
+    }
+    pthread_mutex_unlock(&ids->lock);
+    return id;
+}
+
+int device_ids_macaddr(device_ids_t *ids, bluetooth_device_id_t id, char *macaddr)
+{
+    int ret = 1;
+
+    pthread_mutex_lock(&ids->lock);
+    if (id != BLUETOOTH_DEVICE_ID_NONE && id <= ids->n) {
+        memcpy(macaddr, ids->macaddr[id - 1], BLUETOOTH_MACADDR_MAXLEN);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ids->lock);
+    return ret;
+}
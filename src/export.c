@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bluetooth_internal.h"
+
+#define DEVICE_LOG_INITIAL_CAP  (64)
+/* output is handed over in pieces of this size */
+#define EXPORT_BUF_SIZE         (4096)
+
+/*
+ * Every device id has an entry saying at which generation it came, went and
+ * each of its fields last changed. Entries are also chained in the order of
+ * their last change, so an export walks only the ones changed after since:
+ * its cost follows the churn, not the table.
+ */
+
+enum export_op {
+    EXPORT_END,
+    EXPORT_ADD,
+    EXPORT_CHANGE,
+    EXPORT_REMOVE,
+};
+
+enum export_field {
+    EXPORT_MACADDR  = 1 << 0,
+    EXPORT_NAME     = 1 << 1,
+    EXPORT_FLAGS    = 1 << 2,
+    EXPORT_ICON     = 1 << 3,
+};
+
+/* Encoded under the log lock, handed over after it: out may block */
+typedef struct export_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    bool failed;
+} export_buf_t;
+
+void device_log_init(device_log_t *log)
+{
+    memset(log, 0, sizeof(*log));
+    pthread_mutex_init(&log->lock, NULL);
+}
+
+void device_log_destroy(device_log_t *log)
+{
+    free(log->entries);
+    pthread_mutex_destroy(&log->lock);
+}
+
+static int reserve(device_log_t *log, bluetooth_device_id_t id)
+{
+    size_t cap = log->cap ? log->cap : DEVICE_LOG_INITIAL_CAP;
+    device_log_entry_t *entries;
+
+    if (id <= log->cap)
+        return 0;
+    while (cap < id)
+        cap *= 2;
+    entries = realloc(log->entries, cap * sizeof(device_log_entry_t));
+    if (entries == NULL)
+        return 1;
+    memset(entries + log->cap, 0, (cap - log->cap) * sizeof(device_log_entry_t));
+    log->entries = entries;
+    log->cap = cap;
+    return 0;
+}
+
+/* Move id to the newest end of the change order */
+static void touch(device_log_t *log, bluetooth_device_id_t id, unsigned long long generation)
+{
+    device_log_entry_t *e = &log->entries[id - 1];
+
+    e->changed = generation;
+    if (log->newest == id)
+        return;
+    /* unlink, if linked */
+    if (e->older)
+        log->entries[e->older - 1].newer = e->newer;
+    else if (log->oldest == id)
+        log->oldest = e->newer;
+    if (e->newer)
+        log->entries[e->newer - 1].older = e->older;
+
+    e->older = log->newest;
+    e->newer = 0;
+    if (log->newest)
+        log->entries[log->newest - 1].newer = id;
+    log->newest = id;
+    if (!log->oldest)
+        log->oldest = id;
+}
+
+void device_log_update(device_log_t *log, const bluetooth_device_table_t *prev,
+                       const bluetooth_device_table_t *next)
+{
+    unsigned long long gen = next->generation;
+    const bluetooth_device_info_t *dev, *was;
+    device_log_entry_t *e;
+    bluetooth_device_id_t id;
+    bool changed;
+    size_t i;
+
+    for (i = 0; i < next->n_devices; i++) {
+        dev = &next->devices[i];
+        id = dev->id;
+        if (id == BLUETOOTH_DEVICE_ID_NONE || reserve(log, id))
+            continue;
+        e = &log->entries[id - 1];
+        if (!e->present) {
+            if (!e->first_seen)
+                e->first_seen = gen;
+            e->added = e->name = e->flags = e->icon = gen;
+            e->present = true;
+            touch(log, id, gen);
+        } else {
+            /* row is still the one in prev */
+            was = &prev->devices[e->row];
+            changed = false;
+            if (strcmp(was->name, dev->name)) {
+                e->name = gen;
+                changed = true;
+            }
+            if (was->flags != dev->flags) {
+                e->flags = gen;
+                changed = true;
+            }
+            if (strcmp(was->icon, dev->icon)) {
+                e->icon = gen;
+                changed = true;
+            }
+            if (changed)
+                touch(log, id, gen);
+        }
+        e->row = i;
+    }
+
+    /* listed devices have their row in next by now, the others an old one */
+    for (i = 0; i < prev->n_devices; i++) {
+        id = prev->devices[i].id;
+        if (id == BLUETOOTH_DEVICE_ID_NONE || id > log->cap)
+            continue;
+        e = &log->entries[id - 1];
+        if (!e->present ||
+            (e->row < next->n_devices && next->devices[e->row].id == id))
+            continue;
+        e->present = false;
+        e->removed = gen;
+        touch(log, id, gen);
+    }
+}
+
+static void put(export_buf_t *buf, const void *data, size_t len)
+{
+    size_t cap = buf->cap ? buf->cap : EXPORT_BUF_SIZE;
+    unsigned char *grown;
+
+    if (buf->failed)
+        return;
+    while (cap < buf->len + len)
+        cap *= 2;
+    if (cap != buf->cap) {
+        grown = realloc(buf->data, cap);
+        if (grown == NULL) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void put_byte(export_buf_t *buf, unsigned char byte)
+{
+    put(buf, &byte, 1);
+}
+
+/* LEB128 */
+static void put_varint(export_buf_t *buf, unsigned long long v)
+{
+    unsigned char bytes[10];
+    size_t n = 0;
+
+    do {
+        bytes[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    put(buf, bytes, n);
+}
+
+static void put_u64(export_buf_t *buf, unsigned long long v)
+{
+    unsigned char bytes[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        bytes[i] = v >> (8 * i);
+    put(buf, bytes, sizeof(bytes));
+}
+
+static void put_string(export_buf_t *buf, const char *s)
+{
+    size_t len = strlen(s);
+
+    put_byte(buf, len);
+    put(buf, s, len);
+}
+
+static void put_json_string(export_buf_t *buf, const char *s)
+{
+    char esc[8];
+
+    put_byte(buf, '"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            put_byte(buf, '\\');
+            put_byte(buf, *s);
+        } else if ((unsigned char)*s < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+            put(buf, esc, 6);
+        } else {
+            put_byte(buf, *s);
+        }
+    }
+    put_byte(buf, '"');
+}
+
+/* "C0:FF:EE:00:00:01" -> 6 bytes, zeros if malformed */
+static void put_macaddr(export_buf_t *buf, const char *macaddr)
+{
+    unsigned char bytes[6] = { 0 };
+    unsigned int b[6];
+    int i;
+
+    if (sscanf(macaddr, "%2x:%2x:%2x:%2x:%2x:%2x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) == 6) {
+        for (i = 0; i < 6; i++)
+            bytes[i] = b[i];
+    }
+    put(buf, bytes, sizeof(bytes));
+}
+
+static void put_record(export_buf_t *buf, int format, int op, bluetooth_device_id_t id,
+                       unsigned int fields, const bluetooth_device_info_t *dev)
+{
+    static const char *const ops[] = { "", "add", "change", "remove" };
+    char text[96];
+
+    if (format == BLUETOOTH_EXPORT_BINARY) {
+        put_byte(buf, op);
+        put_varint(buf, id);
+        if (op == EXPORT_REMOVE)
+            return;
+        put_byte(buf, fields);
+        if (fields & EXPORT_MACADDR)
+            put_macaddr(buf, dev->macaddr);
+        if (fields & EXPORT_NAME)
+            put_string(buf, dev->name);
+        if (fields & EXPORT_FLAGS)
+            put_varint(buf, dev->flags);
+        if (fields & EXPORT_ICON)
+            put_string(buf, dev->icon);
+        return;
+    }
+
+    put(buf, text, snprintf(text, sizeof(text), "{\"op\":\"%s\",\"id\":%u", ops[op], id));
+    if (fields & EXPORT_MACADDR)
+        put(buf, text, snprintf(text, sizeof(text), ",\"mac\":\"%s\"", dev->macaddr));
+    if (fields & EXPORT_NAME) {
+        put(buf, ",\"name\":", 8);
+        put_json_string(buf, dev->name);
+    }
+    if (fields & EXPORT_FLAGS)
+        put(buf, text, snprintf(text, sizeof(text), ",\"flags\":%u", dev->flags));
+    if (fields & EXPORT_ICON) {
+        put(buf, ",\"icon\":", 8);
+        put_json_string(buf, dev->icon);
+    }
+    put(buf, "}\n", 2);
+}
+
+int device_log_export(device_log_t *log, const bluetooth_device_table_t *table,
+                      unsigned long long since, int format, void **data, size_t *len)
+{
+    export_buf_t buf = { 0 };
+    const bluetooth_device_info_t *dev;
+    const device_log_entry_t *e;
+    bluetooth_device_id_t id;
+    unsigned int fields;
+    char text[96];
+
+    if (format == BLUETOOTH_EXPORT_BINARY) {
+        put(&buf, "BTD1", 4);
+        put_u64(&buf, since);
+        put_u64(&buf, table->generation);
+    } else {
+        put(&buf, text, snprintf(text, sizeof(text), "{\"since\":%llu,\"generation\":%llu}\n",
+                                 since, table->generation));
+    }
+
+    /* back to the first change after since, then forward in order */
+    for (id = log->newest; id && log->entries[id - 1].changed > since; id = log->entries[id - 1].older)
+        ;
+    id = id ? log->entries[id - 1].newer : log->oldest;
+
+    for (; id && !buf.failed; id = e->newer) {
+        e = &log->entries[id - 1];
+        if (!e->present) {
+            /* the receiver may know it, unless it came and went since */
+            if (e->first_seen <= since)
+                put_record(&buf, format, EXPORT_REMOVE, id, 0, NULL);
+            continue;
+        }
+        dev = &table->devices[e->row];
+        if (e->added > since) {
+            put_record(&buf, format, EXPORT_ADD, id,
+                       EXPORT_MACADDR | EXPORT_NAME | EXPORT_FLAGS | EXPORT_ICON, dev);
+            continue;
+        }
+        fields = (e->name > since ? EXPORT_NAME : 0) | (e->flags > since ? EXPORT_FLAGS : 0) |
+                 (e->icon > since ? EXPORT_ICON : 0);
+        put_record(&buf, format, EXPORT_CHANGE, id, fields, dev);
+    }
+
+    if (format == BLUETOOTH_EXPORT_BINARY)
+        put_byte(&buf, EXPORT_END);
+    if (buf.failed) {
+        free(buf.data);
+        return 1;
+    }
+    *data = buf.data;
+    *len = buf.len;
+    return 0;
+}
+
+int device_log_output(const void *data, size_t len, bluetooth_export_cb_t out, void *userdata)
+{
+    size_t n;
+
+    for (; len; len -= n) {
+        n = len < EXPORT_BUF_SIZE ? len : EXPORT_BUF_SIZE;
+        if (out(data, n, userdata))
+            return 1;
+        data = (const unsigned char *)data + n;
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "bluetooth.h"
+
+/* values moved per recvmmsg/sendmmsg call */
+#define GATT_BATCH  (64)
+
+int bluetooth_gatt_recv(int fd, struct iovec *values, int n, int timeout_ms)
+{
+    struct mmsghdr msgs[GATT_BATCH];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int i, ret;
+
+    if (n > GATT_BATCH)
+        n = GATT_BATCH;
+
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret <= 0)
+        return ret;
+
+    memset(msgs, 0, sizeof(msgs[0]) * n);
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_iov = &values[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* take whatever is queued, don't wait for the batch to fill */
+    ret = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+    if (ret < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    for (i = 0; i < ret; i++)
+        values[i].iov_len = msgs[i].msg_len;
+    return ret;
+}
+
+int bluetooth_gatt_send(int fd, const struct iovec *values, int n)
+{
+    struct mmsghdr msgs[GATT_BATCH];
+    int i, ret, sent = 0;
+
+    while (sent < n) {
+        int batch = (n - sent > GATT_BATCH) ? GATT_BATCH : n - sent;
+
+        memset(msgs, 0, sizeof(msgs[0]) * batch);
+        for (i = 0; i < batch; i++) {
+            msgs[i].msg_hdr.msg_iov = (struct iovec *)&values[sent + i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = sendmmsg(fd, msgs, batch, MSG_NOSIGNAL);
+        if (ret < 0)
+            return sent ? sent : -1;
+        sent += ret;
+    }
+    return sent;
+}
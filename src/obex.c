@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <dbus/dbus.h>
+
+#include "bluetooth_internal.h"
+
+#define OBEX_SERVICE    "org.bluez.obex"
+#define OBEX_PATH       "/org/bluez/obex"
+
+/*
+ * One session per object: CreateSession, ChangeFolder for File Transfer,
+ * SendFile or PutFile, then Transfer1 signals until complete or error.
+ * Every call is pending on the one connection, so devices proceed side by
+ * side; objects to the same device wait for the one ahead.
+ *
+ * obexd reads the source itself, through /proc/<pid>/fd/<fd> of the caller.
+ * Object Push names the object after the file it is given: a symlink named
+ * so, removed once obexd opened it.
+ */
+
+enum obex_step {
+    STEP_WAITING,
+    STEP_SESSION,
+    STEP_FOLDER,
+    STEP_SEND,
+    STEP_TRANSFER,
+    STEP_DONE,
+};
+
+struct obex {
+    DBusConnection *conn;
+    /* readable once the caller cancels, see bluetooth_cancel() */
+    int cancel_fd;
+};
+
+typedef struct obex_batch obex_batch_t;
+
+typedef struct obex_job {
+    obex_batch_t *batch;
+    const bluetooth_obex_request_t *request;
+    const char *macaddr;
+    int step;
+    DBusPendingCall *pending;
+    char session[128];
+    char transfer[128];
+    /* Object Push only, empty once removed */
+    char link_dir[128];
+    char link[384];
+    bluetooth_obex_progress_t progress;
+} obex_job_t;
+
+struct obex_batch {
+    obex_t *obex;
+    obex_job_t *jobs;
+    size_t n;
+    long long deadline;
+    bluetooth_obex_cb_t cb;
+    void *userdata;
+};
+
+obex_t *obex_new(int cancel_fd)
+{
+    obex_t *obex = calloc(1, sizeof(obex_t));
+
+    if (obex)
+        obex->cancel_fd = cancel_fd;
+    return obex;
+}
+
+static void obex_close(obex_t *obex)
+{
+    if (!obex->conn)
+        return;
+    dbus_connection_close(obex->conn);
+    dbus_connection_unref(obex->conn);
+    obex->conn = NULL;
+}
+
+void obex_free(obex_t *obex)
+{
+    if (obex == NULL)
+        return;
+    obex_close(obex);
+    free(obex);
+}
+
+/* The session bus connection outlives calls, like the bluez one */
+static int obex_connect(obex_t *obex)
+{
+    DBusError err;
+
+    if (obex->conn && dbus_connection_get_is_connected(obex->conn))
+        return 0;
+    obex_close(obex);
+
+    dbus_error_init(&err);
+    obex->conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+    if (!obex->conn) {
+        dbus_error_free(&err);
+        return 1;
+    }
+    dbus_connection_set_exit_on_disconnect(obex->conn, FALSE);
+    dbus_bus_add_match(obex->conn,
+        "type='signal',sender='" OBEX_SERVICE "',"
+        "interface='org.freedesktop.DBus.Properties',"
+        "member='PropertiesChanged',arg0='org.bluez.obex.Transfer1'", NULL);
+    return 0;
+}
+
+/* Dispatch what is queued, or wait for traffic until deadline and dispatch
+ * that. Return 1 once the deadline passed or the caller cancelled */
+static int obex_wait(obex_t *obex, long long deadline)
+{
+    struct pollfd pfd[3];
+    long long remaining;
+    int fd, npfd;
+
+    if (bluetooth_cancelled(obex->cancel_fd))
+        return 1;
+
+    if (dbus_connection_get_dispatch_status(obex->conn) != DBUS_DISPATCH_DATA_REMAINS) {
+        remaining = deadline - bluetooth_now_ms();
+        if (remaining <= 0)
+            return 1;
+        if (!dbus_connection_get_is_connected(obex->conn) || !dbus_connection_get_unix_fd(obex->conn, &fd))
+            return 1;
+
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        npfd = 1 + bluetooth_cancel_pollfds(obex->cancel_fd, &pfd[1]);
+        if (poll(pfd, npfd, bluetooth_timeout_ms(remaining)) < 0 && errno != EINTR)
+            return 1;
+        if (npfd > 1 && bluetooth_cancelled(obex->cancel_fd))
+            return 1;
+        dbus_connection_read_write(obex->conn, 0);
+    }
+
+    while (dbus_connection_dispatch(obex->conn) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+    return 0;
+}
+
+static void remove_link(obex_job_t *job)
+{
+    if (!job->link_dir[0])
+        return;
+    unlink(job->link);
+    rmdir(job->link_dir);
+    job->link_dir[0] = '\0';
+}
+
+/* <runtime dir>/hal_bluetooth_obex.XXXXXX/<name> -> /proc/<pid>/fd/<fd> */
+static int make_link(obex_job_t *job, const char *source)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    snprintf(job->link_dir, sizeof(job->link_dir), "%s/hal_bluetooth_obex.XXXXXX",
+             dir && dir[0] ? dir : "/tmp");
+    if (mkdtemp(job->link_dir) == NULL) {
+        job->link_dir[0] = '\0';
+        return 1;
+    }
+    snprintf(job->link, sizeof(job->link), "%s/%s", job->link_dir, job->request->name);
+    if (symlink(source, job->link)) {
+        rmdir(job->link_dir);
+        job->link_dir[0] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+static void job_replied(DBusPendingCall *pending, void *data);
+
+/* The reply is taken as it is dispatched, ahead of the signals behind it */
+static int send_call(obex_t *obex, obex_job_t *job, DBusMessage *message, long long deadline)
+{
+    long long remaining = deadline - bluetooth_now_ms();
+    int ret = 1;
+
+    if (!message)
+        return 1;
+    if (remaining > 0 &&
+        dbus_connection_send_with_reply(obex->conn, message, &job->pending, bluetooth_timeout_ms(remaining)) &&
+        job->pending &&
+        dbus_pending_call_set_notify(job->pending, job_replied, job, NULL))
+        ret = 0;
+    dbus_message_unref(message);
+    return ret;
+}
+
+/* Fire and forget */
+static void send_no_reply(obex_t *obex, DBusMessage *message)
+{
+    if (!message)
+        return;
+    dbus_message_set_no_reply(message, TRUE);
+    dbus_connection_send(obex->conn, message, NULL);
+    dbus_message_unref(message);
+}
+
+static int create_session(obex_t *obex, obex_job_t *job, long long deadline)
+{
+    DBusMessageIter iter, dict, entry, variant;
+    const char *key = "Target", *target = job->request->folder ? "ftp" : "opp";
+    DBusMessage *message;
+
+    message = dbus_message_new_method_call(OBEX_SERVICE, OBEX_PATH, "org.bluez.obex.Client1",
+                                           "CreateSession");
+    if (!message)
+        return 1;
+    dbus_message_iter_init_append(message, &iter);
+    if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &job->macaddr) ||
+        !dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict) ||
+        !dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry) ||
+        !dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key) ||
+        !dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "s", &variant) ||
+        !dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &target) ||
+        !dbus_message_iter_close_container(&entry, &variant) ||
+        !dbus_message_iter_close_container(&dict, &entry) ||
+        !dbus_message_iter_close_container(&iter, &dict)) {
+        dbus_message_unref(message);
+        return 1;
+    }
+    return send_call(obex, job, message, deadline);
+}
+
+/* SendFile or PutFile of the request's fd on the session */
+static int send_object(obex_t *obex, obex_job_t *job, long long deadline)
+{
+    const char *name = job->request->name, *path;
+    char source[64];
+    DBusMessage *message;
+
+    snprintf(source, sizeof(source), "/proc/%d/fd/%d", (int)getpid(), job->request->fd);
+    if (job->request->folder) {
+        path = source;
+        message = dbus_message_new_method_call(OBEX_SERVICE, job->session,
+                                               "org.bluez.obex.FileTransfer1", "PutFile");
+        if (message && !dbus_message_append_args(message, DBUS_TYPE_STRING, &path,
+                                                 DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID)) {
+            dbus_message_unref(message);
+            return 1;
+        }
+    } else {
+        if (make_link(job, source))
+            return 1;
+        path = job->link;
+        message = dbus_message_new_method_call(OBEX_SERVICE, job->session,
+                                               "org.bluez.obex.ObjectPush1", "SendFile");
+        if (message && !dbus_message_append_args(message, DBUS_TYPE_STRING, &path, DBUS_TYPE_INVALID)) {
+            dbus_message_unref(message);
+            return 1;
+        }
+    }
+    return send_call(obex, job, message, deadline);
+}
+
+static int change_folder(obex_t *obex, obex_job_t *job, long long deadline)
+{
+    DBusMessage *message;
+
+    message = dbus_message_new_method_call(OBEX_SERVICE, job->session,
+                                           "org.bluez.obex.FileTransfer1", "ChangeFolder");
+    if (message && !dbus_message_append_args(message, DBUS_TYPE_STRING, &job->request->folder,
+                                             DBUS_TYPE_INVALID)) {
+        dbus_message_unref(message);
+        return 1;
+    }
+    return send_call(obex, job, message, deadline);
+}
+
+static void report(obex_batch_t *batch, obex_job_t *job)
+{
+    if (batch->cb)
+        batch->cb(&job->progress, batch->userdata);
+}
+
+/* The object is done either way: report it, drop the session, free the device */
+static void job_finish(obex_batch_t *batch, obex_job_t *job, bool ok)
+{
+    obex_t *obex = batch->obex;
+
+    if (job->pending) {
+        dbus_pending_call_cancel(job->pending);
+        dbus_pending_call_unref(job->pending);
+        job->pending = NULL;
+    }
+    /* cut short: tell obexd, it keeps going otherwise */
+    if (!ok && job->transfer[0] && obex->conn)
+        send_no_reply(obex, dbus_message_new_method_call(OBEX_SERVICE, job->transfer,
+                                                         "org.bluez.obex.Transfer1", "Cancel"));
+    if (job->session[0] && obex->conn) {
+        const char *session = job->session;
+        DBusMessage *message = dbus_message_new_method_call(OBEX_SERVICE, OBEX_PATH,
+                                                            "org.bluez.obex.Client1", "RemoveSession");
+
+        if (message && !dbus_message_append_args(message, DBUS_TYPE_OBJECT_PATH, &session,
+                                                 DBUS_TYPE_INVALID)) {
+            dbus_message_unref(message);
+            message = NULL;
+        }
+        send_no_reply(obex, message);
+    }
+    remove_link(job);
+
+    job->step = STEP_DONE;
+    job->progress.status = ok ? BLUETOOTH_OBEX_COMPLETE : BLUETOOTH_OBEX_ERROR;
+    if (ok && job->progress.size)
+        job->progress.transferred = job->progress.size;
+    report(batch, job);
+}
+
+/* Transfer1 a{sv}: Status, Transferred and Size. Return 1 if progress moved */
+static int read_transfer(obex_job_t *job, DBusMessageIter *array)
+{
+    DBusMessageIter dict, variant;
+    const char *key, *status;
+    dbus_uint64_t value;
+    int moved = 0;
+
+    if (dbus_message_iter_get_arg_type(array) != DBUS_TYPE_ARRAY)
+        return 0;
+    dbus_message_iter_recurse(array, &dict);
+    for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&dict)) {
+        DBusMessageIter entry;
+
+        dbus_message_iter_recurse(&dict, &entry);
+        dbus_message_iter_get_basic(&entry, &key);
+        if (!dbus_message_iter_next(&entry))
+            continue;
+        dbus_message_iter_recurse(&entry, &variant);
+
+        if (!strcmp(key, "Status") && dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_STRING) {
+            dbus_message_iter_get_basic(&variant, &status);
+            if (!strcmp(status, "active") && job->progress.status != BLUETOOTH_OBEX_ACTIVE) {
+                job->progress.status = BLUETOOTH_OBEX_ACTIVE;
+                moved = 1;
+            } else if (!strcmp(status, "complete")) {
+                job->progress.status = BLUETOOTH_OBEX_COMPLETE;
+            } else if (!strcmp(status, "error")) {
+                job->progress.status = BLUETOOTH_OBEX_ERROR;
+            }
+        } else if (dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_UINT64) {
+            dbus_message_iter_get_basic(&variant, &value);
+            if (!strcmp(key, "Size")) {
+                job->progress.size = value;
+            } else if (!strcmp(key, "Transferred") && value != job->progress.transferred) {
+                job->progress.transferred = value;
+                moved = 1;
+            }
+        }
+    }
+    return moved;
+}
+
+/* Take the reply and make the next call. Return 1 once the job is over, *ok tells how */
+static int job_step(obex_batch_t *batch, obex_job_t *job, long long deadline, bool *ok)
+{
+    DBusMessage *reply = dbus_pending_call_steal_reply(job->pending);
+    DBusMessageIter iter;
+    const char *path;
+    int ret = 1;
+
+    dbus_pending_call_unref(job->pending);
+    job->pending = NULL;
+    *ok = false;
+    if (!reply || dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+        goto out;
+
+    switch (job->step) {
+    case STEP_SESSION:
+        if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID))
+            break;
+        snprintf(job->session, sizeof(job->session), "%s", path);
+        job->step = job->request->folder ? STEP_FOLDER : STEP_SEND;
+        ret = job->request->folder ? change_folder(batch->obex, job, deadline) :
+                                     send_object(batch->obex, job, deadline);
+        break;
+    case STEP_FOLDER:
+        job->step = STEP_SEND;
+        ret = send_object(batch->obex, job, deadline);
+        break;
+    case STEP_SEND:
+        /* (oa{sv}): the transfer and its properties. obexd holds the source open now */
+        remove_link(job);
+        if (!dbus_message_iter_init(reply, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)
+            break;
+        dbus_message_iter_get_basic(&iter, &path);
+        snprintf(job->transfer, sizeof(job->transfer), "%s", path);
+        job->step = STEP_TRANSFER;
+        if (dbus_message_iter_next(&iter))
+            read_transfer(job, &iter);
+        /* small objects may be through already */
+        if (job->progress.status == BLUETOOTH_OBEX_COMPLETE || job->progress.status == BLUETOOTH_OBEX_ERROR) {
+            *ok = job->progress.status == BLUETOOTH_OBEX_COMPLETE;
+            break;
+        }
+        report(batch, job);
+        ret = 0;
+        break;
+    }
+
+out:
+    if (reply)
+        dbus_message_unref(reply);
+    return ret;
+}
+
+static void job_replied(DBusPendingCall *pending, void *data)
+{
+    obex_job_t *job = (obex_job_t *)data;
+    bool ok;
+
+    if (job->pending == pending && job_step(job->batch, job, job->batch->deadline, &ok))
+        job_finish(job->batch, job, ok);
+}
+
+static DBusHandlerResult obex_signal_filter(DBusConnection *connection, DBusMessage *message, void *data)
+{
+    obex_batch_t *batch = (obex_batch_t *)data;
+    const char *path = dbus_message_get_path(message), *interface;
+    DBusMessageIter iter;
+    obex_job_t *job;
+    size_t i;
+
+    (void)connection;
+
+    /* sa{sv}as */
+    if (!dbus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged") ||
+        !path || !dbus_message_iter_init(message, &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    dbus_message_iter_get_basic(&iter, &interface);
+    if (strcmp(interface, "org.bluez.obex.Transfer1") || !dbus_message_iter_next(&iter))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    for (i = 0; i < batch->n; i++) {
+        job = &batch->jobs[i];
+        if (job->step != STEP_TRANSFER || strcmp(job->transfer, path))
+            continue;
+        if (read_transfer(job, &iter) && job->progress.status == BLUETOOTH_OBEX_ACTIVE)
+            report(batch, job);
+        if (job->progress.status == BLUETOOTH_OBEX_COMPLETE)
+            job_finish(batch, job, true);
+        else if (job->progress.status == BLUETOOTH_OBEX_ERROR)
+            job_finish(batch, job, false);
+        break;
+    }
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Another object to the same device is underway */
+static bool device_busy(obex_batch_t *batch, const obex_job_t *job)
+{
+    size_t i;
+
+    for (i = 0; i < batch->n; i++) {
+        if (batch->jobs[i].step > STEP_WAITING && batch->jobs[i].step < STEP_DONE &&
+            !strcmp(batch->jobs[i].macaddr, job->macaddr))
+            return true;
+    }
+    return false;
+}
+
+int obex_send(obex_t *obex, const bluetooth_obex_request_t *requests,
+              const char (*macaddrs)[BLUETOOTH_MACADDR_MAXLEN], size_t n, long long deadline,
+              bluetooth_obex_cb_t cb, void *userdata)
+{
+    obex_batch_t batch = { .obex = obex, .n = n, .deadline = deadline, .cb = cb, .userdata = userdata };
+    obex_job_t *job;
+    size_t i, active;
+    int sent = 0;
+
+    if (obex_connect(obex))
+        return -1;
+    batch.jobs = calloc(n ? n : 1, sizeof(obex_job_t));
+    if (batch.jobs == NULL)
+        return -1;
+    dbus_connection_add_filter(obex->conn, obex_signal_filter, &batch, NULL);
+
+    for (i = 0; i < n; i++) {
+        job = &batch.jobs[i];
+        job->batch = &batch;
+        job->request = &requests[i];
+        job->macaddr = macaddrs[i];
+        job->progress.index = i;
+        /* no device, or a name obexd would take as a path */
+        if (!job->macaddr[0] || requests[i].fd < 0 || !requests[i].name || !requests[i].name[0] ||
+            strchr(requests[i].name, '/'))
+            job_finish(&batch, job, false);
+    }
+
+    for (;;) {
+        active = 0;
+        for (i = 0; i < n; i++) {
+            job = &batch.jobs[i];
+            if (job->step == STEP_WAITING && !device_busy(&batch, job)) {
+                job->step = STEP_SESSION;
+                if (create_session(obex, job, deadline))
+                    job_finish(&batch, job, false);
+            }
+            active += job->step != STEP_DONE;
+        }
+        if (active == 0)
+            break;
+        dbus_connection_flush(obex->conn);
+        if (obex_wait(obex, deadline))
+            break;
+    }
+
+    /* out of time, cancelled or obexd gone */
+    for (i = 0; i < n; i++) {
+        if (batch.jobs[i].step != STEP_DONE)
+            job_finish(&batch, &batch.jobs[i], false);
+        sent += batch.jobs[i].progress.status == BLUETOOTH_OBEX_COMPLETE;
+    }
+    if (obex->conn) {
+        dbus_connection_flush(obex->conn);
+        dbus_connection_remove_filter(obex->conn, obex_signal_filter, &batch);
+        if (!dbus_connection_get_is_connected(obex->conn))
+            obex_close(obex);
+    }
+    free(batch.jobs);
+    return sent;
+}
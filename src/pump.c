@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "bluetooth_internal.h"
+
+#define PUMP_BUFSIZE        (4096)
+#define PUMP_MAX_LINKS      (4096)
+/* bluetooth_pump_free() waits this long for cancelled reads to come back */
+#define PUMP_DRAIN_MS       (1000)
+/* buffer group of the rx buffer ring */
+#define PUMP_BGID           (0)
+
+/*
+ * Every open link has one multishot recv armed for as long as it lives: the
+ * kernel picks a buffer from the rx buffer ring for each read, and the
+ * buffer goes back to the ring once the callback returned. A link with
+ * something queued in its slot of tx gets a send from the registered tx
+ * buffer. A run submits the sends and rearms recvs that ended with the wait
+ * for the first completion, in one io_uring_enter(). Sends keep MSG_NOSIGNAL:
+ * a peer gone must not raise SIGPIPE in the application.
+ *
+ * Runs only walk the links in use, in active. A removed link keeps its slot
+ * until its operations came back cancelled, the kernel may still read its tx
+ * slot until then.
+ */
+
+enum pump_op {
+    OP_READ,
+    OP_SEND,
+    OP_CANCEL,
+};
+
+enum link_state {
+    LINK_FREE,
+    LINK_OPEN,
+    LINK_CLOSING,
+};
+
+typedef struct pump_link {
+    int state;
+    int fd;
+    /* index in active while open */
+    int pos;
+    bluetooth_pump_cb_t cb;
+    void *userdata;
+    unsigned char *tx;
+    /* queued: tx[tx_off, tx_len) */
+    size_t tx_off;
+    size_t tx_len;
+    /* io_uring: underway, tx bytes being sent */
+    bool reading;
+    size_t sending;
+    bool send_fixed;
+    int inflight;
+} pump_link_t;
+
+typedef struct pump_ring {
+    int fd;
+    bool fixed_tx;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    /* rx buffers handed to the kernel */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned br_entries;
+} pump_ring_t;
+
+struct bluetooth_pump {
+    int max_links;
+    pump_link_t *links;
+    /* open links, then free slots */
+    int *active;
+    int n_active;
+    int *free_links;
+    int n_free;
+    int n_closing;
+    /* rx: rx_count buffers, one per read in io_uring's ring */
+    unsigned char *rx;
+    unsigned rx_count;
+    unsigned char *tx;
+    bool uring;
+    pump_ring_t ring;
+    /* poll() fallback */
+    struct pollfd *pfds;
+    int *pfd_links;
+};
+
+static int ring_setup(pump_ring_t *ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    /* completions are reaped at the next run anyway, no need to interrupt */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (ring->fd < 0)
+        return 1;
+    /* a timeout on the wait needs EXT_ARG, the ops used came before it */
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+        goto fail;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+    ring->cq_ptr = ring->sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail_sq;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+fail_sq:
+    munmap(ring->sq_ptr, ring->sq_size);
+fail:
+    close(ring->fd);
+    ring->fd = -1;
+    return 1;
+}
+
+static void ring_free(pump_ring_t *ring)
+{
+    if (ring->fd < 0)
+        return;
+    if (ring->br)
+        munmap(ring->br, ring->br_size);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/* Next free submission entry, zeroed. NULL if the queue is full */
+static struct io_uring_sqe *ring_sqe(pump_ring_t *ring)
+{
+    unsigned tail = *ring->sq_tail, head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= ring->sq_entries)
+        return NULL;
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/* Submit what is queued, and wait for one completion until deadline if wait */
+static int ring_enter(pump_ring_t *ring, bool wait, long long deadline)
+{
+    struct __kernel_timespec ts = { 0 };
+    struct io_uring_getevents_arg arg = { .ts = (unsigned long long)(uintptr_t)&ts };
+    long long remaining = deadline - bluetooth_now_ms();
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    int ret;
+
+    if (wait && remaining > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        ts.tv_sec = remaining / 1000;
+        ts.tv_nsec = (remaining % 1000) * 1000000;
+    } else if (!ring->to_submit) {
+        return 0;
+    }
+    ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, flags & IORING_ENTER_GETEVENTS ? 1 : 0,
+                  flags, &arg, sizeof(arg));
+    if (ret >= 0) {
+        ring->to_submit -= (unsigned)ret < ring->to_submit ? (unsigned)ret : ring->to_submit;
+        return 0;
+    }
+    /* the wait timed out or was interrupted, submissions went in anyway */
+    if (errno == ETIME || errno == EINTR) {
+        ring->to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        return 0;
+    }
+    return 1;
+}
+
+static unsigned long long user_data(int link, int op)
+{
+    return ((unsigned long long)link << 2) | op;
+}
+
+/* Hand rx buffer bid to the kernel for the next read */
+static void ring_give(bluetooth_pump_t *pump, unsigned bid)
+{
+    pump_ring_t *ring = &pump->ring;
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (ring->br_entries - 1)];
+
+    buf->addr = (unsigned long long)(uintptr_t)(pump->rx + (size_t)bid * PUMP_BUFSIZE);
+    buf->len = PUMP_BUFSIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/* rx as a ring of provided buffers, tx registered as one fixed buffer.
+ * Multishot recv needs the former: without it, poll. Past RLIMIT_MEMLOCK
+ * for the latter: plain sends */
+static int ring_buffers(bluetooth_pump_t *pump)
+{
+    pump_ring_t *ring = &pump->ring;
+    struct io_uring_buf_reg reg;
+    struct iovec iov;
+    unsigned i;
+
+    ring->br_entries = pump->rx_count;
+    ring->br_size = ring->br_entries * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        ring->br = NULL;
+        return 1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)ring->br;
+    reg.ring_entries = ring->br_entries;
+    reg.bgid = PUMP_BGID;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+        return 1;
+    for (i = 0; i < pump->rx_count; i++)
+        ring_give(pump, i);
+
+    iov.iov_base = pump->tx;
+    iov.iov_len = (size_t)pump->max_links * PUMP_BUFSIZE;
+    ring->fixed_tx = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return 0;
+}
+
+static void link_close(bluetooth_pump_t *pump, int link);
+
+/* Queue the read and send each open link needs */
+static void ring_prepare(bluetooth_pump_t *pump)
+{
+    struct io_uring_sqe *sqe;
+    pump_link_t *l;
+    int i, link;
+
+    for (i = 0; i < pump->n_active; i++) {
+        link = pump->active[i];
+        l = &pump->links[link];
+        if (!l->reading && (sqe = ring_sqe(&pump->ring))) {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = l->fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = PUMP_BGID;
+            sqe->user_data = user_data(link, OP_READ);
+            l->reading = true;
+            l->inflight++;
+        }
+        if (!l->sending && l->tx_len > l->tx_off && (sqe = ring_sqe(&pump->ring))) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = l->fd;
+            sqe->addr = (unsigned long long)(uintptr_t)(l->tx + l->tx_off);
+            sqe->len = l->tx_len - l->tx_off;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            if (pump->ring.fixed_tx) {
+                sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+                sqe->buf_index = 0;
+            }
+            l->send_fixed = pump->ring.fixed_tx;
+            sqe->user_data = user_data(link, OP_SEND);
+            l->sending = sqe->len;
+            l->inflight++;
+        }
+    }
+}
+
+static void ring_cancel(bluetooth_pump_t *pump, int link, int op)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&pump->ring);
+
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data(link, op);
+    sqe->user_data = user_data(link, OP_CANCEL);
+}
+
+/* Handle the completions there are. Return reads and sends done */
+static int ring_reap(bluetooth_pump_t *pump)
+{
+    pump_ring_t *ring = &pump->ring;
+    unsigned head = *ring->cq_head, flags;
+    struct io_uring_cqe *cqe;
+    pump_link_t *l;
+    int done = 0, link, op, res;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        link = cqe->user_data >> 2;
+        op = cqe->user_data & 3;
+        res = cqe->res;
+        flags = cqe->flags;
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        if (op == OP_CANCEL || link >= pump->max_links)
+            continue;
+
+        l = &pump->links[link];
+        /* a multishot recv goes on while the kernel says more */
+        if (op == OP_SEND || !(flags & IORING_CQE_F_MORE)) {
+            l->inflight--;
+            if (op == OP_READ)
+                l->reading = false;
+            else
+                l->sending = 0;
+        }
+
+        if (l->state == LINK_CLOSING) {
+            if (op == OP_READ && (flags & IORING_CQE_F_BUFFER))
+                ring_give(pump, flags >> IORING_CQE_BUFFER_SHIFT);
+            if (l->inflight == 0) {
+                l->state = LINK_FREE;
+                pump->n_closing--;
+                pump->free_links[pump->n_free++] = link;
+            }
+            continue;
+        }
+        /* out of rx buffers: rearmed next run, once they came back */
+        if (res == -EINTR || res == -EAGAIN || res == -ENOBUFS)
+            continue;
+        /* this kernel can't send from a registered buffer: sent plain next run */
+        if (op == OP_SEND && res == -EINVAL && l->send_fixed) {
+            ring->fixed_tx = false;
+            continue;
+        }
+        if (res <= 0) {
+            /* end of stream or a dead link: last call */
+            link_close(pump, link);
+            continue;
+        }
+        done++;
+        if (op == OP_READ) {
+            l->cb(pump, link, pump->rx + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * PUMP_BUFSIZE, res,
+                  l->userdata);
+            ring_give(pump, flags >> IORING_CQE_BUFFER_SHIFT);
+        } else {
+            l->tx_off += res;
+            if (l->tx_off == l->tx_len)
+                l->tx_off = l->tx_len = 0;
+        }
+    }
+    return done;
+}
+
+static int ring_run(bluetooth_pump_t *pump, long long deadline)
+{
+    ring_prepare(pump);
+    if (ring_enter(&pump->ring, true, deadline))
+        return -1;
+    return ring_reap(pump);
+}
+
+static int poll_run(bluetooth_pump_t *pump, long long deadline)
+{
+    long long remaining = deadline - bluetooth_now_ms();
+    pump_link_t *l;
+    int i, n = 0, done = 0;
+    ssize_t res;
+
+    for (i = 0; i < pump->n_active; i++) {
+        l = &pump->links[pump->active[i]];
+        pump->pfds[n].fd = l->fd;
+        pump->pfds[n].events = POLLIN | (l->tx_len > l->tx_off ? POLLOUT : 0);
+        pump->pfds[n].revents = 0;
+        pump->pfd_links[n++] = pump->active[i];
+    }
+    if (poll(pump->pfds, n, bluetooth_timeout_ms(remaining)) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; i++) {
+        l = &pump->links[pump->pfd_links[i]];
+        /* removed by a callback meanwhile */
+        if (l->state != LINK_OPEN || l->fd != pump->pfds[i].fd)
+            continue;
+        if (pump->pfds[i].revents & POLLOUT) {
+            res = send(l->fd, l->tx + l->tx_off, l->tx_len - l->tx_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (res > 0) {
+                done++;
+                l->tx_off += res;
+                if (l->tx_off == l->tx_len)
+                    l->tx_off = l->tx_len = 0;
+            }
+        }
+        if (pump->pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            res = recv(l->fd, pump->rx, PUMP_BUFSIZE, MSG_DONTWAIT);
+            if (res > 0) {
+                done++;
+                l->cb(pump, pump->pfd_links[i], pump->rx, res, l->userdata);
+            } else if (res == 0 || (errno != EAGAIN && errno != EINTR)) {
+                link_close(pump, pump->pfd_links[i]);
+            }
+        }
+    }
+    return done;
+}
+
+/* Closed from our end or theirs: release the slot, or have it released once
+ * the kernel let go of the buffers */
+static void link_release(bluetooth_pump_t *pump, int link)
+{
+    pump_link_t *l = &pump->links[link];
+
+    pump->active[l->pos] = pump->active[--pump->n_active];
+    pump->links[pump->active[l->pos]].pos = l->pos;
+    if (pump->uring && l->inflight) {
+        if (l->reading)
+            ring_cancel(pump, link, OP_READ);
+        if (l->sending)
+            ring_cancel(pump, link, OP_SEND);
+        l->state = LINK_CLOSING;
+        pump->n_closing++;
+    } else {
+        l->state = LINK_FREE;
+        pump->free_links[pump->n_free++] = link;
+    }
+    close(l->fd);
+    l->fd = -1;
+    l->tx_off = l->tx_len = 0;
+}
+
+/* The link died: tell its owner, once */
+static void link_close(bluetooth_pump_t *pump, int link)
+{
+    pump_link_t *l = &pump->links[link];
+
+    link_release(pump, link);
+    l->cb(pump, link, NULL, 0, l->userdata);
+}
+
+bluetooth_pump_t *bluetooth_pump_new(int max_links, unsigned int flags)
+{
+    bluetooth_pump_t *pump;
+    bool uring = flags & BLUETOOTH_PUMP_URING;
+    int i;
+
+    if (max_links <= 0 || max_links > PUMP_MAX_LINKS)
+        return NULL;
+    pump = calloc(1, sizeof(bluetooth_pump_t));
+    if (pump == NULL)
+        return NULL;
+    pump->max_links = max_links;
+    pump->ring.fd = -1;
+    /* poll reads into one buffer at a time, io_uring into a ring of them: a
+     * power of two, at least one per link */
+    pump->rx_count = 1;
+    while (uring && pump->rx_count < (unsigned)max_links)
+        pump->rx_count <<= 1;
+    pump->links = calloc(max_links, sizeof(pump_link_t));
+    pump->active = calloc(max_links, sizeof(int));
+    pump->free_links = calloc(max_links, sizeof(int));
+    pump->rx = malloc((size_t)pump->rx_count * PUMP_BUFSIZE);
+    pump->tx = malloc((size_t)max_links * PUMP_BUFSIZE);
+    pump->pfds = calloc(max_links, sizeof(struct pollfd));
+    pump->pfd_links = calloc(max_links, sizeof(int));
+    if (!pump->links || !pump->active || !pump->free_links || !pump->rx || !pump->tx || !pump->pfds ||
+        !pump->pfd_links) {
+        bluetooth_pump_free(pump);
+        return NULL;
+    }
+    /* slot 0 first */
+    for (i = 0; i < max_links; i++) {
+        pump->links[i].fd = -1;
+        pump->links[i].tx = pump->tx + (size_t)i * PUMP_BUFSIZE;
+        pump->free_links[pump->n_free++] = max_links - 1 - i;
+    }
+
+    /* a read, a send and a cancel each per link, at most */
+    if (uring && !ring_setup(&pump->ring, max_links * 4)) {
+        pump->uring = !ring_buffers(pump);
+        if (!pump->uring)
+            ring_free(&pump->ring);
+    }
+    return pump;
+}
+
+void bluetooth_pump_free(bluetooth_pump_t *pump)
+{
+    long long deadline = bluetooth_now_ms() + PUMP_DRAIN_MS;
+
+    if (pump == NULL)
+        return;
+    while (pump->n_active)
+        link_release(pump, pump->active[0]);
+    /* the buffers go with pump: wait for the kernel to give them back */
+    while (pump->uring && pump->n_closing) {
+        if (ring_enter(&pump->ring, true, deadline) || bluetooth_now_ms() >= deadline)
+            break;
+        ring_reap(pump);
+    }
+    ring_free(&pump->ring);
+    free(pump->pfd_links);
+    free(pump->pfds);
+    free(pump->tx);
+    free(pump->rx);
+    free(pump->free_links);
+    free(pump->active);
+    free(pump->links);
+    free(pump);
+}
+
+bool bluetooth_pump_uring(const bluetooth_pump_t *pump)
+{
+    return pump && pump->uring;
+}
+
+int bluetooth_pump_add(bluetooth_pump_t *pump, int fd, bluetooth_pump_cb_t cb, void *userdata)
+{
+    pump_link_t *l;
+    int link;
+
+    if (pump == NULL || fd < 0 || cb == NULL || pump->n_free == 0)
+        return -1;
+    link = pump->free_links[--pump->n_free];
+    l = &pump->links[link];
+    l->state = LINK_OPEN;
+    l->fd = fd;
+    l->pos = pump->n_active;
+    l->cb = cb;
+    l->userdata = userdata;
+    l->tx_off = l->tx_len = 0;
+    l->reading = false;
+    l->sending = 0;
+    l->inflight = 0;
+    pump->active[pump->n_active++] = link;
+    return link;
+}
+
+void bluetooth_pump_remove(bluetooth_pump_t *pump, int link)
+{
+    if (pump && link >= 0 && link < pump->max_links && pump->links[link].state == LINK_OPEN)
+        link_release(pump, link);
+}
+
+bool bluetooth_pump_write(bluetooth_pump_t *pump, int link, const void *data, size_t len)
+{
+    pump_link_t *l;
+
+    if (pump == NULL || link < 0 || link >= pump->max_links || pump->links[link].state != LINK_OPEN)
+        return false;
+    l = &pump->links[link];
+    /* the kernel reads tx[tx_off, tx_off + sending) meanwhile, leave it in place */
+    if (!l->sending && l->tx_off) {
+        memmove(l->tx, l->tx + l->tx_off, l->tx_len - l->tx_off);
+        l->tx_len -= l->tx_off;
+        l->tx_off = 0;
+    }
+    if (len > PUMP_BUFSIZE - l->tx_len)
+        return false;
+    memcpy(l->tx + l->tx_len, data, len);
+    l->tx_len += len;
+    return true;
+}
+
+int bluetooth_pump_run(bluetooth_pump_t *pump, bluetooth_deadline_t deadline)
+{
+    if (pump == NULL)
+        return -1;
+    if (pump->n_active == 0) {
+        /* cancels of removed links still go in */
+        if (pump->uring && ring_enter(&pump->ring, false, deadline) == 0)
+            ring_reap(pump);
+        return 0;
+    }
+    return pump->uring ? ring_run(pump, deadline) : poll_run(pump, deadline);
+}
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bluetooth_internal.h"
+
+/* rows a predicate runs over before the next one, match bytes stay in L1 */
+#define QUERY_CHUNK     (256)
+
+/*
+ * Each predicate is a loop over one column of a chunk, and-ing into a byte
+ * per row: straight-line compares the compiler turns into SIMD. Only the
+ * rows left at the end are touched through the device records.
+ */
+struct bluetooth_device_query {
+    uint8_t flags_mask;
+    uint8_t flags_want;
+    /* name prefix: its first 8 bytes as two masked words, the rest compared after */
+    uint32_t name_word[2];
+    uint32_t name_mask[2];
+    char name_tail[BLUETOOTH_DEVNAME_MAXLEN];
+    size_t name_tail_len;
+    bool by_icon;
+    char icon[BLUETOOTH_ICON_MAXLEN];
+    bool by_oui;
+    uint32_t oui;
+    bool by_rssi;
+    int rssi_min;
+    int rssi_max;
+    int max_age_ms;
+};
+
+/* "AA:BB:CC..." -> 0xAABBCC */
+static int parse_oui(const char *s, uint32_t *oui)
+{
+    uint32_t v = 0;
+    int i, c;
+
+    for (i = 0; i < 8; i++) {
+        c = (unsigned char)s[i];
+        if (i % 3 == 2) {
+            if (c != ':')
+                return 1;
+            continue;
+        }
+        if (c >= '0' && c <= '9')
+            c -= '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            c = (c | 0x20) - 'a' + 10;
+        else
+            return 1;
+        v = v << 4 | c;
+    }
+    *oui = v;
+    return 0;
+}
+
+/* First 8 bytes of name, zero padded */
+static void name_words(const char *name, uint32_t word[2])
+{
+    word[0] = word[1] = 0;
+    memcpy(word, name, strnlen(name, 2 * sizeof(uint32_t)));
+}
+
+bluetooth_device_query_t *bluetooth_device_query_new(const bluetooth_device_filter_t *filter)
+{
+    bluetooth_device_query_t *query;
+    size_t len;
+
+    if (filter == NULL)
+        return NULL;
+    query = calloc(1, sizeof(bluetooth_device_query_t));
+    if (query == NULL)
+        return NULL;
+
+    query->flags_mask = filter->flags_set | filter->flags_clear;
+    query->flags_want = filter->flags_set;
+    if (filter->flags_set & filter->flags_clear)
+        goto fail;
+
+    if (filter->name_prefix) {
+        len = strlen(filter->name_prefix);
+        if (len >= BLUETOOTH_DEVNAME_MAXLEN)
+            goto fail;
+        name_words(filter->name_prefix, query->name_word);
+        memset(query->name_mask, 0xff, len < 8 ? len : 8);
+        if (len > 8) {
+            query->name_tail_len = len - 8;
+            memcpy(query->name_tail, filter->name_prefix + 8, query->name_tail_len);
+        }
+    }
+    if (filter->icon) {
+        if (strlen(filter->icon) >= BLUETOOTH_ICON_MAXLEN)
+            goto fail;
+        strcpy(query->icon, filter->icon);
+        query->by_icon = true;
+    }
+    if (filter->oui) {
+        if (strlen(filter->oui) != 8 || parse_oui(filter->oui, &query->oui))
+            goto fail;
+        query->by_oui = true;
+    }
+    if (filter->rssi_min || filter->rssi_max || filter->max_age_ms) {
+        if (filter->rssi_min > filter->rssi_max || filter->max_age_ms < 0)
+            goto fail;
+        query->by_rssi = true;
+        /* an age alone takes any strength */
+        query->rssi_min = filter->rssi_min || filter->rssi_max ? filter->rssi_min : -128;
+        query->rssi_max = filter->rssi_min || filter->rssi_max ? filter->rssi_max : 127;
+        query->max_age_ms = filter->max_age_ms;
+    }
+    return query;
+
+fail:
+    free(query);
+    return NULL;
+}
+
+void bluetooth_device_query_free(bluetooth_device_query_t *query)
+{
+    free(query);
+}
+
+int device_columns_build(device_columns_t *cols, const bluetooth_device_info_t *devs, size_t n)
+{
+    unsigned char *block;
+    uint32_t word[2];
+    size_t i, c;
+
+    memset(cols, 0, sizeof(*cols));
+    /* one block, widest columns first */
+    block = malloc(n * (4 * sizeof(uint32_t) + 2) + QUERY_ICON_OTHER * BLUETOOTH_ICON_MAXLEN);
+    if (block == NULL)
+        return 1;
+    cols->name[0] = (uint32_t *)block;
+    cols->name[1] = cols->name[0] + n;
+    cols->id = cols->name[1] + n;
+    cols->oui = cols->id + n;
+    cols->flags = (uint8_t *)(cols->oui + n);
+    cols->icon = cols->flags + n;
+    cols->icons = (char (*)[BLUETOOTH_ICON_MAXLEN])(cols->icon + n);
+
+    for (i = 0; i < n; i++) {
+        name_words(devs[i].name, word);
+        cols->name[0][i] = word[0];
+        cols->name[1][i] = word[1];
+        cols->id[i] = devs[i].id;
+        if (parse_oui(devs[i].macaddr, &cols->oui[i]))
+            cols->oui[i] = UINT32_MAX;
+        cols->flags[i] = devs[i].flags;
+
+        /* a handful of names in practice */
+        for (c = 0; c < cols->n_icons && strcmp(cols->icons[c], devs[i].icon); c++)
+            ;
+        if (c == cols->n_icons && c < QUERY_ICON_OTHER) {
+            strncpy(cols->icons[c], devs[i].icon, BLUETOOTH_ICON_MAXLEN - 1);
+            cols->icons[c][BLUETOOTH_ICON_MAXLEN - 1] = '\0';
+            cols->n_icons++;
+        }
+        cols->icon[i] = c;
+    }
+    return 0;
+}
+
+void device_columns_free(device_columns_t *cols)
+{
+    /* the first name column heads the block */
+    free(cols->name[0]);
+    memset(cols, 0, sizeof(*cols));
+}
+
+/* Icon class of name in this table, -1 if no device has it */
+static int icon_class(const device_columns_t *cols, const char *icon)
+{
+    size_t c;
+
+    for (c = 0; c < cols->n_icons; c++) {
+        if (!strcmp(cols->icons[c], icon))
+            return c;
+    }
+    return cols->n_icons == QUERY_ICON_OTHER ? QUERY_ICON_OTHER : -1;
+}
+
+/* Rows of a chunk left in match, in order: empty words of 8 are skipped, the
+ * rest taken without a branch per row */
+static size_t chunk_rows(const uint8_t *match, size_t len, uint16_t *rows)
+{
+    size_t i, b, hits = 0;
+    uint64_t word;
+
+    for (i = 0; i < len; i += 8) {
+        memcpy(&word, match + i, sizeof(word));
+        if (word == 0)
+            continue;
+        for (b = i; b < i + 8; b++) {
+            rows[hits] = b;
+            hits += match[b];
+        }
+    }
+    return hits;
+}
+
+size_t device_columns_match(const device_columns_t *cols, const bluetooth_device_info_t *devs,
+                            size_t n, const bluetooth_device_query_t *query,
+                            rssi_table_t *rssi, long long now, bluetooth_device_id_t *ids,
+                            const bluetooth_device_info_t **views, size_t max)
+{
+    /* rounded to whole words, the tail stays zero */
+    uint8_t match[QUERY_CHUNK + 8];
+    uint16_t rows[QUERY_CHUNK];
+    size_t base, len, i, h, hits, found = 0;
+    bool exact = !query->name_tail_len;
+    uint8_t icon = 0;
+    int c;
+
+    if (query->by_icon) {
+        c = icon_class(cols, query->icon);
+        if (c < 0)
+            return 0;
+        icon = c;
+        exact = exact && icon != QUERY_ICON_OTHER;
+    }
+
+    for (base = 0; base < n; base += QUERY_CHUNK) {
+        const uint32_t *name0 = cols->name[0] + base;
+        const uint32_t *name1 = cols->name[1] + base;
+        const uint32_t *oui = cols->oui + base;
+        const uint8_t *flags = cols->flags + base;
+        const uint8_t *icons = cols->icon + base;
+
+        len = n - base < QUERY_CHUNK ? n - base : QUERY_CHUNK;
+
+        for (i = 0; i < len; i++)
+            match[i] = (flags[i] & query->flags_mask) == query->flags_want;
+        if (query->name_mask[0]) {
+            for (i = 0; i < len; i++)
+                match[i] &= ((name0[i] & query->name_mask[0]) == query->name_word[0]) &
+                            ((name1[i] & query->name_mask[1]) == query->name_word[1]);
+        }
+        if (query->by_oui) {
+            for (i = 0; i < len; i++)
+                match[i] &= oui[i] == query->oui;
+        }
+        if (query->by_icon) {
+            for (i = 0; i < len; i++)
+                match[i] &= icons[i] == icon;
+        }
+        if (query->by_rssi)
+            rssi_filter(rssi, now, cols->id + base, len, query->rssi_min, query->rssi_max,
+                        query->max_age_ms, match);
+
+        /* out of room: only counting */
+        if (exact && found >= max) {
+            for (i = 0, hits = 0; i < len; i++)
+                hits += match[i];
+            found += hits;
+            continue;
+        }
+
+        memset(match + len, 0, sizeof(match) - len);
+        hits = chunk_rows(match, len, rows);
+        if (exact) {
+            for (h = 0; h < hits && found + h < max; h++) {
+                if (ids)
+                    ids[found + h] = cols->id[base + rows[h]];
+                if (views)
+                    views[found + h] = &devs[base + rows[h]];
+            }
+            found += hits;
+            continue;
+        }
+        for (h = 0; h < hits; h++) {
+            const bluetooth_device_info_t *dev = &devs[base + rows[h]];
+
+            /* the record itself only when the columns can't tell */
+            if (query->name_tail_len &&
+                memcmp(dev->name + 8, query->name_tail, query->name_tail_len))
+                continue;
+            if (icon == QUERY_ICON_OTHER && strcmp(dev->icon, query->icon))
+                continue;
+            if (found < max) {
+                if (ids)
+                    ids[found] = cols->id[base + rows[h]];
+                if (views)
+                    views[found] = dev;
+            }
+            found++;
+        }
+    }
+    return found;
+}
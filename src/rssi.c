@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bluetooth_internal.h"
+
+/* Weight of a sample against the ones before it: 0.3 new, 0.7 history */
+#define RSSI_EWMA_NUM       (3)
+#define RSSI_EWMA_DEN       (10)
+/* fixed point dBm, integer columns vectorize without -ffast-math */
+#define RSSI_SCALE          (256)
+/* not heard within the window */
+#define RSSI_NONE           INT32_MIN
+/* ranking skips blocks whose best can't make the top k */
+#define RANK_BLOCK          (64)
+#define RSSI_INITIAL_CAP    (64)
+
+/*
+ * Columns, not a struct per device: ranking reads ewma and last front to
+ * back, plain loops the compiler turns into SIMD. Device id is entry id - 1
+ * of every column. Rings keep the raw samples, ring position s of every
+ * device is contiguous too.
+ */
+struct rssi_table {
+    pthread_mutex_t lock;
+    device_ids_t *ids;
+    long long epoch;
+    /* rows in use: highest id sampled */
+    size_t n;
+    size_t cap;
+
+    /* smoothed over every sample so far, dBm * RSSI_SCALE */
+    int32_t *ewma;
+    /* ms since epoch + 1 of the newest sample. 64 bits: 32 wrap in 49.7 days */
+    int64_t *last;
+
+    /* [RSSI_RING_SIZE][cap] */
+    int8_t *samples;
+    /* [RSSI_RING_SIZE][cap], ms since epoch + 1, 0: empty */
+    int64_t *times;
+    /* next ring position written, per device */
+    uint8_t *head;
+
+    /* ranking scratch, [cap] */
+    int32_t *score;
+};
+
+static void *column_realloc(void *old, size_t size, size_t old_cap, size_t cap)
+{
+    unsigned char *col = calloc(RSSI_RING_SIZE, cap * size);
+    size_t s;
+
+    if (col == NULL || old == NULL)
+        return col;
+    for (s = 0; s < RSSI_RING_SIZE; s++)
+        memcpy(col + s * cap * size, (unsigned char *)old + s * old_cap * size, old_cap * size);
+    return col;
+}
+
+/* Room for n rows, new ones zeroed */
+static int grow(rssi_table_t *table, size_t n)
+{
+    size_t cap = table->cap ? table->cap : RSSI_INITIAL_CAP;
+    void *head, *ewma, *last, *score;
+    int8_t *samples;
+    int64_t *times;
+
+    while (cap < n)
+        cap *= 2;
+    if (cap == table->cap)
+        return 0;
+
+    head = realloc(table->head, cap);
+    if (head)
+        table->head = head;
+    ewma = realloc(table->ewma, cap * sizeof(int32_t));
+    if (ewma)
+        table->ewma = ewma;
+    last = realloc(table->last, cap * sizeof(int64_t));
+    if (last)
+        table->last = last;
+    score = realloc(table->score, cap * sizeof(int32_t));
+    if (score)
+        table->score = score;
+    if (!head || !ewma || !last || !score)
+        return 1;
+
+    samples = column_realloc(table->samples, sizeof(int8_t), table->cap, cap);
+    times = column_realloc(table->times, sizeof(int64_t), table->cap, cap);
+    if (!samples || !times) {
+        free(samples);
+        free(times);
+        return 1;
+    }
+    free(table->samples);
+    free(table->times);
+    table->samples = samples;
+    table->times = times;
+
+    memset(table->head + table->cap, 0, cap - table->cap);
+    memset(table->last + table->cap, 0, (cap - table->cap) * sizeof(int64_t));
+    table->cap = cap;
+    return 0;
+}
+
+rssi_table_t *rssi_table_new(device_ids_t *ids)
+{
+    rssi_table_t *table;
+
+    table = calloc(1, sizeof(rssi_table_t));
+    if (table == NULL)
+        return NULL;
+    pthread_mutex_init(&table->lock, NULL);
+    table->ids = ids;
+    if (grow(table, RSSI_INITIAL_CAP)) {
+        rssi_table_free(table);
+        return NULL;
+    }
+    table->epoch = bluetooth_now_ms();
+    return table;
+}
+
+void rssi_table_free(rssi_table_t *table)
+{
+    if (table == NULL)
+        return;
+
+    pthread_mutex_destroy(&table->lock);
+    free(table->samples);
+    free(table->times);
+    free(table->head);
+    free(table->ewma);
+    free(table->last);
+    free(table->score);
+    free(table);
+}
+
+void rssi_record(rssi_table_t *table, const char *macaddr, int rssi, long long now)
+{
+    bluetooth_device_id_t id;
+    size_t d, pos;
+
+    if (table == NULL)
+        return;
+    id = device_ids_assign(table->ids, macaddr, NULL);
+    if (id == BLUETOOTH_DEVICE_ID_NONE)
+        return;
+    if (rssi < -128)
+        rssi = -128;
+    if (rssi > 127)
+        rssi = 127;
+
+    pthread_mutex_lock(&table->lock);
+    if (grow(table, id)) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+    d = id - 1;
+    if (d >= table->n)
+        table->n = d + 1;
+    if (table->last[d] == 0)
+        table->ewma[d] = rssi * RSSI_SCALE;
+
+    pos = table->head[d] * table->cap + d;
+    table->samples[pos] = rssi;
+    table->times[pos] = now - table->epoch + 1;
+    table->ewma[d] += (rssi * RSSI_SCALE - table->ewma[d]) * RSSI_EWMA_NUM / RSSI_EWMA_DEN;
+    table->last[d] = table->times[pos];
+    table->head[d] = (table->head[d] + 1) & (RSSI_RING_SIZE - 1);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* Samples of device d within the window */
+static int window_samples(const rssi_table_t *table, size_t d, int64_t since)
+{
+    int s, n = 0;
+
+    for (s = 0; s < RSSI_RING_SIZE; s++)
+        n += table->times[s * table->cap + d] >= since;
+    return n;
+}
+
+/* Put a device into ranks[0..found), a min-heap by rssi holding the k strongest */
+static void heap_push(bluetooth_rssi_rank_t *ranks, int *found, int k, float score,
+                      bluetooth_device_id_t id)
+{
+    int i, j;
+
+    if (*found < k) {
+        /* sift up from the end */
+        for (i = (*found)++; i > 0 && ranks[(i - 1) / 2].rssi > score; i = (i - 1) / 2)
+            ranks[i] = ranks[(i - 1) / 2];
+    } else {
+        /* replace the weakest, sift down from the root */
+        for (i = 0; (j = 2 * i + 1) < k; i = j) {
+            if (j + 1 < k && ranks[j + 1].rssi < ranks[j].rssi)
+                j++;
+            if (ranks[j].rssi >= score)
+                break;
+            ranks[i] = ranks[j];
+        }
+    }
+    ranks[i].rssi = score;
+    ranks[i].id = id;
+}
+
+int rssi_top(rssi_table_t *table, long long now, int window_ms, bluetooth_rssi_rank_t *ranks, int k)
+{
+    int64_t since = now - table->epoch - window_ms + 1;
+    const int64_t *last;
+    const int32_t *ewma;
+    int32_t *score, floor, best;
+    bluetooth_rssi_rank_t tmp;
+    size_t n, b, d, end;
+    int found = 0, size, i;
+
+    if (k <= 0)
+        return 0;
+    /* 0 is no sample, never within the window */
+    if (since < 1)
+        since = 1;
+
+    pthread_mutex_lock(&table->lock);
+    n = table->n;
+    last = table->last;
+    ewma = table->ewma;
+    score = table->score;
+
+    for (d = 0; d < n; d++) {
+        int32_t e = ewma[d];
+
+        score[d] = last[d] >= since ? e : RSSI_NONE;
+    }
+
+    /* top k by a min-heap, floor is its weakest once full */
+    floor = RSSI_NONE;
+    for (b = 0; b < n; b += RANK_BLOCK) {
+        end = b + RANK_BLOCK < n ? b + RANK_BLOCK : n;
+        best = RSSI_NONE;
+        for (d = b; d < end; d++)
+            best = score[d] > best ? score[d] : best;
+        if (best <= floor)
+            continue;
+
+        for (d = b; d < end; d++) {
+            if (score[d] <= floor)
+                continue;
+            heap_push(ranks, &found, k, (float)score[d] / RSSI_SCALE, d + 1);
+            if (found == k)
+                floor = ranks[0].rssi * RSSI_SCALE;
+        }
+    }
+
+    /* heap to strongest first: move the weakest to the back, one by one */
+    for (size = found - 1; size > 0; size--) {
+        tmp = ranks[size];
+        ranks[size] = ranks[0];
+        heap_push(ranks, &size, size, tmp.rssi, tmp.id);
+    }
+    /* the rest is only wanted for the winners */
+    for (i = 0; i < found; i++) {
+        ranks[i].samples = window_samples(table, ranks[i].id - 1, since);
+        device_ids_macaddr(table->ids, ranks[i].id, ranks[i].macaddr);
+    }
+    pthread_mutex_unlock(&table->lock);
+    return found;
+}
+
+void rssi_filter(rssi_table_t *table, long long now, const uint32_t *ids, size_t n,
+                 int min, int max, int window_ms, uint8_t *match)
+{
+    int64_t since = window_ms > 0 ? now - table->epoch - window_ms + 1 : 1;
+    int32_t lo = min * RSSI_SCALE, hi = max * RSSI_SCALE;
+    const int64_t *last;
+    const int32_t *ewma;
+    size_t rows, i;
+
+    if (since < 1)
+        since = 1;
+
+    pthread_mutex_lock(&table->lock);
+    rows = table->n;
+    last = table->last;
+    ewma = table->ewma;
+    for (i = 0; i < n; i++) {
+        /* id 0 wraps past every row */
+        size_t d = (size_t)ids[i] - 1;
+        int64_t l = d < rows ? last[d] : 0;
+        int32_t e = d < rows ? ewma[d] : 0;
+
+        match[i] &= l >= since && e >= lo && e <= hi;
+    }
+    pthread_mutex_unlock(&table->lock);
+}
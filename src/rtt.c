@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bluetooth_internal.h"
+
+/* Smoothing as in TCP (RFC 6298): 1/8 of a sample moves the mean, 1/4 the deviation */
+#define RTT_ALPHA   (0.125)
+#define RTT_BETA    (0.25)
+/* Timeouts double per consecutive expiry, up to the ceiling */
+#define RTT_MAX_BACKOFF     (64)
+
+#define BREAKER_FAILURES        (3)
+#define BREAKER_COOLDOWN_MS     (1000)
+#define BREAKER_COOLDOWN_MAX_MS (30000)
+
+void rtt_init(rtt_t *rtt, int initial_ms, int min_ms, int max_ms)
+{
+    memset(rtt, 0, sizeof(*rtt));
+    rtt->initial_ms = initial_ms;
+    rtt->min_ms = min_ms;
+    rtt->max_ms = max_ms;
+    rtt->backoff = 1;
+}
+
+void rtt_sample(rtt_t *rtt, long long ms)
+{
+    double err;
+
+    if (rtt->samples++ == 0) {
+        rtt->srtt = ms;
+        rtt->rttvar = ms / 2.0;
+    } else {
+        err = ms - rtt->srtt;
+        rtt->rttvar += RTT_BETA * ((err < 0 ? -err : err) - rtt->rttvar);
+        rtt->srtt += RTT_ALPHA * err;
+    }
+    rtt->backoff = 1;
+}
+
+void rtt_expired(rtt_t *rtt)
+{
+    if (rtt->backoff < RTT_MAX_BACKOFF)
+        rtt->backoff *= 2;
+}
+
+int rtt_timeout(const rtt_t *rtt)
+{
+    double timeout = rtt->samples ? rtt->srtt + 4 * rtt->rttvar : rtt->initial_ms;
+
+    timeout *= rtt->backoff;
+    if (timeout < rtt->min_ms)
+        timeout = rtt->min_ms;
+    if (timeout > rtt->max_ms)
+        timeout = rtt->max_ms;
+    return (int)timeout;
+}
+
+bool breaker_allow(breaker_t *breaker, long long now)
+{
+    /* past the cooldown one call goes through, its outcome decides */
+    return breaker->failures < BREAKER_FAILURES || now >= breaker->open_until;
+}
+
+bool breaker_open(const breaker_t *breaker)
+{
+    return breaker->failures >= BREAKER_FAILURES;
+}
+
+void breaker_success(breaker_t *breaker)
+{
+    breaker->failures = 0;
+    breaker->cooldown_ms = 0;
+}
+
+void breaker_failure(breaker_t *breaker, long long now)
+{
+    if (++breaker->failures < BREAKER_FAILURES)
+        return;
+
+    /* opened again right after a probe: wait longer */
+    if (breaker->cooldown_ms == 0)
+        breaker->cooldown_ms = BREAKER_COOLDOWN_MS;
+    else if (breaker->cooldown_ms < BREAKER_COOLDOWN_MAX_MS)
+        breaker->cooldown_ms *= 2;
+    if (breaker->cooldown_ms > BREAKER_COOLDOWN_MAX_MS)
+        breaker->cooldown_ms = BREAKER_COOLDOWN_MAX_MS;
+    breaker->open_until = now + breaker->cooldown_ms;
+}
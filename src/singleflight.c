@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "bluetooth_internal.h"
+
+void singleflight_init(singleflight_t *sf)
+{
+    pthread_mutex_init(&sf->lock, NULL);
+    INIT_LIST_HEAD(&sf->flights);
+}
+
+void singleflight_destroy(singleflight_t *sf)
+{
+    pthread_mutex_destroy(&sf->lock);
+}
+
+bool singleflight_begin(singleflight_t *sf, flight_t *flight, int op, const char *key, long *result)
+{
+    flight_t *f;
+
+    pthread_mutex_lock(&sf->lock);
+    list_for_each_entry(f, &sf->flights, list) {
+        if (f->op != op || strcmp(f->key, key ? key : ""))
+            continue;
+
+        /* same operation in flight: wait for its result instead of repeating it */
+        f->waiters++;
+        while (!f->done)
+            pthread_cond_wait(&f->cond, &sf->lock);
+        *result = f->result;
+        if (--f->waiters == 0)
+            pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&sf->lock);
+        return false;
+    }
+
+    flight->op = op;
+    strncpy(flight->key, key ? key : "", sizeof(flight->key));
+    flight->key[sizeof(flight->key)-1] = '\0';
+    flight->waiters = 0;
+    flight->done = false;
+    pthread_cond_init(&flight->cond, NULL);
+    list_add_tail(&flight->list, &sf->flights);
+    pthread_mutex_unlock(&sf->lock);
+    return true;
+}
+
+void singleflight_end(singleflight_t *sf, flight_t *flight, long result)
+{
+    pthread_mutex_lock(&sf->lock);
+    /* later callers start a new flight, they must not see this result */
+    list_del(&flight->list);
+    flight->result = result;
+    flight->done = true;
+    pthread_cond_broadcast(&flight->cond);
+
+    /* flight lives on the leader's stack */
+    while (flight->waiters)
+        pthread_cond_wait(&flight->cond, &sf->lock);
+    pthread_mutex_unlock(&sf->lock);
+    pthread_cond_destroy(&flight->cond);
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "bluetooth_internal.h"
+
+/*
+ * Device tables are immutable once published. The current one is named by a
+ * single word: slot index in the top bits, pins taken through the word below.
+ * A reader pins with one fetch_add on it. The writer swaps the word and hands
+ * the pins it collected to the old table, whose own count was only ever
+ * decremented by readers releasing it. Before that it can't reach zero, after
+ * it is the number of readers still holding the table.
+ */
+
+#define TABLE_PIN_MASK  ((1ULL << TABLE_SLOT_SHIFT) - 1)
+
+typedef struct device_table {
+    bluetooth_device_table_t table;
+    long long refs;
+    device_tables_t *tables;
+    int slot;
+    /* the same devices, for queries */
+    device_columns_t columns;
+    bluetooth_device_info_t devices[];
+} device_table_t;
+
+static void table_free(device_table_t *t)
+{
+    __atomic_store_n(&t->tables->slots[t->slot], NULL, __ATOMIC_RELEASE);
+    device_columns_free(&t->columns);
+    free(t);
+}
+
+/* Writer only. Slots come back as readers drop old tables */
+static int table_slot(device_tables_t *tables, int current)
+{
+    int i;
+
+    for (;;) {
+        for (i = 0; i < TABLE_SLOTS; i++) {
+            if (i != current && !__atomic_load_n(&tables->slots[i], __ATOMIC_ACQUIRE))
+                return i;
+        }
+        sched_yield();
+    }
+}
+
+int device_tables_publish(device_tables_t *tables, const bluetooth_device_info_t *devs, size_t n)
+{
+    device_table_t *t, *old;
+    uint64_t word;
+    int current;
+
+    word = __atomic_load_n(&tables->current, __ATOMIC_RELAXED);
+    current = tables->generation ? (int)(word >> TABLE_SLOT_SHIFT) : -1;
+
+    t = malloc(sizeof(device_table_t) + n * sizeof(bluetooth_device_info_t));
+    if (t == NULL)
+        return 1;
+
+    if (n)
+        memcpy(t->devices, devs, n * sizeof(bluetooth_device_info_t));
+    if (device_columns_build(&t->columns, t->devices, n)) {
+        free(t);
+        return 1;
+    }
+    t->table.generation = ++tables->generation;
+    t->table.n_devices = n;
+    t->table.devices = t->devices;
+    t->refs = 0;
+    t->tables = tables;
+    t->slot = table_slot(tables, current);
+    __atomic_store_n(&tables->slots[t->slot], t, __ATOMIC_RELEASE);
+
+    word = __atomic_exchange_n(&tables->current, (uint64_t)t->slot << TABLE_SLOT_SHIFT,
+                               __ATOMIC_ACQ_REL);
+    if (current < 0)
+        return 0;
+
+    /* retire: pins taken through the word move over to the table */
+    old = tables->slots[current];
+    if (__atomic_add_fetch(&old->refs, (long long)(word & TABLE_PIN_MASK), __ATOMIC_ACQ_REL) == 0)
+        table_free(old);
+    return 0;
+}
+
+const bluetooth_device_table_t *device_tables_get(device_tables_t *tables)
+{
+    uint64_t word = __atomic_fetch_add(&tables->current, 1, __ATOMIC_ACQUIRE);
+
+    return &__atomic_load_n(&tables->slots[word >> TABLE_SLOT_SHIFT], __ATOMIC_ACQUIRE)->table;
+}
+
+const device_columns_t *device_table_columns(const bluetooth_device_table_t *table)
+{
+    return &container_of(table, device_table_t, table)->columns;
+}
+
+void bluetooth_device_table_unref(const bluetooth_device_table_t *table)
+{
+    device_table_t *t;
+
+    if (table == NULL)
+        return;
+
+    t = container_of(table, device_table_t, table);
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        table_free(t);
+}
+
+int device_tables_init(device_tables_t *tables)
+{
+    memset(tables, 0, sizeof(*tables));
+    /* readers always find a table, generation 1 is empty */
+    return device_tables_publish(tables, NULL, 0);
+}
+
+void device_tables_destroy(device_tables_t *tables)
+{
+    uint64_t word = __atomic_load_n(&tables->current, __ATOMIC_ACQUIRE);
+    device_table_t *t = tables->slots[word >> TABLE_SLOT_SHIFT];
+
+    if (t && __atomic_add_fetch(&t->refs, (long long)(word & TABLE_PIN_MASK), __ATOMIC_ACQ_REL) == 0)
+        table_free(t);
+}
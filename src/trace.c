@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bluetooth_internal.h"
+
+/*
+ * A trace is a text header naming the backend, then one record per message:
+ *   type (1 byte), microseconds since the previous record, length, payload
+ * with both numbers as LEB128 varints. A D-Bus signal costs its marshalled
+ * size plus 3 or 4 bytes.
+ */
+#define TRACE_MAGIC "hal_bluetooth-trace 1\n"
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void put_varint(FILE *file, unsigned long long value)
+{
+    while (value >= 0x80) {
+        fputc((value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    fputc(value, file);
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, unsigned long long *value)
+{
+    int shift = 0;
+
+    *value = 0;
+    while (*p < end && shift < 64) {
+        *value |= (unsigned long long)(**p & 0x7f) << shift;
+        if (!(*(*p)++ & 0x80))
+            return 0;
+        shift += 7;
+    }
+    return 1;
+}
+
+trace_t *trace_create(const char *path, const char *backend)
+{
+    trace_t *trace;
+
+    trace = calloc(1, sizeof(trace_t));
+    if (trace == NULL)
+        return NULL;
+
+    trace->file = fopen(path, "we");
+    if (trace->file == NULL) {
+        free(trace);
+        return NULL;
+    }
+    strncpy(trace->backend, backend, sizeof(trace->backend) - 1);
+    fprintf(trace->file, TRACE_MAGIC "%s\n", trace->backend);
+    trace->last_us = now_us();
+    return trace;
+}
+
+void trace_write(trace_t *trace, int type, const void *data, size_t len)
+{
+    long long now = now_us();
+
+    if (trace == NULL || trace->file == NULL)
+        return;
+
+    fputc(type, trace->file);
+    put_varint(trace->file, now - trace->last_us);
+    put_varint(trace->file, len);
+    if (len)
+        fwrite(data, 1, len, trace->file);
+    trace->last_us = now;
+}
+
+static int trace_parse(trace_t *trace, const unsigned char *p, const unsigned char *end)
+{
+    unsigned long long delta, len;
+    trace_record_t *records;
+    long long time_us = 0;
+    size_t size = 0;
+    int type;
+
+    while (p < end) {
+        type = *p++;
+        if (get_varint(&p, end, &delta) || get_varint(&p, end, &len) || len > (size_t)(end - p))
+            return 1;
+
+        if (trace->n == size) {
+            size = size ? size * 2 : 256;
+            records = realloc(trace->records, size * sizeof(trace_record_t));
+            if (records == NULL)
+                return 1;
+            trace->records = records;
+        }
+        time_us += delta;
+        trace->records[trace->n].type = type;
+        trace->records[trace->n].time_us = time_us;
+        trace->records[trace->n].data = p;
+        trace->records[trace->n].len = len;
+        trace->n++;
+        p += len;
+    }
+    return 0;
+}
+
+trace_t *trace_load(const char *path, double speed)
+{
+    unsigned char *p, *nl;
+    trace_t *trace;
+    FILE *file;
+    long size;
+
+    file = fopen(path, "re");
+    if (file == NULL)
+        return NULL;
+
+    trace = calloc(1, sizeof(trace_t));
+    if (trace == NULL)
+        goto fail;
+    if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET))
+        goto fail;
+    trace->buf = malloc(size + 1);
+    if (trace->buf == NULL || fread(trace->buf, 1, size, file) != (size_t)size)
+        goto fail;
+    trace->buf[size] = '\0';
+
+    if (strncmp((char *)trace->buf, TRACE_MAGIC, strlen(TRACE_MAGIC)))
+        goto fail;
+    p = trace->buf + strlen(TRACE_MAGIC);
+    nl = memchr(p, '\n', size - (p - trace->buf));
+    if (nl == NULL || nl - p >= (long)sizeof(trace->backend))
+        goto fail;
+    memcpy(trace->backend, p, nl - p);
+
+    if (trace_parse(trace, nl + 1, trace->buf + size))
+        goto fail;
+    trace->speed = speed;
+    fclose(file);
+    return trace;
+
+fail:
+    trace_close(trace);
+    fclose(file);
+    return NULL;
+}
+
+long long trace_delay_ms(trace_t *trace, long long from_us, long long to_us)
+{
+    if (trace->speed <= 0 || to_us <= from_us)
+        return 0;
+    /* rounded up: callers start from a truncated now, short runs would replay fast */
+    return ((long long)((to_us - from_us) / trace->speed) + 999) / 1000;
+}
+
+void trace_close(trace_t *trace)
+{
+    if (trace == NULL)
+        return;
+    if (trace->file)
+        fclose(trace->file);
+    free(trace->records);
+    free(trace->buf);
+    free(trace);
+}
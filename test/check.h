@@ -0,0 +1,51 @@
+/* Shared by the tests: a failed CHECK ends the test with where and what */
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static inline long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Calls mock_bluez got since the last reset whose "interface.member path"
+ * line starts with call, see test/mock_env.sh */
+static inline int mock_calls(const char *call)
+{
+    const char *path = getenv("MOCK_BLUEZ_LOG");
+    char line[512];
+    FILE *f;
+    int n = 0;
+
+    CHECK(path != NULL);
+    f = fopen(path, "r");
+    CHECK(f != NULL);
+    while (fgets(line, sizeof(line), f))
+        n += !strncmp(line, call, strlen(call));
+    fclose(f);
+    return n;
+}
+
+static inline void mock_calls_reset(void)
+{
+    const char *path = getenv("MOCK_BLUEZ_LOG");
+
+    CHECK(path != NULL && truncate(path, 0) == 0);
+}
+
+#endif
@@ -0,0 +1,1206 @@
+/*
+ * Minimal org.bluez service for tests. Serves one adapter and a configurable
+ * number of devices on whatever bus DBUS_SYSTEM_BUS_ADDRESS points at.
+ *
+ * Connected devices expose one GATT service with a notify (2a37), a write
+ * (2a39) and a read (2a38) characteristic, announced with InterfacesAdded
+ * once services resolve and InterfacesRemoved on disconnect. AcquireNotify/AcquireWrite hand
+ * out socketpairs; the notify end is fed a burst of values on every tick.
+ *
+ * Device1.Connect takes connect_ms without blocking other calls. Like a real
+ * controller only so many can be underway, the ones past that fail. Services
+ * resolve resolve_ms after the connection, with -r.
+ *
+ * With -g the peer sends Service Changed change_ms after its services
+ * resolve: the GATT objects are removed and added again at new handles, one
+ * InterfacesRemoved and InterfacesAdded each, the way bluetoothd does.
+ *
+ * With -s it hangs like an overloaded bluetoothd: calls arriving in the
+ * window stall_ms long, starting stall_at_ms after start, are answered after it.
+ *
+ * With -p or -k devices need authentication to pair: Device1.Pair asks the
+ * caller's Agent1 for the PIN (RequestPinCode) or to confirm the passkey
+ * (RequestConfirmation), and fails unless it answers right. A NoInputNoOutput
+ * agent pairs -k devices without being asked. Without an agent Pair is never
+ * answered, like bluetoothd waiting on a prompt nobody sees.
+ *
+ * Device1.ConnectProfile of a profile registered with ProfileManager1 hands
+ * the profile a socketpair through NewConnection; our end echoes whatever it
+ * reads. With -i the first incoming devices connect to every server profile
+ * as soon as it is registered.
+ *
+ * Every method call is logged as "interface.member path" to $MOCK_BLUEZ_LOG
+ * when set, so tests can count what reached bluetoothd.
+ *
+ * usage: mock_bluez [-n devices] [-a advert_interval_ms] [-d reply_delay_ms]
+ *                   [-c connect_ms] [-l max_connecting] [-s stall_at_ms,stall_ms]
+ *                   [-p pin | -k passkey] [-i incoming] [-r resolve_ms]
+ *                   [-g change_ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <dbus/dbus.h>
+
+#define NOTIFY_BURST    (16)
+#define MAX_NOTIFY_FDS  (64)
+#define MAX_CONNECTING  (256)
+#define MAX_AGENTS      (16)
+#define MAX_PROFILES    (16)
+#define MAX_LINKS       (256)
+
+typedef struct mock_device {
+    char path[128];
+    char address[18];
+    char alias[64];
+    char icon[32];
+    dbus_bool_t connected;
+    dbus_bool_t paired;
+    dbus_bool_t trusted;
+    dbus_bool_t services_resolved;
+    /* ServicesResolved turns true then, 0: not connecting */
+    long long resolve_due;
+    /* Service Changed then, 0: none to come */
+    long long change_due;
+    /* GATT handles start at 0x10 past this many changes */
+    int gatt_changes;
+    dbus_int16_t rssi;
+} mock_device_t;
+
+static const char *adapter_path = "/org/bluez/hci0";
+static mock_device_t *devices;
+static int ndevices = 4;
+static int advert_interval = 10;
+static int reply_delay;
+static dbus_bool_t powered;
+static dbus_bool_t discovering;
+static int notify_fds[MAX_NOTIFY_FDS];
+static int nnotify;
+static unsigned char sensor_location[4] = { 1 };
+static int connect_time;
+static FILE *call_log;
+static int resolve_time;
+static int nresolving;
+static int change_time;
+static int nchanging;
+static int max_connecting = MAX_CONNECTING;
+static long long stall_start, stall_end;
+static const char *pair_pin;
+static dbus_uint32_t pair_passkey;
+static int pair_confirm;
+
+/* AgentManager1.RegisterAgent calls, by sender */
+static struct {
+    char owner[64];
+    char path[128];
+    char capability[32];
+} agents[MAX_AGENTS];
+static int nagents;
+
+/* ProfileManager1.RegisterProfile calls */
+static struct {
+    char owner[64];
+    char path[128];
+    char uuid[37];
+    int server;
+    /* -i connections still to make */
+    int incoming;
+} profiles[MAX_PROFILES];
+static int nprofiles;
+static int incoming;
+
+/* our ends of profile sockets */
+static int link_fds[MAX_LINKS];
+static int nlinks;
+
+/* NewConnection waiting for the profile's answer, msg the ConnectProfile if any */
+typedef struct profile_connection {
+    DBusConnection *conn;
+    DBusMessage *msg;
+    int fd;
+} profile_connection_t;
+
+/* Pair waiting for the agent's answer */
+typedef struct pairing {
+    DBusConnection *conn;
+    DBusMessage *msg;
+    mock_device_t *dev;
+} pairing_t;
+
+/* Connect calls underway, answered once due */
+static struct {
+    DBusMessage *reply;
+    mock_device_t *dev;
+    long long due;
+} connecting[MAX_CONNECTING];
+static int nconnecting;
+
+static const char *gatt_service_uuid = "0000180d-0000-1000-8000-00805f9b34fb";
+/* handles past the service's */
+static const struct {
+    int handle;
+    const char *uuid;
+    const char *flags[2];
+} gatt_chars[] = {
+    { 1, "00002a37-0000-1000-8000-00805f9b34fb", { "notify", NULL } },
+    { 4, "00002a39-0000-1000-8000-00805f9b34fb", { "write", "write-without-response" } },
+    { 6, "00002a38-0000-1000-8000-00805f9b34fb", { "read", NULL } },
+};
+#define GATT_OBJECTS    (1 + (int)(sizeof(gatt_chars) / sizeof(gatt_chars[0])))
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static mock_device_t *find_device(const char *path)
+{
+    int i;
+
+    for (i = 0; i < ndevices; i++)
+        if (!strcmp(devices[i].path, path))
+            return &devices[i];
+    return NULL;
+}
+
+static void append_variant(DBusMessageIter *iter, int type, const void *value)
+{
+    DBusMessageIter variant;
+    char sig[2] = { (char)type, '\0' };
+
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, sig, &variant);
+    dbus_message_iter_append_basic(&variant, type, value);
+    dbus_message_iter_close_container(iter, &variant);
+}
+
+static void append_entry(DBusMessageIter *dict, const char *key, int type, const void *value)
+{
+    DBusMessageIter entry;
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    append_variant(&entry, type, value);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_bytes(DBusMessageIter *iter, const unsigned char *data, int len)
+{
+    DBusMessageIter variant, array;
+
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "ay", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "y", &array);
+    dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &data, len);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(iter, &variant);
+}
+
+/* ManufacturerData a{qv} and ServiceData a{sv} */
+static void append_advert(DBusMessageIter *dict, mock_device_t *dev)
+{
+    DBusMessageIter entry, variant, array, item;
+    const char *key;
+    const char *uuid = "0000feaa-0000-1000-8000-00805f9b34fb";
+    dbus_uint16_t company = 0x004c;
+    unsigned char data[24];
+    int i;
+
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = (unsigned char)(i + dev->rssi);
+
+    key = "ManufacturerData";
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "a{qv}", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "{qv}", &array);
+    dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY, NULL, &item);
+    dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT16, &company);
+    append_bytes(&item, data, sizeof(data));
+    dbus_message_iter_close_container(&array, &item);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+
+    key = "ServiceData";
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "a{sv}", &variant);
+    dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "{sv}", &array);
+    dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY, NULL, &item);
+    dbus_message_iter_append_basic(&item, DBUS_TYPE_STRING, &uuid);
+    append_bytes(&item, data, 8);
+    dbus_message_iter_close_container(&array, &item);
+    dbus_message_iter_close_container(&variant, &array);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_device_props(DBusMessageIter *iter, mock_device_t *dev)
+{
+    DBusMessageIter dict;
+    const char *s;
+
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    s = dev->address;
+    append_entry(&dict, "Address", DBUS_TYPE_STRING, &s);
+    s = dev->alias;
+    append_entry(&dict, "Alias", DBUS_TYPE_STRING, &s);
+    s = dev->icon;
+    append_entry(&dict, "Icon", DBUS_TYPE_STRING, &s);
+    append_entry(&dict, "Connected", DBUS_TYPE_BOOLEAN, &dev->connected);
+    append_entry(&dict, "Paired", DBUS_TYPE_BOOLEAN, &dev->paired);
+    append_entry(&dict, "Trusted", DBUS_TYPE_BOOLEAN, &dev->trusted);
+    append_entry(&dict, "ServicesResolved", DBUS_TYPE_BOOLEAN, &dev->services_resolved);
+    append_entry(&dict, "RSSI", DBUS_TYPE_INT16, &dev->rssi);
+    dbus_message_iter_close_container(iter, &dict);
+}
+
+static void append_adapter_props(DBusMessageIter *iter)
+{
+    DBusMessageIter dict;
+    const char *address = "00:1A:7D:DA:71:13";
+
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_entry(&dict, "Address", DBUS_TYPE_STRING, &address);
+    append_entry(&dict, "Powered", DBUS_TYPE_BOOLEAN, &powered);
+    append_entry(&dict, "Discovering", DBUS_TYPE_BOOLEAN, &discovering);
+    dbus_message_iter_close_container(iter, &dict);
+}
+
+static void append_object(DBusMessageIter *objects, const char *path,
+                          const char *interface, mock_device_t *dev)
+{
+    DBusMessageIter object, ifaces, iface;
+
+    dbus_message_iter_open_container(objects, DBUS_TYPE_DICT_ENTRY, NULL, &object);
+    dbus_message_iter_append_basic(&object, DBUS_TYPE_OBJECT_PATH, &path);
+    dbus_message_iter_open_container(&object, DBUS_TYPE_ARRAY, "{sa{sv}}", &ifaces);
+    dbus_message_iter_open_container(&ifaces, DBUS_TYPE_DICT_ENTRY, NULL, &iface);
+    dbus_message_iter_append_basic(&iface, DBUS_TYPE_STRING, &interface);
+    if (dev)
+        append_device_props(&iface, dev);
+    else
+        append_adapter_props(&iface);
+    dbus_message_iter_close_container(&ifaces, &iface);
+    dbus_message_iter_close_container(&object, &ifaces);
+    dbus_message_iter_close_container(objects, &object);
+}
+
+/* Object i of dev's GATT tree: 0 the service, then gatt_chars[i - 1] */
+static void gatt_path(char *path, size_t len, mock_device_t *dev, int i)
+{
+    int service = 0x10 * (dev->gatt_changes + 1);
+
+    if (i == 0)
+        snprintf(path, len, "%s/service%04x", dev->path, service);
+    else
+        snprintf(path, len, "%s/service%04x/char%04x", dev->path, service,
+                 service + gatt_chars[i - 1].handle);
+}
+
+static const char *gatt_interface(int i)
+{
+    return i ? "org.bluez.GattCharacteristic1" : "org.bluez.GattService1";
+}
+
+/* {sa{sv}} of object i */
+static void append_gatt_interface(DBusMessageIter *ifaces, mock_device_t *dev, int i)
+{
+    DBusMessageIter iface, dict, variant, array;
+    const char *interface = gatt_interface(i), *s;
+    char service[192];
+    int j;
+
+    dbus_message_iter_open_container(ifaces, DBUS_TYPE_DICT_ENTRY, NULL, &iface);
+    dbus_message_iter_append_basic(&iface, DBUS_TYPE_STRING, &interface);
+    dbus_message_iter_open_container(&iface, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    s = i ? gatt_chars[i - 1].uuid : gatt_service_uuid;
+    append_entry(&dict, "UUID", DBUS_TYPE_STRING, &s);
+    if (i) {
+        DBusMessageIter entry;
+        const char *key = "Flags";
+
+        gatt_path(service, sizeof(service), dev, 0);
+        s = service;
+        append_entry(&dict, "Service", DBUS_TYPE_OBJECT_PATH, &s);
+        dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+        dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "as", &variant);
+        dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s", &array);
+        for (j = 0; j < 2 && gatt_chars[i - 1].flags[j]; j++)
+            dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &gatt_chars[i - 1].flags[j]);
+        dbus_message_iter_close_container(&variant, &array);
+        dbus_message_iter_close_container(&entry, &variant);
+        dbus_message_iter_close_container(&dict, &entry);
+    }
+    dbus_message_iter_close_container(&iface, &dict);
+    dbus_message_iter_close_container(ifaces, &iface);
+}
+
+/* GATT objects only appear once a device is connected, like bluetoothd */
+static void append_gatt_objects(DBusMessageIter *objects, mock_device_t *dev)
+{
+    DBusMessageIter object, ifaces;
+    char path[192];
+    const char *s = path;
+    int i;
+
+    for (i = 0; i < GATT_OBJECTS; i++) {
+        gatt_path(path, sizeof(path), dev, i);
+        dbus_message_iter_open_container(objects, DBUS_TYPE_DICT_ENTRY, NULL, &object);
+        dbus_message_iter_append_basic(&object, DBUS_TYPE_OBJECT_PATH, &s);
+        dbus_message_iter_open_container(&object, DBUS_TYPE_ARRAY, "{sa{sv}}", &ifaces);
+        append_gatt_interface(&ifaces, dev, i);
+        dbus_message_iter_close_container(&object, &ifaces);
+        dbus_message_iter_close_container(objects, &object);
+    }
+}
+
+/* InterfacesRemoved of each GATT object, when the connection goes or the
+ * services change */
+static void emit_gatt_removed(DBusConnection *conn, mock_device_t *dev)
+{
+    DBusMessage *signal;
+    DBusMessageIter iter, array;
+    char path[192];
+    const char *s = path, *interface;
+    int i;
+
+    for (i = 0; i < GATT_OBJECTS; i++) {
+        gatt_path(path, sizeof(path), dev, i);
+        interface = gatt_interface(i);
+        signal = dbus_message_new_signal("/", "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved");
+        dbus_message_iter_init_append(signal, &iter);
+        dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &s);
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+        dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &interface);
+        dbus_message_iter_close_container(&iter, &array);
+        dbus_connection_send(conn, signal, NULL);
+        dbus_message_unref(signal);
+    }
+}
+
+/* InterfacesAdded of each, when the services resolve or change */
+static void emit_gatt_added(DBusConnection *conn, mock_device_t *dev)
+{
+    DBusMessage *signal;
+    DBusMessageIter iter, array;
+    char path[192];
+    const char *s = path;
+    int i;
+
+    for (i = 0; i < GATT_OBJECTS; i++) {
+        gatt_path(path, sizeof(path), dev, i);
+        signal = dbus_message_new_signal("/", "org.freedesktop.DBus.ObjectManager", "InterfacesAdded");
+        dbus_message_iter_init_append(signal, &iter);
+        dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &s);
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}", &array);
+        append_gatt_interface(&array, dev, i);
+        dbus_message_iter_close_container(&iter, &array);
+        dbus_connection_send(conn, signal, NULL);
+        dbus_message_unref(signal);
+    }
+}
+
+static DBusMessage *get_managed_objects(DBusMessage *msg)
+{
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    DBusMessageIter iter, objects;
+    int i;
+
+    dbus_message_iter_init_append(reply, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}", &objects);
+    append_object(&objects, adapter_path, "org.bluez.Adapter1", NULL);
+    for (i = 0; i < ndevices; i++) {
+        append_object(&objects, devices[i].path, "org.bluez.Device1", &devices[i]);
+        if (devices[i].connected)
+            append_gatt_objects(&objects, &devices[i]);
+    }
+    dbus_message_iter_close_container(&iter, &objects);
+    return reply;
+}
+
+static void emit_changed(DBusConnection *conn, const char *path, const char *interface,
+                         const char *property, int type, const void *value, mock_device_t *advert)
+{
+    DBusMessage *signal;
+    DBusMessageIter iter, dict, invalidated;
+
+    signal = dbus_message_new_signal(path, "org.freedesktop.DBus.Properties", "PropertiesChanged");
+    dbus_message_iter_init_append(signal, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    if (property)
+        append_entry(&dict, property, type, value);
+    if (advert)
+        append_advert(&dict, advert);
+    dbus_message_iter_close_container(&iter, &dict);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &invalidated);
+    dbus_message_iter_close_container(&iter, &invalidated);
+    dbus_connection_send(conn, signal, NULL);
+    dbus_message_unref(signal);
+}
+
+static dbus_bool_t *property_ptr(const char *path, const char *interface, const char *property)
+{
+    mock_device_t *dev;
+
+    if (!strcmp(interface, "org.bluez.Adapter1") && !strcmp(path, adapter_path)) {
+        if (!strcmp(property, "Powered"))
+            return &powered;
+        if (!strcmp(property, "Discovering"))
+            return &discovering;
+        return NULL;
+    }
+
+    dev = find_device(path);
+    if (dev == NULL || strcmp(interface, "org.bluez.Device1"))
+        return NULL;
+    if (!strcmp(property, "Connected"))
+        return &dev->connected;
+    if (!strcmp(property, "Paired"))
+        return &dev->paired;
+    if (!strcmp(property, "Trusted"))
+        return &dev->trusted;
+    if (!strcmp(property, "ServicesResolved"))
+        return &dev->services_resolved;
+    return NULL;
+}
+
+static DBusMessage *properties_get(DBusMessage *msg)
+{
+    DBusMessage *reply;
+    DBusMessageIter iter;
+    const char *interface, *property;
+    dbus_bool_t *value;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &interface,
+                DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID))
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, "bad args");
+
+    value = property_ptr(dbus_message_get_path(msg), interface, property);
+    if (value == NULL)
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, "no such property");
+
+    reply = dbus_message_new_method_return(msg);
+    dbus_message_iter_init_append(reply, &iter);
+    append_variant(&iter, DBUS_TYPE_BOOLEAN, value);
+    return reply;
+}
+
+static DBusMessage *properties_set(DBusConnection *conn, DBusMessage *msg)
+{
+    DBusMessageIter iter, variant;
+    const char *interface, *property;
+    dbus_bool_t *value;
+
+    if (!dbus_message_iter_init(msg, &iter))
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, "bad args");
+    dbus_message_iter_get_basic(&iter, &interface);
+    dbus_message_iter_next(&iter);
+    dbus_message_iter_get_basic(&iter, &property);
+    dbus_message_iter_next(&iter);
+
+    value = property_ptr(dbus_message_get_path(msg), interface, property);
+    if (value == NULL)
+        return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, "no such property");
+
+    dbus_message_iter_recurse(&iter, &variant);
+    dbus_message_iter_get_basic(&variant, value);
+    emit_changed(conn, dbus_message_get_path(msg), interface, property,
+                 DBUS_TYPE_BOOLEAN, value, NULL);
+    return dbus_message_new_method_return(msg);
+}
+
+/* Services resolve resolve_time after connecting, and go with the connection */
+static void set_connected(DBusConnection *conn, mock_device_t *dev, dbus_bool_t connected)
+{
+    dev->connected = connected;
+    emit_changed(conn, dev->path, "org.bluez.Device1", "Connected",
+                 DBUS_TYPE_BOOLEAN, &dev->connected, NULL);
+    if (connected && !dev->services_resolved && !dev->resolve_due) {
+        dev->resolve_due = now_ms() + resolve_time;
+        nresolving++;
+    } else if (!connected) {
+        if (dev->resolve_due) {
+            dev->resolve_due = 0;
+            nresolving--;
+        }
+        if (dev->services_resolved) {
+            emit_gatt_removed(conn, dev);
+            dev->services_resolved = FALSE;
+            emit_changed(conn, dev->path, "org.bluez.Device1", "ServicesResolved",
+                         DBUS_TYPE_BOOLEAN, &dev->services_resolved, NULL);
+        }
+    }
+}
+
+static void pump_resolving(DBusConnection *conn)
+{
+    long long now = now_ms();
+    mock_device_t *dev;
+    int i;
+
+    for (i = 0; nresolving && i < ndevices; i++) {
+        dev = &devices[i];
+        if (!dev->resolve_due || dev->resolve_due > now)
+            continue;
+        dev->resolve_due = 0;
+        nresolving--;
+        dev->services_resolved = TRUE;
+        emit_gatt_added(conn, dev);
+        emit_changed(conn, dev->path, "org.bluez.Device1", "ServicesResolved",
+                     DBUS_TYPE_BOOLEAN, &dev->services_resolved, NULL);
+        if (change_time && !dev->change_due) {
+            dev->change_due = now + change_time;
+            nchanging++;
+        }
+    }
+}
+
+/* Service Changed: the old objects go, the new ones come at other handles */
+static void pump_changing(DBusConnection *conn)
+{
+    long long now = now_ms();
+    mock_device_t *dev;
+    int i;
+
+    for (i = 0; nchanging && i < ndevices; i++) {
+        dev = &devices[i];
+        if (!dev->change_due || dev->change_due > now)
+            continue;
+        dev->change_due = 0;
+        nchanging--;
+        if (!dev->services_resolved)
+            continue;
+        emit_gatt_removed(conn, dev);
+        dev->gatt_changes++;
+        emit_gatt_added(conn, dev);
+    }
+}
+
+static DBusMessage *device_call(DBusConnection *conn, DBusMessage *msg, mock_device_t *dev)
+{
+    const char *member = dbus_message_get_member(msg);
+
+    if (!strcmp(member, "Pair")) {
+        dev->paired = TRUE;
+        emit_changed(conn, dev->path, "org.bluez.Device1", "Paired",
+                     DBUS_TYPE_BOOLEAN, &dev->paired, NULL);
+    } else if (!strcmp(member, "Connect") || !strcmp(member, "Disconnect")) {
+        set_connected(conn, dev, !strcmp(member, "Connect"));
+    } else {
+        return dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, member);
+    }
+    return dbus_message_new_method_return(msg);
+}
+
+static int find_agent(const char *owner)
+{
+    int i;
+
+    for (i = 0; i < nagents; i++) {
+        if (!strcmp(agents[i].owner, owner))
+            return i;
+    }
+    return -1;
+}
+
+static DBusMessage *agent_manager_call(DBusMessage *msg)
+{
+    const char *member = dbus_message_get_member(msg);
+    const char *sender = dbus_message_get_sender(msg);
+    const char *path, *capability = "";
+    int i = find_agent(sender);
+
+    if (!strcmp(member, "RegisterAgent")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path,
+                                   DBUS_TYPE_STRING, &capability, DBUS_TYPE_INVALID))
+            return dbus_message_new_error(msg, "org.bluez.Error.InvalidArguments", "Invalid arguments");
+        if (i >= 0)
+            return dbus_message_new_error(msg, "org.bluez.Error.AlreadyExists", "Already Exists");
+        if (nagents == MAX_AGENTS)
+            return dbus_message_new_error(msg, "org.bluez.Error.Failed", "Too many agents");
+        i = nagents++;
+        snprintf(agents[i].owner, sizeof(agents[i].owner), "%s", sender);
+        snprintf(agents[i].path, sizeof(agents[i].path), "%s", path);
+        snprintf(agents[i].capability, sizeof(agents[i].capability), "%s", capability);
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "UnregisterAgent")) {
+        if (i < 0)
+            return dbus_message_new_error(msg, "org.bluez.Error.DoesNotExist", "Does Not Exist");
+        agents[i] = agents[--nagents];
+        return dbus_message_new_method_return(msg);
+    }
+    return NULL;
+}
+
+static void pairing_free(void *data)
+{
+    pairing_t *pairing = (pairing_t *)data;
+
+    dbus_message_unref(pairing->msg);
+    free(pairing);
+}
+
+static void pairing_answered(DBusPendingCall *pending, void *data)
+{
+    pairing_t *pairing = (pairing_t *)data;
+    DBusMessage *answer = dbus_pending_call_steal_reply(pending), *reply;
+    const char *pin;
+    dbus_bool_t ok;
+
+    ok = answer && dbus_message_get_type(answer) == DBUS_MESSAGE_TYPE_METHOD_RETURN;
+    if (ok && pair_pin)
+        ok = dbus_message_get_args(answer, NULL, DBUS_TYPE_STRING, &pin, DBUS_TYPE_INVALID) &&
+             !strcmp(pin, pair_pin);
+    if (answer)
+        dbus_message_unref(answer);
+
+    if (ok) {
+        pairing->dev->paired = TRUE;
+        emit_changed(pairing->conn, pairing->dev->path, "org.bluez.Device1", "Paired",
+                     DBUS_TYPE_BOOLEAN, &pairing->dev->paired, NULL);
+        reply = dbus_message_new_method_return(pairing->msg);
+    } else {
+        reply = dbus_message_new_error(pairing->msg, "org.bluez.Error.AuthenticationFailed",
+                                       "Authentication Failed");
+    }
+    dbus_connection_send(pairing->conn, reply, NULL);
+    dbus_message_unref(reply);
+}
+
+/* Pair needing authentication. NULL: answered later, or never */
+static DBusMessage *pair_with_agent(DBusConnection *conn, DBusMessage *msg, mock_device_t *dev)
+{
+    DBusPendingCall *pending;
+    DBusMessage *request;
+    pairing_t *pairing;
+    const char *path = dev->path;
+    int i = find_agent(dbus_message_get_sender(msg));
+
+    if (i < 0)
+        return NULL;
+    if (!strcmp(agents[i].capability, "NoInputNoOutput")) {
+        if (pair_pin)
+            return dbus_message_new_error(msg, "org.bluez.Error.AuthenticationFailed",
+                                          "Authentication Failed");
+        /* just works */
+        return device_call(conn, msg, dev);
+    }
+
+    request = dbus_message_new_method_call(agents[i].owner, agents[i].path, "org.bluez.Agent1",
+                                           pair_pin ? "RequestPinCode" : "RequestConfirmation");
+    if (pair_pin)
+        dbus_message_append_args(request, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID);
+    else
+        dbus_message_append_args(request, DBUS_TYPE_OBJECT_PATH, &path,
+                                 DBUS_TYPE_UINT32, &pair_passkey, DBUS_TYPE_INVALID);
+
+    pairing = calloc(1, sizeof(pairing_t));
+    pairing->conn = conn;
+    pairing->msg = dbus_message_ref(msg);
+    pairing->dev = dev;
+    if (!dbus_connection_send_with_reply(conn, request, &pending, 5000) || !pending) {
+        pairing_free(pairing);
+        dbus_message_unref(request);
+        return dbus_message_new_error(msg, "org.bluez.Error.Failed", "agent unreachable");
+    }
+    dbus_pending_call_set_notify(pending, pairing_answered, pairing, pairing_free);
+    dbus_pending_call_unref(pending);
+    dbus_message_unref(request);
+    return NULL;
+}
+
+static DBusMessage *profile_manager_call(DBusMessage *msg)
+{
+    const char *member = dbus_message_get_member(msg);
+    const char *sender = dbus_message_get_sender(msg);
+    DBusMessageIter iter, dict, entry, variant;
+    const char *path, *uuid, *key, *role;
+    int i, server = 0;
+
+    if (!strcmp(member, "RegisterProfile")) {
+        /* oa{sv} after the uuid: only Role matters here */
+        if (!dbus_message_iter_init(msg, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)
+            return dbus_message_new_error(msg, "org.bluez.Error.InvalidArguments", "Invalid arguments");
+        dbus_message_iter_get_basic(&iter, &path);
+        if (!dbus_message_iter_next(&iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+            return dbus_message_new_error(msg, "org.bluez.Error.InvalidArguments", "Invalid arguments");
+        dbus_message_iter_get_basic(&iter, &uuid);
+        if (dbus_message_iter_next(&iter) && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY) {
+            dbus_message_iter_recurse(&iter, &dict);
+            for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&dict)) {
+                dbus_message_iter_recurse(&dict, &entry);
+                dbus_message_iter_get_basic(&entry, &key);
+                dbus_message_iter_next(&entry);
+                dbus_message_iter_recurse(&entry, &variant);
+                if (!strcmp(key, "Role") && dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_STRING) {
+                    dbus_message_iter_get_basic(&variant, &role);
+                    server = !strcmp(role, "server");
+                }
+            }
+        }
+        for (i = 0; i < nprofiles; i++) {
+            if (!strcasecmp(profiles[i].uuid, uuid))
+                return dbus_message_new_error(msg, "org.bluez.Error.AlreadyExists", "Already Exists");
+        }
+        if (nprofiles == MAX_PROFILES)
+            return dbus_message_new_error(msg, "org.bluez.Error.Failed", "Too many profiles");
+        i = nprofiles++;
+        snprintf(profiles[i].owner, sizeof(profiles[i].owner), "%s", sender);
+        snprintf(profiles[i].path, sizeof(profiles[i].path), "%s", path);
+        snprintf(profiles[i].uuid, sizeof(profiles[i].uuid), "%s", uuid);
+        profiles[i].server = server;
+        profiles[i].incoming = server ? incoming : 0;
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "UnregisterProfile")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID))
+            return dbus_message_new_error(msg, "org.bluez.Error.InvalidArguments", "Invalid arguments");
+        for (i = 0; i < nprofiles; i++) {
+            if (!strcmp(profiles[i].owner, sender) && !strcmp(profiles[i].path, path)) {
+                profiles[i] = profiles[--nprofiles];
+                return dbus_message_new_method_return(msg);
+            }
+        }
+        return dbus_message_new_error(msg, "org.bluez.Error.DoesNotExist", "Does Not Exist");
+    }
+    return NULL;
+}
+
+static void profile_connection_free(void *data)
+{
+    profile_connection_t *pc = (profile_connection_t *)data;
+
+    if (pc->fd >= 0)
+        close(pc->fd);
+    if (pc->msg)
+        dbus_message_unref(pc->msg);
+    free(pc);
+}
+
+static void profile_answered(DBusPendingCall *pending, void *data)
+{
+    profile_connection_t *pc = (profile_connection_t *)data;
+    DBusMessage *answer = dbus_pending_call_steal_reply(pending), *reply;
+    int ok = answer && dbus_message_get_type(answer) == DBUS_MESSAGE_TYPE_METHOD_RETURN;
+
+    if (answer)
+        dbus_message_unref(answer);
+    if (ok && nlinks < MAX_LINKS) {
+        link_fds[nlinks++] = pc->fd;
+        pc->fd = -1;
+    }
+    if (pc->msg) {
+        reply = pc->fd < 0 ? dbus_message_new_method_return(pc->msg) :
+                dbus_message_new_error(pc->msg, "org.bluez.Error.Failed", "Connection refused");
+        dbus_connection_send(pc->conn, reply, NULL);
+        dbus_message_unref(reply);
+    }
+}
+
+/* NewConnection to profile i from dev. msg: the ConnectProfile to answer once
+ * it is through. NULL: answered later */
+static DBusMessage *new_connection(DBusConnection *conn, int i, mock_device_t *dev, DBusMessage *msg)
+{
+    DBusMessageIter iter, dict;
+    DBusPendingCall *pending;
+    profile_connection_t *pc;
+    DBusMessage *request;
+    const char *path = dev->path;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+        return msg ? dbus_message_new_error(msg, "org.bluez.Error.Failed", strerror(errno)) : NULL;
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+    request = dbus_message_new_method_call(profiles[i].owner, profiles[i].path, "org.bluez.Profile1",
+                                           "NewConnection");
+    dbus_message_iter_init_append(request, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_UNIX_FD, &sv[1]);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    dbus_message_iter_close_container(&iter, &dict);
+    /* the message holds a duplicate */
+    close(sv[1]);
+
+    pc = calloc(1, sizeof(profile_connection_t));
+    pc->conn = conn;
+    pc->msg = msg ? dbus_message_ref(msg) : NULL;
+    pc->fd = sv[0];
+    if (!dbus_connection_send_with_reply(conn, request, &pending, 5000) || !pending) {
+        profile_connection_free(pc);
+        dbus_message_unref(request);
+        return msg ? dbus_message_new_error(msg, "org.bluez.Error.Failed", "profile unreachable") : NULL;
+    }
+    dbus_pending_call_set_notify(pending, profile_answered, pc, profile_connection_free);
+    dbus_pending_call_unref(pending);
+    dbus_message_unref(request);
+    return NULL;
+}
+
+static DBusMessage *connect_profile(DBusConnection *conn, DBusMessage *msg, mock_device_t *dev)
+{
+    const char *uuid;
+    int i;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &uuid, DBUS_TYPE_INVALID))
+        return dbus_message_new_error(msg, "org.bluez.Error.InvalidArguments", "Invalid arguments");
+    for (i = 0; i < nprofiles; i++) {
+        if (!strcasecmp(profiles[i].uuid, uuid) && !profiles[i].server)
+            return new_connection(conn, i, dev, msg);
+    }
+    return dbus_message_new_error(msg, "org.bluez.Error.Failed", "Protocol not available");
+}
+
+/* Devices of -i connecting to server profiles */
+static void pump_incoming(DBusConnection *conn)
+{
+    int i;
+
+    for (i = 0; i < nprofiles; i++) {
+        while (profiles[i].incoming > 0) {
+            profiles[i].incoming--;
+            if (profiles[i].incoming < ndevices)
+                new_connection(conn, i, &devices[profiles[i].incoming], NULL);
+        }
+    }
+}
+
+/* Echo what profile sockets read, forget closed ones */
+static void pump_links(void)
+{
+    char buf[4096];
+    ssize_t n, sent, m;
+    int i, j;
+
+    for (i = 0; i < nlinks; i++) {
+        /* a bounded share each, D-Bus traffic waits meanwhile */
+        for (j = 0; j < 16 && (n = recv(link_fds[i], buf, sizeof(buf), 0)) > 0; j++) {
+            for (sent = 0; sent < n; sent += m) {
+                m = send(link_fds[i], buf + sent, n - sent, MSG_NOSIGNAL);
+                if (m < 0 && errno == EAGAIN) {
+                    usleep(100);
+                    m = 0;
+                } else if (m < 0) {
+                    break;
+                }
+            }
+        }
+        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+            close(link_fds[i]);
+            link_fds[i--] = link_fds[--nlinks];
+        }
+    }
+}
+
+/* Index into gatt_chars of the characteristic at path, -1: none there now */
+static int find_characteristic(const char *path)
+{
+    char char_path[192];
+    size_t len;
+    int d, i;
+
+    for (d = 0; d < ndevices; d++) {
+        len = strlen(devices[d].path);
+        if (!devices[d].connected || strncmp(path, devices[d].path, len))
+            continue;
+        for (i = 1; i < GATT_OBJECTS; i++) {
+            gatt_path(char_path, sizeof(char_path), &devices[d], i);
+            if (!strcmp(path, char_path))
+                return i - 1;
+        }
+    }
+    return -1;
+}
+
+static DBusMessage *characteristic_call(DBusMessage *msg, int index)
+{
+    const char *member = dbus_message_get_member(msg);
+    DBusMessage *reply;
+    DBusMessageIter iter, array;
+    const unsigned char *data = sensor_location;
+    dbus_uint16_t mtu = 23;
+    int sv[2];
+
+    if (!strcmp(member, "ReadValue")) {
+        reply = dbus_message_new_method_return(msg);
+        dbus_message_iter_init_append(reply, &iter);
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "y", &array);
+        dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE, &data, sizeof(sensor_location));
+        dbus_message_iter_close_container(&iter, &array);
+        return reply;
+    }
+    if (!strcmp(member, "WriteValue")) {
+        const unsigned char *value;
+        int len;
+
+        dbus_message_iter_init(msg, &iter);
+        dbus_message_iter_recurse(&iter, &array);
+        dbus_message_iter_get_fixed_array(&array, &value, &len);
+        memcpy(sensor_location, value, len < (int)sizeof(sensor_location) ? len : (int)sizeof(sensor_location));
+        return dbus_message_new_method_return(msg);
+    }
+    if (strcmp(member, "AcquireNotify") && strcmp(member, "AcquireWrite"))
+        return dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, member);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv))
+        return dbus_message_new_error(msg, DBUS_ERROR_FAILED, "socketpair");
+
+    reply = dbus_message_new_method_return(msg);
+    dbus_message_append_args(reply, DBUS_TYPE_UNIX_FD, &sv[1], DBUS_TYPE_UINT16, &mtu, DBUS_TYPE_INVALID);
+    close(sv[1]);
+
+    /* keep our end: notify ends are fed, write ends only need a reader */
+    if (!strcmp(member, "AcquireNotify") && nnotify < MAX_NOTIFY_FDS && index == 0)
+        notify_fds[nnotify++] = sv[0];
+    else if (nnotify < MAX_NOTIFY_FDS)
+        notify_fds[nnotify++] = -sv[0] - 1;
+    return reply;
+}
+
+/* Feed notify sockets, drain write sockets, forget closed ones */
+static void pump_gatt(void)
+{
+    unsigned char value[20];
+    char drain[512];
+    int i, j;
+
+    for (i = 0; i < nnotify; i++) {
+        int fd = notify_fds[i] >= 0 ? notify_fds[i] : -notify_fds[i] - 1;
+        int closed = 0;
+
+        if (notify_fds[i] >= 0) {
+            for (j = 0; j < NOTIFY_BURST; j++) {
+                value[0] = j;
+                if (send(fd, value, sizeof(value), MSG_NOSIGNAL) < 0) {
+                    closed = (errno != EAGAIN);
+                    break;
+                }
+            }
+        } else {
+            ssize_t n;
+
+            while ((n = recv(fd, drain, sizeof(drain), 0)) > 0)
+                ;
+            closed = (n == 0);
+        }
+
+        if (closed) {
+            close(fd);
+            notify_fds[i--] = notify_fds[--nnotify];
+        }
+    }
+}
+
+/* NULL: reply comes later from pump_connecting() */
+static DBusMessage *defer_connect(DBusMessage *msg, mock_device_t *dev)
+{
+    if (nconnecting >= max_connecting)
+        return dbus_message_new_error(msg, "org.bluez.Error.Failed", "le-connection-abort-by-local");
+
+    connecting[nconnecting].reply = dbus_message_new_method_return(msg);
+    connecting[nconnecting].dev = dev;
+    connecting[nconnecting].due = now_ms() + connect_time;
+    nconnecting++;
+    return NULL;
+}
+
+static void pump_connecting(DBusConnection *conn)
+{
+    long long now = now_ms();
+    int i;
+
+    for (i = 0; i < nconnecting; i++) {
+        if (connecting[i].due > now)
+            continue;
+
+        set_connected(conn, connecting[i].dev, TRUE);
+        dbus_connection_send(conn, connecting[i].reply, NULL);
+        dbus_message_unref(connecting[i].reply);
+        connecting[i--] = connecting[--nconnecting];
+    }
+}
+
+static DBusHandlerResult handle_message(DBusConnection *conn, DBusMessage *msg, void *data)
+{
+    const char *interface = dbus_message_get_interface(msg);
+    const char *member = dbus_message_get_member(msg);
+    const char *path = dbus_message_get_path(msg);
+    DBusMessage *reply = NULL;
+    mock_device_t *dev;
+    int i;
+
+    (void)data;
+
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL || !interface)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (call_log)
+        fprintf(call_log, "%s.%s %s\n", interface, member, path);
+    if (reply_delay)
+        usleep(reply_delay * 1000);
+    if (now_ms() >= stall_start && now_ms() < stall_end)
+        usleep((stall_end - now_ms()) * 1000);
+
+    if (!strcmp(interface, "org.freedesktop.DBus.ObjectManager") &&
+        !strcmp(member, "GetManagedObjects")) {
+        reply = get_managed_objects(msg);
+    } else if (!strcmp(interface, "org.freedesktop.DBus.Properties")) {
+        if (!strcmp(member, "Get"))
+            reply = properties_get(msg);
+        else if (!strcmp(member, "Set"))
+            reply = properties_set(conn, msg);
+    } else if (!strcmp(interface, "org.bluez.Adapter1") && !strcmp(path, adapter_path)) {
+        if (!strcmp(member, "StartDiscovery") && !powered) {
+            reply = dbus_message_new_error(msg, "org.bluez.Error.NotReady", "Resource Not Ready");
+        } else if (!strcmp(member, "StartDiscovery") || !strcmp(member, "StopDiscovery")) {
+            discovering = !strcmp(member, "StartDiscovery");
+            emit_changed(conn, adapter_path, "org.bluez.Adapter1", "Discovering",
+                         DBUS_TYPE_BOOLEAN, &discovering, NULL);
+            reply = dbus_message_new_method_return(msg);
+        }
+    } else if (!strcmp(interface, "org.bluez.AgentManager1") && !strcmp(path, "/org/bluez")) {
+        reply = agent_manager_call(msg);
+    } else if (!strcmp(interface, "org.bluez.ProfileManager1") && !strcmp(path, "/org/bluez")) {
+        reply = profile_manager_call(msg);
+    } else if (!strcmp(interface, "org.bluez.Device1") && (dev = find_device(path))) {
+        if ((pair_pin || pair_confirm) && !dev->paired && !strcmp(member, "Pair")) {
+            reply = pair_with_agent(conn, msg, dev);
+            if (reply == NULL)
+                return DBUS_HANDLER_RESULT_HANDLED;
+        } else if (!strcmp(member, "ConnectProfile")) {
+            reply = connect_profile(conn, msg, dev);
+            if (reply == NULL)
+                return DBUS_HANDLER_RESULT_HANDLED;
+        } else if (connect_time && !strcmp(member, "Connect")) {
+            reply = defer_connect(msg, dev);
+            if (reply == NULL)
+                return DBUS_HANDLER_RESULT_HANDLED;
+        } else {
+            reply = device_call(conn, msg, dev);
+        }
+    } else if (!strcmp(interface, "org.bluez.GattCharacteristic1")) {
+        if ((i = find_characteristic(path)) >= 0)
+            reply = characteristic_call(msg, i);
+        else
+            reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_OBJECT, path);
+    }
+
+    if (reply == NULL)
+        reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, member);
+    if (!dbus_message_get_no_reply(msg))
+        dbus_connection_send(conn, reply, NULL);
+    dbus_message_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+int main(int argc, char *argv[])
+{
+    DBusObjectPathVTable vtable = { .message_function = handle_message };
+    DBusConnection *conn;
+    DBusError err;
+    long long next_advert = 0;
+    int opt, i, cursor = 0, stall_at, stall_ms;
+
+    while ((opt = getopt(argc, argv, "n:a:d:c:l:s:p:k:i:r:g:")) != -1) {
+        switch (opt) {
+        case 'n': ndevices = atoi(optarg); break;
+        case 'a': advert_interval = atoi(optarg); break;
+        case 'd': reply_delay = atoi(optarg); break;
+        case 'c': connect_time = atoi(optarg); break;
+        case 'l':
+            max_connecting = atoi(optarg);
+            if (max_connecting > MAX_CONNECTING)
+                max_connecting = MAX_CONNECTING;
+            break;
+        case 's':
+            if (sscanf(optarg, "%d,%d", &stall_at, &stall_ms) == 2) {
+                stall_start = now_ms() + stall_at;
+                stall_end = stall_start + stall_ms;
+            }
+            break;
+        case 'p': pair_pin = optarg; break;
+        case 'k':
+            pair_passkey = strtoul(optarg, NULL, 10);
+            pair_confirm = 1;
+            break;
+        case 'i': incoming = atoi(optarg); break;
+        case 'r': resolve_time = atoi(optarg); break;
+        case 'g': change_time = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n devices] [-a advert_interval_ms] [-d reply_delay_ms] "
+                    "[-c connect_ms] [-l max_connecting] [-s stall_at_ms,stall_ms] "
+                    "[-p pin | -k passkey] [-i incoming] [-r resolve_ms] [-g change_ms]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (getenv("MOCK_BLUEZ_LOG")) {
+        call_log = fopen(getenv("MOCK_BLUEZ_LOG"), "a");
+        if (call_log)
+            setvbuf(call_log, NULL, _IOLBF, 0);
+    }
+
+    devices = calloc(ndevices, sizeof(mock_device_t));
+    for (i = 0; i < ndevices; i++) {
+        mock_device_t *dev = &devices[i];
+
+        snprintf(dev->address, sizeof(dev->address), "C0:FF:EE:%02X:%02X:%02X",
+                 (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        snprintf(dev->path, sizeof(dev->path), "%s/dev_C0_FF_EE_%02X_%02X_%02X",
+                 adapter_path, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        if (i == 0)
+            snprintf(dev->alias, sizeof(dev->alias), "WI-XB400");
+        else
+            snprintf(dev->alias, sizeof(dev->alias), "MOCK-%05d", i);
+        snprintf(dev->icon, sizeof(dev->icon), i % 2 ? "audio-headset" : "phone");
+        dev->rssi = -40 - (i % 50);
+    }
+
+    dbus_error_init(&err);
+    conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+    if (conn == NULL) {
+        fprintf(stderr, "mock_bluez: %s\n", err.message);
+        return 1;
+    }
+    if (dbus_bus_request_name(conn, "org.bluez", DBUS_NAME_FLAG_DO_NOT_QUEUE, &err) !=
+            DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        fprintf(stderr, "mock_bluez: can't own org.bluez\n");
+        return 1;
+    }
+    dbus_connection_register_fallback(conn, "/", &vtable, NULL);
+
+    while (dbus_connection_read_write_dispatch(conn, nconnecting || nlinks || nresolving || nchanging ? 1 :
+                                               advert_interval > 0 ? advert_interval : 100)) {
+        pump_gatt();
+        pump_connecting(conn);
+        pump_resolving(conn);
+        pump_changing(conn);
+        pump_incoming(conn);
+        pump_links();
+        if (!discovering || advert_interval <= 0 || ndevices == 0)
+            continue;
+        if (now_ms() < next_advert)
+            continue;
+
+        mock_device_t *dev = &devices[cursor++ % ndevices];
+        dev->rssi = -40 - (rand() % 50);
+        emit_changed(conn, dev->path, "org.bluez.Device1", "RSSI",
+                     DBUS_TYPE_INT16, &dev->rssi, dev);
+        next_advert = now_ms() + advert_interval;
+    }
+
+    return 0;
+}
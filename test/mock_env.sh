@@ -0,0 +1,29 @@
+#!/bin/sh
+# Run a command against mock_bluez on a private bus, which is the session bus
+# too. With MOCK_OBEXD set, mock_obexd runs with those arguments and stores
+# objects under $MOCK_OBEXD_DIR. mock_bluez logs the calls it gets to
+# $MOCK_BLUEZ_LOG, for tests counting what reached it.
+# usage: [MOCK_ARGS="-n 100"] [MOCK_OBEXD="-r 1000000"] test/mock_env.sh command [args]
+set -e
+cd "$(dirname "$0")/.."
+
+PIDFILE=$(mktemp)
+DBUS_SYSTEM_BUS_ADDRESS=$(dbus-daemon --session --fork --print-address=1 --print-pid=3 3>"$PIDFILE")
+DBUS_SESSION_BUS_ADDRESS=$DBUS_SYSTEM_BUS_ADDRESS
+export DBUS_SYSTEM_BUS_ADDRESS DBUS_SESSION_BUS_ADDRESS
+export LD_LIBRARY_PATH=$(pwd)${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+
+MOCK_BLUEZ_LOG=$(mktemp)
+export MOCK_BLUEZ_LOG
+./test/mock_bluez $MOCK_ARGS &
+MOCK_PID=$!
+if [ -n "${MOCK_OBEXD+set}" ]; then
+    MOCK_OBEXD_DIR=$(mktemp -d)
+    export MOCK_OBEXD_DIR
+    ./test/mock_obexd -o "$MOCK_OBEXD_DIR" $MOCK_OBEXD &
+    MOCK_PID="$MOCK_PID $!"
+fi
+trap 'kill $MOCK_PID $(cat "$PIDFILE") 2>/dev/null; rm -f "$PIDFILE" "$MOCK_BLUEZ_LOG"; [ -z "$MOCK_OBEXD_DIR" ] || rm -rf "$MOCK_OBEXD_DIR"' EXIT
+sleep 0.2
+
+"$@"
@@ -0,0 +1,377 @@
+/*
+ * Minimal org.bluez.obex client service for tests, on whatever bus
+ * DBUS_SESSION_BUS_ADDRESS points at. Sessions reach C0:FF:EE:* devices only.
+ *
+ * Like obexd, a transfer opens its source file when it is created and reads
+ * it from there: rate bytes a second, every chunk reported through Transferred.
+ * Objects land in dir/<destination>[/<folder>]/<name>. Transfer1.Cancel ends a
+ * transfer with Status "error".
+ *
+ * usage: mock_obexd [-r bytes_per_s] [-o dir]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dbus/dbus.h>
+
+#define MAX_SESSIONS    (64)
+#define MAX_TRANSFERS   (64)
+#define TICK_MS         (10)
+
+typedef struct session {
+    char path[64];
+    char dest[18];
+    char folder[128];
+    int used;
+} session_t;
+
+typedef struct transfer {
+    char path[96];
+    int session;
+    int in, out;
+    dbus_uint64_t size, transferred;
+    int started;
+    int used;
+} transfer_t;
+
+static session_t sessions[MAX_SESSIONS];
+static transfer_t transfers[MAX_TRANSFERS];
+static int next_session, next_transfer;
+static long rate = 1 << 20;
+static const char *outdir = "/tmp";
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void append_entry(DBusMessageIter *dict, const char *key, int type, const void *value)
+{
+    DBusMessageIter entry, variant;
+    char sig[2] = { (char)type, '\0' };
+
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, sig, &variant);
+    dbus_message_iter_append_basic(&variant, type, value);
+    dbus_message_iter_close_container(&entry, &variant);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void emit_changed(DBusConnection *conn, const char *path, const char *property,
+                         int type, const void *value)
+{
+    const char *interface = "org.bluez.obex.Transfer1";
+    DBusMessageIter iter, dict, invalidated;
+    DBusMessage *signal;
+
+    signal = dbus_message_new_signal(path, "org.freedesktop.DBus.Properties", "PropertiesChanged");
+    dbus_message_iter_init_append(signal, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_entry(&dict, property, type, value);
+    dbus_message_iter_close_container(&iter, &dict);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &invalidated);
+    dbus_message_iter_close_container(&iter, &invalidated);
+    dbus_connection_send(conn, signal, NULL);
+    dbus_message_unref(signal);
+}
+
+static void emit_status(DBusConnection *conn, transfer_t *t, const char *status)
+{
+    emit_changed(conn, t->path, "Status", DBUS_TYPE_STRING, &status);
+}
+
+static void end_transfer(DBusConnection *conn, transfer_t *t, const char *status)
+{
+    emit_status(conn, t, status);
+    close(t->in);
+    close(t->out);
+    t->used = 0;
+}
+
+static session_t *find_session(const char *path)
+{
+    int i;
+
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].used && !strcmp(sessions[i].path, path))
+            return &sessions[i];
+    }
+    return NULL;
+}
+
+static transfer_t *find_transfer(const char *path)
+{
+    int i;
+
+    for (i = 0; i < MAX_TRANSFERS; i++) {
+        if (transfers[i].used && !strcmp(transfers[i].path, path))
+            return &transfers[i];
+    }
+    return NULL;
+}
+
+static DBusMessage *create_session(DBusMessage *msg)
+{
+    DBusMessageIter iter, dict, entry, variant;
+    const char *dest, *key, *target = "", *path;
+    session_t *s = NULL;
+    int i;
+
+    if (!dbus_message_iter_init(msg, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.InvalidArguments", "Invalid arguments");
+    dbus_message_iter_get_basic(&iter, &dest);
+    if (dbus_message_iter_next(&iter) && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY) {
+        dbus_message_iter_recurse(&iter, &dict);
+        for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&dict)) {
+            dbus_message_iter_recurse(&dict, &entry);
+            dbus_message_iter_get_basic(&entry, &key);
+            dbus_message_iter_next(&entry);
+            dbus_message_iter_recurse(&entry, &variant);
+            if (!strcmp(key, "Target") && dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_STRING)
+                dbus_message_iter_get_basic(&variant, &target);
+        }
+    }
+    if (strcmp(target, "opp") && strcmp(target, "ftp"))
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.InvalidArguments", "Invalid target");
+    if (strncmp(dest, "C0:FF:EE:", 9))
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.Failed", "Host is down");
+
+    for (i = 0; i < MAX_SESSIONS && !s; i++) {
+        if (!sessions[i].used)
+            s = &sessions[i];
+    }
+    if (s == NULL)
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.Failed", "Too many sessions");
+    memset(s, 0, sizeof(*s));
+    s->used = 1;
+    snprintf(s->path, sizeof(s->path), "/org/bluez/obex/client/session%d", next_session++);
+    snprintf(s->dest, sizeof(s->dest), "%s", dest);
+
+    msg = dbus_message_new_method_return(msg);
+    path = s->path;
+    dbus_message_append_args(msg, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID);
+    return msg;
+}
+
+static DBusMessage *remove_session(DBusConnection *conn, DBusMessage *msg)
+{
+    const char *path;
+    session_t *s;
+    int i;
+
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID) ||
+        !(s = find_session(path)))
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.InvalidArguments", "Invalid path");
+    for (i = 0; i < MAX_TRANSFERS; i++) {
+        if (transfers[i].used && &sessions[transfers[i].session] == s)
+            end_transfer(conn, &transfers[i], "error");
+    }
+    s->used = 0;
+    return dbus_message_new_method_return(msg);
+}
+
+/* mkdir -p of dir/<dest>[/<folder>], then the object in it */
+static int open_object(session_t *s, const char *name)
+{
+    char path[512];
+    char *p;
+
+    snprintf(path, sizeof(path), "%s/%s/%s/%s", outdir, s->dest, s->folder, name);
+    for (p = path + strlen(outdir) + 1; (p = strchr(p, '/')); p++) {
+        *p = '\0';
+        if (mkdir(path, 0700) && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+}
+
+static DBusMessage *start_transfer(DBusMessage *msg, session_t *s, const char *source, const char *name)
+{
+    DBusMessageIter iter, dict;
+    const char *status = "queued", *path;
+    transfer_t *t = NULL;
+    struct stat st = { 0 };
+    int i;
+
+    for (i = 0; i < MAX_TRANSFERS && !t; i++) {
+        if (!transfers[i].used)
+            t = &transfers[i];
+    }
+    if (t == NULL)
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.Failed", "Too many transfers");
+
+    t->in = open(source, O_RDONLY | O_CLOEXEC);
+    if (t->in < 0)
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.Failed", strerror(errno));
+    fstat(t->in, &st);
+    t->out = open_object(s, name);
+    if (t->out < 0) {
+        close(t->in);
+        return dbus_message_new_error(msg, "org.bluez.obex.Error.Failed", strerror(errno));
+    }
+    t->used = 1;
+    t->started = 0;
+    t->session = s - sessions;
+    t->size = S_ISREG(st.st_mode) ? (dbus_uint64_t)st.st_size : 0;
+    t->transferred = 0;
+    snprintf(t->path, sizeof(t->path), "%s/transfer%d", s->path, next_transfer++);
+
+    msg = dbus_message_new_method_return(msg);
+    path = t->path;
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+    append_entry(&dict, "Status", DBUS_TYPE_STRING, &status);
+    append_entry(&dict, "Name", DBUS_TYPE_STRING, &name);
+    append_entry(&dict, "Size", DBUS_TYPE_UINT64, &t->size);
+    dbus_message_iter_close_container(&iter, &dict);
+    return msg;
+}
+
+static DBusMessage *session_call(DBusMessage *msg, session_t *s)
+{
+    const char *interface = dbus_message_get_interface(msg);
+    const char *member = dbus_message_get_member(msg);
+    const char *source, *name;
+
+    if (!strcmp(interface, "org.bluez.obex.ObjectPush1") && !strcmp(member, "SendFile")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &source, DBUS_TYPE_INVALID))
+            return dbus_message_new_error(msg, "org.bluez.obex.Error.InvalidArguments", "Invalid arguments");
+        /* named after the file */
+        name = strrchr(source, '/') ? strrchr(source, '/') + 1 : source;
+        return start_transfer(msg, s, source, name);
+    }
+    if (!strcmp(interface, "org.bluez.obex.FileTransfer1") && !strcmp(member, "ChangeFolder")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID))
+            return dbus_message_new_error(msg, "org.bluez.obex.Error.InvalidArguments", "Invalid arguments");
+        snprintf(s->folder, sizeof(s->folder), "%s", name);
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(interface, "org.bluez.obex.FileTransfer1") && !strcmp(member, "PutFile")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &source, DBUS_TYPE_STRING, &name,
+                                   DBUS_TYPE_INVALID))
+            return dbus_message_new_error(msg, "org.bluez.obex.Error.InvalidArguments", "Invalid arguments");
+        return start_transfer(msg, s, source, name);
+    }
+    return NULL;
+}
+
+/* One tick of every transfer: start, or move a chunk */
+static void pump_transfers(DBusConnection *conn)
+{
+    static char buf[1 << 20];
+    size_t chunk = rate * TICK_MS / 1000;
+    transfer_t *t;
+    ssize_t n;
+    int i;
+
+    if (chunk == 0)
+        chunk = 1;
+    if (chunk > sizeof(buf))
+        chunk = sizeof(buf);
+    for (i = 0; i < MAX_TRANSFERS; i++) {
+        t = &transfers[i];
+        if (!t->used)
+            continue;
+        if (!t->started) {
+            emit_status(conn, t, "active");
+            t->started = 1;
+            continue;
+        }
+        n = read(t->in, buf, chunk);
+        if (n < 0 || (n > 0 && write(t->out, buf, n) != n)) {
+            end_transfer(conn, t, "error");
+        } else if (n == 0) {
+            end_transfer(conn, t, "complete");
+        } else {
+            t->transferred += n;
+            emit_changed(conn, t->path, "Transferred", DBUS_TYPE_UINT64, &t->transferred);
+        }
+    }
+}
+
+static DBusHandlerResult handle_message(DBusConnection *conn, DBusMessage *msg, void *data)
+{
+    const char *interface = dbus_message_get_interface(msg);
+    const char *member = dbus_message_get_member(msg);
+    const char *path = dbus_message_get_path(msg);
+    DBusMessage *reply = NULL;
+    transfer_t *t;
+    session_t *s;
+
+    (void)data;
+
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL || !interface)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (!strcmp(path, "/org/bluez/obex") && !strcmp(interface, "org.bluez.obex.Client1")) {
+        if (!strcmp(member, "CreateSession"))
+            reply = create_session(msg);
+        else if (!strcmp(member, "RemoveSession"))
+            reply = remove_session(conn, msg);
+    } else if ((s = find_session(path))) {
+        reply = session_call(msg, s);
+    } else if ((t = find_transfer(path)) && !strcmp(interface, "org.bluez.obex.Transfer1") &&
+               !strcmp(member, "Cancel")) {
+        end_transfer(conn, t, "error");
+        reply = dbus_message_new_method_return(msg);
+    }
+
+    if (reply == NULL)
+        reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, member);
+    if (!dbus_message_get_no_reply(msg))
+        dbus_connection_send(conn, reply, NULL);
+    dbus_message_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+int main(int argc, char *argv[])
+{
+    DBusObjectPathVTable vtable = { .message_function = handle_message };
+    DBusConnection *conn;
+    DBusError err;
+    long long next_tick = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:o:")) != -1) {
+        switch (opt) {
+        case 'r': rate = atol(optarg); break;
+        case 'o': outdir = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-r bytes_per_s] [-o dir]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    dbus_error_init(&err);
+    conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+    if (conn == NULL) {
+        fprintf(stderr, "mock_obexd: %s\n", err.message);
+        return 1;
+    }
+    if (dbus_bus_request_name(conn, "org.bluez.obex", DBUS_NAME_FLAG_DO_NOT_QUEUE, &err) !=
+            DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        fprintf(stderr, "mock_obexd: can't own org.bluez.obex\n");
+        return 1;
+    }
+    dbus_connection_register_fallback(conn, "/", &vtable, NULL);
+
+    while (dbus_connection_read_write_dispatch(conn, TICK_MS)) {
+        if (now_ms() < next_tick)
+            continue;
+        pump_transfers(conn);
+        next_tick = now_ms() + TICK_MS;
+    }
+    return 0;
+}
@@ -0,0 +1,242 @@
+/* Soak / benchmark: run scan, query, connect and disconnect cycles and watch
+ * for anything that grows with them. bluez runs through test/mock_env.sh,
+ * bluetoothctl with test/fake first in PATH.
+ * usage: soak <backend> [cycles] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include "bluetooth.h"
+
+/* Samples taken over the run, the first quarter is warm-up */
+#define SAMPLES         (16)
+#define WARMUP          (SAMPLES / 4)
+/* Live allocations libdbus may still add to its caches after warm-up */
+#define LIVE_SLACK      (64)
+/* RSS growth over the measured cycles that counts as a leak; page faults
+ * alone move RSS by a few pages either way */
+#define RSS_GROWTH_MAX  (1024 * 1024)
+
+typedef struct sample {
+    long cycle;
+    long rss;
+    long live;
+    int fds;
+    int zombies;
+} sample_t;
+
+/* Every allocation of the process, libdbus included */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static long allocs, frees;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    *memptr = __libc_memalign(alignment, size);
+    if (*memptr == NULL)
+        return 12;  /* ENOMEM */
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void free(void *ptr)
+{
+    if (ptr)
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+
+static long rss_bytes(void)
+{
+    long size, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int count_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *ent;
+    int n = 0;
+
+    if (dir == NULL)
+        return -1;
+    while ((ent = readdir(dir)))
+        if (ent->d_name[0] != '.')
+            n++;
+    closedir(dir);
+    return n - 1;   /* the one opendir holds */
+}
+
+/* Children that exited but were never waited for */
+static int count_zombies(void)
+{
+    DIR *dir = opendir("/proc");
+    struct dirent *ent;
+    char path[300], state;
+    int n = 0, pid, ppid;
+    FILE *fp;
+
+    if (dir == NULL)
+        return -1;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9')
+            continue;
+        snprintf(path, sizeof(path), "/proc/%s/stat", ent->d_name);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        /* comm may hold spaces, but not ours: bluetoothctl / sh */
+        if (fscanf(fp, "%d %*s %c %d", &pid, &state, &ppid) == 3 &&
+            ppid == getpid() && state == 'Z')
+            n++;
+        fclose(fp);
+    }
+    closedir(dir);
+    return n;
+}
+
+static void take_sample(sample_t *s, long cycle)
+{
+    s->cycle = cycle;
+    s->fds = count_fds();
+    s->zombies = count_zombies();
+    s->rss = rss_bytes();
+    s->live = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - __atomic_load_n(&frees, __ATOMIC_RELAXED);
+}
+
+/* Least squares slope of rss over cycle, from warm-up on */
+static double rss_slope(const sample_t *s, int n)
+{
+    double mx = 0, my = 0, sxy = 0, sxx = 0;
+    int i;
+
+    for (i = WARMUP; i < n; i++) {
+        mx += s[i].cycle;
+        my += s[i].rss;
+    }
+    mx /= n - WARMUP;
+    my /= n - WARMUP;
+    for (i = WARMUP; i < n; i++) {
+        sxy += (s[i].cycle - mx) * (s[i].rss - my);
+        sxx += (s[i].cycle - mx) * (s[i].cycle - mx);
+    }
+    return sxx ? sxy / sxx : 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = "WI-XB400";
+    char devs[64][BLUETOOTH_DEVNAME_MAXLEN], state[64];
+    sample_t samples[SAMPLES + 1];
+    long cycles, cycle, ops = 0, allocs0;
+    int ns = 0, failed = 0;
+    double start, slope;
+    bluetooth_t *bt;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <backend> [cycles]\n", argv[0]);
+        return 2;
+    }
+    cycles = argc > 2 ? atol(argv[2]) : 100000;
+    if (cycles < SAMPLES)
+        cycles = SAMPLES;
+
+    bt = bluetooth_new();
+    if (bluetooth_open(bt, argv[1])) {
+        fprintf(stderr, "%s\n", bluetooth_errmsg(bt));
+        return 1;
+    }
+
+    allocs0 = allocs;
+    start = now();
+    for (cycle = 0; cycle < cycles; cycle++) {
+        if (cycle % (cycles / SAMPLES) == 0 && ns < SAMPLES)
+            take_sample(&samples[ns++], cycle);
+
+        /* the scan window is not what is measured here */
+        bluetooth_scan(bt, bluetooth_deadline(1));
+        bluetooth_get_devices(bt, devs, sizeof(devs) / sizeof(devs[0]));
+        bluetooth_device_is_connected(bt, device);
+        if (!bluetooth_connect_device(bt, device, bluetooth_deadline(5000)) ||
+            !bluetooth_device_is_connected(bt, device) ||
+            !bluetooth_disconnect_device(bt, device, bluetooth_deadline(5000))) {
+            fprintf(stderr, "cycle %ld failed\n", cycle);
+            return 1;
+        }
+        ops += 6;
+    }
+    take_sample(&samples[ns++], cycle);
+    slope = rss_slope(samples, ns) * 1000;
+
+    printf("%s: %ld cycles, %ld ops, %.1f us/op, %.1f allocs/op\n", argv[1], cycles, ops,
+           (now() - start) * 1e6 / ops, (double)(allocs - allocs0) / ops);
+    printf("  live allocations %ld -> %ld, rss %ld -> %ld KiB (%.0f B/1000 cycles), "
+           "fds %d -> %d, zombies %d\n",
+           samples[WARMUP].live, samples[ns-1].live,
+           samples[WARMUP].rss / 1024, samples[ns-1].rss / 1024, slope,
+           samples[WARMUP].fds, samples[ns-1].fds, samples[ns-1].zombies);
+
+    if (samples[ns-1].live - samples[WARMUP].live > LIVE_SLACK) {
+        fprintf(stderr, "%s: live allocations keep growing\n", argv[1]);
+        failed = 1;
+    }
+    if (slope / 1000 * (samples[ns-1].cycle - samples[WARMUP].cycle) > RSS_GROWTH_MAX) {
+        fprintf(stderr, "%s: rss keeps growing\n", argv[1]);
+        failed = 1;
+    }
+    if (samples[ns-1].fds > samples[WARMUP].fds) {
+        fprintf(stderr, "%s: fds keep growing\n", argv[1]);
+        failed = 1;
+    }
+    if (samples[ns-1].zombies > 0) {
+        fprintf(stderr, "%s: unreaped children\n", argv[1]);
+        failed = 1;
+    }
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    snprintf(state, sizeof(state), "/tmp/fake_bluetoothctl.%d", getpid());
+    unlink(state);
+    return failed;
+}
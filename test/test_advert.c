@@ -0,0 +1,123 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-a 1": adverts decode to what
+ * mock_bluez sent, records come from a fixed pool, a referenced record
+ * stays intact until it is released, and between scans the bus sends none */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bluetooth.h"
+#include "check.h"
+
+/* ADVERT_POOL_SLOTS of src/bluez.c */
+#define POOL_SLOTS      (64)
+#define MANUFACTURER_ID (0x004c)
+#define SERVICE_UUID    "0000feaa-0000-1000-8000-00805f9b34fb"
+
+typedef struct adverts {
+    const bluetooth_advert_t *kept[2 * POOL_SLOTS];
+    int n_kept;
+    int seen;
+    /* ref every record, until told otherwise */
+    int keep;
+} adverts_t;
+
+/* What mock_bluez sends: 24 bytes counting up, the first 8 as service data */
+static void check_advert(const bluetooth_advert_t *advert)
+{
+    const bluetooth_advert_data_t *m, *s;
+    size_t i;
+
+    CHECK(!strncmp(advert->macaddr, "C0:FF:EE:", 9) && strlen(advert->macaddr) == 17);
+    CHECK(advert->n_manufacturer == 1 && advert->n_service == 1);
+    m = &advert->manufacturer[0];
+    s = &advert->service[0];
+    CHECK(m->company_id == MANUFACTURER_ID && m->len == 24);
+    for (i = 0; i < m->len; i++)
+        CHECK(m->data[i] == (unsigned char)(m->data[0] + i));
+    CHECK(!strcmp(s->uuid, SERVICE_UUID) && s->len == 8);
+    CHECK(!memcmp(s->data, m->data, s->len));
+}
+
+/* Match rules on the bus asking for Device1 property changes, anyone's */
+static int device_matches(void)
+{
+    char line[512];
+    FILE *f;
+    int n = 0;
+
+    f = popen("dbus-send --system --print-reply --dest=org.freedesktop.DBus /org/freedesktop/DBus "
+              "org.freedesktop.DBus.Debug.Stats.GetAllMatchRules", "r");
+    CHECK(f != NULL);
+    while (fgets(line, sizeof(line), f))
+        n += strstr(line, "arg0='org.bluez.Device1'") != NULL;
+    CHECK(pclose(f) == 0);
+    return n;
+}
+
+static void on_advert(const bluetooth_advert_t *advert, void *userdata)
+{
+    adverts_t *adverts = (adverts_t *)userdata;
+
+    check_advert(advert);
+    adverts->seen++;
+    if (adverts->keep && adverts->n_kept < (int)(sizeof(adverts->kept) / sizeof(adverts->kept[0])))
+        adverts->kept[adverts->n_kept++] = bluetooth_advert_ref(advert);
+}
+
+int main(void)
+{
+    static adverts_t adverts;
+    const bluetooth_advert_t *held;
+    bluetooth_t *bt = bluetooth_new();
+    char macaddr[18], first[24];
+    int i;
+
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    CHECK(bluetooth_set_advert_callback(bt, on_advert, &adverts));
+
+    /* records handed out and released come back */
+    bluetooth_scan(bt, bluetooth_deadline(300));
+    CHECK(adverts.seen > POOL_SLOTS);
+    /* idle, the connection stays but nothing queues up on it */
+    CHECK(device_matches() == 0);
+
+    /* held ones don't: the pool runs dry and adverts are dropped, not allocated */
+    adverts.seen = 0;
+    adverts.keep = 1;
+    bluetooth_scan(bt, bluetooth_deadline(300));
+    printf("test_advert: pool of %d held, %d adverts seen\n", adverts.n_kept, adverts.seen);
+    CHECK(adverts.n_kept == POOL_SLOTS && adverts.seen == POOL_SLOTS);
+
+    /* kept records outlive their callback and the adverts after them */
+    snprintf(macaddr, sizeof(macaddr), "%s", adverts.kept[0]->macaddr);
+    memcpy(first, adverts.kept[0]->manufacturer[0].data, sizeof(first));
+    for (i = 0; i < adverts.n_kept; i++)
+        check_advert(adverts.kept[i]);
+    CHECK(!strcmp(adverts.kept[0]->macaddr, macaddr));
+    CHECK(!memcmp(adverts.kept[0]->manufacturer[0].data, first, sizeof(first)));
+
+    /* a second ref keeps a record past the first unref */
+    held = bluetooth_advert_ref(adverts.kept[0]);
+    CHECK(held == adverts.kept[0]);
+    for (i = 0; i < adverts.n_kept; i++)
+        bluetooth_advert_unref(adverts.kept[i]);
+
+    /* released ones flow again, all but the one still held, which new ones
+     * don't overwrite */
+    adverts.seen = 0;
+    adverts.n_kept = 0;
+    bluetooth_scan(bt, bluetooth_deadline(300));
+    CHECK(adverts.n_kept == POOL_SLOTS - 1);
+    for (i = 0; i < adverts.n_kept; i++)
+        CHECK(adverts.kept[i] != held);
+    CHECK(!strcmp(held->macaddr, macaddr));
+    CHECK(!memcmp(held->manufacturer[0].data, first, sizeof(first)));
+    bluetooth_advert_unref(held);
+    for (i = 0; i < adverts.n_kept; i++)
+        bluetooth_advert_unref(adverts.kept[i]);
+
+    CHECK(bluetooth_set_advert_callback(bt, NULL, NULL));
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_advert: OK\n");
+    return 0;
+}
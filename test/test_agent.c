@@ -0,0 +1,164 @@
+/* Run through test/mock_env.sh with test/fake first in PATH, and
+ * MOCK_ARGS="-p 1234" for "test_agent pin" or MOCK_ARGS="-k 123456" for
+ * "test_agent confirm": pairing asks our agent and is answered inline, without
+ * one it stalls until the deadline */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define STALL_MS    (1500)
+
+typedef struct asked {
+    int n;
+    int type;
+    unsigned int passkey;
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN];
+} asked_t;
+
+static bool answer(bluetooth_agent_request_t *request, void *userdata)
+{
+    asked_t *asked = (asked_t *)userdata;
+
+    asked->n++;
+    asked->type = request->type;
+    asked->passkey = request->passkey;
+    snprintf(asked->macaddr, sizeof(asked->macaddr), "%s", request->macaddr);
+    if (request->type == BLUETOOTH_AGENT_REQUEST_PIN)
+        strcpy(request->pin, "1234");
+    return request->type != BLUETOOTH_AGENT_REQUEST_CONFIRM || request->passkey == 123456;
+}
+
+/* Connect, return how long it took. ok is what it must return */
+static long long try_connect(bluetooth_t *bt, const char *device, int timeout_ms, bool ok)
+{
+    long long t = now_ms();
+
+    CHECK(bluetooth_connect_device(bt, device, bluetooth_deadline(timeout_ms)) == ok);
+    return now_ms() - t;
+}
+
+static void set_agent(bluetooth_t *bt, int capability, const char *pin, asked_t *asked)
+{
+    bluetooth_agent_t agent = { .capability = capability, .pin = pin, .cb = answer, .userdata = asked };
+
+    CHECK(bluetooth_set_agent(bt, &agent));
+}
+
+static void test_pin(void)
+{
+    bluetooth_agent_t agent = { .capability = BLUETOOTH_AGENT_FIXED_PIN };
+    asked_t asked = { 0 };
+    char state[64], pin[32];
+    bluetooth_t *bt;
+    long long t;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+
+    /* malformed */
+    CHECK(!bluetooth_set_agent(bt, &agent));
+    memset(pin, '1', sizeof(pin) - 1);
+    pin[sizeof(pin) - 1] = '\0';
+    agent.pin = pin;
+    CHECK(!bluetooth_set_agent(bt, &agent));
+    agent.capability = BLUETOOTH_AGENT_CALLBACK;
+    CHECK(!bluetooth_set_agent(bt, &agent));
+
+    /* nobody answers bluetoothd */
+    t = try_connect(bt, "WI-XB400", STALL_MS, false);
+    printf("test_agent: without an agent, gave up after %lld ms\n", t);
+    CHECK(t >= STALL_MS - 50);
+
+    /* answers that fail, fail fast */
+    set_agent(bt, BLUETOOTH_AGENT_NO_IO, NULL, NULL);
+    CHECK(try_connect(bt, "WI-XB400", STALL_MS, false) < STALL_MS / 2);
+    set_agent(bt, BLUETOOTH_AGENT_FIXED_PIN, "0000", NULL);
+    CHECK(try_connect(bt, "WI-XB400", STALL_MS, false) < STALL_MS / 2);
+
+    set_agent(bt, BLUETOOTH_AGENT_CALLBACK, NULL, &asked);
+    t = try_connect(bt, "WI-XB400", STALL_MS, true);
+    printf("test_agent: paired with a PIN in %lld ms\n", t);
+    CHECK(t < STALL_MS / 2);
+    CHECK(asked.n == 1 && asked.type == BLUETOOTH_AGENT_REQUEST_PIN);
+    CHECK(!strcmp(asked.macaddr, "C0:FF:EE:00:00:00"));
+    CHECK(bluetooth_device_is_connected(bt, "WI-XB400"));
+
+    /* the agent outlives reopening */
+    set_agent(bt, BLUETOOTH_AGENT_FIXED_PIN, "1234", NULL);
+    bluetooth_close(bt);
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    CHECK(try_connect(bt, "MOCK-00001", STALL_MS, true) < STALL_MS / 2);
+    CHECK(bluetooth_set_agent(bt, NULL));
+    try_connect(bt, "MOCK-00002", 300, false);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    /* bluetoothctl prompts for it */
+    snprintf(state, sizeof(state), "/tmp/test_agent.%d", (int)getpid());
+    setenv("FAKE_BLUETOOTHCTL_STATE", state, 1);
+    setenv("FAKE_BLUETOOTHCTL_PIN", "1234", 1);
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluetoothctl") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+
+    t = try_connect(bt, "WI-XB400", STALL_MS, false);
+    CHECK(t >= STALL_MS - 50);
+    set_agent(bt, BLUETOOTH_AGENT_FIXED_PIN, "0000", NULL);
+    CHECK(try_connect(bt, "WI-XB400", STALL_MS, false) < STALL_MS / 2);
+    CHECK(!bluetooth_device_is_connected(bt, "WI-XB400"));
+
+    asked.n = 0;
+    set_agent(bt, BLUETOOTH_AGENT_CALLBACK, NULL, &asked);
+    CHECK(try_connect(bt, "WI-XB400", STALL_MS, true) < STALL_MS / 2);
+    CHECK(asked.n == 1 && asked.type == BLUETOOTH_AGENT_REQUEST_PIN);
+    CHECK(!strcmp(asked.macaddr, "C0:FF:EE:00:00:00"));
+    CHECK(bluetooth_device_is_connected(bt, "WI-XB400"));
+    CHECK(bluetooth_disconnect_device(bt, "WI-XB400", bluetooth_deadline(STALL_MS)));
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    unlink(state);
+}
+
+static void test_confirm(void)
+{
+    asked_t asked = { 0 };
+    bluetooth_t *bt;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+
+    CHECK(try_connect(bt, "WI-XB400", STALL_MS, false) >= STALL_MS - 50);
+
+    /* the passkey both sides show */
+    set_agent(bt, BLUETOOTH_AGENT_CALLBACK, NULL, &asked);
+    CHECK(try_connect(bt, "WI-XB400", STALL_MS, true) < STALL_MS / 2);
+    CHECK(asked.n == 1 && asked.type == BLUETOOTH_AGENT_REQUEST_CONFIRM && asked.passkey == 123456);
+
+    set_agent(bt, BLUETOOTH_AGENT_FIXED_PIN, "111111", NULL);
+    CHECK(try_connect(bt, "MOCK-00001", STALL_MS, false) < STALL_MS / 2);
+    set_agent(bt, BLUETOOTH_AGENT_FIXED_PIN, "123456", NULL);
+    CHECK(try_connect(bt, "MOCK-00001", STALL_MS, true) < STALL_MS / 2);
+
+    /* just works */
+    set_agent(bt, BLUETOOTH_AGENT_NO_IO, NULL, NULL);
+    CHECK(try_connect(bt, "MOCK-00002", STALL_MS, true) < STALL_MS / 2);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "confirm"))
+        test_confirm();
+    else
+        test_pin();
+    printf("test_agent: OK\n");
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* Run through test/mock_env.sh with test/fake first in PATH: background scans
+ * keep the device table fresh, keep devices missing from a scan until they
+ * age out, and stop with the window in progress */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define WINDOW_MS       (100)
+#define INTERVAL_MS     (200)
+#define MAX_AGE_MS      (800)
+
+/* Wait for a table past generation, return its device count */
+static size_t next_table(bluetooth_t *bt, unsigned long long *generation)
+{
+    const bluetooth_device_table_t *table;
+    long long give_up = now_ms() + 5 * INTERVAL_MS;
+    size_t n;
+
+    for (;;) {
+        table = bluetooth_device_table_get(bt);
+        if (table->generation > *generation)
+            break;
+        bluetooth_device_table_unref(table);
+        CHECK(now_ms() < give_up);
+        usleep(10000);
+    }
+    *generation = table->generation;
+    n = table->n_devices;
+    bluetooth_device_table_unref(table);
+    return n;
+}
+
+static const bluetooth_background_options_t opts = {
+    .window_ms = WINDOW_MS, .interval_ms = INTERVAL_MS, .max_age_ms = MAX_AGE_MS,
+};
+
+int main(void)
+{
+    const bluetooth_device_table_t *table;
+    /* generation 1 is the empty table of a new handle */
+    unsigned long long generation = 1;
+    char state[64], gone[80];
+    long long t, stop;
+    bluetooth_t *bt;
+    size_t n;
+
+    snprintf(state, sizeof(state), "/tmp/test_background.%d", (int)getpid());
+    snprintf(gone, sizeof(gone), "%s.gone", state);
+    setenv("FAKE_BLUETOOTHCTL_STATE", state, 1);
+    unlink(gone);
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluetoothctl") == 0);
+    CHECK(bluetooth_background_scan_start(bt, &opts) == 0);
+    CHECK(bluetooth_background_scan_start(bt, &opts) == -1);
+    CHECK(next_table(bt, &generation) == 2);
+    CHECK(next_table(bt, &generation) == 2);
+
+    /* out of range: kept while young, then dropped */
+    fclose(fopen(gone, "w"));
+    t = now_ms();
+    CHECK(next_table(bt, &generation) == 2);
+    CHECK(next_table(bt, &generation) == 2);
+    while ((n = next_table(bt, &generation)) == 2)
+        CHECK(now_ms() - t < MAX_AGE_MS + 4 * INTERVAL_MS);
+    CHECK(n == 1);
+    printf("test_background: aged out after %lld ms\n", now_ms() - t);
+    CHECK(now_ms() - t >= MAX_AGE_MS - INTERVAL_MS);
+
+    /* back in range */
+    unlink(gone);
+    CHECK(next_table(bt, &generation) == 2);
+
+    /* no scans once stopped, and scans replace the table again */
+    bluetooth_background_scan_stop(bt);
+    usleep(2 * INTERVAL_MS * 1000);
+    table = bluetooth_device_table_get(bt);
+    CHECK(table->generation == generation);
+    bluetooth_device_table_unref(table);
+    fclose(fopen(gone, "w"));
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    CHECK(next_table(bt, &generation) == 1);
+    unlink(gone);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    /* bluez: connecting holds windows back, closing stops the scans */
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    generation = 1;
+    CHECK(bluetooth_background_scan_start(bt, &opts) == 0);
+    CHECK(next_table(bt, &generation) >= 1);
+    CHECK(bluetooth_connect_device(bt, "WI-XB400", bluetooth_deadline(3000)));
+    CHECK(next_table(bt, &generation) >= 1);
+    CHECK(bluetooth_device_is_connected(bt, "WI-XB400"));
+    CHECK(bluetooth_disconnect_device(bt, "WI-XB400", bluetooth_deadline(3000)));
+    stop = now_ms();
+    bluetooth_close(bt);
+    stop = now_ms() - stop;
+    printf("test_background: closed in %lld ms\n", stop);
+    CHECK(stop < WINDOW_MS + INTERVAL_MS);
+    bluetooth_free(bt);
+
+    unlink(state);
+    printf("test_background: OK\n");
+    return 0;
+}
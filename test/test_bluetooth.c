@@ -1,26 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include "bluetooth.h"
 
-typedef enum device_status {
-    DEVICE_CONNECTED,
-    DEVICE_DISCONNECTED,
-} device_status_t;
-
-static bool wait_status(bluetooth_t *bt, const char *device, device_status_t status, int timeout)
-{
-    do {
-        if (status == DEVICE_CONNECTED && bluetooth_device_is_connected(bt, device))
-            return true;
-        if (status == DEVICE_DISCONNECTED && !bluetooth_device_is_connected(bt, device))
-            return true;
-        if (timeout-- > 0)
-            sleep(1);
-    } while(timeout > 0);
-    return false;
-}
-
 static void test_backend(bluetooth_t *bt, const char *backend)
 {
     if (bluetooth_open(bt, backend)) {
@@ -29,7 +10,7 @@ static void test_backend(bluetooth_t *bt, const char *backend)
     }
     printf("Test backend: %s\n", backend);
     printf("scanning...\n");
-    bluetooth_scan(bt,3);
+    bluetooth_scan(bt, bluetooth_deadline(3000));
     char devs[64][BLUETOOTH_DEVNAME_MAXLEN];
     int i = 0, len;
     len =bluetooth_get_devices(bt, devs, sizeof(devs)/sizeof(devs[0]));
@@ -38,13 +19,17 @@ static void test_backend(bluetooth_t *bt, const char *backend)
 
     const char *device = "WI-XB400";
     printf("%s connecting\n", device);
-    bluetooth_connect_device(bt, device, 0);
-    printf("%s connected %s\n", device, wait_status(bt, device, DEVICE_CONNECTED, 3) ? "OK":"fail");
+    bluetooth_connect_device(bt, device, bluetooth_deadline(10000));
+    printf("%s connected %s\n", device,
+           bluetooth_wait_device_state(bt, device, BLUETOOTH_STATE_CONNECTED,
+                                       bluetooth_deadline(3000)) ? "OK":"fail");
 
     if (bluetooth_device_is_connected(bt, device)) {
         printf("%s disconnecting\n", device);
-        bluetooth_disconnect_device(bt, device, 0);
-        printf("%s disconnected %s\n", device, wait_status(bt, device, DEVICE_DISCONNECTED, 3) ? "OK":"fail");
+        bluetooth_disconnect_device(bt, device, bluetooth_deadline(10000));
+        printf("%s disconnected %s\n", device,
+               bluetooth_wait_device_state(bt, device, BLUETOOTH_STATE_DISCONNECTED,
+                                           bluetooth_deadline(3000)) ? "OK":"fail");
     }
 
     bluetooth_close(bt);
@@ -0,0 +1,78 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-s 1000,2500": mock_bluez hangs
+ * 1 s after start for 2.5 s. Calls must give up early, then answer from cache */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define STALL_AT_MS     (1000)
+#define STALL_MS        (2500)
+
+static long long start;
+
+static void sleep_until(long long ms)
+{
+    long long left = start + ms - now_ms();
+
+    if (left > 0)
+        usleep(left * 1000);
+}
+
+static bluetooth_t *open_scanned(void)
+{
+    bluetooth_t *bt = bluetooth_new();
+
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    return bt;
+}
+
+int main(void)
+{
+    bluetooth_t *bt, *other;
+    long long t, stalled;
+    int i;
+
+    start = now_ms();
+    bt = open_scanned();
+    other = open_scanned();
+    CHECK(bluetooth_connect_device(bt, "WI-XB400", bluetooth_deadline(1000)));
+    CHECK(bluetooth_device_is_connected(bt, "WI-XB400"));
+
+    /* bluetoothd stuck: the first calls time out after what round trips
+     * suggested, far sooner than the fixed 1 s each used to */
+    sleep_until(STALL_AT_MS);
+    t = now_ms();
+    for (i = 0; i < 3; i++)
+        bluetooth_device_is_connected(bt, "WI-XB400");
+    stalled = now_ms() - t;
+    CHECK(stalled < 1000);
+
+    /* then the breaker is open: last known answer, right away */
+    for (i = 0; i < 3; i++) {
+        t = now_ms();
+        CHECK(bluetooth_device_is_connected(bt, "WI-XB400"));
+        CHECK(now_ms() - t < 50);
+    }
+    printf("test_breaker: 3 stuck calls gave up in %lld ms, then answered from cache\n", stalled);
+
+    /* bluetoothd back: a probe closes the breaker and the change shows */
+    sleep_until(STALL_AT_MS + STALL_MS + 200);
+    CHECK(bluetooth_disconnect_device(other, "WI-XB400", bluetooth_deadline(1000)));
+    t = now_ms();
+    while (bluetooth_device_is_connected(bt, "WI-XB400")) {
+        CHECK(now_ms() - t < 5000);
+        usleep(100000);
+    }
+    printf("test_breaker: recovered after %lld ms\n", now_ms() - t);
+
+    bluetooth_close(other);
+    bluetooth_free(other);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_breaker: OK\n");
+    return 0;
+}
@@ -0,0 +1,144 @@
+/* Run through test/mock_env.sh with the broker's path: clients of one broker
+ * share its scans and connects, and read its device table without asking,
+ * never write to it */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define CLIENTS     (4)
+#define SCAN_MS     (300)
+
+static bluetooth_t *open_broker(void)
+{
+    bluetooth_t *bt = bluetooth_new();
+    long long t = now_ms();
+
+    /* the broker may still be coming up */
+    while (bluetooth_open(bt, "broker")) {
+        CHECK(now_ms() - t < 3000);
+        usleep(20000);
+    }
+    return bt;
+}
+
+/* The table fd the broker hands every client, as src/broker.c gets it */
+static int table_fd(const char *name)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char control[CMSG_SPACE(sizeof(int))], buf[256];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    int fd, memfd = -1;
+
+    memcpy(addr.sun_path + 1, name, strlen(name));
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    CHECK(fd >= 0);
+    CHECK(connect(fd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name)) == 0);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    CHECK(recvmsg(fd, &msg, 0) > 0);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    close(fd);
+    return memfd;
+}
+
+static int client(void)
+{
+    bluetooth_t *bt = open_broker();
+    char devs[8][BLUETOOTH_DEVNAME_MAXLEN];
+
+    bluetooth_scan(bt, bluetooth_deadline(SCAN_MS));
+    CHECK(bluetooth_get_devices(bt, devs, 8) >= 1);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char name[64], devs[8][BLUETOOTH_DEVNAME_MAXLEN];
+    pid_t broker, pids[CLIENTS];
+    bluetooth_t *bt, *reader;
+    long long t;
+    void *map;
+    int i, status, fd;
+
+    CHECK(argc == 2);
+    snprintf(name, sizeof(name), "test_broker.%d", getpid());
+    setenv("HAL_BLUETOOTH_BROKER", name, 1);
+
+    broker = fork();
+    CHECK(broker >= 0);
+    if (broker == 0) {
+        execl(argv[1], argv[1], "-b", "bluez", (char *)NULL);
+        _exit(127);
+    }
+    bt = open_broker();
+    reader = open_broker();
+
+    /* one scan window for every process asking at once */
+    mock_calls_reset();
+    t = now_ms();
+    for (i = 0; i < CLIENTS; i++) {
+        pids[i] = fork();
+        CHECK(pids[i] >= 0);
+        if (pids[i] == 0)
+            _exit(client());
+    }
+    for (i = 0; i < CLIENTS; i++) {
+        CHECK(waitpid(pids[i], &status, 0) == pids[i]);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    t = now_ms() - t;
+    printf("test_broker: %d concurrent scans took %lld ms\n", CLIENTS, t);
+    CHECK(mock_calls("org.bluez.Adapter1.StartDiscovery") == 1);
+
+    /* readable, not writable, however a client tries */
+    fd = table_fd(name);
+    CHECK(fd >= 0);
+    map = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+    CHECK(map != MAP_FAILED);
+    munmap(map, 4096);
+    CHECK(mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED);
+    CHECK(pwrite(fd, "x", 1, 0) < 0);
+    CHECK(ftruncate(fd, 0) < 0);
+    close(fd);
+
+    /* never scanned, sees what the broker found */
+    CHECK(bluetooth_get_devices(reader, devs, 8) >= 1);
+
+    CHECK(bluetooth_connect_device(bt, "WI-XB400", bluetooth_deadline(3000)));
+    CHECK(bluetooth_device_is_connected(reader, "WI-XB400"));
+    CHECK(bluetooth_disconnect_device(bt, "WI-XB400", bluetooth_deadline(3000)));
+    CHECK(!bluetooth_device_is_connected(reader, "WI-XB400"));
+
+    /* broker gone: calls fail instead of hanging */
+    kill(broker, SIGTERM);
+    CHECK(waitpid(broker, &status, 0) == broker);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    t = now_ms();
+    CHECK(!bluetooth_connect_device(bt, "WI-XB400", bluetooth_deadline(1000)));
+    CHECK(now_ms() - t < 1000);
+
+    bluetooth_close(reader);
+    bluetooth_free(reader);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_broker: OK\n");
+    return 0;
+}
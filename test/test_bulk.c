@@ -0,0 +1,84 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-n 41 -c 200 -l 4": connects take
+ * 200 ms and the controller takes 4 at a time */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define DEVICES     (41)
+#define CONNECT_MS  (200)
+
+static char first[BLUETOOTH_DEVNAME_MAXLEN];
+static size_t max_in_flight;
+
+static void progress(const bluetooth_bulk_progress_t *p, const char *device, bool ok, void *userdata)
+{
+    (void)userdata;
+    if (ok && first[0] == '\0')
+        strncpy(first, device, sizeof(first) - 1);
+    /* counted before this one finished */
+    if (p->in_flight + 1 > max_in_flight)
+        max_in_flight = p->in_flight + 1;
+}
+
+static long long elapsed_ms(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000LL + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int main(void)
+{
+    bluetooth_connect_request_t requests[DEVICES];
+    bluetooth_bulk_options_t opts = { .max_in_flight = 4 };
+    char names[DEVICES][BLUETOOTH_DEVNAME_MAXLEN];
+    struct timespec start;
+    long long took;
+    bluetooth_t *bt;
+    int i;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(300));
+
+    for (i = 0; i < DEVICES; i++) {
+        snprintf(names[i], sizeof(names[i]), i ? "MOCK-%05d" : "WI-XB400", i);
+        requests[i].device = names[i];
+        requests[i].priority = 0;
+    }
+    /* last in the list, first to go */
+    requests[0].device = names[DEVICES - 1];
+    requests[DEVICES - 1].device = names[0];
+    requests[DEVICES - 1].priority = 10;
+
+    /* as many as the controller takes */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK(bluetooth_connect_devices(bt, requests, DEVICES, &opts, bluetooth_deadline(30000),
+                                    progress, NULL) == DEVICES);
+    took = elapsed_ms(&start);
+    CHECK(!strcmp(first, "WI-XB400"));
+    CHECK(max_in_flight == 4);
+    CHECK(took < DEVICES * CONNECT_MS / 2);
+    printf("test_bulk: %d devices, 4 in flight: %lld ms (one at a time: %d ms)\n",
+           DEVICES, took, DEVICES * CONNECT_MS);
+
+    /* more than the controller takes: the rejected ones come back */
+    opts.max_in_flight = 8;
+    opts.max_retries = 10;
+    CHECK(bluetooth_connect_devices(bt, requests, DEVICES, &opts, bluetooth_deadline(30000),
+                                    NULL, NULL) == DEVICES);
+
+    /* no retries left, deadline way too short */
+    opts.max_retries = 0;
+    CHECK(bluetooth_connect_devices(bt, requests, DEVICES, &opts, bluetooth_deadline(CONNECT_MS / 2),
+                                    NULL, NULL) == 0);
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_bulk: OK\n");
+    return 0;
+}
@@ -0,0 +1,103 @@
+/* Run through test/mock_env.sh, as "test_cancel <backend> [pair]":
+ *   bluez: MOCK_ARGS="-c 3000", or "-p 1234" for pair
+ *   bluetoothctl: test/fake first in PATH and FAKE_BLUETOOTHCTL_CONNECT_S=3,
+ *   or FAKE_BLUETOOTHCTL_PIN=1234 for pair
+ * A scan, connect or pair in flight returns right after bluetooth_cancel(),
+ * not at its deadline, however far that is */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define DEVICE      "WI-XB400"
+#define DEADLINE_MS (5000)
+/* past INT_MAX ms: timeouts mustn't wrap */
+#define FAR_DEADLINE (LLONG_MAX / 2)
+/* what the call is doing when cancelled */
+#define CANCEL_MS   (300)
+#define SLACK_MS    (300)
+
+enum op {
+    OP_SCAN,
+    OP_CONNECT,
+};
+
+typedef struct call {
+    bluetooth_t *bt;
+    enum op op;
+    long long deadline;
+    bool ok;
+} call_t;
+
+static void *run(void *data)
+{
+    call_t *call = (call_t *)data;
+
+    switch (call->op) {
+    case OP_SCAN:
+        bluetooth_scan(call->bt, call->deadline);
+        call->ok = true;
+        break;
+    case OP_CONNECT:
+        call->ok = bluetooth_connect_device(call->bt, DEVICE, call->deadline);
+        break;
+    }
+    return NULL;
+}
+
+/* Start op, cancel it underway, check it returned right away */
+static void cancel_in_flight(bluetooth_t *bt, enum op op, long long deadline, const char *what)
+{
+    call_t call = { .bt = bt, .op = op, .deadline = deadline };
+    pthread_t thread;
+    long long t = now_ms();
+
+    CHECK(pthread_create(&thread, NULL, run, &call) == 0);
+    usleep(CANCEL_MS * 1000);
+    bluetooth_cancel(bt);
+    pthread_join(thread, NULL);
+    t = now_ms() - t;
+    bluetooth_cancel_reset(bt);
+    printf("test_cancel: %s cancelled after %lld ms\n", what, t);
+    CHECK(t >= CANCEL_MS - 10 && t < CANCEL_MS + SLACK_MS);
+    /* a scan just stops early, a connect fails */
+    CHECK(op == OP_SCAN || !call.ok);
+}
+
+int main(int argc, char *argv[])
+{
+    bool pair = argc > 2 && !strcmp(argv[2], "pair");
+    bluetooth_t *bt = bluetooth_new();
+
+    CHECK(argc >= 2);
+    CHECK(bluetooth_open(bt, argv[1]) == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    CHECK(!bluetooth_device_is_connected(bt, DEVICE));
+
+    if (pair) {
+        /* the connect is stuck pairing, no agent answers */
+        cancel_in_flight(bt, OP_CONNECT, bluetooth_deadline(DEADLINE_MS), "pair");
+        cancel_in_flight(bt, OP_CONNECT, FAR_DEADLINE, "pair, far deadline");
+    } else {
+        cancel_in_flight(bt, OP_SCAN, bluetooth_deadline(DEADLINE_MS), "scan");
+        cancel_in_flight(bt, OP_CONNECT, bluetooth_deadline(DEADLINE_MS), "connect");
+        cancel_in_flight(bt, OP_SCAN, FAR_DEADLINE, "scan, far deadline");
+        cancel_in_flight(bt, OP_CONNECT, FAR_DEADLINE, "connect, far deadline");
+    }
+    CHECK(!bluetooth_device_is_connected(bt, DEVICE));
+
+    /* reset: calls run to completion again. The cancelled scan found nothing */
+    if (!pair) {
+        bluetooth_scan(bt, bluetooth_deadline(100));
+        CHECK(bluetooth_connect_device(bt, DEVICE, FAR_DEADLINE));
+        bluetooth_disconnect_device(bt, DEVICE, bluetooth_deadline(1000));
+    }
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_cancel: OK\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Run through test/mock_env.sh: bluetooth.hpp awaitables driven by a poll loop
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <poll.h>
+#include "bluetooth.hpp"
+#include "check.h"
+
+using namespace std::chrono_literals;
+
+#define CONCURRENT  (100)
+
+// fire and forget, the poll loop below keeps things going
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static int finished;
+
+static task scan(bluetooth::Bluetooth &bt)
+{
+    co_await bt.scan(300ms);
+
+    bool found = false;
+    for (const auto &dev : bt.devices())
+        if (!strcmp(dev.name, "WI-XB400"))
+            found = !strcmp(dev.macaddr, "C0:FF:EE:00:00:00");
+    CHECK(found);
+    CHECK(bt.devices().names().front() == "WI-XB400");
+    finished++;
+}
+
+static task connect_cycle(bluetooth::Bluetooth &bt)
+{
+    // g++ 12 drops the awaiter early when co_await sits inside a condition
+    bool connected = co_await bt.connect("WI-XB400", 5000ms);
+    CHECK(connected);
+    bool disconnected = co_await bt.disconnect("WI-XB400", 5000ms);
+    CHECK(disconnected);
+    finished++;
+}
+
+static void run(bluetooth::Bluetooth &bt, int until)
+{
+    struct pollfd pfd = { bt.event_fd(), POLLIN, 0 };
+
+    while (finished < until) {
+        CHECK(poll(&pfd, 1, 10000) == 1);
+        bt.dispatch();
+    }
+}
+
+int main()
+{
+    bluetooth::Bluetooth first("bluez");
+    bluetooth::Bluetooth bt = std::move(first);
+
+    CHECK(first.get() == nullptr);
+
+    scan(bt);
+    run(bt, 1);
+
+    for (int i = 0; i < CONCURRENT; i++)
+        connect_cycle(bt);
+    run(bt, 1 + CONCURRENT);
+
+    printf("test_cpp: OK (%d coroutines)\n", finished);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-n 1000" and test/fake first
+ * in PATH: exports carry what changed since a generation, and nothing else */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+typedef struct output {
+    char data[1 << 17];
+    size_t len;
+} output_t;
+
+static int collect(const void *data, size_t len, void *userdata)
+{
+    output_t *out = (output_t *)userdata;
+
+    CHECK(out->len + len < sizeof(out->data));
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    out->data[out->len] = '\0';
+    return 0;
+}
+
+static int refuse(const void *data, size_t len, void *userdata)
+{
+    (void)data;
+    (void)len;
+    (void)userdata;
+    return 1;
+}
+
+/* A consumer that scans from its callback: the log isn't held meanwhile */
+static int rescan(const void *data, size_t len, void *userdata)
+{
+    (void)data;
+    (void)len;
+    bluetooth_scan((bluetooth_t *)userdata, bluetooth_deadline(50));
+    return 0;
+}
+
+/* Export since into out, return the generation it went up to */
+static long long export(bluetooth_t *bt, unsigned long long since, int format, output_t *out)
+{
+    long long generation;
+
+    out->len = 0;
+    out->data[0] = '\0';
+    generation = bluetooth_device_export(bt, since, format, collect, out);
+    CHECK(generation > 0);
+    return generation;
+}
+
+static int lines(const output_t *out, const char *needle)
+{
+    const char *p = out->data;
+    int n = 0;
+
+    while ((p = strstr(p, needle))) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+int main(void)
+{
+    char state[64], gone[80], line[160], added[64];
+    bluetooth_device_id_t id;
+    long long full, since;
+    output_t *out;
+    bluetooth_t *bt;
+    int pipefd[2];
+    ssize_t n;
+
+    out = calloc(1, sizeof(output_t));
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+
+    /* everything once */
+    since = export(bt, 0, BLUETOOTH_EXPORT_NDJSON, out);
+    CHECK(lines(out, "\"op\":\"add\"") >= 1000);
+    CHECK(strstr(out->data, "{\"since\":0,\"generation\":2}\n") == out->data);
+    CHECK(strstr(out->data, "{\"op\":\"add\",\"id\":1,\"mac\":\"C0:FF:EE:00:00:00\","
+                            "\"name\":\"WI-XB400\",\"flags\":0,\"icon\":\"phone\"}\n"));
+    full = export(bt, 0, BLUETOOTH_EXPORT_BINARY, out);
+    CHECK(full == since);
+    CHECK(!memcmp(out->data, "BTD1", 4) && out->data[out->len - 1] == 0);
+    printf("test_export: full table %zu bytes binary\n", out->len);
+
+    /* a rescan finding the same devices changes nothing */
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    since = export(bt, since, BLUETOOTH_EXPORT_NDJSON, out);
+    CHECK(since == full + 1);
+    CHECK(!strstr(out->data, "\"op\""));
+    export(bt, since, BLUETOOTH_EXPORT_BINARY, out);
+    CHECK(out->len == 4 + 8 + 8 + 1);
+
+    /* one connection: its flags, nothing else */
+    CHECK(bluetooth_connect_device(bt, "WI-XB400", bluetooth_deadline(3000)));
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    export(bt, since, BLUETOOTH_EXPORT_NDJSON, out);
+    CHECK(lines(out, "\"op\"") == 1);
+    CHECK(strstr(out->data, "{\"op\":\"change\",\"id\":1,\"flags\":7}\n"));
+    export(bt, since, BLUETOOTH_EXPORT_BINARY, out);
+    /* header, change of id 1 with flags 7, end */
+    CHECK(out->len == 4 + 8 + 8 + 4 + 1 && !memcmp(out->data + 20, "\2\1\4\7", 4));
+    CHECK(bluetooth_disconnect_device(bt, "WI-XB400", bluetooth_deadline(3000)));
+
+    /* an aborted export is an error */
+    CHECK(bluetooth_device_export(bt, 0, BLUETOOTH_EXPORT_BINARY, refuse, NULL) == -1);
+    CHECK(bluetooth_device_export(bt, 0, 7, collect, out) == -1);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    /* bluetoothctl: devices out of range are removed, and come back whole */
+    snprintf(state, sizeof(state), "/tmp/test_export.%d", (int)getpid());
+    snprintf(gone, sizeof(gone), "%s.gone", state);
+    setenv("FAKE_BLUETOOTHCTL_STATE", state, 1);
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluetoothctl") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    since = export(bt, 0, BLUETOOTH_EXPORT_NDJSON, out);
+    CHECK(lines(out, "\"op\":\"add\"") == 2);
+    id = bluetooth_device_lookup(bt, "MOCK-00001");
+    snprintf(added, sizeof(added), "\"op\":\"add\",\"id\":%u,", id);
+
+    fclose(fopen(gone, "w"));
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    full = export(bt, since, BLUETOOTH_EXPORT_NDJSON, out);
+    snprintf(line, sizeof(line), "{\"op\":\"remove\",\"id\":%u}\n", id);
+    CHECK(lines(out, "\"op\"") == 1 && strstr(out->data, line));
+    /* since 0 knows nothing of it */
+    export(bt, 0, BLUETOOTH_EXPORT_NDJSON, out);
+    CHECK(lines(out, "\"op\"") == 1 && strstr(out->data, "\"name\":\"WI-XB400\""));
+
+    unlink(gone);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    export(bt, full, BLUETOOTH_EXPORT_NDJSON, out);
+    CHECK(lines(out, "\"op\"") == 1 && strstr(out->data, added));
+    /* from before it went: it was there then and is now, with all its fields */
+    export(bt, since, BLUETOOTH_EXPORT_NDJSON, out);
+    CHECK(lines(out, "\"op\"") == 1 && strstr(out->data, "\"name\":\"MOCK-00001\""));
+
+    CHECK(bluetooth_device_export(bt, 0, BLUETOOTH_EXPORT_BINARY, rescan, bt) > 0);
+
+    /* to an fd */
+    CHECK(pipe(pipefd) == 0);
+    CHECK(bluetooth_device_export_fd(bt, full, BLUETOOTH_EXPORT_NDJSON, pipefd[1]) > full);
+    close(pipefd[1]);
+    n = read(pipefd[0], line, sizeof(line) - 1);
+    CHECK(n > 0);
+    line[n] = '\0';
+    CHECK(strstr(line, added));
+    close(pipefd[0]);
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    unlink(state);
+    free(out);
+    printf("test_export: OK\n");
+    return 0;
+}
@@ -0,0 +1,158 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-c 300 -d 50": identical calls
+ * overlapping on one handle reach bluetoothd once, see src/singleflight.c, and
+ * async connects queued together are in flight together */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define THREADS     (8)
+#define DEVICE      "WI-XB400"
+#define DEVICE_PATH "/org/bluez/hci0/dev_C0_FF_EE_00_00_00"
+
+enum call {
+    CALL_SCAN,
+    CALL_CONNECT,
+    CALL_IS_CONNECTED,
+};
+
+static bluetooth_t *bt;
+static pthread_barrier_t start;
+static bool results[THREADS];
+
+static void *caller(void *data)
+{
+    int i = (int)(long)data >> 8;
+    enum call call = (int)(long)data & 0xff;
+
+    /* all at once */
+    pthread_barrier_wait(&start);
+    switch (call) {
+    case CALL_SCAN:
+        bluetooth_scan(bt, bluetooth_deadline(300));
+        results[i] = true;
+        break;
+    case CALL_CONNECT:
+        results[i] = bluetooth_connect_device(bt, DEVICE, bluetooth_deadline(5000));
+        break;
+    case CALL_IS_CONNECTED:
+        results[i] = bluetooth_device_is_connected(bt, DEVICE);
+        break;
+    }
+    return NULL;
+}
+
+static void run(enum call call)
+{
+    pthread_t threads[THREADS];
+    long i;
+
+    memset(results, 0, sizeof(results));
+    pthread_barrier_init(&start, NULL, THREADS);
+    for (i = 0; i < THREADS; i++)
+        CHECK(pthread_create(&threads[i], NULL, caller, (void *)(i << 8 | call)) == 0);
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&start);
+    for (i = 0; i < THREADS; i++)
+        CHECK(results[i]);
+}
+
+static void done(bool ok, void *userdata)
+{
+    (void)ok;
+    (*(int *)userdata)++;
+}
+
+/* counts calls that went well */
+static void done_ok(bool ok, void *userdata)
+{
+    if (ok)
+        (*(int *)userdata)++;
+}
+
+/* Dispatch until *n reaches want or 2 s passed */
+static void dispatch_until(int *n, int want)
+{
+    long long deadline = bluetooth_deadline(2000);
+
+    while (*n < want && now_ms() < deadline) {
+        struct pollfd pfd = { .fd = bluetooth_event_fd(bt), .events = POLLIN };
+
+        poll(&pfd, 1, deadline - now_ms());
+        bluetooth_dispatch(bt);
+    }
+}
+
+int main(void)
+{
+    static const char *devices[] = { "MOCK-00001", "MOCK-00002", "MOCK-00003" };
+    long long t, one;
+    int i, n = 0;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+
+    mock_calls_reset();
+    run(CALL_SCAN);
+    CHECK(mock_calls("org.bluez.Adapter1.StartDiscovery") == 1);
+
+    /* the async workers share it the same way */
+    mock_calls_reset();
+    for (i = 0; i < 4; i++)
+        CHECK(bluetooth_scan_async(bt, bluetooth_deadline(300), done, &n) == 0);
+    dispatch_until(&n, 4);
+    CHECK(n == 4);
+    CHECK(mock_calls("org.bluez.Adapter1.StartDiscovery") == 1);
+
+    mock_calls_reset();
+    run(CALL_CONNECT);
+    CHECK(mock_calls("org.bluez.Device1.Connect " DEVICE_PATH) == 1);
+
+    mock_calls_reset();
+    run(CALL_IS_CONNECTED);
+    CHECK(mock_calls("org.freedesktop.DBus.Properties.Get " DEVICE_PATH) == 1);
+
+    /* async connects queued together take about as long as one, not one after another */
+    n = 0;
+    one = now_ms();
+    CHECK(bluetooth_connect_device_async(bt, devices[0], bluetooth_deadline(5000), done_ok, &n) == 0);
+    dispatch_until(&n, 1);
+    one = now_ms() - one;
+    CHECK(n == 1);
+    CHECK(bluetooth_disconnect_device(bt, devices[0], bluetooth_deadline(5000)));
+
+    mock_calls_reset();
+    n = 0;
+    t = now_ms();
+    for (i = 0; i < 3; i++)
+        CHECK(bluetooth_connect_device_async(bt, devices[i], bluetooth_deadline(5000), done_ok, &n) == 0);
+    dispatch_until(&n, 3);
+    t = now_ms() - t;
+    printf("test_flight: 3 async connects in %lld ms, one in %lld ms\n", t, one);
+    CHECK(n == 3);
+    CHECK(t < 2 * one);
+    CHECK(mock_calls("org.bluez.Device1.Connect") == 3);
+    for (i = 0; i < 3; i++)
+        CHECK(bluetooth_device_is_connected(bt, devices[i]));
+
+    /* disconnects too, and a connect queued behind one for its device runs after it */
+    n = 0;
+    for (i = 0; i < 3; i++)
+        CHECK(bluetooth_disconnect_device_async(bt, devices[i], bluetooth_deadline(5000), done_ok, &n) == 0);
+    CHECK(bluetooth_connect_device_async(bt, devices[0], bluetooth_deadline(5000), done_ok, &n) == 0);
+    dispatch_until(&n, 4);
+    CHECK(n == 4);
+    CHECK(bluetooth_device_is_connected(bt, devices[0]));
+    for (i = 1; i < 3; i++)
+        CHECK(!bluetooth_device_is_connected(bt, devices[i]));
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_flight: OK\n");
+    return 0;
+}
@@ -0,0 +1,170 @@
+/* Run through test/mock_env.sh: GATT discovery, read/write, fd based bulk I/O
+ * and the on-disk attribute cache, kept across reconnects. As "test_gatt changed" with
+ * MOCK_ARGS="-g 200": a Service Changed drops the cached tree */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define NOTIFY_UUID "00002a37-0000-1000-8000-00805f9b34fb"
+#define WRITE_UUID  "00002a39-0000-1000-8000-00805f9b34fb"
+#define READ_UUID   "00002a38-0000-1000-8000-00805f9b34fb"
+#define DEVICE_PATH "/org/bluez/hci0/dev_C0_FF_EE_00_00_00"
+#define CHANGE_MS   (200)
+
+static void test_cache(const char *device)
+{
+    char dir[] = "/tmp/test_gatt.XXXXXX", file[64];
+    bluetooth_t *bt;
+    unsigned char value[4];
+    FILE *fp;
+
+    CHECK(mkdtemp(dir));
+
+    /* first handle resolves the tree and writes it out */
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    CHECK(bluetooth_gatt_set_cache_dir(bt, dir));
+    bluetooth_scan(bt, bluetooth_deadline(500));
+    CHECK(bluetooth_connect_device(bt, device, bluetooth_deadline(1000)));
+    CHECK(bluetooth_gatt_read(bt, device, READ_UUID, value, sizeof(value)) == 4);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    snprintf(file, sizeof(file), "%s/C0_FF_EE_00_00_00", dir);
+    fp = fopen(file, "r");
+    CHECK(fp);
+    fclose(fp);
+
+    /* stale paths: the call fails with UnknownObject and the tree is resolved again */
+    fp = fopen(file, "w");
+    CHECK(fp);
+    fprintf(fp, "hal_bluetooth-gatt 1\n0 /org/bluez/hci0/dev_C0_FF_EE_00_00_00/service0001 "
+                "0000180d-0000-1000-8000-00805f9b34fb - 0\n1 /org/bluez/hci0/dev_C0_FF_EE_00_00_00/"
+                "service0001/char0002 " READ_UUID " /org/bluez/hci0/dev_C0_FF_EE_00_00_00/service0001 1\n");
+    fclose(fp);
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    CHECK(bluetooth_gatt_set_cache_dir(bt, dir));
+    bluetooth_scan(bt, bluetooth_deadline(500));
+    CHECK(bluetooth_gatt_read(bt, device, READ_UUID, value, sizeof(value)) == 4);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    unlink(file);
+    rmdir(dir);
+}
+
+/* The peer moved its services: the next call goes to where they are now,
+ * not to the cached paths, and the tree on disk is the new one */
+static void test_changed(const char *device)
+{
+    char dir[] = "/tmp/test_gatt.XXXXXX", file[64], line[256];
+    bluetooth_t *bt = bluetooth_new();
+    unsigned char value[4];
+    bool moved = false;
+    FILE *fp;
+
+    CHECK(mkdtemp(dir));
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    CHECK(bluetooth_gatt_set_cache_dir(bt, dir));
+    bluetooth_scan(bt, bluetooth_deadline(500));
+    CHECK(bluetooth_connect_device(bt, device, bluetooth_deadline(1000)));
+    CHECK(bluetooth_gatt_read(bt, device, READ_UUID, value, sizeof(value)) == 4);
+
+    usleep(2 * CHANGE_MS * 1000);
+    mock_calls_reset();
+    CHECK(bluetooth_gatt_read(bt, device, READ_UUID, value, sizeof(value)) == 4);
+    CHECK(mock_calls("org.bluez.GattCharacteristic1.ReadValue " DEVICE_PATH "/service0010/") == 0);
+    CHECK(mock_calls("org.bluez.GattCharacteristic1.ReadValue " DEVICE_PATH "/service0020/") == 1);
+    CHECK(mock_calls("org.freedesktop.DBus.ObjectManager.GetManagedObjects") == 1);
+
+    snprintf(file, sizeof(file), "%s/C0_FF_EE_00_00_00", dir);
+    fp = fopen(file, "r");
+    CHECK(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        CHECK(strstr(line, "/service0010") == NULL);
+        moved |= strstr(line, "/service0020") != NULL;
+    }
+    fclose(fp);
+    CHECK(moved);
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    unlink(file);
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = "WI-XB400";
+    bluetooth_t *bt = bluetooth_new();
+    bluetooth_gatt_char_t chars[8];
+    unsigned char buf[64][32], value[4] = { 7, 0, 0, 0 };
+    struct iovec iov[64];
+    size_t mtu = 0;
+    int i, n, fd, received = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "changed")) {
+        test_changed(device);
+        printf("test_gatt: OK (services changed)\n");
+        return 0;
+    }
+
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(500));
+    CHECK(bluetooth_connect_device(bt, device, bluetooth_deadline(1000)));
+
+    n = bluetooth_gatt_discover(bt, device, chars, 8);
+    CHECK(n == 3);
+    CHECK(!strcmp(chars[0].uuid, NOTIFY_UUID));
+    CHECK(chars[0].flags & BLUETOOTH_GATT_NOTIFY);
+    CHECK(!strcmp(chars[1].service_uuid, "0000180d-0000-1000-8000-00805f9b34fb"));
+
+    CHECK(bluetooth_gatt_write(bt, device, WRITE_UUID, value, sizeof(value)));
+    memset(value, 0, sizeof(value));
+    CHECK(bluetooth_gatt_read(bt, device, READ_UUID, value, sizeof(value)) == 4);
+    CHECK(value[0] == 7);
+
+    fd = bluetooth_gatt_acquire_notify(bt, device, NOTIFY_UUID, &mtu);
+    CHECK(fd >= 0);
+    CHECK(mtu == 23);
+    while (received < 256) {
+        for (i = 0; i < 64; i++) {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = sizeof(buf[i]);
+        }
+        n = bluetooth_gatt_recv(fd, iov, 64, 1000);
+        CHECK(n > 0);
+        CHECK(iov[0].iov_len == 20);
+        received += n;
+    }
+    bluetooth_gatt_release(bt, fd);
+
+    fd = bluetooth_gatt_acquire_write(bt, device, WRITE_UUID, &mtu);
+    CHECK(fd >= 0);
+    for (i = 0; i < 64; i++) {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = mtu - 3;
+    }
+    CHECK(bluetooth_gatt_send(fd, iov, 64) == 64);
+    bluetooth_gatt_release(bt, fd);
+
+    /* a reconnect exports the same tree again, the cached one stays */
+    CHECK(bluetooth_disconnect_device(bt, device, bluetooth_deadline(1000)));
+    CHECK(bluetooth_connect_device(bt, device, bluetooth_deadline(1000)));
+    usleep(100 * 1000);
+    mock_calls_reset();
+    CHECK(bluetooth_gatt_read(bt, device, READ_UUID, value, sizeof(value)) == 4);
+    CHECK(mock_calls("org.freedesktop.DBus.ObjectManager.GetManagedObjects") == 0);
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    test_cache(device);
+    printf("test_gatt: OK (%d notifications)\n", received);
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-n 1000": device ids survive
+ * rescans, and per-device calls by id reach the right device */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define RUNS        (200)
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int main(void)
+{
+    const bluetooth_device_table_t *first, *again;
+    bluetooth_device_id_t id, last_id;
+    const char *last_name;
+    unsigned char *seen;
+    long long by_name, by_id;
+    bluetooth_t *bt;
+    size_t i;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    CHECK(bluetooth_device_lookup(bt, "WI-XB400") == BLUETOOTH_DEVICE_ID_NONE);
+
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    first = bluetooth_device_table_get(bt);
+    CHECK(first->n_devices >= 1000);
+    seen = calloc(first->n_devices + 1, 1);
+    for (i = 0; i < first->n_devices; i++) {
+        id = first->devices[i].id;
+        CHECK(id != BLUETOOTH_DEVICE_ID_NONE && id <= first->n_devices && !seen[id]);
+        seen[id] = 1;
+        CHECK(bluetooth_device_lookup(bt, first->devices[i].macaddr) == id);
+    }
+    free(seen);
+
+    /* a rescan lists the same devices under the same ids */
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    again = bluetooth_device_table_get(bt);
+    CHECK(again->generation == first->generation + 1);
+    for (i = 0; i < again->n_devices; i++)
+        CHECK(bluetooth_device_lookup(bt, again->devices[i].macaddr) == again->devices[i].id);
+    CHECK(bluetooth_device_lookup(bt, "WI-XB400") == first->devices[0].id);
+    /* names are exact, a prefix of many is no device */
+    CHECK(bluetooth_device_lookup(bt, "MOCK-") == BLUETOOTH_DEVICE_ID_NONE);
+
+    id = bluetooth_device_lookup(bt, "WI-XB400");
+    CHECK(!bluetooth_device_is_connected_id(bt, id));
+    CHECK(bluetooth_connect_device_id(bt, id, bluetooth_deadline(3000)));
+    CHECK(bluetooth_device_is_connected_id(bt, id));
+    CHECK(bluetooth_device_is_connected(bt, "WI-XB400"));
+    /* the string calls take a known MAC address too */
+    CHECK(bluetooth_device_is_connected(bt, first->devices[0].macaddr));
+    CHECK(bluetooth_disconnect_device_id(bt, id, bluetooth_deadline(3000)));
+    CHECK(!bluetooth_device_is_connected_id(bt, id));
+    CHECK(!bluetooth_device_is_connected_id(bt, 1000000));
+
+    /* not asserted: a D-Bus round trip each, the name walk on top */
+    last_name = again->devices[again->n_devices - 1].name;
+    last_id = again->devices[again->n_devices - 1].id;
+    by_name = now_us();
+    for (i = 0; i < RUNS; i++)
+        bluetooth_device_is_connected(bt, last_name);
+    by_name = now_us() - by_name;
+    by_id = now_us();
+    for (i = 0; i < RUNS; i++)
+        bluetooth_device_is_connected_id(bt, last_id);
+    by_id = now_us() - by_id;
+    printf("test_ids: is_connected of device %zu by name %lld us, by id %lld us\n",
+           again->n_devices, by_name / RUNS, by_id / RUNS);
+
+    bluetooth_device_table_unref(first);
+    bluetooth_device_table_unref(again);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_ids: OK\n");
+    return 0;
+}
@@ -0,0 +1,178 @@
+/* Run through test/mock_env.sh with MOCK_OBEXD="-r 2000000": objects to
+ * different devices go side by side, to one device one after another, and
+ * arrive whole in $MOCK_OBEXD_DIR */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define RATE            (2000000)
+#define OBJECT_SIZE     (400000)
+#define OBJECT_MS       (OBJECT_SIZE * 1000LL / RATE)
+#define MAX_OBJECTS     (8)
+
+typedef struct seen {
+    int calls;
+    int status;
+    unsigned long long transferred;
+    unsigned long long size;
+} seen_t;
+
+/* Progress only moves forward and nothing follows the end */
+static void progress(const bluetooth_obex_progress_t *progress, void *userdata)
+{
+    seen_t *seen = &((seen_t *)userdata)[progress->index];
+
+    CHECK(progress->index < MAX_OBJECTS);
+    CHECK(seen->status != BLUETOOTH_OBEX_COMPLETE && seen->status != BLUETOOTH_OBEX_ERROR);
+    CHECK(progress->transferred >= seen->transferred);
+    CHECK(!progress->size || progress->transferred <= progress->size);
+    seen->calls++;
+    seen->status = progress->status;
+    seen->transferred = progress->transferred;
+    seen->size = progress->size;
+}
+
+/* An unlinked file of size bytes, seeded so every object differs */
+static int make_object(size_t size, unsigned int seed)
+{
+    char path[] = "/tmp/test_obex.XXXXXX";
+    unsigned char buf[4096];
+    size_t i, n;
+    int fd;
+
+    fd = mkstemp(path);
+    CHECK(fd >= 0);
+    unlink(path);
+    while (size) {
+        n = size < sizeof(buf) ? size : sizeof(buf);
+        for (i = 0; i < n; i++)
+            buf[i] = rand_r(&seed);
+        CHECK(write(fd, buf, n) == (ssize_t)n);
+        size -= n;
+    }
+    return fd;
+}
+
+/* The object obexd stored equals what fd holds */
+static void check_arrived(int fd, const char *macaddr, const char *folder, const char *name)
+{
+    unsigned char a[4096], b[4096];
+    char path[512];
+    ssize_t n;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s/%s%s%s", getenv("MOCK_OBEXD_DIR"), macaddr,
+             folder ? folder : "", folder ? "/" : "", name);
+    f = fopen(path, "rb");
+    CHECK(f != NULL);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    while ((n = read(fd, a, sizeof(a))) > 0)
+        CHECK(fread(b, 1, n, f) == (size_t)n && !memcmp(a, b, n));
+    CHECK(fread(b, 1, 1, f) == 0);
+    fclose(f);
+}
+
+static void check_sent(const seen_t *seen, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        CHECK(seen[i].status == BLUETOOTH_OBEX_COMPLETE);
+        CHECK(seen[i].size == OBJECT_SIZE && seen[i].transferred == OBJECT_SIZE);
+        /* queued or active, some progress, complete */
+        CHECK(seen[i].calls >= 3);
+    }
+}
+
+int main(void)
+{
+    static const char *devices[] = { "WI-XB400", "MOCK-00001", "MOCK-00002", "MOCK-00003" };
+    static const char *macaddrs[] = { "C0:FF:EE:00:00:00", "C0:FF:EE:00:00:01",
+                                      "C0:FF:EE:00:00:02", "C0:FF:EE:00:00:03" };
+    bluetooth_obex_request_t requests[MAX_OBJECTS];
+    seen_t seen[MAX_OBJECTS];
+    int fds[4], big;
+    bluetooth_t *bt;
+    long long t;
+    size_t i;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    for (i = 0; i < 4; i++)
+        fds[i] = make_object(OBJECT_SIZE, i + 1);
+
+    /* one device each, side by side */
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < 4; i++)
+        requests[i] = (bluetooth_obex_request_t){ .device = devices[i], .fd = fds[i], .name = "photo.jpg" };
+    t = now_ms();
+    CHECK(bluetooth_obex_send(bt, requests, 4, bluetooth_deadline(5000), progress, seen) == 4);
+    t = now_ms() - t;
+    printf("test_obex: 4 objects to 4 devices in %lld ms, %lld ms each\n", t, (long long)OBJECT_MS);
+    CHECK(t < OBJECT_MS * 3);
+    check_sent(seen, 4);
+    for (i = 0; i < 4; i++)
+        check_arrived(fds[i], macaddrs[i], NULL, "photo.jpg");
+
+    /* one device, one after another, by MAC and into a folder */
+    memset(seen, 0, sizeof(seen));
+    requests[0] = (bluetooth_obex_request_t){ .device = macaddrs[1], .fd = fds[2], .name = "a.bin", .folder = "fw" };
+    requests[1] = (bluetooth_obex_request_t){ .device = "MOCK-00001", .fd = fds[3], .name = "b.bin", .folder = "fw" };
+    t = now_ms();
+    CHECK(bluetooth_obex_send(bt, requests, 2, bluetooth_deadline(5000), progress, seen) == 2);
+    t = now_ms() - t;
+    printf("test_obex: 2 objects to 1 device in %lld ms\n", t);
+    CHECK(t >= OBJECT_MS * 2 - 20);
+    check_sent(seen, 2);
+    check_arrived(fds[2], macaddrs[1], "fw", "a.bin");
+    check_arrived(fds[3], macaddrs[1], "fw", "b.bin");
+
+    /* failures stay with their object */
+    memset(seen, 0, sizeof(seen));
+    requests[0] = (bluetooth_obex_request_t){ .device = "NO-SUCH-DEVICE", .fd = fds[0], .name = "x" };
+    requests[1] = (bluetooth_obex_request_t){ .device = "DE:AD:BE:EF:00:00", .fd = fds[0], .name = "x" };
+    requests[2] = (bluetooth_obex_request_t){ .device = "WI-XB400", .fd = fds[0], .name = "../x" };
+    requests[3] = (bluetooth_obex_request_t){ .device = "WI-XB400", .fd = -1, .name = "x" };
+    requests[4] = (bluetooth_obex_request_t){ .device = "MOCK-00002", .fd = fds[0], .name = "ok.bin" };
+    CHECK(bluetooth_obex_send(bt, requests, 5, bluetooth_deadline(5000), progress, seen) == 1);
+    for (i = 0; i < 4; i++)
+        CHECK(seen[i].calls == 1 && seen[i].status == BLUETOOTH_OBEX_ERROR);
+    check_sent(&seen[4], 1);
+    check_arrived(fds[0], macaddrs[2], NULL, "ok.bin");
+
+    /* the deadline cancels what is underway, and whatever waits behind it */
+    memset(seen, 0, sizeof(seen));
+    big = make_object(OBJECT_SIZE * 10, 99);
+    requests[0] = (bluetooth_obex_request_t){ .device = "MOCK-00003", .fd = big, .name = "big.bin" };
+    requests[1] = (bluetooth_obex_request_t){ .device = "MOCK-00003", .fd = fds[1], .name = "next.bin" };
+    t = now_ms();
+    CHECK(bluetooth_obex_send(bt, requests, 2, bluetooth_deadline(OBJECT_MS), progress, seen) == 0);
+    t = now_ms() - t;
+    CHECK(t < OBJECT_MS * 3);
+    CHECK(seen[0].status == BLUETOOTH_OBEX_ERROR && seen[0].transferred < OBJECT_SIZE * 10);
+    CHECK(seen[1].calls == 1 && seen[1].status == BLUETOOTH_OBEX_ERROR);
+
+    /* and the next batch is not held up by it */
+    memset(seen, 0, sizeof(seen));
+    requests[0] = (bluetooth_obex_request_t){ .device = "MOCK-00003", .fd = fds[1], .name = "next.bin" };
+    CHECK(bluetooth_obex_send(bt, requests, 1, bluetooth_deadline(5000), progress, seen) == 1);
+    check_arrived(fds[1], macaddrs[3], NULL, "next.bin");
+
+    for (i = 0; i < 4; i++)
+        close(fds[i]);
+    close(big);
+    bluetooth_close(bt);
+
+    /* bluez only */
+    CHECK(bluetooth_open(bt, "bluetoothctl") != 0 ||
+          bluetooth_obex_send(bt, requests, 1, bluetooth_deadline(100), NULL, NULL) == -1);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_obex: OK\n");
+    return 0;
+}
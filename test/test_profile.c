@@ -0,0 +1,206 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-i 2": profile sockets come
+ * from NewConnection, and the pump moves data for all of them from one thread */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define SPP_UUID        "00001101-0000-1000-8000-00805f9b34fb"
+#define SERVER_UUID     "0000abcd-0000-1000-8000-00805f9b34fb"
+#define PAIRS           (64)
+#define ROUNDS          (200)
+#define MESSAGE         (64)
+
+/* One end of a ping-pong pair: the pinger counts rounds, the other echoes */
+typedef struct end {
+    int link;
+    bool pinger;
+    int round;
+    size_t got;
+    unsigned char buf[MESSAGE];
+    bool closed;
+} end_t;
+
+static end_t ends[PAIRS * 2];
+
+static void fill(unsigned char *buf, int pair, int round)
+{
+    int i;
+
+    for (i = 0; i < MESSAGE; i++)
+        buf[i] = pair * 7 + round + i;
+}
+
+/* Messages may come in pieces: act on whole ones */
+static void got(bluetooth_pump_t *pump, int link, const void *data, size_t len, void *userdata)
+{
+    end_t *end = (end_t *)userdata;
+    unsigned char expect[MESSAGE];
+    int pair = (end - ends) / 2;
+
+    if (len == 0) {
+        end->closed = true;
+        return;
+    }
+    CHECK(link == end->link);
+    CHECK(end->got + len <= MESSAGE);
+    memcpy(end->buf + end->got, data, len);
+    end->got += len;
+    if (end->got < MESSAGE)
+        return;
+    end->got = 0;
+
+    fill(expect, pair, end->round);
+    CHECK(!memcmp(end->buf, expect, MESSAGE));
+    if (!end->pinger) {
+        CHECK(bluetooth_pump_write(pump, link, end->buf, MESSAGE));
+        end->round++;
+    } else if (++end->round < ROUNDS) {
+        fill(end->buf, pair, end->round);
+        CHECK(bluetooth_pump_write(pump, link, end->buf, MESSAGE));
+    }
+}
+
+static void test_pump(unsigned int flags)
+{
+    bluetooth_pump_t *pump = bluetooth_pump_new(PAIRS * 2, flags);
+    long long t, deadline;
+    int i, sv[2], runs = 0, ops = 0, n;
+    unsigned char buf[MESSAGE];
+    bool done;
+
+    CHECK(pump != NULL);
+    /* io_uring only when asked */
+    if (!(flags & BLUETOOTH_PUMP_URING))
+        CHECK(!bluetooth_pump_uring(pump));
+    CHECK(bluetooth_pump_add(pump, -1, got, NULL) == -1);
+    memset(ends, 0, sizeof(ends));
+    for (i = 0; i < PAIRS; i++) {
+        CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        ends[2 * i].pinger = true;
+        ends[2 * i].link = bluetooth_pump_add(pump, sv[0], got, &ends[2 * i]);
+        ends[2 * i + 1].link = bluetooth_pump_add(pump, sv[1], got, &ends[2 * i + 1]);
+        CHECK(ends[2 * i].link >= 0 && ends[2 * i + 1].link >= 0);
+    }
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    CHECK(bluetooth_pump_add(pump, sv[0], got, NULL) == -1);
+    close(sv[0]);
+    close(sv[1]);
+
+    for (i = 0; i < PAIRS; i++) {
+        fill(buf, i, 0);
+        CHECK(bluetooth_pump_write(pump, ends[2 * i].link, buf, MESSAGE));
+    }
+    t = now_ms();
+    deadline = bluetooth_deadline(10000);
+    do {
+        n = bluetooth_pump_run(pump, deadline);
+        CHECK(n >= 0);
+        ops += n;
+        runs++;
+        done = true;
+        for (i = 0; i < PAIRS; i++)
+            done &= ends[2 * i].round == ROUNDS;
+    } while (!done && now_ms() < deadline);
+    t = now_ms() - t;
+    CHECK(done);
+    printf("test_profile: %s, %d links, %d round trips in %lld ms, %d reads and writes in %d runs\n",
+           bluetooth_pump_uring(pump) ? "io_uring" : "poll", PAIRS * 2, PAIRS * ROUNDS, t, ops, runs);
+    /* every message read and written once, many per run */
+    CHECK(ops >= PAIRS * ROUNDS * 4);
+    CHECK(runs < ops / 4);
+
+    /* one end goes, the other hears of it */
+    bluetooth_pump_remove(pump, ends[0].link);
+    deadline = bluetooth_deadline(1000);
+    while (!ends[1].closed && now_ms() < deadline)
+        bluetooth_pump_run(pump, deadline);
+    CHECK(ends[1].closed && !ends[0].closed);
+    CHECK(!bluetooth_pump_write(pump, ends[1].link, buf, 1));
+
+    /* a write too big to queue */
+    CHECK(!bluetooth_pump_write(pump, ends[2].link, ends, sizeof(ends)));
+    bluetooth_pump_free(pump);
+}
+
+/* The mock echoes */
+static void echoed(bluetooth_pump_t *pump, int link, const void *data, size_t len, void *userdata)
+{
+    size_t *n = (size_t *)userdata;
+
+    (void)pump;
+    (void)link;
+    (void)data;
+    *n += len;
+}
+
+static void test_profiles(void)
+{
+    static const char *devices[] = { "WI-XB400", "MOCK-00001", "MOCK-00002", "MOCK-00003" };
+    bluetooth_profile_t spp = { .uuid = SPP_UUID, .name = "Serial Port", .role = BLUETOOTH_PROFILE_CLIENT };
+    bluetooth_profile_t server = { .uuid = SERVER_UUID, .role = BLUETOOTH_PROFILE_SERVER, .channel = 22 };
+    char macaddr[BLUETOOTH_MACADDR_MAXLEN], uuid[BLUETOOTH_UUID_MAXLEN];
+    size_t echoed_bytes[4] = { 0 };
+    bluetooth_pump_t *pump;
+    bluetooth_t *bt;
+    long long t, deadline;
+    int i, fd, links[4];
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+
+    /* not registered */
+    CHECK(bluetooth_profile_connect(bt, "WI-XB400", SPP_UUID, bluetooth_deadline(1000)) == -1);
+    CHECK(bluetooth_profile_register(bt, &spp));
+    CHECK(!bluetooth_profile_register(bt, &spp));
+    spp.uuid = "1101";
+    CHECK(!bluetooth_profile_register(bt, &spp));
+    CHECK(bluetooth_profile_connect(bt, "NO-SUCH-DEVICE", SPP_UUID, bluetooth_deadline(1000)) == -1);
+
+    pump = bluetooth_pump_new(4, 0);
+    CHECK(pump != NULL);
+    for (i = 0; i < 4; i++) {
+        fd = bluetooth_profile_connect(bt, devices[i], SPP_UUID, bluetooth_deadline(1000));
+        CHECK(fd >= 0);
+        links[i] = bluetooth_pump_add(pump, fd, echoed, &echoed_bytes[i]);
+        CHECK(links[i] >= 0);
+        CHECK(bluetooth_pump_write(pump, links[i], devices[i], strlen(devices[i])));
+    }
+    deadline = bluetooth_deadline(2000);
+    for (i = 0; i < 4 && now_ms() < deadline; ) {
+        bluetooth_pump_run(pump, deadline);
+        while (i < 4 && echoed_bytes[i] == strlen(devices[i]))
+            i++;
+    }
+    CHECK(i == 4);
+    bluetooth_pump_free(pump);
+
+    /* devices connecting to us */
+    CHECK(bluetooth_profile_register(bt, &server));
+    for (i = 1; i >= 0; i--) {
+        fd = bluetooth_profile_accept(bt, macaddr, uuid, bluetooth_deadline(1000));
+        CHECK(fd >= 0);
+        close(fd);
+        CHECK(!strcmp(uuid, SERVER_UUID));
+        CHECK(!strncmp(macaddr, "C0:FF:EE:00:00:0", 16) && macaddr[16] == '0' + i);
+    }
+    t = now_ms();
+    CHECK(bluetooth_profile_accept(bt, NULL, NULL, bluetooth_deadline(200)) == -1);
+    CHECK(now_ms() - t >= 190);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+}
+
+int main(void)
+{
+    test_pump(BLUETOOTH_PUMP_URING);
+    test_pump(0);
+    test_profiles();
+    printf("test_profile: OK\n");
+    return 0;
+}
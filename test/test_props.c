@@ -0,0 +1,142 @@
+/* Run through test/mock_env.sh: allocations per connection poll, the
+ * library's own and libdbus' counted apart. The library allocates nothing
+ * once a device has been polled */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <link.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define RUNS        (2000)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/* Text of libhal_bluetooth*.so: allocations called from there are the library's */
+static struct {
+    uintptr_t start, end;
+} libs[8];
+static int n_libs;
+static long allocs, lib_allocs;
+
+static void count(const void *caller)
+{
+    uintptr_t pc = (uintptr_t)caller;
+    int i;
+
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < n_libs; i++) {
+        if (pc >= libs[i].start && pc < libs[i].end)
+            __atomic_add_fetch(&lib_allocs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void *malloc(size_t size)
+{
+    count(__builtin_return_address(0));
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    count(__builtin_return_address(0));
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    count(__builtin_return_address(0));
+    return __libc_realloc(ptr, size);
+}
+
+static int find_libs(struct dl_phdr_info *info, size_t size, void *data)
+{
+    int i;
+
+    (void)size;
+    (void)data;
+    if (!strstr(info->dlpi_name, "libhal_bluetooth") || n_libs == 8)
+        return 0;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type == PT_LOAD && (info->dlpi_phdr[i].p_flags & PF_X)) {
+            libs[n_libs].start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+            libs[n_libs].end = libs[n_libs].start + info->dlpi_phdr[i].p_memsz;
+            n_libs++;
+        }
+    }
+    return 0;
+}
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Poll RUNS times, print and return the library's allocations per poll */
+static double poll_device(bluetooth_t *bt, const char *what, bool (*poll)(bluetooth_t *, const void *),
+                          const void *device)
+{
+    long a0, l0;
+    long long t;
+    int i;
+
+    /* warm-up: templates built, libdbus caches filled */
+    for (i = 0; i < 10; i++)
+        poll(bt, device);
+
+    a0 = allocs;
+    l0 = lib_allocs;
+    t = now_us();
+    for (i = 0; i < RUNS; i++)
+        CHECK(!poll(bt, device));
+    t = now_us() - t;
+    printf("test_props: is_connected by %s: %.1f us, %.2f allocs/call (library %.2f)\n", what,
+           (double)t / RUNS, (double)(allocs - a0) / RUNS, (double)(lib_allocs - l0) / RUNS);
+    return (double)(lib_allocs - l0) / RUNS;
+}
+
+static bool by_name(bluetooth_t *bt, const void *device)
+{
+    return bluetooth_device_is_connected(bt, device);
+}
+
+static bool by_id(bluetooth_t *bt, const void *device)
+{
+    return bluetooth_device_is_connected_id(bt, *(const bluetooth_device_id_t *)device);
+}
+
+int main(void)
+{
+    bluetooth_device_id_t id;
+    bluetooth_t *bt;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    dl_iterate_phdr(find_libs, NULL);
+    CHECK(n_libs >= 2);
+
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    id = bluetooth_device_lookup(bt, "WI-XB400");
+    CHECK(id != BLUETOOTH_DEVICE_ID_NONE);
+
+    CHECK(poll_device(bt, "name", by_name, "WI-XB400") == 0);
+    CHECK(poll_device(bt, "id", by_id, &id) == 0);
+
+    /* a changed answer comes through the same template */
+    CHECK(bluetooth_connect_device_id(bt, id, bluetooth_deadline(3000)));
+    CHECK(bluetooth_device_is_connected_id(bt, id));
+    CHECK(bluetooth_disconnect_device_id(bt, id, bluetooth_deadline(3000)));
+    CHECK(!bluetooth_device_is_connected_id(bt, id));
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_props: OK\n");
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-n 20000 -a 0": device i is
+ * MOCK-%05d (WI-XB400 first), a phone when even, heard at -40 - i % 50 dBm */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define DEVICES     (20000)
+#define RUNS        (200)
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static size_t count(bluetooth_t *bt, const bluetooth_device_filter_t *filter)
+{
+    bluetooth_device_query_t *query = bluetooth_device_query_new(filter);
+    size_t n;
+
+    CHECK(query);
+    n = bluetooth_device_query_ids(bt, query, NULL, 0);
+    bluetooth_device_query_free(query);
+    return n;
+}
+
+int main(void)
+{
+    static bluetooth_device_id_t ids[DEVICES];
+    const bluetooth_device_info_t *views[16];
+    const bluetooth_device_table_t *table;
+    bluetooth_device_query_t *query;
+    bluetooth_device_id_t id;
+    bluetooth_t *bt;
+    long long t;
+    size_t i, n;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ 0 }) == 0);
+    bluetooth_scan(bt, bluetooth_deadline(200));
+    CHECK(count(bt, &(bluetooth_device_filter_t){ 0 }) == DEVICES);
+
+    /* one column each */
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .icon = "phone" }) == DEVICES / 2);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .icon = "printer" }) == 0);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .name_prefix = "WI-" }) == 1);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .name_prefix = "MOCK-0001" }) == 10);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .name_prefix = "MOCK-00019" }) == 1);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .oui = "c0:ff:ee" }) == DEVICES);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .oui = "00:11:22" }) == 0);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .rssi_min = -45, .rssi_max = -40 }) ==
+          DEVICES / 50 * 6);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .max_age_ms = 60000 }) == DEVICES);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .flags_set = BLUETOOTH_DEVICE_CONNECTED }) == 0);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .icon = "audio-headset", .rssi_min = -40,
+                                                  .rssi_max = -40 }) == 0);
+
+    CHECK(!bluetooth_device_query_new(&(bluetooth_device_filter_t){ .oui = "C0FFEE" }));
+    CHECK(!bluetooth_device_query_new(&(bluetooth_device_filter_t){ .rssi_min = -40, .rssi_max = -50 }));
+    CHECK(!bluetooth_device_query_new(&(bluetooth_device_filter_t){
+        .flags_set = BLUETOOTH_DEVICE_PAIRED, .flags_clear = BLUETOOTH_DEVICE_PAIRED }));
+
+    /* flags are as of the scan */
+    id = bluetooth_device_lookup(bt, "WI-XB400");
+    CHECK(bluetooth_connect_device_id(bt, id, bluetooth_deadline(3000)));
+    bluetooth_scan(bt, bluetooth_deadline(200));
+    query = bluetooth_device_query_new(&(bluetooth_device_filter_t){
+        .flags_set = BLUETOOTH_DEVICE_CONNECTED | BLUETOOTH_DEVICE_PAIRED });
+    CHECK(bluetooth_device_query_ids(bt, query, ids, DEVICES) == 1 && ids[0] == id);
+    bluetooth_device_query_free(query);
+    CHECK(count(bt, &(bluetooth_device_filter_t){ .flags_clear = BLUETOOTH_DEVICE_CONNECTED }) ==
+          DEVICES - 1);
+
+    /* views point into the pinned table, more matches than room is a count */
+    table = bluetooth_device_table_get(bt);
+    query = bluetooth_device_query_new(&(bluetooth_device_filter_t){ .name_prefix = "MOCK-0001" });
+    n = bluetooth_device_table_query(bt, table, query, views, 4);
+    CHECK(n == 10);
+    for (i = 0; i < 4; i++) {
+        CHECK(views[i] >= table->devices && views[i] < table->devices + table->n_devices);
+        CHECK(!strncmp(views[i]->name, "MOCK-0001", 9));
+        if (i)
+            CHECK(views[i] > views[i - 1]);
+    }
+    bluetooth_device_query_free(query);
+    bluetooth_device_table_unref(table);
+
+    /* a dashboard: strong, unconnected phones heard lately, not asserted */
+    query = bluetooth_device_query_new(&(bluetooth_device_filter_t){
+        .flags_clear = BLUETOOTH_DEVICE_CONNECTED, .icon = "phone", .oui = "C0:FF:EE",
+        .rssi_min = -60, .rssi_max = 0, .max_age_ms = 60000 });
+    t = now_us();
+    for (i = 0; i < RUNS; i++)
+        n = bluetooth_device_query_ids(bt, query, ids, DEVICES);
+    t = now_us() - t;
+    CHECK(n == DEVICES / 50 * 11 - 1);
+    bluetooth_device_query_free(query);
+    printf("test_query: %zu of %d devices in %lld us\n", n, DEVICES, t / RUNS);
+
+    CHECK(bluetooth_disconnect_device_id(bt, id, bluetooth_deadline(3000)));
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_query: OK\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-n 20000 -a 1" and test/fake first
+ * in PATH: ranks every device mock_bluez advertises by smoothed RSSI */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define TOP_K       (16)
+#define RUNS        (200)
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void check_sorted(const bluetooth_rssi_rank_t *ranks, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        CHECK(ranks[i].samples >= 1);
+        CHECK(ranks[i].rssi <= 0 && ranks[i].rssi >= -128);
+        if (i)
+            CHECK(ranks[i].rssi <= ranks[i - 1].rssi);
+    }
+}
+
+int main(void)
+{
+    bluetooth_rssi_rank_t ranks[TOP_K];
+    bluetooth_t *bt;
+    long long t;
+    int i, n;
+
+    /* every device listed once, and some heard again while discovering */
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    CHECK(bluetooth_nearest_devices(bt, 60000, ranks, TOP_K) == 0);
+    bluetooth_scan(bt, bluetooth_deadline(1000));
+
+    t = now_us();
+    for (i = 0; i < RUNS; i++)
+        n = bluetooth_nearest_devices(bt, 60000, ranks, TOP_K);
+    t = now_us() - t;
+    CHECK(n == TOP_K);
+    check_sorted(ranks, n);
+    /* mock_bluez starts everyone between -40 and -89 dBm */
+    CHECK(ranks[0].rssi >= -45);
+    printf("test_rssi: top %d of every device heard in %lld us, nearest %s at %.1f dBm\n",
+           TOP_K, t / RUNS, ranks[0].macaddr, ranks[0].rssi);
+
+    /* nothing heard that recently */
+    CHECK(bluetooth_nearest_devices(bt, 1, ranks, TOP_K) == 0 ||
+          ranks[0].samples >= 1);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    /* bluetoothctl: test/fake reports -71 then -75 for MOCK-00001, -50 for WI-XB400 */
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluetoothctl") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(1000));
+    n = bluetooth_nearest_devices(bt, 60000, ranks, TOP_K);
+    CHECK(n == 2);
+    CHECK(!strcmp(ranks[0].macaddr, "C0:FF:EE:00:00:00") && ranks[0].rssi == -50);
+    CHECK(ranks[1].samples == 2 && ranks[1].rssi < -71 && ranks[1].rssi > -75);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    printf("test_rssi: OK\n");
+    return 0;
+}
@@ -0,0 +1,94 @@
+/* Run through test/mock_env.sh with test/fake first in PATH: repeated scans
+ * find the adapter and power it on once, and power it on again when it
+ * turned out to be off */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define SCANS       (3)
+
+/* Occurrences of needle in the file at path */
+static int count(const char *path, const char *needle, size_t len)
+{
+    char buf[1 << 16];
+    size_t n, i;
+    int found = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    CHECK(f);
+    n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    CHECK(n < sizeof(buf));
+    for (i = 0; i + len <= n; i++)
+        found += !memcmp(buf + i, needle, len);
+    return found;
+}
+
+static void scan(bluetooth_t *bt, const char *first)
+{
+    const bluetooth_device_table_t *table;
+
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    table = bluetooth_device_table_get(bt);
+    CHECK(table->n_devices >= 1 && !strcmp(table->devices[0].name, first));
+    bluetooth_device_table_unref(table);
+}
+
+int main(void)
+{
+    char trace[] = "/tmp/test_session.XXXXXX";
+    char state[64], off[80], log[80];
+    bluetooth_t *bt;
+    int i, fd;
+
+    /* bluez: the recording has every call made, method names length prefixed */
+    fd = mkstemp(trace);
+    CHECK(fd >= 0);
+    close(fd);
+    bt = bluetooth_new();
+    CHECK(bluetooth_record(bt, trace) == 0);
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    for (i = 0; i < SCANS; i++)
+        scan(bt, "WI-XB400");
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    /* the adapter once, the device listing every scan */
+    CHECK(count(trace, "\x11\0\0\0GetManagedObjects", 21) == 1 + SCANS);
+    /* mock_bluez starts powered off */
+    CHECK(count(trace, "\3\0\0\0Set", 7) == 1);
+    CHECK(count(trace, "\16\0\0\0StartDiscovery", 18) == SCANS);
+    unlink(trace);
+
+    /* bluetoothctl */
+    snprintf(state, sizeof(state), "/tmp/test_session.%d", (int)getpid());
+    snprintf(off, sizeof(off), "%s.off", state);
+    snprintf(log, sizeof(log), "%s.log", state);
+    setenv("FAKE_BLUETOOTHCTL_STATE", state, 1);
+    setenv("FAKE_BLUETOOTHCTL_LOG", log, 1);
+    unlink(log);
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluetoothctl") == 0);
+    scan(bt, "WI-XB400");
+    scan(bt, "WI-XB400");
+    CHECK(count(log, "power on", 8) == 1);
+    CHECK(count(log, "scan on", 7) == 2);
+
+    /* switched off behind the handle's back: NotReady, power on, scan again */
+    fclose(fopen(off, "w"));
+    scan(bt, "WI-XB400");
+    CHECK(count(log, "power on", 8) == 2);
+    CHECK(count(log, "scan on", 7) == 4);
+    CHECK(access(off, F_OK));
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    unlink(log);
+    unlink(state);
+    printf("test_session: OK\n");
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* Run through test/mock_env.sh: shared handles on one backend see one device
+ * table and one scan, keep their own errors, cancel and adverts, and cost two
+ * descriptors each */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define HANDLES         (32)
+#define SCAN_MS         (300)
+
+static void count_advert(const bluetooth_advert_t *advert, void *userdata)
+{
+    (void)advert;
+    (*(int *)userdata)++;
+}
+
+static int open_fds(void)
+{
+    struct dirent *ent;
+    DIR *dir;
+    int n = 0;
+
+    dir = opendir("/proc/self/fd");
+    CHECK(dir != NULL);
+    while ((ent = readdir(dir)) != NULL)
+        n += ent->d_name[0] != '.';
+    closedir(dir);
+    /* opendir()'s own */
+    return n - 1;
+}
+
+int main(void)
+{
+    char devs[8][BLUETOOTH_DEVNAME_MAXLEN];
+    const bluetooth_device_table_t *ta, *tb;
+    bluetooth_t *handles[HANDLES], *a, *b, *bt;
+    bluetooth_agent_t agent = { .capability = BLUETOOTH_AGENT_NO_IO };
+    int base, first, i, adverts_a = 0, adverts_b = 0;
+    long long t;
+
+    base = open_fds();
+    a = bluetooth_new_shared("bluez");
+    CHECK(a != NULL);
+    CHECK(bluetooth_errmsg(a)[0] == '\0');
+    b = bluetooth_new_shared("bluez");
+    CHECK(b != NULL);
+
+    /* one scan, seen by both */
+    CHECK(bluetooth_get_devices(b, devs, 8) == 0);
+    bluetooth_scan(a, bluetooth_deadline(100));
+    CHECK(bluetooth_get_devices(b, devs, 8) > 0);
+    ta = bluetooth_device_table_get(a);
+    tb = bluetooth_device_table_get(b);
+    CHECK(ta != NULL && ta == tb);
+    CHECK(bluetooth_device_is_connected(b, "WI-XB400") == bluetooth_device_is_connected(a, "WI-XB400"));
+    bluetooth_device_table_unref(ta);
+    bluetooth_device_table_unref(tb);
+
+    /* a cancel is the handle's, the other one's scan runs on */
+    bluetooth_cancel(a);
+    t = now_ms();
+    bluetooth_scan(a, bluetooth_deadline(SCAN_MS));
+    CHECK(now_ms() - t < SCAN_MS / 2);
+    t = now_ms();
+    bluetooth_scan(b, bluetooth_deadline(SCAN_MS));
+    CHECK(now_ms() - t >= SCAN_MS - 10);
+    bluetooth_cancel_reset(a);
+
+    /* each handle its own advert callback, the agent is no handle's */
+    CHECK(bluetooth_set_advert_callback(a, count_advert, &adverts_a));
+    CHECK(bluetooth_set_advert_callback(b, count_advert, &adverts_b));
+    bluetooth_scan(a, bluetooth_deadline(SCAN_MS));
+    CHECK(adverts_a > 0 && adverts_b > 0);
+    CHECK(bluetooth_set_advert_callback(a, NULL, NULL));
+    adverts_a = adverts_b = 0;
+    bluetooth_scan(b, bluetooth_deadline(SCAN_MS));
+    CHECK(adverts_a == 0 && adverts_b > 0);
+    CHECK(bluetooth_set_advert_callback(b, NULL, NULL));
+    CHECK(!bluetooth_set_agent(a, &agent));
+    CHECK(bluetooth_errmsg(a)[0] != '\0');
+
+    /* errors stay with their handle */
+    bluetooth_free(a);
+    a = bluetooth_new_shared("bluez");
+    CHECK(bluetooth_open(a, "bluez") != 0);
+    CHECK(bluetooth_errmsg(a)[0] != '\0');
+    CHECK(bluetooth_errmsg(b)[0] == '\0');
+    /* closing one is no business of the others */
+    bluetooth_close(a);
+    CHECK(bluetooth_get_devices(b, devs, 8) > 0);
+
+    /* a handle more is its event and cancel fd, no connection */
+    first = open_fds();
+    for (i = 0; i < HANDLES; i++) {
+        handles[i] = bluetooth_new_shared("bluez");
+        CHECK(handles[i] != NULL);
+        CHECK(bluetooth_get_devices(handles[i], devs, 8) > 0);
+    }
+    printf("test_shared: %d fds for 2 handles, %d for %d more\n",
+           first - base, open_fds() - first, HANDLES);
+    CHECK(open_fds() - first == 2 * HANDLES);
+    for (i = 0; i < HANDLES; i++)
+        bluetooth_free(handles[i]);
+    bluetooth_free(a);
+    CHECK(bluetooth_get_devices(b, devs, 8) > 0);
+
+    /* the last one closes the context, the next opens a fresh one */
+    bluetooth_free(b);
+    CHECK(open_fds() == base);
+    a = bluetooth_new_shared("bluez");
+    CHECK(bluetooth_get_devices(a, devs, 8) == 0);
+    bluetooth_free(a);
+
+    /* a context that failed to open */
+    bt = bluetooth_new_shared("no-such-backend");
+    CHECK(bt != NULL);
+    CHECK(bluetooth_errmsg(bt)[0] != '\0');
+    CHECK(bluetooth_get_devices(bt, devs, 8) == 0);
+    bluetooth_free(bt);
+    CHECK(open_fds() == base);
+    printf("test_shared: OK\n");
+    return 0;
+}
@@ -0,0 +1,89 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-n 1000": readers walk device
+ * tables while scans keep publishing new ones */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define SCANS       (20)
+#define MAX_READERS (8)
+
+static bluetooth_t *bt;
+static volatile int stop;
+
+static void *reader(void *data)
+{
+    const bluetooth_device_table_t *table;
+    unsigned long long last = 0;
+    long *reads = (long *)data;
+    size_t i, named;
+
+    while (!stop) {
+        table = bluetooth_device_table_get(bt);
+        CHECK(table->generation >= last);
+        last = table->generation;
+        for (i = 0, named = 0; i < table->n_devices; i++)
+            named += table->devices[i].name[0] != '\0';
+        CHECK(named == table->n_devices);
+        bluetooth_device_table_unref(table);
+        (*reads)++;
+    }
+    return NULL;
+}
+
+static long run_readers(int n, int scans)
+{
+    pthread_t threads[MAX_READERS];
+    long reads[MAX_READERS] = { 0 }, total = 0;
+    int i;
+
+    stop = 0;
+    for (i = 0; i < n; i++)
+        CHECK(pthread_create(&threads[i], NULL, reader, &reads[i]) == 0);
+    if (scans) {
+        for (i = 0; i < scans; i++)
+            bluetooth_scan(bt, bluetooth_deadline(1));
+    } else {
+        usleep(200000);
+    }
+    stop = 1;
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+        total += reads[i];
+    }
+    return total;
+}
+
+int main(void)
+{
+    const bluetooth_device_table_t *first, *last;
+    int n;
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+
+    first = bluetooth_device_table_get(bt);
+    CHECK(first->n_devices == 0);
+
+    run_readers(4, SCANS);
+
+    /* the pinned table outlived every scan, untouched */
+    last = bluetooth_device_table_get(bt);
+    CHECK(first->n_devices == 0);
+    CHECK(last->generation == first->generation + SCANS);
+    CHECK(last->n_devices >= 1000);
+    bluetooth_device_table_unref(first);
+    bluetooth_device_table_unref(last);
+
+    /* not asserted: depends on the machine */
+    for (n = 1; n <= MAX_READERS; n *= 2)
+        printf("test_table: %d readers, %ld reads in 200 ms\n", n, run_readers(n, 0));
+
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+    printf("test_table: OK\n");
+    return 0;
+}
@@ -0,0 +1,99 @@
+/* Run through test/mock_env.sh with test/fake first in PATH: records a session
+ * of each backend, then replays it with mock_bluez and bluetoothctl out of reach */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bluetooth.h"
+#include "check.h"
+
+typedef struct session {
+    size_t n_devices;
+    char first[BLUETOOTH_DEVNAME_MAXLEN];
+    bool connected;
+    bool disconnected;
+    long long took;
+} session_t;
+
+static void run(bluetooth_t *bt, int scan_ms, session_t *s)
+{
+    const bluetooth_device_table_t *table;
+    long long start = now_ms();
+
+    bluetooth_scan(bt, bluetooth_deadline(scan_ms));
+    table = bluetooth_device_table_get(bt);
+    s->n_devices = table->n_devices;
+    if (table->n_devices)
+        strcpy(s->first, table->devices[0].name);
+    bluetooth_device_table_unref(table);
+
+    s->connected = bluetooth_connect_device(bt, "WI-XB400", bluetooth_deadline(3000)) &&
+                   bluetooth_device_is_connected(bt, "WI-XB400");
+    s->disconnected = bluetooth_disconnect_device(bt, "WI-XB400", bluetooth_deadline(3000));
+    s->took = now_ms() - start;
+}
+
+static void same(const session_t *a, const session_t *b)
+{
+    CHECK(a->n_devices == b->n_devices);
+    CHECK(!strcmp(a->first, b->first));
+    CHECK(a->connected == b->connected);
+    CHECK(a->disconnected == b->disconnected);
+}
+
+static void check_backend(const char *backend, const char *path)
+{
+    session_t recorded, replayed;
+    bluetooth_t *bt;
+    struct stat st;
+    char *saved_path = strdup(getenv("PATH"));
+
+    bt = bluetooth_new();
+    CHECK(bluetooth_record(bt, path) == 0);
+    CHECK(bluetooth_open(bt, backend) == 0);
+    run(bt, 300, &recorded);
+    bluetooth_close(bt);
+    CHECK(recorded.n_devices >= 1 && recorded.connected);
+    CHECK(stat(path, &st) == 0);
+
+    /* nothing to talk to but the recording */
+    setenv("PATH", "/nonexistent", 1);
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", "unix:path=/nonexistent", 1);
+
+    /* as fast as it goes */
+    CHECK(bluetooth_open_replay(bt, path, 0) == 0);
+    run(bt, 50, &replayed);
+    bluetooth_close(bt);
+    same(&recorded, &replayed);
+    printf("test_trace: %s, %ld bytes, recorded %lld ms, replayed %lld ms",
+           backend, (long)st.st_size, recorded.took, replayed.took);
+
+    /* at recorded pace, the scan window is the caller's */
+    CHECK(bluetooth_open_replay(bt, path, 1) == 0);
+    run(bt, 300, &replayed);
+    bluetooth_close(bt);
+    same(&recorded, &replayed);
+    CHECK(replayed.took >= recorded.took * 3 / 4);
+    printf(", at pace %lld ms\n", replayed.took);
+
+    bluetooth_free(bt);
+    setenv("PATH", saved_path, 1);
+    free(saved_path);
+    unlink(path);
+}
+
+int main(void)
+{
+    char path[64], *bus = strdup(getenv("DBUS_SYSTEM_BUS_ADDRESS"));
+
+    snprintf(path, sizeof(path), "/tmp/test_trace.%d", getpid());
+    check_backend("bluez", path);
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", bus, 1);
+    check_backend("bluetoothctl", path);
+    free(bus);
+
+    printf("test_trace: OK\n");
+    return 0;
+}
@@ -0,0 +1,210 @@
+/* Run through test/mock_env.sh with MOCK_ARGS="-n 6 -c 300 -r 100" and test/fake
+ * first in PATH: waits end on the signal that gets devices there, not on a
+ * poll, while another handle connects them */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "bluetooth.h"
+#include "check.h"
+
+#define CONNECT_MS      (300)
+#define RESOLVE_MS      (100)
+/* a signal, not a poll, woke us */
+#define SLACK_MS        (150)
+
+static bluetooth_t *open_bluez(void)
+{
+    bluetooth_t *bt = bluetooth_new();
+
+    CHECK(bt != NULL);
+    CHECK(bluetooth_open(bt, "bluez") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(100));
+    return bt;
+}
+
+typedef struct waiter {
+    bluetooth_t *bt;
+    const char *device;
+    enum bluetooth_device_state state;
+    bool ok;
+} waiter_t;
+
+static void *wait_thread(void *data)
+{
+    waiter_t *waiter = (waiter_t *)data;
+
+    waiter->ok = bluetooth_wait_device_state(waiter->bt, waiter->device, waiter->state,
+                                             bluetooth_deadline(5000));
+    return NULL;
+}
+
+/* A close while the wait sleeps ends it before the backend goes */
+static void close_waiting(bluetooth_t *bt, const char *device, enum bluetooth_device_state state)
+{
+    waiter_t waiter = { bt, device, state, true };
+    pthread_t thread;
+    long long t;
+
+    CHECK(pthread_create(&thread, NULL, wait_thread, &waiter) == 0);
+    usleep(200 * 1000);
+    t = now_ms();
+    bluetooth_close(bt);
+    pthread_join(thread, NULL);
+    printf("test_wait: closed a waiting handle in %lld ms\n", now_ms() - t);
+    CHECK(!waiter.ok);
+    CHECK(now_ms() - t < SLACK_MS);
+    bluetooth_free(bt);
+}
+
+static void test_bluez(void)
+{
+    static const char *mocks[] = { "MOCK-00001", "MOCK-00002", "MOCK-00003" };
+    static const char *some[] = { "MOCK-00001", "NO-SUCH-DEVICE", "WI-XB400", "MOCK-00002" };
+    bluetooth_t *bt = open_bluez(), *other = open_bluez();
+    long long t, elapsed;
+    bool reached[4];
+    int i;
+
+    /* already there */
+    t = now_ms();
+    CHECK(bluetooth_wait_device_state(bt, "WI-XB400", BLUETOOTH_STATE_DISCONNECTED, bluetooth_deadline(1000)));
+    CHECK(now_ms() - t < SLACK_MS);
+
+    /* connected by someone else */
+    t = now_ms();
+    CHECK(bluetooth_connect_device_async(other, "WI-XB400", bluetooth_deadline(2000), NULL, NULL) == 0);
+    CHECK(bluetooth_wait_device_state(bt, "WI-XB400", BLUETOOTH_STATE_CONNECTED, bluetooth_deadline(2000)));
+    elapsed = now_ms() - t;
+    CHECK(elapsed >= CONNECT_MS - 10 && elapsed < CONNECT_MS + SLACK_MS);
+    CHECK(bluetooth_wait_device_state(bt, "WI-XB400", BLUETOOTH_STATE_SERVICES_RESOLVED, bluetooth_deadline(2000)));
+    elapsed = now_ms() - t;
+    printf("test_wait: connected after %lld ms, services resolved after %lld ms\n",
+           elapsed - RESOLVE_MS, elapsed);
+    CHECK(elapsed >= CONNECT_MS + RESOLVE_MS - 10 && elapsed < CONNECT_MS + RESOLVE_MS + SLACK_MS);
+    CHECK(bluetooth_device_is_connected(bt, "WI-XB400"));
+
+    /* several, connected one after another: the first of them, then all */
+    t = now_ms();
+    for (i = 0; i < 3; i++)
+        CHECK(bluetooth_connect_device_async(other, mocks[i], bluetooth_deadline(5000), NULL, NULL) == 0);
+    CHECK(bluetooth_wait_devices_state(bt, mocks, 3, BLUETOOTH_STATE_CONNECTED, 1,
+                                       bluetooth_deadline(5000), NULL) >= 1);
+    CHECK(now_ms() - t < CONNECT_MS + SLACK_MS);
+    CHECK(bluetooth_wait_devices_state(bt, mocks, 3, BLUETOOTH_STATE_CONNECTED, 3,
+                                       bluetooth_deadline(5000), reached) == 3);
+    CHECK(reached[0] && reached[1] && reached[2]);
+    elapsed = now_ms() - t;
+    printf("test_wait: 3 devices connected after %lld ms\n", elapsed);
+    CHECK(elapsed < 3 * CONNECT_MS + SLACK_MS);
+
+    /* one never gets there: the deadline ends it, reached says which did */
+    t = now_ms();
+    CHECK(bluetooth_wait_devices_state(bt, some, 4, BLUETOOTH_STATE_CONNECTED, 4,
+                                       bluetooth_deadline(200), reached) == 3);
+    CHECK(now_ms() - t >= 190);
+    CHECK(reached[0] && !reached[1] && reached[2] && reached[3]);
+    CHECK(bluetooth_wait_devices_state(bt, some, 4, BLUETOOTH_STATE_CONNECTED, 0,
+                                       bluetooth_deadline(1000), NULL) == 3);
+
+    /* and back */
+    t = now_ms();
+    CHECK(bluetooth_disconnect_device_async(other, "WI-XB400", bluetooth_deadline(2000), NULL, NULL) == 0);
+    CHECK(bluetooth_wait_device_state(bt, "WI-XB400", BLUETOOTH_STATE_DISCONNECTED, bluetooth_deadline(2000)));
+    CHECK(!bluetooth_wait_device_state(bt, "WI-XB400", BLUETOOTH_STATE_SERVICES_RESOLVED, bluetooth_deadline(0)));
+    CHECK(now_ms() - t < SLACK_MS);
+
+    /* a cancel ends the wait */
+    bluetooth_cancel(bt);
+    t = now_ms();
+    CHECK(!bluetooth_wait_device_state(bt, "MOCK-00003", BLUETOOTH_STATE_DISCONNECTED, bluetooth_deadline(5000)));
+    CHECK(now_ms() - t < SLACK_MS);
+    bluetooth_cancel_reset(bt);
+
+    bluetooth_close(other);
+    bluetooth_free(other);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+}
+
+/* The wait sleeps with the handle unlocked: what it waits for can run on the
+ * same handle, or another one sharing its context */
+static void test_same_handle(void)
+{
+    bluetooth_t *bt = open_bluez(), *a, *b;
+    long long t, elapsed;
+
+    t = now_ms();
+    CHECK(bluetooth_connect_device_async(bt, "MOCK-00004", bluetooth_deadline(2000), NULL, NULL) == 0);
+    CHECK(bluetooth_wait_device_state(bt, "MOCK-00004", BLUETOOTH_STATE_CONNECTED, bluetooth_deadline(2000)));
+    elapsed = now_ms() - t;
+    printf("test_wait: connected on the same handle after %lld ms\n", elapsed);
+    CHECK(elapsed >= CONNECT_MS - 10 && elapsed < CONNECT_MS + SLACK_MS);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+
+    a = bluetooth_new_shared("bluez");
+    b = bluetooth_new_shared("bluez");
+    CHECK(a != NULL && b != NULL);
+    bluetooth_scan(a, bluetooth_deadline(100));
+    t = now_ms();
+    CHECK(bluetooth_connect_device_async(b, "MOCK-00005", bluetooth_deadline(2000), NULL, NULL) == 0);
+    CHECK(bluetooth_wait_device_state(a, "MOCK-00005", BLUETOOTH_STATE_CONNECTED, bluetooth_deadline(2000)));
+    elapsed = now_ms() - t;
+    printf("test_wait: connected on a shared handle after %lld ms\n", elapsed);
+    CHECK(elapsed >= CONNECT_MS - 10 && elapsed < CONNECT_MS + SLACK_MS);
+    bluetooth_free(b);
+    bluetooth_free(a);
+
+    close_waiting(open_bluez(), "MOCK-00003", BLUETOOTH_STATE_DISCONNECTED);
+}
+
+/* Connect, then wait, on a handle that never scanned: it finds the adapter
+ * itself and takes the device by address */
+static void test_fresh_handle(void)
+{
+    bluetooth_t *bt = open_bluez(), *fresh = bluetooth_new();
+    long long t, elapsed;
+
+    CHECK(bluetooth_open(fresh, "bluez") == 0);
+    t = now_ms();
+    CHECK(bluetooth_connect_device_async(bt, "WI-XB400", bluetooth_deadline(2000), NULL, NULL) == 0);
+    CHECK(bluetooth_wait_device_state(fresh, "C0:FF:EE:00:00:00", BLUETOOTH_STATE_CONNECTED,
+                                      bluetooth_deadline(2000)));
+    elapsed = now_ms() - t;
+    printf("test_wait: connected on a fresh handle after %lld ms\n", elapsed);
+    CHECK(elapsed >= CONNECT_MS - 10 && elapsed < CONNECT_MS + SLACK_MS);
+    CHECK(bluetooth_disconnect_device(bt, "WI-XB400", bluetooth_deadline(2000)));
+    bluetooth_close(fresh);
+    bluetooth_free(fresh);
+    bluetooth_close(bt);
+    bluetooth_free(bt);
+}
+
+/* No signals: connected is polled, nothing else is known */
+static void test_poll(void)
+{
+    bluetooth_t *bt = bluetooth_new();
+    const char *device = "WI-XB400";
+
+    CHECK(bluetooth_open(bt, "bluetoothctl") == 0);
+    bluetooth_scan(bt, bluetooth_deadline(1000));
+    CHECK(bluetooth_wait_device_state(bt, device, BLUETOOTH_STATE_DISCONNECTED, bluetooth_deadline(1000)));
+    CHECK(bluetooth_connect_device(bt, device, bluetooth_deadline(1000)));
+    CHECK(bluetooth_wait_device_state(bt, device, BLUETOOTH_STATE_CONNECTED, bluetooth_deadline(1000)));
+    CHECK(bluetooth_wait_devices_state(bt, &device, 1, BLUETOOTH_STATE_PAIRED, 1,
+                                       bluetooth_deadline(1000), NULL) == -1);
+    bluetooth_disconnect_device(bt, device, bluetooth_deadline(1000));
+    close_waiting(bt, device, BLUETOOTH_STATE_CONNECTED);
+}
+
+int main(void)
+{
+    test_bluez();
+    test_same_handle();
+    test_fresh_handle();
+    test_poll();
+    printf("test_wait: OK\n");
+    return 0;
+}